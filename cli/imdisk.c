@@ -239,7 +239,9 @@ ImDiskSyntaxHelp()
         "        existing read-only virtual disk writable.\n"
         "\n"
         "sparse  Sets NTFS sparse attribute on image file. This has no effect on proxy\n"
-        "        or vm type virtual disks.\n"
+        "        type virtual disks. For vm type virtual disks, memory is allocated\n"
+        "        when data is first written instead of when the disk is created, and\n"
+        "        any image file is loaded while the virtual disk is used.\n"
         "\n"
         "rem     Specifies that the device should be created with removable media\n"
         "        characteristics. This changes the device properties returned by the\n"
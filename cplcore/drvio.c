@@ -36,6 +36,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "..\inc\ntumapi.h"
 #include "..\inc\imdisk.h"
 #include "..\inc\imdproxy.h"
+#include "..\inc\imdbuf.h"
 
 #include "drvio.h"
 #include "mbr.h"
@@ -2702,6 +2703,110 @@ ImDiskExtendDevice(HWND hWnd,
     return TRUE;
 }
 
+// Number of buffers in the pipeline between the reading thread and the
+// writing thread in ImDiskSaveImageFile.
+#define IMDISK_SAVE_BUFFERS 4
+
+typedef struct _IMDISK_SAVE_BUFFER
+{
+    LPBYTE Data;
+    DWORD Length;
+    BOOL Zero;
+} IMDISK_SAVE_BUFFER, *PIMDISK_SAVE_BUFFER;
+
+typedef struct _IMDISK_SAVE_CONTEXT
+{
+    HANDLE FileHandle;
+    HANDLE FreeSemaphore;
+    HANDLE FullSemaphore;
+    IMDISK_SAVE_BUFFER Buffers[IMDISK_SAVE_BUFFERS];
+    LARGE_INTEGER Position;
+    LONGLONG InitialFileSize;
+    BOOL SkipZero;
+    volatile LONG Failed;
+    DWORD LastError;
+} IMDISK_SAVE_CONTEXT, *PIMDISK_SAVE_CONTEXT;
+
+// Writes buffers filled by ImDiskSaveImageFile, in order. All-zero buffers
+// beyond end of original target file are skipped by moving file pointer
+// instead, so that they become unallocated ranges in a sparse file. A
+// buffer with zero length ends the thread.
+DWORD
+WINAPI
+ImDiskSaveImageFileWriter(LPVOID lpParameter)
+{
+    PIMDISK_SAVE_CONTEXT context = (PIMDISK_SAVE_CONTEXT)lpParameter;
+    BOOL extend_file = FALSE;
+    DWORD i;
+
+    for (i = 0; ; i = (i + 1) % IMDISK_SAVE_BUFFERS)
+    {
+        PIMDISK_SAVE_BUFFER buffer = context->Buffers + i;
+        DWORD dwWriteSize;
+
+        WaitForSingleObject(context->FullSemaphore, INFINITE);
+
+        if (buffer->Length == 0)
+            break;
+
+        if (context->Failed)
+        {
+            ReleaseSemaphore(context->FreeSemaphore, 1, NULL);
+            continue;
+        }
+
+        if (buffer->Zero && context->SkipZero &&
+            context->Position.QuadPart >= context->InitialFileSize)
+        {
+            LARGE_INTEGER distance;
+
+            distance.QuadPart = buffer->Length;
+
+            if (SetFilePointer(context->FileHandle, distance.LowPart,
+                &distance.HighPart, FILE_CURRENT) ==
+                INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
+            {
+                context->LastError = GetLastError();
+                context->Failed = TRUE;
+            }
+            else
+            {
+                context->Position.QuadPart += buffer->Length;
+                extend_file = TRUE;
+            }
+        }
+        else if (!WriteFile(context->FileHandle, buffer->Data,
+            buffer->Length, &dwWriteSize, NULL))
+        {
+            context->LastError = GetLastError();
+            context->Failed = TRUE;
+        }
+        else if (dwWriteSize != buffer->Length)
+        {
+            context->LastError = ERROR_DISK_FULL;
+            context->Failed = TRUE;
+        }
+        else
+        {
+            context->Position.QuadPart += dwWriteSize;
+            extend_file = FALSE;
+        }
+
+        ReleaseSemaphore(context->FreeSemaphore, 1, NULL);
+    }
+
+    // If the image ends with skipped zero buffers, file size needs to be
+    // set to include them.
+    if (extend_file && !context->Failed &&
+        !SetEndOfFile(context->FileHandle))
+    {
+        context->LastError = GetLastError();
+        context->Failed = TRUE;
+    }
+
+    return 0;
+}
+
 IMDISK_API BOOL
 WINAPI
 ImDiskSaveImageFile(IN HANDLE DeviceHandle,
@@ -2709,12 +2814,15 @@ ImDiskSaveImageFile(IN HANDLE DeviceHandle,
     IN DWORD BufferSize OPTIONAL,
     IN LPBOOL CancelFlag OPTIONAL)
 {
-    LPBYTE buffer;
+    IMDISK_SAVE_CONTEXT context = { 0 };
     IMDISK_SET_DEVICE_FLAGS device_flags = { 0 };
     LARGE_INTEGER disk_size = { 0 };
+    LARGE_INTEGER file_size = { 0 };
     LONGLONG saved_size = 0;
+    HANDLE writer_thread = NULL;
     DWORD dwReadSize;
-    DWORD dwWriteSize;
+    DWORD dwLastError = NO_ERROR;
+    DWORD i;
 
     if (!ImDiskGetVolumeSize(DeviceHandle, &disk_size.QuadPart))
         return FALSE;
@@ -2722,9 +2830,15 @@ ImDiskSaveImageFile(IN HANDLE DeviceHandle,
     if (disk_size.QuadPart == 0)
         return TRUE;
 
-    // Auto-select buffer size based on disk size
+    // Auto-select buffer size based on disk size, from 512 KB for small
+    // disks up to 8 MB for disks of 512 MB or larger.
     if (BufferSize == 0)
-        BufferSize = 1 << 19;
+    {
+        for (BufferSize = 1 << 19;
+            BufferSize < (1 << 23) &&
+            ((LONGLONG)BufferSize << 6) < disk_size.QuadPart;
+            BufferSize <<= 1);
+    }
 
     // Turn on FSCTL_ALLOW_EXTENDED_DASD_IO so that we can make sure that
     // we read the entire drive
@@ -2737,58 +2851,160 @@ ImDiskSaveImageFile(IN HANDLE DeviceHandle,
         &dwReadSize,
         NULL);
 
-    buffer = (LPBYTE)VirtualAlloc(NULL, BufferSize, MEM_COMMIT, PAGE_READWRITE);
-    if (buffer == NULL)
-        return FALSE;
+    // Zero ranges are only skipped when writing past existing end of a
+    // target file, so that existing data is never left where zeros should
+    // have been written. Only targets that can be made sparse, or that are
+    // files on a file system, count as files. Pipes, devices, volumes and
+    // everything else are written in full.
+    context.FileHandle = FileHandle;
 
-    for (;;)
+    if (GetFileType(FileHandle) == FILE_TYPE_DISK)
     {
+        BY_HANDLE_FILE_INFORMATION file_info = { 0 };
+        BOOL is_file = DeviceIoControl(FileHandle,
+            FSCTL_SET_SPARSE,
+            NULL,
+            0,
+            NULL,
+            0,
+            &dwReadSize,
+            NULL);
+
+        if (!is_file &&
+            GetFileInformationByHandle(FileHandle, &file_info) &&
+            (file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            is_file = TRUE;
+
+        if (is_file)
+        {
+            file_size.LowPart = GetFileSize(FileHandle,
+                (LPDWORD)&file_size.HighPart);
+
+            if (file_size.LowPart == INVALID_FILE_SIZE &&
+                GetLastError() != NO_ERROR)
+                is_file = FALSE;
+        }
+
+        if (is_file)
+        {
+            context.Position.LowPart = SetFilePointer(FileHandle, 0,
+                &context.Position.HighPart, FILE_CURRENT);
+
+            if (context.Position.LowPart != INVALID_SET_FILE_POINTER ||
+                GetLastError() == NO_ERROR)
+            {
+                context.InitialFileSize = file_size.QuadPart;
+                context.SkipZero = TRUE;
+            }
+        }
+    }
+
+    context.FreeSemaphore = CreateSemaphore(NULL, IMDISK_SAVE_BUFFERS,
+        IMDISK_SAVE_BUFFERS, NULL);
+    context.FullSemaphore = CreateSemaphore(NULL, 0, IMDISK_SAVE_BUFFERS,
+        NULL);
+
+    for (i = 0; i < IMDISK_SAVE_BUFFERS; i++)
+    {
+        context.Buffers[i].Data = (LPBYTE)VirtualAlloc(NULL, BufferSize,
+            MEM_COMMIT, PAGE_READWRITE);
+
+        if (context.Buffers[i].Data == NULL)
+            break;
+    }
+
+    if (i == IMDISK_SAVE_BUFFERS &&
+        context.FreeSemaphore != NULL &&
+        context.FullSemaphore != NULL)
+    {
+        writer_thread = CreateThread(NULL, 0, ImDiskSaveImageFileWriter,
+            &context, 0, NULL);
+    }
+
+    if (writer_thread == NULL)
+    {
+        dwLastError = GetLastError();
+        if (dwLastError == NO_ERROR)
+            dwLastError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+    else for (i = 0; ; i = (i + 1) % IMDISK_SAVE_BUFFERS)
+    {
+        PIMDISK_SAVE_BUFFER buffer = context.Buffers + i;
+        DWORD dwReadRequest = BufferSize;
+
+        WaitForSingleObject(context.FreeSemaphore, INFINITE);
+
+        buffer->Length = 0;
+
         if (CancelFlag != NULL)
         {
             ImDiskFlushWindowMessages(NULL);
 
             if (*CancelFlag)
             {
-                VirtualFree(buffer, 0, MEM_RELEASE);
-                SetLastError(ERROR_CANCELLED);
-                return FALSE;
+                dwLastError = ERROR_CANCELLED;
+                ReleaseSemaphore(context.FullSemaphore, 1, NULL);
+                break;
             }
         }
 
-        if (disk_size.QuadPart - saved_size < BufferSize)
-            BufferSize = (DWORD)(disk_size.QuadPart - saved_size);
-
-        if (!ReadFile(DeviceHandle, buffer, BufferSize, &dwReadSize, NULL))
+        if (context.Failed)
         {
-            DWORD dwLastError = GetLastError();
-            VirtualFree(buffer, 0, MEM_RELEASE);
-            SetLastError(dwLastError);
-            return FALSE;
+            ReleaseSemaphore(context.FullSemaphore, 1, NULL);
+            break;
         }
 
-        if (dwReadSize == 0)
+        if (disk_size.QuadPart - saved_size < dwReadRequest)
+            dwReadRequest = (DWORD)(disk_size.QuadPart - saved_size);
+
+        if (dwReadRequest == 0)
         {
-            VirtualFree(buffer, 0, MEM_RELEASE);
+            ReleaseSemaphore(context.FullSemaphore, 1, NULL);
             break;
         }
 
-        if (!WriteFile(FileHandle, buffer, dwReadSize, &dwWriteSize, NULL))
+        if (!ReadFile(DeviceHandle, buffer->Data, dwReadRequest, &dwReadSize,
+            NULL))
         {
-            DWORD dwLastError = GetLastError();
-            VirtualFree(buffer, 0, MEM_RELEASE);
-            SetLastError(dwLastError);
-            return FALSE;
+            dwLastError = GetLastError();
+            ReleaseSemaphore(context.FullSemaphore, 1, NULL);
+            break;
         }
 
-        saved_size += dwWriteSize;
+        buffer->Length = dwReadSize;
+        buffer->Zero = ImDiskBufferIsZero(buffer->Data, dwReadSize);
 
-        if (dwWriteSize != dwReadSize)
-        {
-            DWORD dwLastError = GetLastError();
-            VirtualFree(buffer, 0, MEM_RELEASE);
-            SetLastError(dwLastError);
-            return FALSE;
-        }
+        saved_size += dwReadSize;
+
+        ReleaseSemaphore(context.FullSemaphore, 1, NULL);
+
+        if (dwReadSize == 0)
+            break;
+    }
+
+    if (writer_thread != NULL)
+    {
+        WaitForSingleObject(writer_thread, INFINITE);
+        CloseHandle(writer_thread);
+    }
+
+    if (dwLastError == NO_ERROR && context.Failed)
+        dwLastError = context.LastError;
+
+    for (i = 0; i < IMDISK_SAVE_BUFFERS; i++)
+        if (context.Buffers[i].Data != NULL)
+            VirtualFree(context.Buffers[i].Data, 0, MEM_RELEASE);
+
+    if (context.FreeSemaphore != NULL)
+        CloseHandle(context.FreeSemaphore);
+
+    if (context.FullSemaphore != NULL)
+        CloseHandle(context.FullSemaphore);
+
+    if (dwLastError != NO_ERROR)
+    {
+        SetLastError(dwLastError);
+        return FALSE;
     }
 
     device_flags.FlagsToChange = IMDISK_IMAGE_MODIFIED;
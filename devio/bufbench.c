@@ -0,0 +1,450 @@
+/*
+Checks the vectorized buffer operations used by driver and tools against
+scalar reference implementations, and measures their throughput.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdbuf.h"
+#include "devstats.h"
+
+// Bytes around checked range that must not change
+#define GUARD 64
+
+// Vector paths to check. Each sets up ImDiskBufferAvx2Support, and returns
+// zero if the path is not available on this processor.
+typedef struct _BUF_PATH
+{
+    const char *name;
+    int avx2;
+} BUF_PATH;
+
+#ifdef IMDBUF_AVX2
+BUF_PATH paths[] = { { "SSE2", 0 }, { "AVX2", 1 } };
+#elif defined(IMDBUF_SSE2)
+BUF_PATH paths[] = { { "SSE2", 0 } };
+#elif defined(IMDBUF_NEON)
+BUF_PATH paths[] = { { "NEON", 0 } };
+#else
+BUF_PATH paths[] = { { "Scalar", 0 } };
+#endif
+
+size_t max_length = 300;
+size_t offsets = 64;
+ULONGLONG bench_bytes = 1 << 30;
+
+int
+select_path(const BUF_PATH *path)
+{
+#ifdef IMDBUF_AVX2
+    ImDiskBufferAvx2Support = -1;
+
+    if (path->avx2 && !ImDiskBufferHaveAvx2())
+        return 0;
+
+    ImDiskBufferAvx2Support = path->avx2;
+#endif
+
+    return 1;
+}
+
+// Scalar references
+
+int
+ref_is_zero(const unsigned char *ptr, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        if (ptr[i] != 0)
+            return 0;
+
+    return 1;
+}
+
+void
+ref_swap16(unsigned char *ptr, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= length; i += 2)
+    {
+        unsigned char b = ptr[i];
+        ptr[i] = ptr[i + 1];
+        ptr[i + 1] = b;
+    }
+}
+
+size_t
+ref_compare(const unsigned char *ptr1, const unsigned char *ptr2,
+    size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length && ptr1[i] == ptr2[i]; i++);
+
+    return i;
+}
+
+void
+fill_random(unsigned char *ptr, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        ptr[i] = (unsigned char)next_random();
+}
+
+// Checks all three operations on one range. ptr1 and ptr2 have GUARD bytes
+// before and after that are checked to be unchanged.
+int
+check_range(const char *path, unsigned char *ptr1, unsigned char *ptr2,
+    unsigned char *expected, size_t length)
+{
+    size_t pos;
+
+    // Zero detection, with a non-zero byte at each position, with only one
+    // bit set so that no lane could pass it by mistake
+    memset(ptr1, 0, length);
+
+    if (!ImDiskBufferIsZero(ptr1, length))
+    {
+        syslog(LOG_ERR, "%s IsZero: zero buffer of %zu bytes at %p not "
+            "detected.\n", path, length, ptr1);
+        return 0;
+    }
+
+    for (pos = 0; pos < length; pos++)
+    {
+        ptr1[pos] = (unsigned char)(1 << (pos & 7));
+
+        if (ImDiskBufferIsZero(ptr1, length) != ref_is_zero(ptr1, length))
+        {
+            syslog(LOG_ERR, "%s IsZero: non-zero byte at %zu of %zu at %p "
+                "not found.\n", path, pos, length, ptr1);
+            return 0;
+        }
+
+        ptr1[pos] = 0;
+    }
+
+    // Non-zero bytes just outside the range must not be seen
+    ptr1[-1] = 0xFF;
+    ptr1[length] = 0xFF;
+
+    if (!ImDiskBufferIsZero(ptr1, length))
+    {
+        syslog(LOG_ERR, "%s IsZero: byte outside %zu bytes at %p seen.\n",
+            path, length, ptr1);
+        return 0;
+    }
+
+    // Comparison, equal and with a difference at each position
+    fill_random(ptr1 - GUARD, length + 2 * GUARD);
+    memcpy(ptr2 - GUARD, ptr1 - GUARD, length + 2 * GUARD);
+    ptr2[-1] ^= 0x01;
+    ptr2[length] ^= 0x01;
+
+    if (ImDiskBufferCompare(ptr1, ptr2, length) != length)
+    {
+        syslog(LOG_ERR, "%s Compare: equal buffers of %zu bytes at %p and %p "
+            "differ.\n", path, length, ptr1, ptr2);
+        return 0;
+    }
+
+    for (pos = 0; pos < length; pos++)
+    {
+        size_t result;
+
+        ptr2[pos] ^= (unsigned char)(0x80 >> (pos & 7));
+
+        result = ImDiskBufferCompare(ptr1, ptr2, length);
+
+        if (result != ref_compare(ptr1, ptr2, length))
+        {
+            syslog(LOG_ERR, "%s Compare: difference at %zu of %zu bytes "
+                "reported at %zu.\n", path, pos, length, result);
+            return 0;
+        }
+
+        ptr2[pos] = ptr1[pos];
+    }
+
+    // Byte swap, with bytes around the range unchanged
+    fill_random(ptr1 - GUARD, length + 2 * GUARD);
+    memcpy(expected, ptr1 - GUARD, length + 2 * GUARD);
+    ref_swap16(expected + GUARD, length);
+
+    ImDiskBufferSwap16(ptr1, length);
+
+    if (memcmp(ptr1 - GUARD, expected, length + 2 * GUARD) != 0)
+    {
+        syslog(LOG_ERR, "%s Swap16: %zu bytes at %p differ from reference.\n",
+            path, length, ptr1);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Every length up to max_length at every start offset up to offsets, and
+// every length ending right before an inaccessible page, so that reads
+// past end of buffers fault.
+int
+check_path(const BUF_PATH *path, unsigned char *area1, unsigned char *area2,
+    unsigned char *expected, unsigned char *page_end)
+{
+    size_t offset;
+    size_t length;
+    ULONGLONG ranges = 0;
+
+    for (offset = 0; offset < offsets; offset++)
+        for (length = 0; length <= max_length; length++)
+        {
+            if (!check_range(path->name, area1 + GUARD + offset,
+                area2 + GUARD + (offset * 7 % 64), expected, length))
+                return 0;
+
+            ranges++;
+        }
+
+    for (length = 0; length <= max_length; length++)
+    {
+        unsigned char *ptr = page_end - length;
+
+        memset(ptr, 0, length);
+        ptr[-1] = 0xFF;
+
+        if (!ImDiskBufferIsZero(ptr, length) ||
+            (length > 0 && (ptr[length - 1] = 1, ImDiskBufferIsZero(ptr,
+                length))) ||
+            ImDiskBufferCompare(ptr, ptr, length) != length)
+        {
+            syslog(LOG_ERR, "%s: wrong result for %zu bytes at end of "
+                "page.\n", path->name, length);
+            return 0;
+        }
+
+        fill_random(ptr, length);
+        memcpy(expected, ptr, length);
+        ref_swap16(expected, length);
+        ImDiskBufferSwap16(ptr, length);
+
+        if (memcmp(ptr, expected, length) != 0)
+        {
+            syslog(LOG_ERR, "%s Swap16: %zu bytes at end of page differ.\n",
+                path->name, length);
+            return 0;
+        }
+
+        ranges++;
+    }
+
+    printf("%-6s ok, " ULL_FMT " ranges of 0 to %zu bytes at %zu offsets\n",
+        path->name, ranges, max_length, offsets);
+
+    return 1;
+}
+
+void
+report(const char *path, const char *name, size_t size, ULONGLONG bytes,
+    uint64_t elapsed)
+{
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%-6s %-8s %8zu bytes %9.1f MB/s\n", path, name, size,
+        (double)bytes / elapsed);
+}
+
+// Throughput for buffers of a few sizes, with each operation looking at
+// whole buffer: zero buffers, equal buffers.
+volatile size_t sink;
+
+void
+bench_path(const char *path, unsigned char *buf1, unsigned char *buf2,
+    int reference)
+{
+    static const size_t sizes[] = { 512, 4096, 65536, 1 << 20 };
+    size_t s;
+
+    memset(buf1, 0, 1 << 20);
+    memset(buf2, 0, 1 << 20);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t size = sizes[s];
+        ULONGLONG count = bench_bytes / size;
+        ULONGLONG i;
+        uint64_t start_time;
+
+        if (count == 0)
+            count = 1;
+
+        start_time = stats_clock();
+        for (i = 0; i < count; i++)
+            sink += reference ? ref_is_zero(buf1, size) :
+            ImDiskBufferIsZero(buf1, size);
+        report(path, "IsZero", size, count * size, stats_clock() - start_time);
+
+        start_time = stats_clock();
+        for (i = 0; i < count; i++)
+            sink += reference ? ref_compare(buf1, buf2, size) :
+            ImDiskBufferCompare(buf1, buf2, size);
+        report(path, "Compare", size, count * size,
+            stats_clock() - start_time);
+
+        start_time = stats_clock();
+        for (i = 0; i < count; i++)
+            if (reference)
+                ref_swap16(buf1, size);
+            else
+                ImDiskBufferSwap16(buf1, size);
+        report(path, "Swap16", size, count * size,
+            stats_clock() - start_time);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char *area1;
+    unsigned char *area2;
+    unsigned char *expected;
+    unsigned char *pages;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t area_size;
+    size_t p;
+    int opt;
+
+    openlog("bufbench", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "m:o:b:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            max_length = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'o':
+            offsets = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            if (!parse_size(optarg, &bench_bytes))
+                return -1;
+            break;
+
+        case 'r':
+            seed_random(strtoull(optarg, NULL, 0));
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc != optind || max_length + 1 > (size_t)page_size)
+    {
+        fprintf(stderr,
+            "bufbench - Buffer operations of driver and tools\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "bufbench [-m maxlength] [-o offsets] [-b bytes] [-r seed]\n"
+            "\n"
+            "Checks ImDiskBufferIsZero, ImDiskBufferSwap16 and ImDiskBufferCompare\n"
+            "in inc/imdbuf.h against scalar reference implementations, with each\n"
+            "vector path the processor supports. Every length up to maxlength is\n"
+            "checked at each start offset, with a non-zero byte or a difference\n"
+            "at each position, and ending right before an inaccessible page. Then\n"
+            "measures throughput of each path and of the references.\n"
+            "\n"
+            "-m      Longest range to check, less than page size. Default 300.\n"
+            "-o      Start offsets to check. Default 64.\n"
+            "-b      Bytes for each throughput measurement, 0 to skip. Default 1G.\n"
+            "-r      Random seed.\n");
+
+        return -1;
+    }
+
+    area_size = GUARD + offsets + max_length + GUARD + 64;
+
+    area1 = (unsigned char *)malloc(area_size > (1 << 20) ? area_size :
+        (1 << 20));
+    area2 = (unsigned char *)malloc(area_size > (1 << 20) ? area_size :
+        (1 << 20));
+    expected = (unsigned char *)malloc(max_length + 2 * GUARD);
+    pages = (unsigned char *)mmap(NULL, 2 * page_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (area1 == NULL || area2 == NULL || expected == NULL ||
+        pages == MAP_FAILED ||
+        mprotect(pages + page_size, page_size, PROT_NONE) != 0)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    for (p = 0; p < sizeof(paths) / sizeof(*paths); p++)
+    {
+        if (!select_path(&paths[p]))
+        {
+            printf("%-6s not supported by processor\n", paths[p].name);
+            continue;
+        }
+
+        if (!check_path(&paths[p], area1, area2, expected,
+            pages + page_size))
+            return 2;
+    }
+
+    if (bench_bytes > 0)
+    {
+        for (p = 0; p < sizeof(paths) / sizeof(*paths); p++)
+            if (select_path(&paths[p]))
+                bench_path(paths[p].name, area1, area2, 0);
+
+        bench_path("Ref", area1, area2, 1);
+    }
+
+    munmap(pages, 2 * page_size);
+    free(area1);
+    free(area2);
+    free(expected);
+
+    return 0;
+}
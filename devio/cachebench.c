@@ -0,0 +1,796 @@
+/*
+Checks the block cache used by the driver for file and proxy devices
+against a reference model, and measures lookup latency.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdcache.h"
+#include "devstats.h"
+
+// Reads and writes in flight at the same time in the model check
+#define MAX_PENDING 8
+
+#define MAX_SETS 64
+
+typedef struct _PENDING_READ
+{
+    unsigned int generation;
+    long long offset;
+    size_t length;
+    unsigned char *data;        // Image data when read was done
+} PENDING_READ;
+
+typedef struct _PENDING_WRITE
+{
+    long long offset;
+    size_t length;
+    unsigned char *old_data;    // Image data before write
+} PENDING_WRITE;
+
+ULONGLONG block_size = 512;
+ULONGLONG cache_size = 16 << 10;
+ULONGLONG image_size = 256 << 10;
+ULONGLONG bench_cache_size = 64 << 20;
+size_t operations = 1000000;
+size_t bench_lookups = 1000000;
+
+unsigned char *image;
+
+// Reference model. Each set is a list of block numbers with most recently
+// used first. The model generation changes on every invalidation.
+long long model_sets[MAX_SETS][IMDCACHE_WAYS];
+size_t model_count[MAX_SETS];
+size_t model_set_count;
+unsigned int model_generation;
+
+PENDING_READ reads[MAX_PENDING];
+size_t read_count = 0;
+PENDING_WRITE writes[MAX_PENDING];
+size_t write_count = 0;
+
+ULONGLONG stale_rejected = 0;
+ULONGLONG evictions = 0;
+
+void
+model_clear()
+{
+    memset(model_count, 0, sizeof model_count);
+    model_generation++;
+}
+
+// Returns position of block in its set, or -1.
+int
+model_find(long long block)
+{
+    size_t set = (size_t)block & (model_set_count - 1);
+    size_t i;
+
+    for (i = 0; i < model_count[set]; i++)
+        if (model_sets[set][i] == block)
+            return (int)i;
+
+    return -1;
+}
+
+void
+model_remove(long long block)
+{
+    size_t set = (size_t)block & (model_set_count - 1);
+    int pos = model_find(block);
+
+    if (pos < 0)
+        return;
+
+    memmove(&model_sets[set][pos], &model_sets[set][pos + 1],
+        (model_count[set] - pos - 1) * sizeof(model_sets[set][0]));
+    model_count[set]--;
+}
+
+// Moves block first in its set, replacing the last one if the set is full.
+void
+model_touch(long long block)
+{
+    size_t set = (size_t)block & (model_set_count - 1);
+
+    if (model_find(block) >= 0)
+        model_remove(block);
+    else if (model_count[set] == IMDCACHE_WAYS)
+    {
+        model_count[set]--;
+        evictions++;
+    }
+
+    memmove(&model_sets[set][1], &model_sets[set][0],
+        model_count[set] * sizeof(model_sets[set][0]));
+    model_sets[set][0] = block;
+    model_count[set]++;
+}
+
+// Lookup touches blocks in order until the first one that is not cached.
+int
+model_lookup(long long offset, size_t length)
+{
+    long long block = offset / (long long)block_size;
+    long long last = (offset + (long long)length - 1) / (long long)block_size;
+
+    for (; block <= last; block++)
+    {
+        if (model_find(block) < 0)
+            return 0;
+
+        model_touch(block);
+    }
+
+    return 1;
+}
+
+int
+model_fillable(long long offset, size_t length)
+{
+    long long first = (offset + (long long)block_size - 1) /
+        (long long)block_size;
+
+    return (first + 1) * (long long)block_size <= offset + (long long)length;
+}
+
+void
+model_insert(unsigned int generation, long long offset, size_t length)
+{
+    long long block = (offset + (long long)block_size - 1) /
+        (long long)block_size;
+
+    if (generation != model_generation)
+    {
+        stale_rejected++;
+        return;
+    }
+
+    for (; (block + 1) * (long long)block_size <= offset + (long long)length;
+        block++)
+        model_touch(block);
+}
+
+void
+model_invalidate(long long offset, size_t length)
+{
+    long long block = offset / (long long)block_size;
+    long long last = (offset + (long long)length - 1) / (long long)block_size;
+
+    if (length == 0)
+        return;
+
+    model_generation++;
+
+    for (; block <= last; block++)
+        model_remove(block);
+}
+
+// Compares set of cached blocks in cache and model.
+int
+compare_contents(PIMDCACHE cache)
+{
+    size_t cached = 0;
+    size_t modeled = 0;
+    size_t i;
+
+    for (i = 0; i < cache->entries; i++)
+        if (cache->tags[i] != IMDCACHE_EMPTY)
+        {
+            if (model_find(cache->tags[i]) < 0)
+            {
+                syslog(LOG_ERR, "Block %lli is cached but not in model.\n",
+                    cache->tags[i]);
+                return 0;
+            }
+
+            cached++;
+        }
+
+    for (i = 0; i < model_set_count; i++)
+        modeled += model_count[i];
+
+    if (cached != modeled)
+    {
+        syslog(LOG_ERR, "%zu blocks cached, %zu in model.\n", cached,
+            modeled);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Data from a cache hit is the current image data, except where a write
+// is in flight, where it may also be data from before the write.
+int
+check_hit(long long offset, size_t length, const unsigned char *data)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        long long pos = offset + (long long)i;
+        size_t w;
+
+        if (data[i] == image[pos])
+            continue;
+
+        for (w = 0; w < write_count; w++)
+            if (pos >= writes[w].offset &&
+                pos < writes[w].offset + (long long)writes[w].length &&
+                data[i] == writes[w].old_data[pos - writes[w].offset])
+                break;
+
+        if (w == write_count)
+        {
+            syslog(LOG_ERR, "Stale data from cache at %lli.\n", pos);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void
+random_range(long long *offset, size_t *length)
+{
+    ULONGLONG span = image_size;
+
+    // Half of ranges are in a region that fits in cache, so that lookups
+    // hit often, and the rest are spread over the image to cause evictions
+    if (next_random() % 2 == 0)
+        span = cache_size / 2;
+
+    *length = 1 + (size_t)(next_random() % (4 * block_size));
+    *offset = (long long)(next_random() % (span - *length + 1));
+
+    // Mostly block aligned requests, like file systems send
+    if (next_random() % 4 != 0)
+    {
+        *offset -= *offset % (long long)block_size;
+        *length = (size_t)((*length + block_size - 1) / block_size *
+            block_size);
+
+        if (*offset + (long long)*length > (long long)span)
+            *offset = (long long)(span - *length);
+    }
+}
+
+void
+start_read(PIMDCACHE cache)
+{
+    PENDING_READ *read = &reads[read_count];
+
+    random_range(&read->offset, &read->length);
+
+    // Generation is taken before image is read, as the driver does
+    read->generation = ImDiskCacheGeneration(cache);
+    memcpy(read->data, image + read->offset, read->length);
+
+    read_count++;
+}
+
+void
+complete_read(PIMDCACHE cache, size_t index)
+{
+    PENDING_READ read = reads[index];
+
+    ImDiskCacheInsert(cache, read.generation, read.offset, read.data,
+        read.length);
+    model_insert(read.generation, read.offset, read.length);
+
+    reads[index] = reads[read_count - 1];
+    reads[read_count - 1] = read;
+    read_count--;
+}
+
+void
+start_write()
+{
+    PENDING_WRITE *write = &writes[write_count];
+    size_t i;
+
+    random_range(&write->offset, &write->length);
+
+    memcpy(write->old_data, image + write->offset, write->length);
+
+    for (i = 0; i < write->length; i++)
+        image[write->offset + i] = (unsigned char)next_random();
+
+    write_count++;
+}
+
+void
+complete_write(PIMDCACHE cache, size_t index)
+{
+    PENDING_WRITE write = writes[index];
+
+    ImDiskCacheInvalidate(cache, write.offset, write.length);
+    model_invalidate(write.offset, write.length);
+
+    writes[index] = writes[write_count - 1];
+    writes[write_count - 1] = write;
+    write_count--;
+}
+
+// The case the generation check is for. A read starts, a write to the same
+// range completes, then the read completes with data from before the write.
+int
+check_race(PIMDCACHE cache, unsigned char *buffer)
+{
+    long long offset = 2 * (long long)block_size;
+    size_t length = 2 * (size_t)block_size;
+    unsigned int generation;
+    size_t i;
+
+    ImDiskCacheClear(cache);
+    model_clear();
+
+    generation = ImDiskCacheGeneration(cache);
+    memcpy(buffer, image + offset, length);
+
+    for (i = 0; i < length; i++)
+        image[offset + i] ^= 0x5A;
+
+    ImDiskCacheInvalidate(cache, offset, length);
+    ImDiskCacheInsert(cache, generation, offset, buffer, length);
+
+    if (ImDiskCacheLookup(cache, offset, buffer, length))
+    {
+        syslog(LOG_ERR, "Data read before write was cached after write.\n");
+        return 0;
+    }
+
+    // Write elsewhere also makes earlier reads uncacheable
+    generation = ImDiskCacheGeneration(cache);
+    memcpy(buffer, image + offset, length);
+    ImDiskCacheInvalidate(cache, offset + 4 * length, length);
+    ImDiskCacheInsert(cache, generation, offset, buffer, length);
+
+    if (ImDiskCacheLookup(cache, offset, buffer, length))
+    {
+        syslog(LOG_ERR, "Read that overlapped a write was cached.\n");
+        return 0;
+    }
+
+    generation = ImDiskCacheGeneration(cache);
+    memcpy(buffer, image + offset, length);
+    ImDiskCacheInsert(cache, generation, offset, buffer, length);
+
+    if (!ImDiskCacheLookup(cache, offset, buffer, length) ||
+        memcmp(buffer, image + offset, length) != 0)
+    {
+        syslog(LOG_ERR, "Read without writes in flight was not cached.\n");
+        return 0;
+    }
+
+    ImDiskCacheClear(cache);
+    model_clear();
+
+    printf("Race      ok\n");
+
+    return 1;
+}
+
+// Fills a set with blocks, touches all but one, and inserts one more block
+// in the same set, which has to replace the one not touched.
+int
+check_lru(PIMDCACHE cache, unsigned char *buffer)
+{
+    long long stride = (long long)model_set_count;
+    long long victim = 3;
+    long long block;
+    size_t i;
+
+    ImDiskCacheClear(cache);
+    model_clear();
+
+    for (i = 0; i < IMDCACHE_WAYS; i++)
+    {
+        block = victim + (long long)i * stride;
+
+        ImDiskCacheInsert(cache, ImDiskCacheGeneration(cache),
+            block * (long long)block_size,
+            image + block * (long long)block_size, (size_t)block_size);
+    }
+
+    for (i = 1; i < IMDCACHE_WAYS; i++)
+    {
+        block = victim + (long long)i * stride;
+
+        if (!ImDiskCacheLookup(cache, block * (long long)block_size, buffer,
+            (size_t)block_size))
+        {
+            syslog(LOG_ERR, "Block %lli missing from full set.\n", block);
+            return 0;
+        }
+    }
+
+    block = victim + IMDCACHE_WAYS * stride;
+
+    ImDiskCacheInsert(cache, ImDiskCacheGeneration(cache),
+        block * (long long)block_size, image + block * (long long)block_size,
+        (size_t)block_size);
+
+    if (ImDiskCacheLookup(cache, victim * (long long)block_size, buffer,
+        (size_t)block_size))
+    {
+        syslog(LOG_ERR, "Least recently used block was not replaced.\n");
+        return 0;
+    }
+
+    for (i = 1; i <= IMDCACHE_WAYS; i++)
+    {
+        block = victim + (long long)i * stride;
+
+        if (!ImDiskCacheLookup(cache, block * (long long)block_size, buffer,
+            (size_t)block_size))
+        {
+            syslog(LOG_ERR, "Recently used block %lli was replaced.\n",
+                block);
+            return 0;
+        }
+    }
+
+    ImDiskCacheClear(cache);
+    model_clear();
+
+    printf("LRU       ok\n");
+
+    return 1;
+}
+
+// Random reads, writes, lookups, invalidations and clears, with several
+// reads and writes in flight, compared with the model after each step.
+int
+check_model(PIMDCACHE cache, unsigned char *buffer)
+{
+    ULONGLONG hits = 0;
+    ULONGLONG lookups = 0;
+    size_t i;
+
+    model_generation = ImDiskCacheGeneration(cache);
+
+    for (i = 0; i < operations; i++)
+    {
+        unsigned int op = (unsigned int)(next_random() % 100);
+        long long offset;
+        size_t length;
+
+        if (op < 25 && read_count < MAX_PENDING)
+            start_read(cache);
+        else if (op < 50 && read_count > 0)
+            complete_read(cache, (size_t)(next_random() % read_count));
+        else if (op < 55 && write_count < MAX_PENDING)
+            start_write();
+        else if (op < 60 && write_count > 0)
+            complete_write(cache, (size_t)(next_random() % write_count));
+        else if (op == 60)
+        {
+            ImDiskCacheClear(cache);
+            model_clear();
+        }
+        else if (op == 61)
+        {
+            // Trim of a range larger than the cache, which is invalidated
+            // entry by entry instead of block by block
+            length = (size_t)(next_random() % (image_size / 2)) + 1;
+            offset = (long long)(next_random() % (image_size - length + 1));
+
+            memset(image + offset, 0, length);
+
+            ImDiskCacheInvalidate(cache, offset, length);
+            model_invalidate(offset, length);
+        }
+        else
+        {
+            int hit;
+            int expected;
+
+            random_range(&offset, &length);
+
+            if (ImDiskCacheFillable(cache, offset, length) !=
+                model_fillable(offset, length))
+            {
+                syslog(LOG_ERR, "Fillable differs at %lli, %zu bytes.\n",
+                    offset, length);
+                return 0;
+            }
+
+            hit = ImDiskCacheLookup(cache, offset, buffer, length);
+            expected = model_lookup(offset, length);
+
+            lookups++;
+
+            if (hit != expected)
+            {
+                syslog(LOG_ERR, "Lookup at %lli, %zu bytes: %s, model %s.\n",
+                    offset, length, hit ? "hit" : "miss",
+                    expected ? "hit" : "miss");
+                return 0;
+            }
+
+            if (hit)
+            {
+                hits++;
+
+                if (!check_hit(offset, length, buffer))
+                    return 0;
+            }
+        }
+
+        if (ImDiskCacheGeneration(cache) != model_generation ||
+            !compare_contents(cache))
+        {
+            syslog(LOG_ERR, "Cache differs from model after operation %zu.\n",
+                i);
+            return 0;
+        }
+    }
+
+    printf("Model     ok, %zu operations, " ULL_FMT " of " ULL_FMT " lookups "
+        "hit, " ULL_FMT " evictions, " ULL_FMT " stale inserts rejected\n",
+        operations, hits, lookups, evictions, stale_rejected);
+
+    return 1;
+}
+
+// Hit latency for lookups of one block and of 64 KB, with all blocks
+// cached, and miss latency. Lookups are timed in batches, since one lookup
+// is shorter than clock resolution.
+int
+bench_lookup()
+{
+    IMDCACHE cache;
+    static const size_t sizes[] = { 0, 65536 };
+    size_t blocks;
+    unsigned char *data;
+    uint64_t start_time;
+    size_t s;
+    size_t i;
+
+    if (!ImDiskCacheInitialize(&cache, (size_t)block_size,
+        (size_t)bench_cache_size))
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    // Half the cache, so that no set overflows
+    blocks = cache.entries / 2;
+
+    if (blocks <= 65536 / block_size)
+    {
+        fprintf(stderr, "Cache for latency measurement is too small.\n");
+        ImDiskCacheFree(&cache);
+        return 0;
+    }
+
+    data = (unsigned char *)malloc(65536 + (size_t)block_size);
+    if (data == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    memset(data, 0xA5, 65536 + (size_t)block_size);
+
+    for (i = 0; i < blocks; i++)
+        ImDiskCacheInsert(&cache, ImDiskCacheGeneration(&cache),
+            (long long)(i * block_size), data, (size_t)block_size);
+
+    printf("Latency   %zu blocks cached of %zu entries.\n", blocks,
+        cache.entries);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        size_t length = sizes[s] > block_size ? sizes[s] : (size_t)block_size;
+        size_t span = blocks - length / (size_t)block_size;
+        uint64_t elapsed;
+
+        start_time = stats_clock();
+
+        for (i = 0; i < bench_lookups; i++)
+        {
+            long long offset = (long long)(next_random() % span * block_size);
+
+            if (!ImDiskCacheLookup(&cache, offset, data, length))
+            {
+                syslog(LOG_ERR, "Cached block missing at %lli.\n", offset);
+                return 0;
+            }
+        }
+
+        elapsed = stats_clock() - start_time;
+        if (elapsed == 0)
+            elapsed = 1;
+
+        printf("Hit       %6zu bytes %8.1f ns per lookup %8.1f MB/s\n",
+            length, elapsed * 1000.0 / bench_lookups,
+            (double)length * bench_lookups / elapsed);
+    }
+
+    start_time = stats_clock();
+
+    for (i = 0; i < bench_lookups; i++)
+        ImDiskCacheLookup(&cache, (long long)((blocks + next_random() %
+            blocks) * block_size), data, (size_t)block_size);
+
+    printf("Miss      %6zu bytes %8.1f ns per lookup\n", (size_t)block_size,
+        (stats_clock() - start_time) * 1000.0 / bench_lookups);
+
+    ImDiskCacheFree(&cache);
+    free(data);
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    IMDCACHE cache;
+    unsigned char *buffer;
+    size_t i;
+    int opt;
+
+    openlog("cachebench", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "b:c:i:n:l:m:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if (!parse_size(optarg, &block_size))
+                return -1;
+            break;
+
+        case 'c':
+            if (!parse_size(optarg, &cache_size))
+                return -1;
+            break;
+
+        case 'i':
+            if (!parse_size(optarg, &image_size))
+                return -1;
+            break;
+
+        case 'n':
+            operations = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'l':
+            bench_lookups = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'm':
+            if (!parse_size(optarg, &bench_cache_size))
+                return -1;
+            break;
+
+        case 'r':
+            seed_random(strtoull(optarg, NULL, 0));
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc != optind || block_size == 0 ||
+        (block_size & (block_size - 1)) != 0 ||
+        cache_size / block_size < IMDCACHE_WAYS ||
+        cache_size / block_size / IMDCACHE_WAYS > MAX_SETS ||
+        image_size < (IMDCACHE_WAYS + 1) * cache_size ||
+        image_size % block_size != 0)
+    {
+        fprintf(stderr,
+            "cachebench - Block cache of file and proxy devices\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "cachebench [-b blocksize] [-c cachesize] [-i imagesize] [-n operations]\n"
+            "           [-l lookups] [-m benchcachesize] [-r seed]\n"
+            "\n"
+            "Checks the cache in inc/imdcache.h against a reference model with\n"
+            "least recently used replacement in each set. Random reads, writes,\n"
+            "lookups and clears are done with several reads and writes in flight,\n"
+            "where reads that overlap a write completing must not be cached, and\n"
+            "lookups must never return data older than writes completed. Then\n"
+            "measures latency of cache hits and misses.\n"
+            "\n"
+            "-b      Block size, a power of two. Default 512.\n"
+            "-c      Cache size for model check, at most 64 sets. Default 16K.\n"
+            "-i      Image size for model check, whole blocks and at least 9 times\n"
+            "        cache size. Default 256K.\n"
+            "-n      Operations in model check. Default 1000000.\n"
+            "-l      Lookups for each latency measurement. Default 1000000.\n"
+            "-m      Cache size for latency measurement. Default 64M.\n"
+            "-r      Random seed.\n");
+
+        return -1;
+    }
+
+    image = (unsigned char *)malloc((size_t)image_size);
+    buffer = (unsigned char *)malloc(4 * (size_t)block_size);
+    for (i = 0; i < MAX_PENDING; i++)
+    {
+        reads[i].data = (unsigned char *)malloc(4 * (size_t)block_size);
+        writes[i].old_data = (unsigned char *)malloc(4 * (size_t)block_size);
+
+        if (reads[i].data == NULL || writes[i].old_data == NULL)
+            image = NULL;
+    }
+
+    if (image == NULL || buffer == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    for (i = 0; i < image_size; i++)
+        image[i] = (unsigned char)next_random();
+
+    if (!ImDiskCacheInitialize(&cache, (size_t)block_size,
+        (size_t)cache_size))
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    model_set_count = cache.set_mask + 1;
+    model_generation = ImDiskCacheGeneration(&cache);
+
+    printf("%zu sets of %i blocks of " ULL_FMT " bytes, image " ULL_FMT
+        " bytes.\n", model_set_count, IMDCACHE_WAYS, block_size, image_size);
+
+    if (!check_race(&cache, buffer) ||
+        !check_lru(&cache, buffer) ||
+        !check_model(&cache, buffer))
+        return 2;
+
+    ImDiskCacheFree(&cache);
+
+    if (bench_lookups > 0 && !bench_lookup())
+        return 2;
+
+    free(image);
+    free(buffer);
+    for (i = 0; i < MAX_PENDING; i++)
+    {
+        free(reads[i].data);
+        free(writes[i].old_data);
+    }
+
+    return 0;
+}
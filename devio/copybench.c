@@ -0,0 +1,272 @@
+/*
+Measures cost of copying image I/O through an intermediate buffer, as
+the driver did for all file and proxy device reads and writes, compared to
+reading and writing directly to and from request buffers.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devstats.h"
+
+// Request buffers are used in turn from an area larger than processor
+// caches, like buffers of different callers would be.
+#define REQUEST_AREA_SIZE (64 << 20)
+
+int image_fd = -1;
+int random_pattern = 0;
+ULONGLONG block_size = 65536;
+ULONGLONG span = 0;
+uint64_t duration = 5000000;
+char *request_area = NULL;
+size_t request_buffers = 0;
+char *io_buffer = NULL;
+
+uint64_t
+cpu_clock()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+        1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Runs requests for the configured time, through io_buffer if copy is set.
+// Returns 0 if an I/O error occurred.
+int
+run(const char *name, int write, int copy)
+{
+    LATENCY_LIST list = { 0 };
+    ULONGLONG blocks = span / block_size;
+    ULONGLONG next_block = 0;
+    uint64_t start_time = stats_clock();
+    uint64_t start_cpu = cpu_clock();
+    uint64_t elapsed;
+    uint64_t cpu;
+    size_t count;
+
+    // Same offsets for every run.
+    seed_random(0);
+
+    for (count = 0;; count++)
+    {
+        char *request = request_area +
+            (count % request_buffers) * (size_t)block_size;
+        ULONGLONG block;
+        uint64_t issue_time = stats_clock();
+        ssize_t done;
+
+        if (issue_time >= start_time + duration)
+            break;
+
+        if (random_pattern)
+        {
+            block = next_random() % blocks;
+        }
+        else
+        {
+            block = next_block;
+            next_block = (next_block + 1) % blocks;
+        }
+
+        if (write)
+        {
+            if (copy)
+                memcpy(io_buffer, request, (size_t)block_size);
+
+            done = pwrite(image_fd, copy ? io_buffer : request,
+                (size_t)block_size, (off_t)(block * block_size));
+        }
+        else
+        {
+            done = pread(image_fd, copy ? io_buffer : request,
+                (size_t)block_size, (off_t)(block * block_size));
+
+            if (copy && done > 0)
+                memcpy(request, io_buffer, (size_t)done);
+        }
+
+        if (done != (ssize_t)block_size)
+        {
+            syslog(LOG_ERR, "I/O error at offset " ULL_FMT ": %m\n",
+                block * block_size);
+            latency_free(&list);
+            return 0;
+        }
+
+        latency_add(&list, stats_clock() - issue_time, block_size);
+    }
+
+    elapsed = stats_clock() - start_time;
+    cpu = cpu_clock() - start_cpu;
+
+    latency_report(name, &list, elapsed);
+
+    printf("       processor time %.1f ms per GB, %.0f%% busy\n",
+        list.bytes ? (double)cpu * 1024.0 * 1024.0 * 1024.0 / 1000.0 /
+        (double)list.bytes : 0.0,
+        elapsed ? 100.0 * cpu / elapsed : 0.0);
+
+    latency_free(&list);
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct stat file_stat;
+    int writes = 0;
+    int opt;
+
+    openlog("copybench", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "p:b:s:t:w")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            if (strcmp(optarg, "rand") == 0)
+                random_pattern = 1;
+            else if (strcmp(optarg, "seq") == 0)
+                random_pattern = 0;
+            else
+                argc = 0;
+            break;
+
+        case 'b':
+            if (!parse_size(optarg, &block_size) || block_size == 0 ||
+                block_size > REQUEST_AREA_SIZE)
+                return -1;
+            break;
+
+        case 's':
+            if (!parse_size(optarg, &span))
+                return -1;
+            break;
+
+        case 't':
+            duration = (uint64_t)(strtod(optarg, NULL) * 1000000.0);
+            break;
+
+        case 'w':
+            writes = 1;
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        fprintf(stderr,
+            "copybench - Cost of intermediate buffer copies in image I/O\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "copybench [-p seq|rand] [-b blocksize] [-s span] [-t seconds] [-w]\n"
+            "          imagefile\n"
+            "\n"
+            "Reads blocks from image file, first through an intermediate buffer\n"
+            "that is then copied to request buffer, and then directly into\n"
+            "request buffer. With -w, writes are measured the same way. Each run\n"
+            "reports throughput, latency and processor time per GB transferred.\n"
+            "\n"
+            "-p      Access pattern, sequential or uniformly random. Default seq.\n"
+            "-b      Block size. Default 64K.\n"
+            "-s      Size of area at start of image to access. Default whole image.\n"
+            "-t      Run time in seconds for each run. Default 5.\n"
+            "-w      Also measure writes. Writes overwrite image contents, so only\n"
+            "        use with scratch images.\n");
+
+        return -1;
+    }
+
+    image_fd = open(argv[optind], writes ? O_RDWR : O_RDONLY);
+    if (image_fd == -1 || fstat(image_fd, &file_stat) != 0)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", argv[optind]);
+        return 1;
+    }
+
+    if (span == 0 || span > (ULONGLONG)file_stat.st_size)
+        span = file_stat.st_size;
+
+    if (span < block_size)
+    {
+        fprintf(stderr, "Image size " ULL_FMT " is smaller than block size "
+            ULL_FMT ".\n", span, block_size);
+        return 1;
+    }
+
+    request_buffers = REQUEST_AREA_SIZE / (size_t)block_size;
+    request_area = (char*)malloc(request_buffers * (size_t)block_size);
+    io_buffer = (char*)malloc((size_t)block_size);
+
+    if (request_area == NULL || io_buffer == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    memset(request_area, 0xA5, request_buffers * (size_t)block_size);
+    memset(io_buffer, 0, (size_t)block_size);
+
+    printf("%s, block size " ULL_FMT ", span " ULL_FMT ".\n",
+        random_pattern ? "Random" : "Sequential", block_size, span);
+
+    // Image data is read once first, so that both read runs find it in
+    // the same place, normally the page cache.
+    if (!run("Warmup", 0, 0) ||
+        !run("Copy", 0, 1) ||
+        !run("Direct", 0, 0))
+        return 2;
+
+    if (writes &&
+        (!run("WrCopy", 1, 1) ||
+            !run("WrDirect", 1, 0)))
+        return 2;
+
+    close(image_fd);
+    free(request_area);
+    free(io_buffer);
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+/*
+Lists or copies blocks changed since last reset, from a devio server that
+tracks changed blocks.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "safeio.h"
+#include "devioclnt.h"
+
+#define COPY_CHUNK_SIZE (1 << 20)
+
+int
+main(int argc, char **argv)
+{
+    DEVIO_CLIENT client;
+    ULONGLONG flags = 0;
+    const char *out_path = NULL;
+    int out_fd = -1;
+    char *buf = NULL;
+    ULONGLONG offset = 0;
+    ULONGLONG changed = 0;
+    ULONGLONG range_count = 0;
+    ULONGLONG block_size = 0;
+    int retval = 0;
+    int opt;
+
+    openlog("devcbt", LOG_PERROR, LOG_USER);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "ro:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            flags |= IMDPROXY_CBT_FLAG_RESET;
+            break;
+
+        case 'o':
+            out_path = optarg;
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        fprintf(stderr,
+            "devcbt - Lists or copies blocks changed since last reset, from a devio\n"
+            "server started with --cbt.\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "devcbt [-r] [-o outfile] host:port|exec:command\n"
+            "\n"
+            "-r          Reset listed blocks, so that next run only finds blocks written\n"
+            "            after this one. If this run fails after the reset, next backup\n"
+            "            needs to be a full one.\n"
+            "\n"
+            "-o outfile  Copy changed blocks to the same offsets in outfile, for example\n"
+            "            a copy of the image from last backup. Without this switch,\n"
+            "            changed ranges are listed as offset and length pairs.\n");
+
+        return -1;
+    }
+
+    if (out_path != NULL)
+    {
+        out_fd = open(out_path, O_BINARY | O_WRONLY | O_CREAT, 0644);
+        if (out_fd == -1)
+        {
+            syslog(LOG_ERR, "Cannot open '%s': %m\n", out_path);
+            return 1;
+        }
+
+        buf = (char*)malloc(COPY_CHUNK_SIZE);
+        if (buf == NULL)
+        {
+            syslog(LOG_ERR, "Memory allocation failed: %m\n");
+            return 1;
+        }
+    }
+
+    if (!devio_client_open(&client, argv[optind]))
+        return 1;
+
+    if ((client.info.flags & IMDPROXY_FLAG_SUPPORTS_CBT) == 0)
+    {
+        fprintf(stderr, "Server does not track changed blocks.\n");
+        devio_client_close(&client);
+        return 1;
+    }
+
+    while (offset < client.info.file_size && retval == 0)
+    {
+        IMDPROXY_CBT_RESP resp;
+        PIMDPROXY_CBT_RANGE ranges;
+        size_t count;
+        size_t i;
+
+        if (!devio_client_cbt_query(&client, flags, offset,
+            client.info.file_size - offset, &resp, &ranges))
+        {
+            fprintf(stderr, "Connection lost.\n");
+            retval = 1;
+            break;
+        }
+
+        if (resp.errorno != 0)
+        {
+            errno = (int)resp.errorno;
+            syslog(LOG_ERR, "Changed block query failed: %m\n");
+            retval = 1;
+            break;
+        }
+
+        block_size = resp.block_size;
+        count = (size_t)(resp.length / sizeof(*ranges));
+
+        for (i = 0; i < count && retval == 0; i++)
+        {
+            ULONGLONG done = 0;
+
+            changed += ranges[i].length;
+            ++range_count;
+
+            if (out_fd == -1)
+            {
+                printf(ULL_FMT " " ULL_FMT "\n", ranges[i].offset,
+                    ranges[i].length);
+
+                continue;
+            }
+
+            while (done < ranges[i].length)
+            {
+                safeio_size_t size = COPY_CHUNK_SIZE;
+                safeio_ssize_t readdone;
+
+                if (ranges[i].length - done < size)
+                    size = (safeio_size_t)(ranges[i].length - done);
+
+                readdone = devio_client_read(&client, buf, size,
+                    (off_t_64)(ranges[i].offset + done));
+
+                if (readdone <= 0)
+                {
+                    syslog(LOG_ERR, "Read error at " ULL_FMT ": %m\n",
+                        ranges[i].offset + done);
+                    retval = 1;
+                    break;
+                }
+
+                if (pwrite(out_fd, buf, readdone,
+                    (off_t_64)(ranges[i].offset + done)) != readdone)
+                {
+                    syslog(LOG_ERR, "Write error on '%s': %m\n", out_path);
+                    retval = 1;
+                    break;
+                }
+
+                done += readdone;
+            }
+        }
+
+        free(ranges);
+
+        if (resp.end_offset <= offset)
+            break;
+
+        offset = resp.end_offset;
+    }
+
+    devio_client_close(&client);
+
+    if (out_fd != -1)
+    {
+        if (close(out_fd) != 0)
+        {
+            syslog(LOG_ERR, "Write error on '%s': %m\n", out_path);
+            retval = 1;
+        }
+
+        free(buf);
+    }
+
+    fprintf(stderr, ULL_FMT " changed bytes in " ULL_FMT " ranges, block size "
+        ULL_FMT " bytes%s.\n", changed, range_count, block_size,
+        (flags & IMDPROXY_CBT_FLAG_RESET) ? ", ranges reset" : "");
+
+    if (retval != 0 && (flags & IMDPROXY_CBT_FLAG_RESET))
+        fprintf(stderr, "Changed ranges may have been reset before failure, "
+            "next backup needs to be a full one.\n");
+
+    return retval;
+}
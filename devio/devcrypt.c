@@ -0,0 +1,1300 @@
+/*
+AES-XTS encryption of image data for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define DEVCRYPT_X86
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define DEVCRYPT_ARM64
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#ifdef DEVCRYPT_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+#ifdef DEVCRYPT_ARM64
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "devio_types.h"
+#include "devcrypt.h"
+
+// Functions using instructions that are not enabled for the whole file
+#if defined(_MSC_VER) && !defined(__clang__)
+#define DEVCRYPT_TARGET(features)
+#else
+#define DEVCRYPT_TARGET(features) __attribute__((target(features)))
+#endif
+
+#if defined(__clang__) || defined(_MSC_VER)
+#define DEVCRYPT_ARM64_TARGET DEVCRYPT_TARGET("aes")
+#else
+#define DEVCRYPT_ARM64_TARGET DEVCRYPT_TARGET("+crypto")
+#endif
+
+// Blocks processed together by software engine, one bit of each byte in
+// each of eight 64 bit words
+#define SLICED_BLOCKS           4
+#define SLICED_BYTES            (SLICED_BLOCKS * DEVCRYPT_BLOCK_SIZE)
+
+#define SLICED_ROW_MASK         0x1111111111111111ULL
+#define SLICED_LANE(pattern)    ((uint64_t)(pattern) * 0x0001000100010001ULL)
+
+/*
+Scalar arithmetic in GF(2^8) for key expansion. Only used a few hundred
+times per key, but written without table lookups or branches on data like
+the rest of the software engine.
+*/
+
+static uint8_t
+gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t result = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        result ^= (uint8_t)(-(b & 1) & a);
+        a = (uint8_t)((a << 1) ^ (-(a >> 7) & 0x1B));
+        b >>= 1;
+    }
+
+    return result;
+}
+
+static uint8_t
+gf_inverse(uint8_t x)
+{
+    // x^254, zero for zero
+    uint8_t x2 = gf_mul(x, x);
+    uint8_t x3 = gf_mul(x2, x);
+    uint8_t x12 = gf_mul(gf_mul(x3, x3), gf_mul(x3, x3));
+    uint8_t x15 = gf_mul(x12, x3);
+    uint8_t x240 = x15;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        x240 = gf_mul(x240, x240);
+
+    return gf_mul(gf_mul(x240, x12), x2);
+}
+
+static uint8_t
+aes_sbox(uint8_t x)
+{
+    uint8_t y = gf_inverse(x);
+
+    return (uint8_t)(y ^
+        ((y << 1) | (y >> 7)) ^
+        ((y << 2) | (y >> 6)) ^
+        ((y << 3) | (y >> 5)) ^
+        ((y << 4) | (y >> 4)) ^ 0x63);
+}
+
+static void
+aes_inv_mix_column(uint8_t *column)
+{
+    uint8_t a0 = column[0];
+    uint8_t a1 = column[1];
+    uint8_t a2 = column[2];
+    uint8_t a3 = column[3];
+
+    column[0] = gf_mul(a0, 14) ^ gf_mul(a1, 11) ^ gf_mul(a2, 13) ^
+        gf_mul(a3, 9);
+    column[1] = gf_mul(a0, 9) ^ gf_mul(a1, 14) ^ gf_mul(a2, 11) ^
+        gf_mul(a3, 13);
+    column[2] = gf_mul(a0, 13) ^ gf_mul(a1, 9) ^ gf_mul(a2, 14) ^
+        gf_mul(a3, 11);
+    column[3] = gf_mul(a0, 11) ^ gf_mul(a1, 13) ^ gf_mul(a2, 9) ^
+        gf_mul(a3, 14);
+}
+
+/*
+Bitsliced AES for the software engine. Four blocks are processed together
+in eight 64 bit words, where word i holds bit i of every byte. Byte n of
+block b is at bit position 16 * b + n, so each 16 bit lane holds one block
+and each nibble one column, with row number as bit number in the nibble.
+S-box is computed with a boolean circuit, so no lookups depend on data.
+*/
+
+// Transposes an 8x8 bit matrix with row r in byte r
+static uint64_t
+transpose8x8(uint64_t x)
+{
+    uint64_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x ^= t ^ (t << 28);
+
+    return x;
+}
+
+static void
+sliced_pack(uint64_t *s, const uint8_t *in)
+{
+    int i;
+    int g;
+
+    for (i = 0; i < 8; i++)
+        s[i] = 0;
+
+    for (g = 0; g < 8; g++)
+    {
+        uint64_t x = 0;
+
+        for (i = 0; i < 8; i++)
+            x |= (uint64_t)in[(g << 3) + i] << (i << 3);
+
+        x = transpose8x8(x);
+
+        for (i = 0; i < 8; i++)
+            s[i] |= ((x >> (i << 3)) & 0xFF) << (g << 3);
+    }
+}
+
+static void
+sliced_unpack(uint8_t *out, const uint64_t *s)
+{
+    int i;
+    int g;
+
+    for (g = 0; g < 8; g++)
+    {
+        uint64_t x = 0;
+
+        for (i = 0; i < 8; i++)
+            x |= ((s[i] >> (g << 3)) & 0xFF) << (i << 3);
+
+        x = transpose8x8(x);
+
+        for (i = 0; i < 8; i++)
+            out[(g << 3) + i] = (uint8_t)(x >> (i << 3));
+    }
+}
+
+// S-box circuit with 113 gates by Boyar and Peralta
+static void
+sliced_sub_bytes(uint64_t *q)
+{
+    uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint64_t y20, y21;
+    uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+// Inverse affine transform of the S-box, including its constant
+static void
+sliced_inv_affine(uint64_t *s)
+{
+    uint64_t t[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        t[i] = s[(i + 2) & 7] ^ s[(i + 5) & 7] ^ s[(i + 7) & 7];
+
+    // Constant 0x05
+    s[0] = ~t[0];
+    s[1] = t[1];
+    s[2] = ~t[2];
+    s[3] = t[3];
+    s[4] = t[4];
+    s[5] = t[5];
+    s[6] = t[6];
+    s[7] = t[7];
+}
+
+// S-box is an inversion in GF(2^8) followed by an affine transform A, so
+// inversion is A^-1 of S-box, and inverse S-box is A^-1, S-box, A^-1.
+static void
+sliced_inv_sub_bytes(uint64_t *s)
+{
+    sliced_inv_affine(s);
+    sliced_sub_bytes(s);
+    sliced_inv_affine(s);
+}
+
+// Moves column c + k of each row r to column c, for k = r in ShiftRows
+// and k = 4 - r in InvShiftRows.
+static void
+sliced_shift_rows(uint64_t *s, int inverse)
+{
+    int i;
+    int r;
+
+    for (i = 0; i < 8; i++)
+    {
+        uint64_t result = s[i] & SLICED_ROW_MASK;
+
+        for (r = 1; r < 4; r++)
+        {
+            int k = inverse ? 4 - r : r;
+            uint64_t low = SLICED_LANE((1U << (16 - (k << 2))) - 1);
+            uint64_t x = s[i] & (SLICED_ROW_MASK << r);
+
+            result |= ((x >> (k << 2)) & low) |
+                ((x << (16 - (k << 2))) & ~low);
+        }
+
+        s[i] = result;
+    }
+}
+
+// Moves row r + k of each column to row r
+static uint64_t
+sliced_rotate_rows(uint64_t w, int k)
+{
+    uint64_t low = SLICED_ROW_MASK * ((1U << (4 - k)) - 1);
+
+    return ((w >> k) & low) | ((w << (4 - k)) & ~low);
+}
+
+// Multiplies by x in place
+static void
+sliced_xtime(uint64_t *s)
+{
+    uint64_t top = s[7];
+
+    s[7] = s[6];
+    s[6] = s[5];
+    s[5] = s[4];
+    s[4] = s[3] ^ top;
+    s[3] = s[2] ^ top;
+    s[2] = s[1];
+    s[1] = s[0] ^ top;
+    s[0] = top;
+}
+
+static void
+sliced_mix_columns(uint64_t *s)
+{
+    uint64_t t[8];
+    uint64_t r1[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        r1[i] = sliced_rotate_rows(s[i], 1);
+        t[i] = s[i] ^ r1[i];
+    }
+
+    sliced_xtime(t);
+
+    for (i = 0; i < 8; i++)
+        s[i] = t[i] ^ r1[i] ^ sliced_rotate_rows(s[i], 2) ^
+        sliced_rotate_rows(s[i], 3);
+}
+
+static void
+sliced_inv_mix_columns(uint64_t *s)
+{
+    uint64_t t[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        t[i] = s[i] ^ sliced_rotate_rows(s[i], 2);
+
+    sliced_xtime(t);
+    sliced_xtime(t);
+
+    for (i = 0; i < 8; i++)
+        s[i] ^= t[i];
+
+    sliced_mix_columns(s);
+}
+
+static void
+sliced_add_key(uint64_t *s, const uint64_t *key)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        s[i] ^= key[i];
+}
+
+static void
+sliced_encrypt(const DEVCRYPT_AES *aes, uint8_t *data)
+{
+    uint64_t s[8];
+    int r;
+
+    sliced_pack(s, data);
+    sliced_add_key(s, aes->sliced_keys[0]);
+
+    for (r = 1; r < aes->rounds; r++)
+    {
+        sliced_sub_bytes(s);
+        sliced_shift_rows(s, 0);
+        sliced_mix_columns(s);
+        sliced_add_key(s, aes->sliced_keys[r]);
+    }
+
+    sliced_sub_bytes(s);
+    sliced_shift_rows(s, 0);
+    sliced_add_key(s, aes->sliced_keys[aes->rounds]);
+    sliced_unpack(data, s);
+}
+
+static void
+sliced_decrypt(const DEVCRYPT_AES *aes, uint8_t *data)
+{
+    uint64_t s[8];
+    int r;
+
+    sliced_pack(s, data);
+    sliced_add_key(s, aes->sliced_keys[aes->rounds]);
+
+    for (r = aes->rounds - 1; r > 0; r--)
+    {
+        sliced_shift_rows(s, 1);
+        sliced_inv_sub_bytes(s);
+        sliced_add_key(s, aes->sliced_keys[r]);
+        sliced_inv_mix_columns(s);
+    }
+
+    sliced_shift_rows(s, 1);
+    sliced_inv_sub_bytes(s);
+    sliced_add_key(s, aes->sliced_keys[0]);
+    sliced_unpack(data, s);
+}
+
+// Multiplies a tweak by the primitive element in GF(2^128), as a little
+// endian value.
+static void
+xts_next_tweak_bytes(uint8_t *tweak)
+{
+    uint8_t carry = 0;
+    int i;
+
+    for (i = 0; i < DEVCRYPT_BLOCK_SIZE; i++)
+    {
+        uint8_t next = tweak[i] >> 7;
+
+        tweak[i] = (uint8_t)((tweak[i] << 1) | carry);
+        carry = next;
+    }
+
+    tweak[0] ^= (uint8_t)(-carry & 0x87);
+}
+
+static void
+xts_first_tweak_bytes(uint8_t *tweak, uint64_t unit_number)
+{
+    int i;
+
+    for (i = 0; i < DEVCRYPT_BLOCK_SIZE; i++)
+        tweak[i] = i < 8 ? (uint8_t)(unit_number >> (i << 3)) : 0;
+}
+
+static void
+software_xts(const DEVCRYPT_XTS *xts, uint8_t *data, size_t unit_size,
+    size_t units, uint64_t unit_number, int decrypt)
+{
+    uint8_t tweaks[SLICED_BYTES];
+    uint8_t batch[SLICED_BYTES];
+    size_t unit;
+
+    for (unit = 0; unit < units; unit++)
+    {
+        uint8_t tweak[DEVCRYPT_BLOCK_SIZE];
+        size_t done;
+
+        // Tweaks for up to four data units are encrypted together
+        if ((unit % SLICED_BLOCKS) == 0)
+        {
+            int i;
+
+            for (i = 0; i < SLICED_BLOCKS; i++)
+                xts_first_tweak_bytes(tweaks + i * DEVCRYPT_BLOCK_SIZE,
+                    unit_number + unit + i);
+
+            sliced_encrypt(&xts->tweak_key, tweaks);
+        }
+
+        memcpy(tweak,
+            tweaks + (unit % SLICED_BLOCKS) * DEVCRYPT_BLOCK_SIZE,
+            DEVCRYPT_BLOCK_SIZE);
+
+        for (done = 0; done < unit_size; done += SLICED_BYTES)
+        {
+            uint8_t batch_tweaks[SLICED_BYTES];
+            size_t size = unit_size - done;
+            size_t i;
+
+            if (size > SLICED_BYTES)
+                size = SLICED_BYTES;
+
+            memset(batch, 0, sizeof(batch));
+
+            for (i = 0; i < size; i += DEVCRYPT_BLOCK_SIZE)
+            {
+                memcpy(batch_tweaks + i, tweak, DEVCRYPT_BLOCK_SIZE);
+                xts_next_tweak_bytes(tweak);
+            }
+
+            for (i = 0; i < size; i++)
+                batch[i] = data[done + i] ^ batch_tweaks[i];
+
+            if (decrypt)
+                sliced_decrypt(&xts->data_key, batch);
+            else
+                sliced_encrypt(&xts->data_key, batch);
+
+            for (i = 0; i < size; i++)
+                data[done + i] = batch[i] ^ batch_tweaks[i];
+        }
+
+        data += unit_size;
+    }
+}
+
+#ifdef DEVCRYPT_X86
+
+static __inline void
+xts_next_tweak(uint64_t *lo, uint64_t *hi)
+{
+    uint64_t carry = *hi >> 63;
+
+    *hi = (*hi << 1) | (*lo >> 63);
+    *lo = (*lo << 1) ^ (0x87 & (0 - carry));
+}
+
+#define AESNI_ROUND8(op, key) \
+    b0 = op(b0, key); b1 = op(b1, key); b2 = op(b2, key); \
+    b3 = op(b3, key); b4 = op(b4, key); b5 = op(b5, key); \
+    b6 = op(b6, key); b7 = op(b7, key)
+
+DEVCRYPT_TARGET("aes,sse2")
+static __m128i
+aesni_first_tweak(const DEVCRYPT_AES *aes, uint64_t unit_number)
+{
+    __m128i t = _mm_set_epi64x(0, (long long)unit_number);
+    int r;
+
+    t = _mm_xor_si128(t, _mm_loadu_si128((const __m128i*)aes->enc_keys[0]));
+
+    for (r = 1; r < aes->rounds; r++)
+        t = _mm_aesenc_si128(t,
+            _mm_loadu_si128((const __m128i*)aes->enc_keys[r]));
+
+    return _mm_aesenclast_si128(t,
+        _mm_loadu_si128((const __m128i*)aes->enc_keys[aes->rounds]));
+}
+
+// Processes blocks of one data unit, continuing from tweak in lo and hi.
+DEVCRYPT_TARGET("aes,sse2")
+static void
+aesni_xts_blocks(const DEVCRYPT_AES *aes, uint8_t *data, size_t blocks,
+    uint64_t *lo, uint64_t *hi, int decrypt)
+{
+    const uint8_t(*keys)[DEVCRYPT_BLOCK_SIZE] =
+        decrypt ? aes->dec_keys : aes->enc_keys;
+    __m128i *ptr = (__m128i*)data;
+    int rounds = aes->rounds;
+    __m128i first_key = _mm_loadu_si128((const __m128i*)keys[0]);
+    __m128i last_key = _mm_loadu_si128((const __m128i*)keys[rounds]);
+    int r;
+
+    for (; blocks >= 8; blocks -= 8, ptr += 8)
+    {
+        __m128i t0, t1, t2, t3, t4, t5, t6, t7;
+        __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+#define AESNI_TWEAK(t) \
+        t = _mm_set_epi64x((long long)*hi, (long long)*lo); \
+        xts_next_tweak(lo, hi)
+
+        AESNI_TWEAK(t0); AESNI_TWEAK(t1); AESNI_TWEAK(t2); AESNI_TWEAK(t3);
+        AESNI_TWEAK(t4); AESNI_TWEAK(t5); AESNI_TWEAK(t6); AESNI_TWEAK(t7);
+
+#undef AESNI_TWEAK
+
+        b0 = _mm_xor_si128(_mm_loadu_si128(ptr + 0), t0);
+        b1 = _mm_xor_si128(_mm_loadu_si128(ptr + 1), t1);
+        b2 = _mm_xor_si128(_mm_loadu_si128(ptr + 2), t2);
+        b3 = _mm_xor_si128(_mm_loadu_si128(ptr + 3), t3);
+        b4 = _mm_xor_si128(_mm_loadu_si128(ptr + 4), t4);
+        b5 = _mm_xor_si128(_mm_loadu_si128(ptr + 5), t5);
+        b6 = _mm_xor_si128(_mm_loadu_si128(ptr + 6), t6);
+        b7 = _mm_xor_si128(_mm_loadu_si128(ptr + 7), t7);
+
+        AESNI_ROUND8(_mm_xor_si128, first_key);
+
+        if (decrypt)
+        {
+            for (r = 1; r < rounds; r++)
+            {
+                __m128i key = _mm_loadu_si128((const __m128i*)keys[r]);
+                AESNI_ROUND8(_mm_aesdec_si128, key);
+            }
+
+            AESNI_ROUND8(_mm_aesdeclast_si128, last_key);
+        }
+        else
+        {
+            for (r = 1; r < rounds; r++)
+            {
+                __m128i key = _mm_loadu_si128((const __m128i*)keys[r]);
+                AESNI_ROUND8(_mm_aesenc_si128, key);
+            }
+
+            AESNI_ROUND8(_mm_aesenclast_si128, last_key);
+        }
+
+        _mm_storeu_si128(ptr + 0, _mm_xor_si128(b0, t0));
+        _mm_storeu_si128(ptr + 1, _mm_xor_si128(b1, t1));
+        _mm_storeu_si128(ptr + 2, _mm_xor_si128(b2, t2));
+        _mm_storeu_si128(ptr + 3, _mm_xor_si128(b3, t3));
+        _mm_storeu_si128(ptr + 4, _mm_xor_si128(b4, t4));
+        _mm_storeu_si128(ptr + 5, _mm_xor_si128(b5, t5));
+        _mm_storeu_si128(ptr + 6, _mm_xor_si128(b6, t6));
+        _mm_storeu_si128(ptr + 7, _mm_xor_si128(b7, t7));
+    }
+
+    for (; blocks > 0; blocks--, ptr++)
+    {
+        __m128i t = _mm_set_epi64x((long long)*hi, (long long)*lo);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(ptr), t);
+
+        xts_next_tweak(lo, hi);
+
+        b = _mm_xor_si128(b, first_key);
+
+        if (decrypt)
+        {
+            for (r = 1; r < rounds; r++)
+                b = _mm_aesdec_si128(b,
+                    _mm_loadu_si128((const __m128i*)keys[r]));
+
+            b = _mm_aesdeclast_si128(b, last_key);
+        }
+        else
+        {
+            for (r = 1; r < rounds; r++)
+                b = _mm_aesenc_si128(b,
+                    _mm_loadu_si128((const __m128i*)keys[r]));
+
+            b = _mm_aesenclast_si128(b, last_key);
+        }
+
+        _mm_storeu_si128(ptr, _mm_xor_si128(b, t));
+    }
+}
+
+DEVCRYPT_TARGET("aes,sse2")
+static void
+aesni_xts(const DEVCRYPT_XTS *xts, uint8_t *data, size_t unit_size,
+    size_t units, uint64_t unit_number, int decrypt)
+{
+    size_t unit;
+
+    for (unit = 0; unit < units; unit++)
+    {
+        uint64_t tweak[2];
+
+        _mm_storeu_si128((__m128i*)tweak,
+            aesni_first_tweak(&xts->tweak_key, unit_number + unit));
+
+        aesni_xts_blocks(&xts->data_key, data,
+            unit_size / DEVCRYPT_BLOCK_SIZE, &tweak[0], &tweak[1], decrypt);
+
+        data += unit_size;
+    }
+}
+
+// VAES processes two blocks per instruction, sixteen blocks at a time.
+// Remaining blocks in a data unit are processed with AES-NI.
+DEVCRYPT_TARGET("vaes,avx2,aes")
+static void
+vaes_xts(const DEVCRYPT_XTS *xts, uint8_t *data, size_t unit_size,
+    size_t units, uint64_t unit_number, int decrypt)
+{
+    const DEVCRYPT_AES *aes = &xts->data_key;
+    const uint8_t(*keys)[DEVCRYPT_BLOCK_SIZE] =
+        decrypt ? aes->dec_keys : aes->enc_keys;
+    int rounds = aes->rounds;
+    __m256i round_keys[DEVCRYPT_MAX_ROUNDS + 1];
+    size_t unit;
+    int r;
+
+    for (r = 0; r <= rounds; r++)
+        round_keys[r] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*)keys[r]));
+
+    for (unit = 0; unit < units; unit++)
+    {
+        __m256i *ptr = (__m256i*)data;
+        size_t blocks = unit_size / DEVCRYPT_BLOCK_SIZE;
+        uint64_t tweak[2];
+
+        _mm_storeu_si128((__m128i*)tweak,
+            aesni_first_tweak(&xts->tweak_key, unit_number + unit));
+
+        for (; blocks >= 16; blocks -= 16, ptr += 8)
+        {
+            uint64_t lanes[32];
+            __m256i t0, t1, t2, t3, t4, t5, t6, t7;
+            __m256i b0, b1, b2, b3, b4, b5, b6, b7;
+            int i;
+
+            for (i = 0; i < 32; i += 2)
+            {
+                lanes[i] = tweak[0];
+                lanes[i + 1] = tweak[1];
+                xts_next_tweak(&tweak[0], &tweak[1]);
+            }
+
+            t0 = _mm256_loadu_si256((const __m256i*)lanes + 0);
+            t1 = _mm256_loadu_si256((const __m256i*)lanes + 1);
+            t2 = _mm256_loadu_si256((const __m256i*)lanes + 2);
+            t3 = _mm256_loadu_si256((const __m256i*)lanes + 3);
+            t4 = _mm256_loadu_si256((const __m256i*)lanes + 4);
+            t5 = _mm256_loadu_si256((const __m256i*)lanes + 5);
+            t6 = _mm256_loadu_si256((const __m256i*)lanes + 6);
+            t7 = _mm256_loadu_si256((const __m256i*)lanes + 7);
+
+            b0 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 0), t0);
+            b1 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 1), t1);
+            b2 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 2), t2);
+            b3 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 3), t3);
+            b4 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 4), t4);
+            b5 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 5), t5);
+            b6 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 6), t6);
+            b7 = _mm256_xor_si256(_mm256_loadu_si256(ptr + 7), t7);
+
+            AESNI_ROUND8(_mm256_xor_si256, round_keys[0]);
+
+            if (decrypt)
+            {
+                for (r = 1; r < rounds; r++)
+                {
+                    AESNI_ROUND8(_mm256_aesdec_epi128, round_keys[r]);
+                }
+
+                AESNI_ROUND8(_mm256_aesdeclast_epi128, round_keys[rounds]);
+            }
+            else
+            {
+                for (r = 1; r < rounds; r++)
+                {
+                    AESNI_ROUND8(_mm256_aesenc_epi128, round_keys[r]);
+                }
+
+                AESNI_ROUND8(_mm256_aesenclast_epi128, round_keys[rounds]);
+            }
+
+            _mm256_storeu_si256(ptr + 0, _mm256_xor_si256(b0, t0));
+            _mm256_storeu_si256(ptr + 1, _mm256_xor_si256(b1, t1));
+            _mm256_storeu_si256(ptr + 2, _mm256_xor_si256(b2, t2));
+            _mm256_storeu_si256(ptr + 3, _mm256_xor_si256(b3, t3));
+            _mm256_storeu_si256(ptr + 4, _mm256_xor_si256(b4, t4));
+            _mm256_storeu_si256(ptr + 5, _mm256_xor_si256(b5, t5));
+            _mm256_storeu_si256(ptr + 6, _mm256_xor_si256(b6, t6));
+            _mm256_storeu_si256(ptr + 7, _mm256_xor_si256(b7, t7));
+        }
+
+        if (blocks > 0)
+            aesni_xts_blocks(aes, (uint8_t*)ptr, blocks, &tweak[0],
+                &tweak[1], decrypt);
+
+        data += unit_size;
+    }
+
+    // Avoids transition penalties in following SSE code
+    _mm256_zeroupper();
+}
+
+static DEVCRYPT_ENGINE
+devcrypt_detect()
+{
+    unsigned int leaf1_ecx;
+    unsigned int leaf7_ebx = 0;
+    unsigned int leaf7_ecx = 0;
+    uint64_t xcr0 = 0;
+
+#ifdef _MSC_VER
+    int regs[4];
+
+    __cpuid(regs, 0);
+    if (regs[0] < 1)
+        return DEVCRYPT_ENGINE_SOFTWARE;
+
+    if (regs[0] >= 7)
+    {
+        __cpuidex(regs, 7, 0);
+        leaf7_ebx = (unsigned int)regs[1];
+        leaf7_ecx = (unsigned int)regs[2];
+    }
+
+    __cpuid(regs, 1);
+    leaf1_ecx = (unsigned int)regs[2];
+
+    if (leaf1_ecx & (1U << 27))
+        xcr0 = _xgetbv(0);
+#else
+    unsigned int eax, ebx, edx;
+    unsigned int max_leaf = __get_cpuid_max(0, NULL);
+
+    if (max_leaf < 1)
+        return DEVCRYPT_ENGINE_SOFTWARE;
+
+    if (max_leaf >= 7)
+        __cpuid_count(7, 0, eax, leaf7_ebx, leaf7_ecx, edx);
+
+    __cpuid(1, eax, ebx, leaf1_ecx, edx);
+
+    if (leaf1_ecx & (1U << 27))
+    {
+        unsigned int xcr0_lo, xcr0_hi;
+
+        __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        xcr0 = ((uint64_t)xcr0_hi << 32) | xcr0_lo;
+    }
+#endif
+
+    if ((leaf1_ecx & (1U << 25)) == 0)
+        return DEVCRYPT_ENGINE_SOFTWARE;
+
+    // VAES with AVX2, and operating system saving YMM registers
+    if ((leaf7_ecx & (1U << 9)) && (leaf7_ebx & (1U << 5)) &&
+        (leaf1_ecx & (1U << 28)) && (xcr0 & 6) == 6)
+        return DEVCRYPT_ENGINE_VAES;
+
+    return DEVCRYPT_ENGINE_AESNI;
+}
+
+#elif defined(DEVCRYPT_ARM64)
+
+static __inline void
+xts_next_tweak(uint64_t *lo, uint64_t *hi)
+{
+    uint64_t carry = *hi >> 63;
+
+    *hi = (*hi << 1) | (*lo >> 63);
+    *lo = (*lo << 1) ^ (0x87 & (0 - carry));
+}
+
+// AESE and AESD start with AddRoundKey, so last round key is added
+// separately.
+DEVCRYPT_ARM64_TARGET
+static uint8x16_t
+armv8_crypt_block(const uint8_t(*keys)[DEVCRYPT_BLOCK_SIZE], int rounds,
+    uint8x16_t b, int decrypt)
+{
+    int r;
+
+    if (decrypt)
+    {
+        for (r = 0; r < rounds - 1; r++)
+            b = vaesimcq_u8(vaesdq_u8(b, vld1q_u8(keys[r])));
+
+        b = vaesdq_u8(b, vld1q_u8(keys[rounds - 1]));
+    }
+    else
+    {
+        for (r = 0; r < rounds - 1; r++)
+            b = vaesmcq_u8(vaeseq_u8(b, vld1q_u8(keys[r])));
+
+        b = vaeseq_u8(b, vld1q_u8(keys[rounds - 1]));
+    }
+
+    return veorq_u8(b, vld1q_u8(keys[rounds]));
+}
+
+DEVCRYPT_ARM64_TARGET
+static void
+armv8_xts(const DEVCRYPT_XTS *xts, uint8_t *data, size_t unit_size,
+    size_t units, uint64_t unit_number, int decrypt)
+{
+    const DEVCRYPT_AES *aes = &xts->data_key;
+    const uint8_t(*keys)[DEVCRYPT_BLOCK_SIZE] =
+        decrypt ? aes->dec_keys : aes->enc_keys;
+    int rounds = aes->rounds;
+    size_t unit;
+    int r;
+
+    for (unit = 0; unit < units; unit++)
+    {
+        size_t blocks = unit_size / DEVCRYPT_BLOCK_SIZE;
+        uint8_t *ptr = data;
+        uint64_t first[2] = { unit_number + unit, 0 };
+        uint64_t lo;
+        uint64_t hi;
+
+        vst1q_u8((uint8_t*)first, armv8_crypt_block(
+            (const uint8_t(*)[DEVCRYPT_BLOCK_SIZE])xts->tweak_key.enc_keys,
+            xts->tweak_key.rounds, vld1q_u8((const uint8_t*)first), 0));
+
+        lo = first[0];
+        hi = first[1];
+
+        for (; blocks >= 8; blocks -= 8, ptr += 8 * DEVCRYPT_BLOCK_SIZE)
+        {
+            uint8x16_t t[8];
+            uint8x16_t b[8];
+            int i;
+
+            for (i = 0; i < 8; i++)
+            {
+                t[i] = vreinterpretq_u8_u64(
+                    vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)));
+                xts_next_tweak(&lo, &hi);
+                b[i] = veorq_u8(vld1q_u8(ptr + i * DEVCRYPT_BLOCK_SIZE), t[i]);
+            }
+
+            if (decrypt)
+            {
+                for (r = 0; r < rounds - 1; r++)
+                {
+                    uint8x16_t key = vld1q_u8(keys[r]);
+
+                    for (i = 0; i < 8; i++)
+                        b[i] = vaesimcq_u8(vaesdq_u8(b[i], key));
+                }
+
+                for (i = 0; i < 8; i++)
+                    b[i] = vaesdq_u8(b[i], vld1q_u8(keys[rounds - 1]));
+            }
+            else
+            {
+                for (r = 0; r < rounds - 1; r++)
+                {
+                    uint8x16_t key = vld1q_u8(keys[r]);
+
+                    for (i = 0; i < 8; i++)
+                        b[i] = vaesmcq_u8(vaeseq_u8(b[i], key));
+                }
+
+                for (i = 0; i < 8; i++)
+                    b[i] = vaeseq_u8(b[i], vld1q_u8(keys[rounds - 1]));
+            }
+
+            for (i = 0; i < 8; i++)
+                vst1q_u8(ptr + i * DEVCRYPT_BLOCK_SIZE,
+                    veorq_u8(veorq_u8(b[i], vld1q_u8(keys[rounds])), t[i]));
+        }
+
+        for (; blocks > 0; blocks--, ptr += DEVCRYPT_BLOCK_SIZE)
+        {
+            uint8x16_t t = vreinterpretq_u8_u64(
+                vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)));
+
+            xts_next_tweak(&lo, &hi);
+
+            vst1q_u8(ptr, veorq_u8(armv8_crypt_block(keys, rounds,
+                veorq_u8(vld1q_u8(ptr), t), decrypt), t));
+        }
+
+        data += unit_size;
+    }
+}
+
+static DEVCRYPT_ENGINE
+devcrypt_detect()
+{
+#if defined(_WIN32)
+    if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE))
+        return DEVCRYPT_ENGINE_ARMV8;
+#elif defined(__APPLE__)
+    return DEVCRYPT_ENGINE_ARMV8;
+#elif defined(__linux__) && defined(HWCAP_AES)
+    if (getauxval(AT_HWCAP) & HWCAP_AES)
+        return DEVCRYPT_ENGINE_ARMV8;
+#endif
+
+    return DEVCRYPT_ENGINE_SOFTWARE;
+}
+
+#else
+
+static DEVCRYPT_ENGINE
+devcrypt_detect()
+{
+    return DEVCRYPT_ENGINE_SOFTWARE;
+}
+
+#endif
+
+static void
+aes_expand_key(PDEVCRYPT_AES aes, const uint8_t *key, size_t key_size)
+{
+    uint8_t *w = &aes->enc_keys[0][0];
+    size_t nk = key_size / 4;
+    size_t words;
+    size_t i;
+    uint8_t rcon = 1;
+    int r;
+
+    aes->rounds = (int)nk + 6;
+    words = 4 * (size_t)(aes->rounds + 1);
+
+    memcpy(w, key, key_size);
+
+    for (i = nk; i < words; i++)
+    {
+        uint8_t temp[4];
+
+        memcpy(temp, w + 4 * (i - 1), 4);
+
+        if (i % nk == 0)
+        {
+            uint8_t first = temp[0];
+
+            temp[0] = aes_sbox(temp[1]) ^ rcon;
+            temp[1] = aes_sbox(temp[2]);
+            temp[2] = aes_sbox(temp[3]);
+            temp[3] = aes_sbox(first);
+
+            rcon = gf_mul(rcon, 2);
+        }
+        else if (nk > 6 && i % nk == 4)
+        {
+            int j;
+
+            for (j = 0; j < 4; j++)
+                temp[j] = aes_sbox(temp[j]);
+        }
+
+        w[4 * i + 0] = w[4 * (i - nk) + 0] ^ temp[0];
+        w[4 * i + 1] = w[4 * (i - nk) + 1] ^ temp[1];
+        w[4 * i + 2] = w[4 * (i - nk) + 2] ^ temp[2];
+        w[4 * i + 3] = w[4 * (i - nk) + 3] ^ temp[3];
+    }
+
+    // Equivalent inverse cipher round keys, with InvMixColumns applied to
+    // all but first and last
+    for (r = 0; r <= aes->rounds; r++)
+    {
+        memcpy(aes->dec_keys[r], aes->enc_keys[aes->rounds - r],
+            DEVCRYPT_BLOCK_SIZE);
+
+        if (r > 0 && r < aes->rounds)
+        {
+            int c;
+
+            for (c = 0; c < 4; c++)
+                aes_inv_mix_column(aes->dec_keys[r] + 4 * c);
+        }
+    }
+
+    for (r = 0; r <= aes->rounds; r++)
+    {
+        uint8_t copies[SLICED_BYTES];
+        int b;
+
+        for (b = 0; b < SLICED_BLOCKS; b++)
+            memcpy(copies + b * DEVCRYPT_BLOCK_SIZE, aes->enc_keys[r],
+                DEVCRYPT_BLOCK_SIZE);
+
+        sliced_pack(aes->sliced_keys[r], copies);
+    }
+}
+
+int
+devcrypt_xts_init(PDEVCRYPT_XTS xts, const uint8_t *key, size_t key_size)
+{
+    size_t half = key_size / 2;
+
+    if (key_size != 32 && key_size != 64)
+        return 0;
+
+    if (memcmp(key, key + half, half) == 0)
+        return 0;
+
+    aes_expand_key(&xts->data_key, key, half);
+    aes_expand_key(&xts->tweak_key, key + half, half);
+
+    xts->engine = devcrypt_detect();
+
+    return 1;
+}
+
+int
+devcrypt_xts_set_engine(PDEVCRYPT_XTS xts, DEVCRYPT_ENGINE engine)
+{
+    DEVCRYPT_ENGINE best = devcrypt_detect();
+
+    switch (engine)
+    {
+    case DEVCRYPT_ENGINE_SOFTWARE:
+        break;
+
+    case DEVCRYPT_ENGINE_AESNI:
+        if (best != DEVCRYPT_ENGINE_AESNI && best != DEVCRYPT_ENGINE_VAES)
+            return 0;
+        break;
+
+    default:
+        if (best != engine)
+            return 0;
+    }
+
+    xts->engine = engine;
+
+    return 1;
+}
+
+const char *
+devcrypt_engine_name(DEVCRYPT_ENGINE engine)
+{
+    switch (engine)
+    {
+    case DEVCRYPT_ENGINE_AESNI:
+        return "AES-NI";
+    case DEVCRYPT_ENGINE_VAES:
+        return "VAES";
+    case DEVCRYPT_ENGINE_ARMV8:
+        return "ARMv8 crypto extension";
+    default:
+        return "constant-time software";
+    }
+}
+
+static void
+devcrypt_xts(const DEVCRYPT_XTS *xts, uint8_t *data, size_t unit_size,
+    size_t units, uint64_t unit_number, int decrypt)
+{
+    switch (xts->engine)
+    {
+#ifdef DEVCRYPT_X86
+    case DEVCRYPT_ENGINE_VAES:
+        vaes_xts(xts, data, unit_size, units, unit_number, decrypt);
+        return;
+
+    case DEVCRYPT_ENGINE_AESNI:
+        aesni_xts(xts, data, unit_size, units, unit_number, decrypt);
+        return;
+#endif
+
+#ifdef DEVCRYPT_ARM64
+    case DEVCRYPT_ENGINE_ARMV8:
+        armv8_xts(xts, data, unit_size, units, unit_number, decrypt);
+        return;
+#endif
+
+    default:
+        software_xts(xts, data, unit_size, units, unit_number, decrypt);
+    }
+}
+
+void
+devcrypt_xts_encrypt(const DEVCRYPT_XTS *xts, uint8_t *data,
+    size_t unit_size, size_t units, uint64_t unit_number)
+{
+    devcrypt_xts(xts, data, unit_size, units, unit_number, 0);
+}
+
+void
+devcrypt_xts_decrypt(const DEVCRYPT_XTS *xts, uint8_t *data,
+    size_t unit_size, size_t units, uint64_t unit_number)
+{
+    devcrypt_xts(xts, data, unit_size, units, unit_number, 1);
+}
+
+void
+devcrypt_xts_clear(PDEVCRYPT_XTS xts)
+{
+    volatile uint8_t *ptr = (volatile uint8_t*)xts;
+    size_t i;
+
+    for (i = 0; i < sizeof(*xts); i++)
+        ptr[i] = 0;
+}
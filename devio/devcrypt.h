@@ -0,0 +1,116 @@
+/*
+AES-XTS encryption of image data for devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVCRYPT_
+#define _INC_DEVCRYPT_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+    XTS-AES as specified in IEEE 1619. Image data is encrypted in data units
+    of a fixed size, normally the sector size, and the tweak for each data
+    unit is its number counted from start of image, as a 128 bit little
+    endian value. Data unit size must be a multiple of 16 bytes, so
+    ciphertext stealing is never needed.
+
+    Keys are 32 bytes for XTS-AES-128 or 64 bytes for XTS-AES-256. The
+    first half of a key encrypts data and the second half encrypts tweaks.
+
+    Encryption uses VAES or AES-NI instructions on x86 and x64, and ARMv8
+    cryptography extension instructions on ARM64, when the processor
+    supports them. Otherwise a bitsliced implementation without table
+    lookups or data dependent branches is used, so that timing does not
+    depend on keys or data.
+    */
+
+#define DEVCRYPT_BLOCK_SIZE     16
+#define DEVCRYPT_MAX_ROUNDS     14
+
+    typedef enum _DEVCRYPT_ENGINE
+    {
+        DEVCRYPT_ENGINE_SOFTWARE,
+        DEVCRYPT_ENGINE_AESNI,
+        DEVCRYPT_ENGINE_VAES,
+        DEVCRYPT_ENGINE_ARMV8
+    } DEVCRYPT_ENGINE;
+
+    typedef struct _DEVCRYPT_AES
+    {
+        int rounds;
+
+        // Round keys for encryption, and for decryption with the
+        // equivalent inverse cipher used by processor instructions
+        uint8_t enc_keys[DEVCRYPT_MAX_ROUNDS + 1][DEVCRYPT_BLOCK_SIZE];
+        uint8_t dec_keys[DEVCRYPT_MAX_ROUNDS + 1][DEVCRYPT_BLOCK_SIZE];
+
+        // Encryption round keys in bitsliced form for software engine
+        uint64_t sliced_keys[DEVCRYPT_MAX_ROUNDS + 1][8];
+    } DEVCRYPT_AES, *PDEVCRYPT_AES;
+
+    typedef struct _DEVCRYPT_XTS
+    {
+        DEVCRYPT_AES data_key;
+        DEVCRYPT_AES tweak_key;
+        DEVCRYPT_ENGINE engine;
+    } DEVCRYPT_XTS, *PDEVCRYPT_XTS;
+
+    // Expands a 32 or 64 byte key and selects the fastest engine supported
+    // by the processor. Returns 0 if key size is invalid or the two key
+    // halves are equal, which IEEE 1619 does not allow.
+    int
+        devcrypt_xts_init(PDEVCRYPT_XTS xts, const uint8_t *key,
+            size_t key_size);
+
+    // Forces an engine, for example to compare engines. Returns 0 if the
+    // engine is not supported by the processor or by this build.
+    int
+        devcrypt_xts_set_engine(PDEVCRYPT_XTS xts, DEVCRYPT_ENGINE engine);
+
+    const char *
+        devcrypt_engine_name(DEVCRYPT_ENGINE engine);
+
+    // Encrypts or decrypts units data units of unit_size bytes each, in
+    // place. First data unit has number unit_number.
+    void
+        devcrypt_xts_encrypt(const DEVCRYPT_XTS *xts, uint8_t *data,
+            size_t unit_size, size_t units, uint64_t unit_number);
+
+    void
+        devcrypt_xts_decrypt(const DEVCRYPT_XTS *xts, uint8_t *data,
+            size_t unit_size, size_t units, uint64_t unit_number);
+
+    // Overwrites key material before memory is freed.
+    void
+        devcrypt_xts_clear(PDEVCRYPT_XTS xts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_DEVCRYPT_
@@ -180,9 +180,22 @@ OVERLAPPED drv_request_io;
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/mempolicy.h>
+#endif
 
 #endif
 
@@ -190,6 +203,10 @@ OVERLAPPED drv_request_io;
 #include "devio_types.h"
 #include "safeio.h"
 #include "devio.h"
+#include "devtrace.h"
+#include "devnbd.h"
+#include "devcrypt.h"
+#include "../inc/imdbuf.h"
 
 #ifndef O_DIRECT
 #define O_DIRECT 0
@@ -199,25 +216,60 @@ OVERLAPPED drv_request_io;
 #define O_FSYNC 0
 #endif
 
+// Connections are served by threads in one process. Globals for the
+// connection, and the copy of image state it uses, are kept for each thread.
+// State shared by connections, such as the changed block bitmap, request
+// recording and export throttling, is changed under locks or atomically.
+#ifdef _WIN32
+#define DEVIO_TLS __declspec(thread)
+#else
+#define DEVIO_TLS __thread
+#endif
+
 #define DEF_BUFFER_SIZE ((int)((sizeof(void*) << 3) << 20))
 
+// Largest buffer a client can make us allocate, unless a larger buffer size
+// is given on command line
+#define DEF_MAX_BUFFER_SIZE ((safeio_size_t)DEF_BUFFER_SIZE << 2)
+
 #define DEF_REQUIRED_ALIGNMENT 1
 
+#define DEF_CBT_BLOCK_SIZE 65536
+#define DEF_QUEUE_DEPTH 16
+#define MAX_TAGGED_WORKERS 8
+
+// How long client needs to be idle before VHD compaction continues
+#define COMPACT_IDLE_MS 100
+
+// Changed block tracking bitmap file: header followed by one bit per block
+// at DEVIO_CBT_BITMAP_OFFSET.
+#define DEVIO_CBT_MAGIC "DEVIOCBT"
+#define DEVIO_CBT_VERSION 1
+#define DEVIO_CBT_BITMAP_OFFSET 512
+
+typedef struct _DEVIO_CBT_HEADER
+{
+    char magic[8];
+    ULONGLONG version;
+    ULONGLONG block_size;
+    ULONGLONG image_size;
+} DEVIO_CBT_HEADER, *PDEVIO_CBT_HEADER;
+
 #if defined(DEBUG) || defined(_DEBUG) || defined(DBG) || defined(SYSLOG)
 #define dbglog(x) syslog x
 #else
 #define dbglog(x)
 #endif
 
-int64_t GetBigEndian64(int8_t *storage)
+int64_t GetBigEndian64(uint8_t *storage)
 {
     int i;
-    int64_t number = 0;
+    uint64_t number = 0;
     for (i = 0; i < sizeof(int64_t); i++)
     {
-        number |= (int64_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
+        number |= (uint64_t)storage[i] << ((sizeof(int64_t) - i - 1) << 3);
     }
-    return number;
+    return (int64_t)number;
 }
 
 uint32_t GetLittleEndian32U(uint8_t *storage)
@@ -231,24 +283,54 @@ uint32_t GetLittleEndian32U(uint8_t *storage)
     return number;
 }
 
-int image_fd = -1;
+uint64_t GetLittleEndian64U(uint8_t *storage)
+{
+    int i;
+    uint64_t number = 0;
+    for (i = 0; i < sizeof(uint64_t); i++)
+    {
+        number |= (uint64_t)storage[i] << (i << 3);
+    }
+    return number;
+}
+
+DEVIO_TLS int image_fd = -1;
 void *libhandle = NULL;
-SOCKET sd = INVALID_SOCKET;
+DEVIO_TLS SOCKET sd = INVALID_SOCKET;
 int shm_mode = 0;
 char *shm_readptr = 0;
 char *shm_writeptr = 0;
 char *shm_view = NULL;
-char *buf = NULL;
-char *buf2 = NULL;
-safeio_size_t buffer_size = DEF_BUFFER_SIZE;
-off_t_64 image_offset = 0;
-IMDPROXY_INFO_RESP devio_info = { 0 };
+DEVIO_TLS char *buf = NULL;
+DEVIO_TLS char *buf2 = NULL;
+DEVIO_TLS safeio_size_t buffer_size = DEF_BUFFER_SIZE;
+safeio_size_t max_buffer_size = DEF_MAX_BUFFER_SIZE;
+DEVIO_TLS off_t_64 image_offset = 0;
+DEVIO_TLS IMDPROXY_INFO_RESP devio_info = { 0 };
 char dll_mode = 0;
 char drv_mode = 0;
-char vhd_mode = 0;
+DEVIO_TLS char vhd_mode = 0;
 char auto_vhd_detect = 1;
-
-struct _VHD_INFO
+DEVIO_TLS char comm_selectable = 0;
+// Set when connections are served by threads in parallel
+char thread_mode = 0;
+char compact_mode = 0;
+// Compaction progress is shared by connection threads and only used under
+// the VHD allocation lock
+char compact_disabled = 0;
+char compact_pending = 0;
+uint32_t compact_cursor = 0;
+uint32_t compact_checked = 0;
+char *compact_buf = NULL;
+DEVIO_TLS char blkdev_mode = 0;
+DEVIO_TLS safeio_size_t blkdev_sector_size = 0;
+safeio_size_t blkdev_alignment = 0;
+DEVIO_TLS safeio_size_t max_transfer_size = 0;
+const char *nbd_export_name = "";
+DEVIO_TLS char nbd_structured = 0;
+DEVIO_TLS char nbd_meta_context = 0;
+
+DEVIO_TLS struct _VHD_INFO
 {
     struct _VHD_FOOTER
     {
@@ -261,7 +343,7 @@ struct _VHD_INFO
         uint32_t CreatorVersion;
         uint32_t CreatorHostOS;
         int64_t OriginalSize;
-        int8_t CurrentSize[sizeof(int64_t)];
+        uint8_t CurrentSize[sizeof(int64_t)];
         uint32_t DiskGeometry;
         uint32_t DiskType;
         uint32_t Checksum;
@@ -274,7 +356,7 @@ struct _VHD_INFO
     {
         uint8_t Cookie[8];
         int64_t DataOffset;
-        int8_t TableOffset[sizeof(int64_t)];
+        uint8_t TableOffset[sizeof(int64_t)];
         uint32_t HeaderVersion;
         uint32_t MaxTableEntries;
         uint32_t BlockSize;
@@ -296,23 +378,564 @@ struct _VHD_INFO
 
 } vhd_info = { { { 0 } } };
 
-safeio_size_t block_size = 0;
-safeio_size_t sector_size = 512;
-off_t_64 table_offset = 0;
-int16_t block_shift = 0;
-int16_t sector_shift = 0;
-off_t_64 current_size = 0;
+DEVIO_TLS safeio_size_t block_size = 0;
+DEVIO_TLS safeio_size_t sector_size = 512;
+DEVIO_TLS off_t_64 table_offset = 0;
+DEVIO_TLS uint32_t table_entries = 0;
+DEVIO_TLS off_t_64 vhd_file_size = 0;
+DEVIO_TLS int16_t block_shift = 0;
+DEVIO_TLS int16_t sector_shift = 0;
+DEVIO_TLS off_t_64 current_size = 0;
 
 dllread_proc dll_read = NULL;
 dllwrite_proc dll_write = NULL;
 dllclose_proc dll_close = NULL;
 dllopen_proc dll_open = NULL;
 
+FILE *trace_file = NULL;
+char trace_hash = 0;
+
+// Time and end offset of last recorded request. Records store differences
+// from these, so connection threads update them and write records under
+// trace_lock.
+typedef struct _DEVIO_TRACE_STATE
+{
+    uint64_t last_time;
+    ULONGLONG last_end;
+} DEVIO_TRACE_STATE, *PDEVIO_TRACE_STATE;
+
+DEVIO_TRACE_STATE trace_state = { 0 };
+#ifndef _WIN32
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int cbt_fd = -1;
+uint8_t *cbt_bitmap = NULL;
+ULONGLONG cbt_block_size = DEF_CBT_BLOCK_SIZE;
+#ifndef _WIN32
+// Connection threads and tagged workers change the bitmap and write it to
+// the bitmap file under cbt_lock, so that the file is written in the same
+// order as the bitmap changes. Queries hold it while they reset blocks.
+// Writes are not done under it: a query is served after tagged requests
+// sent before it are done, and NBD connections that write in parallel
+// cannot query, so a block is never reset between being marked and
+// written.
+pthread_mutex_t cbt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Number of tagged requests clients may send before reading responses, or
+// zero to not accept tagged requests. On Unix, up to MAX_TAGGED_WORKERS of
+// them are served in parallel and responses are sent as they complete.
+unsigned int queue_depth = DEF_QUEUE_DEPTH;
+
+// Set while serving the request in a tagged request, with the tag to send
+// before the response.
+DEVIO_TLS int tagged_io = 0;
+DEVIO_TLS IMDPROXY_TAGGED_RESP tagged_resp = { 0 };
+int16_t cbt_block_shift = 0;
+ULONGLONG cbt_blocks = 0;
+
+uint64_t
+trace_clock()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+
+    QueryPerformanceCounter(&counter);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+        counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+int
+trace_open(const char *trace_path)
+{
+    unsigned char header[sizeof(DEVIO_TRACE_MAGIC) - 1 +
+        4 * DEVIO_TRACE_MAX_VARINT];
+    int size = sizeof(DEVIO_TRACE_MAGIC) - 1;
+
+    trace_file = fopen(trace_path, "wb");
+    if (trace_file == NULL)
+    {
+        syslog(LOG_ERR, "Cannot create trace file '%s': %m\n", trace_path);
+        return 0;
+    }
+
+    memcpy(header, DEVIO_TRACE_MAGIC, size);
+    size += devtrace_put_varint(header + size, DEVIO_TRACE_VERSION);
+    size += devtrace_put_varint(header + size,
+        trace_hash ? DEVIO_TRACE_FLAG_HASH : 0);
+    size += devtrace_put_varint(header + size, devio_info.file_size);
+    size += devtrace_put_varint(header + size, devio_info.req_alignment);
+
+    if (fwrite(header, size, 1, trace_file) != 1)
+    {
+        syslog(LOG_ERR, "Error writing trace file: %m\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        return 0;
+    }
+
+    trace_state.last_time = trace_clock();
+
+    printf("Recording requests to '%s'.\n", trace_path);
+
+    return 1;
+}
+
+void
+trace_record(ULONGLONG request_code, ULONGLONG offset, ULONGLONG length,
+    const void *data)
+{
+    unsigned char record[1 + 3 * DEVIO_TRACE_MAX_VARINT + sizeof(uint64_t)];
+    int size = 0;
+    uint64_t now;
+    int written;
+
+    if (trace_file == NULL)
+        return;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&trace_lock);
+
+    // Another connection may have stopped recording
+    if (trace_file == NULL)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+#endif
+
+    now = trace_clock();
+
+    record[size++] = (unsigned char)request_code;
+    size += devtrace_put_varint(record + size, now - trace_state.last_time);
+    trace_state.last_time = now;
+
+    if (request_code == IMDPROXY_REQ_READ ||
+        request_code == IMDPROXY_REQ_WRITE)
+    {
+        size += devtrace_put_varint(record + size,
+            devtrace_zigzag((int64_t)(offset - trace_state.last_end)));
+        size += devtrace_put_varint(record + size, length);
+        trace_state.last_end = offset + length;
+
+        if (trace_hash && data != NULL)
+        {
+            uint64_t hash = devtrace_hash(data, (size_t)length);
+            int i;
+
+            for (i = 0; i < sizeof(hash); i++)
+                record[size++] = (unsigned char)(hash >> (i << 3));
+        }
+    }
+
+    written = fwrite(record, size, 1, trace_file) == 1;
+
+    if (!written)
+    {
+        syslog(LOG_ERR, "Error writing trace file, recording stopped: %m\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+void
+trace_close()
+{
+    if (trace_file == NULL)
+        return;
+
+    if (fclose(trace_file) != 0)
+        syslog(LOG_ERR, "Error closing trace file: %m\n");
+
+    trace_file = NULL;
+}
+
+// I/O rate limits. Each limit is a token bucket kept in GCRA form: instead
+// of a token count, a bucket holds the theoretical arrival time when it
+// would be empty again. A request reserves its cost by moving that time
+// forward and is delayed by as much as the time is ahead of current time
+// by more than the burst allowance. Export state in export_qos_table is
+// shared by connection threads, and connection state by tagged workers of
+// the connection. Buckets, activity times and statistics are read and
+// updated with atomic operations instead of a lock, since every request
+// updates them.
+
+#define DEF_QOS_BURST_MS        100
+#define QOS_ACTIVE_US           1000000
+
+typedef struct _DEVIO_QOS
+{
+    // Settings, zero for unlimited
+    ULONGLONG iops;
+    ULONGLONG bps;
+    ULONGLONG burst_ms;
+    ULONGLONG weight;
+
+    // Bucket state, microseconds on trace_clock() scale
+    volatile uint64_t iops_tat;
+    volatile uint64_t bps_tat;
+    volatile uint64_t share_iops_tat;
+    volatile uint64_t share_bps_tat;
+    volatile uint64_t last_active;
+
+    // Statistics
+    volatile uint64_t requests;
+    volatile uint64_t throttled;
+    volatile uint64_t delay_us;
+} DEVIO_QOS, *PDEVIO_QOS;
+
+#ifdef _WIN32
+#define qos_cas(ptr, old_value, new_value) \
+    (InterlockedCompareExchange64((volatile LONGLONG*)(ptr), \
+    (LONGLONG)(new_value), (LONGLONG)(old_value)) == (LONGLONG)(old_value))
+#define qos_add(ptr, value) \
+    InterlockedExchangeAdd64((volatile LONGLONG*)(ptr), (LONGLONG)(value))
+#define qos_set(ptr, value) \
+    InterlockedExchange64((volatile LONGLONG*)(ptr), (LONGLONG)(value))
+#else
+#define qos_cas(ptr, old_value, new_value) \
+    __sync_bool_compare_and_swap(ptr, old_value, new_value)
+#define qos_add(ptr, value) __sync_fetch_and_add(ptr, value)
+#define qos_set(ptr, value) __sync_lock_test_and_set(ptr, value)
+#endif
+
+// 64 bit loads are not atomic on 32 bit systems
+#define qos_get(ptr) ((uint64_t)qos_add(ptr, 0))
+
+char qos_enabled = 0;
+
+// Limits for each connection, from --qos. Connection threads start with a
+// copy of the settings from the listening thread.
+DEVIO_TLS DEVIO_QOS conn_qos = { 0 };
+
+// Limits for all exports together, from --qos-total. These are divided
+// between exports with recent requests in proportion to their weights.
+DEVIO_QOS total_qos = { 0 };
+
+// Shared state for each export and for export used by this connection
+PDEVIO_QOS export_qos_table = NULL;
+int export_qos_count = 0;
+DEVIO_TLS PDEVIO_QOS export_qos = NULL;
+
+#ifndef _WIN32
+// Tagged requests on a connection are served by a few worker threads, so
+// that reads and writes to different parts of the image run in parallel.
+// The connection thread reads each request with its data into a free
+// worker, and the worker sends the response when done. Responses are sent
+// whole under send_lock in the order requests complete.
+typedef struct _DEVIO_TAGGED_QUEUE *PDEVIO_TAGGED_QUEUE;
+
+typedef struct _DEVIO_TAGGED_WORKER
+{
+    PDEVIO_TAGGED_QUEUE queue;
+    pthread_t thread;
+
+    // Request to serve, with header and data after the request code
+    ULONGLONG io_tag;
+    ULONGLONG request_code;
+    char *request;
+    safeio_size_t request_length;
+    safeio_size_t request_size;
+
+    // Export selected by connection when request was read
+    struct _DEVIO_EXPORT *export_item;
+    PDEVIO_QOS export_qos;
+
+    int busy;
+    int sending;
+} DEVIO_TAGGED_WORKER, *PDEVIO_TAGGED_WORKER;
+
+typedef struct _DEVIO_TAGGED_QUEUE
+{
+    // Protects busy flags and counter. Workers wait for work and the
+    // connection thread waits for a free or idle worker set.
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_mutex_t send_lock;
+
+    SOCKET sd;
+    safeio_size_t buffer_size;
+    PDEVIO_QOS conn_qos;
+    int busy;
+    int closing;
+    int worker_count;
+    DEVIO_TAGGED_WORKER workers[MAX_TAGGED_WORKERS];
+} DEVIO_TAGGED_QUEUE;
+
+// Workers of this connection, and for worker threads the worker itself
+DEVIO_TLS PDEVIO_TAGGED_QUEUE tagged_queue = NULL;
+DEVIO_TLS PDEVIO_TAGGED_WORKER tagged_worker = NULL;
+
+// Request data that a worker thread reads instead of the connection
+DEVIO_TLS const char *queued_ptr = NULL;
+DEVIO_TLS safeio_size_t queued_left = 0;
+#endif
+
+// Parses one setting for a DEVIO_QOS: iops=n, bps=n, burst=ms or weight=n.
+// Values accept the same K, M, G, k, m and g suffixes as sizes on command
+// line. Returns 0 for unknown or invalid settings.
+int
+qos_setting(PDEVIO_QOS qos, const char *setting)
+{
+    ULONGLONG *field;
+    ULONGLONG value = 0;
+    char suf = 0;
+    int fields;
+
+    if (_strnicmp(setting, "iops=", 5) == 0)
+        field = &qos->iops;
+    else if (_strnicmp(setting, "bps=", 4) == 0)
+        field = &qos->bps;
+    else if (_strnicmp(setting, "burst=", 6) == 0)
+        field = &qos->burst_ms;
+    else if (_strnicmp(setting, "weight=", 7) == 0)
+        field = &qos->weight;
+    else
+        return 0;
+
+    fields = sscanf(strchr(setting, '=') + 1, ULL_FMT "%c", &value, &suf);
+
+    if (fields == 2)
+        switch (suf)
+        {
+        case 'G':
+            value <<= 10;
+        case 'M':
+            value <<= 10;
+        case 'K':
+            value <<= 10;
+            break;
+        case 'g':
+            value *= 1000;
+        case 'm':
+            value *= 1000;
+        case 'k':
+            value *= 1000;
+            break;
+        default:
+            return 0;
+        }
+    else if (fields != 1)
+        return 0;
+
+    *field = value;
+
+    if (qos->iops != 0 || qos->bps != 0)
+        qos_enabled = 1;
+
+    return 1;
+}
+
+// Parses a comma separated list of settings from command line.
+int
+qos_settings(PDEVIO_QOS qos, char *settings)
+{
+    char *setting;
+
+    for (setting = strtok(settings, ",");
+        setting != NULL;
+        setting = strtok(NULL, ","))
+        if (!qos_setting(qos, setting))
+        {
+            syslog(LOG_ERR, "Invalid QoS setting '%s'.\n", setting);
+            return 0;
+        }
+
+    return 1;
+}
+
+// Reserves cost tokens from a bucket with given rate per second. Returns
+// number of microseconds caller needs to wait for the tokens.
+uint64_t
+qos_reserve(volatile uint64_t *tat, ULONGLONG rate, ULONGLONG burst_ms,
+    ULONGLONG cost, uint64_t now)
+{
+    uint64_t old_tat;
+    uint64_t start;
+    uint64_t tolerance;
+
+    if (rate == 0 || cost == 0)
+        return 0;
+
+    do
+    {
+        old_tat = *tat;
+        start = old_tat > now ? old_tat : now;
+    } while (!qos_cas(tat, old_tat, start + cost * 1000000 / rate));
+
+    tolerance = (burst_ms != 0 ? burst_ms : DEF_QOS_BURST_MS) * 1000;
+
+    if (start - now <= tolerance)
+        return 0;
+
+    return start - now - tolerance;
+}
+
+// Returns this export's share of a total rate, in proportion to its weight
+// among exports with requests during the last second.
+ULONGLONG
+qos_share(ULONGLONG total_rate, uint64_t now)
+{
+    ULONGLONG weight_sum = 0;
+    int i;
+
+    if (total_rate == 0)
+        return 0;
+
+    for (i = 0; i < export_qos_count; i++)
+        if (now - qos_get(&export_qos_table[i].last_active) < QOS_ACTIVE_US)
+            weight_sum += export_qos_table[i].weight;
+
+    if (weight_sum <= export_qos->weight)
+        return total_rate;
+
+    return total_rate * export_qos->weight / weight_sum;
+}
+
+// Delays a request as needed by connection, export and total limits.
+// Length is number of bytes transferred, zero for requests without data.
+void
+qos_throttle(ULONGLONG length)
+{
+    PDEVIO_QOS conn = &conn_qos;
+    uint64_t now;
+    uint64_t wait;
+    uint64_t export_wait;
+
+    if (!qos_enabled)
+        return;
+
+#ifndef _WIN32
+    // Workers count against limits of their connection
+    if (tagged_worker != NULL)
+        conn = tagged_worker->queue->conn_qos;
+#endif
+
+    now = trace_clock();
+
+    wait = qos_reserve(&conn->iops_tat, conn->iops, conn->burst_ms, 1, now);
+
+    export_wait = qos_reserve(&conn->bps_tat, conn->bps, conn->burst_ms,
+        length, now);
+    if (export_wait > wait)
+        wait = export_wait;
+
+    if (export_qos != NULL)
+    {
+        qos_set(&export_qos->last_active, now);
+
+        export_wait = qos_reserve(&export_qos->iops_tat, export_qos->iops,
+            export_qos->burst_ms, 1, now);
+        if (export_wait > wait)
+            wait = export_wait;
+
+        export_wait = qos_reserve(&export_qos->bps_tat, export_qos->bps,
+            export_qos->burst_ms, length, now);
+        if (export_wait > wait)
+            wait = export_wait;
+
+        export_wait = qos_reserve(&export_qos->share_iops_tat,
+            qos_share(total_qos.iops, now), total_qos.burst_ms, 1, now);
+        if (export_wait > wait)
+            wait = export_wait;
+
+        export_wait = qos_reserve(&export_qos->share_bps_tat,
+            qos_share(total_qos.bps, now), total_qos.burst_ms, length, now);
+        if (export_wait > wait)
+            wait = export_wait;
+
+        qos_add(&export_qos->requests, 1);
+    }
+
+    qos_add(&conn->requests, 1);
+
+    if (wait == 0)
+        return;
+
+    qos_add(&conn->throttled, 1);
+    qos_add(&conn->delay_us, wait);
+
+    if (export_qos != NULL)
+    {
+        qos_add(&export_qos->throttled, 1);
+        qos_add(&export_qos->delay_us, wait);
+    }
+
+    dbglog((LOG_ERR, "Throttling request for " ULL_FMT " us.\n",
+        (ULONGLONG)wait));
+
+#ifdef _WIN32
+    Sleep((DWORD)((wait + 999) / 1000));
+#else
+    {
+        struct timespec delay;
+
+        delay.tv_sec = (time_t)(wait / 1000000);
+        delay.tv_nsec = (long)(wait % 1000000 * 1000);
+
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+    }
+#endif
+}
+
+// Splits requests larger than max transfer size of a block device into
+// several requests.
+safeio_ssize_t
+physical_split_io(int write, char *io_ptr, safeio_size_t size,
+    off_t_64 offset)
+{
+    safeio_size_t done = 0;
+
+    while (done < size)
+    {
+        safeio_size_t chunk = size - done;
+        safeio_ssize_t chunk_done;
+
+        if (chunk > max_transfer_size)
+            chunk = max_transfer_size;
+
+        if (write)
+            chunk_done = pwrite(image_fd, io_ptr + done, chunk, offset + done);
+        else
+            chunk_done = pread(image_fd, io_ptr + done, chunk, offset + done);
+
+        if (chunk_done < 0)
+            return done > 0 ? (safeio_ssize_t)done : chunk_done;
+
+        done += chunk_done;
+
+        if ((safeio_size_t)chunk_done < chunk)
+            break;
+    }
+
+    return (safeio_ssize_t)done;
+}
+
 safeio_ssize_t
 physical_read(void *io_ptr, safeio_size_t size, off_t_64 offset)
 {
     if (dll_mode)
         return dll_read(libhandle, io_ptr, size, offset);
+    else if (max_transfer_size != 0 && size > max_transfer_size)
+        return physical_split_io(0, (char*)io_ptr, size, offset);
     else
         return pread(image_fd, io_ptr, size, offset);
 }
@@ -322,6 +945,8 @@ physical_write(void *io_ptr, safeio_size_t size, off_t_64 offset)
 {
     if (dll_mode)
         return dll_write(libhandle, io_ptr, size, offset);
+    else if (max_transfer_size != 0 && size > max_transfer_size)
+        return physical_split_io(1, (char*)io_ptr, size, offset);
     else
         return pwrite(image_fd, io_ptr, size, offset);
 }
@@ -586,14 +1211,19 @@ drv_flush()
 void
 buf_realloc(ULONGLONG new_size)
 {
+    safeio_size_t existing_buffer_size = buffer_size;
+
     if (shm_mode)
         return;
 
-    if (new_size > (((safeio_size_t)-1) >> 1))
+    if (new_size > max_buffer_size)
     {
-        new_size = (((safeio_size_t)-1) >> 1);
+        new_size = max_buffer_size;
     }
 
+    if (new_size <= buffer_size)
+        return;
+
     buffer_size = (safeio_size_t)new_size;
 
     dbglog((LOG_ERR, "Read request " SLL_FMT " bytes, reallocating buffer.\n",
@@ -607,7 +1237,6 @@ buf_realloc(ULONGLONG new_size)
         char* existing_buf = buf;
         char* existing_buf2 = buf2;
         char* existing_shm_view = shm_view;
-        safeio_size_t existing_buffer_size = buffer_size;
 
         if (!GetOverlappedResult((HANDLE)sd, &drv_memory_io, &dw, TRUE) &&
             GetLastError() != ERROR_INSUFFICIENT_BUFFER)
@@ -642,6 +1271,8 @@ buf_realloc(ULONGLONG new_size)
                 free(new_buf);
             if (new_buf2 != NULL)
                 free(new_buf2);
+
+            buffer_size = existing_buffer_size;
         }
         else
         {
@@ -653,6 +1284,12 @@ buf_realloc(ULONGLONG new_size)
     }
 }
 
+#ifdef DEVIO_FUZZ
+// Fuzz builds read requests from memory and throw responses away
+const char *fuzz_comm_ptr = NULL;
+size_t fuzz_comm_left = 0;
+#endif
+
 int
 comm_flush()
 {
@@ -667,387 +1304,573 @@ comm_flush()
 int
 comm_read(void *io_ptr, safeio_size_t size)
 {
+#ifdef DEVIO_FUZZ
+    if (size > fuzz_comm_left)
+    {
+        fuzz_comm_left = 0;
+        return 0;
+    }
+
+    memcpy(io_ptr, fuzz_comm_ptr, size);
+    fuzz_comm_ptr += size;
+    fuzz_comm_left -= size;
+    return 1;
+#endif
+
+#ifndef _WIN32
+    if (queued_left > 0)
+    {
+        safeio_size_t chunk = size < queued_left ? size : queued_left;
+
+        memcpy(io_ptr, queued_ptr, chunk);
+        queued_ptr += chunk;
+        queued_left -= chunk;
+        io_ptr = (char*)io_ptr + chunk;
+        size -= chunk;
+
+        if (size == 0)
+            return 1;
+    }
+
+    // Workers only have the data read with the request
+    if (tagged_worker != NULL)
+    {
+        errno = EPROTO;
+        return 0;
+    }
+#endif
+
     if (shm_mode || drv_mode)
         return shm_read(io_ptr, size);
     else
         return safe_read(sd, io_ptr, size);
 }
 
+// Returns non-zero if no request arrives from the client within timeout_ms
+// milliseconds. Returns zero if a request is waiting, or if the comm channel
+// cannot be polled.
+int
+comm_idle(int timeout_ms)
+{
+    fd_set fds;
+    struct timeval tv;
+
+    if (!comm_selectable)
+        return 0;
+
+    FD_ZERO(&fds);
+    FD_SET(sd, &fds);
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    return select((int)sd + 1, &fds, NULL, NULL, &tv) == 0;
+}
+
 int
 comm_write(const void *io_ptr, safeio_size_t size)
 {
+#ifdef DEVIO_FUZZ
+    return 1;
+#endif
+
+#ifndef _WIN32
+    // Worker keeps the lock until its whole response is sent
+    if (tagged_worker != NULL && !tagged_worker->sending)
+    {
+        pthread_mutex_lock(&tagged_worker->queue->send_lock);
+        tagged_worker->sending = 1;
+    }
+#endif
+
     if (shm_mode || drv_mode)
         return shm_write(io_ptr, size);
     else
         return safe_write(sd, io_ptr, size);
 }
 
+// Reads and throws away data the client sent with a request we cannot
+// serve, so that the next request header is read from the right position.
 int
-send_info()
+comm_discard(ULONGLONG size)
 {
-    if (!comm_write(&devio_info, sizeof devio_info))
-        return 0;
-
-    if (!comm_flush())
+    if (shm_mode || drv_mode)
+        return 1;
+
+    while (size > 0)
     {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        safeio_size_t chunk =
+            size < buffer_size ? (safeio_size_t)size : buffer_size;
 
-        return 0;
+        if (!comm_read(buf, chunk))
+            return 0;
+
+        size -= chunk;
     }
 
     return 1;
 }
 
-safeio_ssize_t
-vhd_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+// Checks that a request stays within the image, or within the selected
+// partition, and returns how many bytes of it can be served.
+int
+check_request_range(ULONGLONG offset, ULONGLONG length, ULONGLONG *valid_length)
 {
-    off_t_64 block_number;
-    off_t_64 data_offset;
-    safeio_size_t in_block_offset;
-    uint32_t block_offset;
-    safeio_size_t first_size = size;
-    off_t_64 second_offset = 0;
-    safeio_size_t second_size = 0;
-    safeio_ssize_t readdone;
+    ULONGLONG max_offset = (ULONGLONG)(((uint64_t)1 << 63) - 1) -
+        (ULONGLONG)image_offset;
 
-    dbglog((LOG_ERR, "vhd_read: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
-        (off_t_64)size, (off_t_64)offset));
+    if (devio_info.file_size != 0 && devio_info.file_size < max_offset)
+        max_offset = devio_info.file_size;
 
-    if (offset + size > current_size)
+    if (offset > max_offset)
         return 0;
 
-    block_number = (safeio_size_t)(offset >> block_shift);
-    data_offset = table_offset + (block_number << 2);
-    in_block_offset = (safeio_size_t)offset & (block_size - 1);
-    if (first_size + in_block_offset > block_size)
-    {
-        first_size = block_size - in_block_offset;
-        second_size = size - first_size;
-        second_offset = offset + first_size;
-    }
+    if (length > max_offset - offset)
+        length = max_offset - offset;
 
-    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
-    if (readdone != sizeof(block_offset))
-    {
-        syslog(LOG_ERR, "vhd_read: Error reading block table: %m\n");
+    *valid_length = length;
+    return 1;
+}
 
-        if (errno == 0)
-            errno = E2BIG;
+#ifdef __linux__
 
-        return (safeio_ssize_t)-1;
-    }
+// Block devices report zero size with fstat(), so ask the device for size,
+// sector sizes and max transfer size instead. Unmap and zero requests are
+// served with native discard and write zeroes on block devices.
+void
+blkdev_probe()
+{
+    struct stat file_stat = { 0 };
+    uint64_t size = 0;
+    int logical_sector_size = 0;
+    unsigned int physical_sector_size = 0;
+    unsigned short max_sectors = 0;
 
-    memset(io_ptr, 0, size);
+    if (fstat(image_fd, &file_stat) != 0 || !S_ISBLK(file_stat.st_mode))
+        return;
 
-    if (block_offset == 0xFFFFFFFF)
-        readdone = first_size;
-    else
-    {
-        block_offset = ntohl(block_offset);
+    blkdev_mode = 1;
 
-        data_offset =
-            (((off_t_64)block_offset) << sector_shift) + sector_size +
-            in_block_offset;
+    if (ioctl(image_fd, BLKGETSIZE64, &size) != 0)
+        syslog(LOG_ERR, "Cannot determine size of block device: %m\n");
+    else if (devio_info.file_size == 0)
+        devio_info.file_size = size;
 
-        readdone = physical_read(io_ptr, (safeio_size_t)first_size, data_offset);
-        readdone = physical_read(io_ptr, (safeio_size_t)first_size, data_offset);
-        if (readdone == -1)
-            return (safeio_ssize_t)-1;
-    }
+    if (ioctl(image_fd, BLKSSZGET, &logical_sector_size) == 0 &&
+        logical_sector_size > 0)
+        blkdev_sector_size = (safeio_size_t)logical_sector_size;
 
-    if (second_size > 0)
-    {
-        safeio_size_t second_read =
-            vhd_read(io_ptr + first_size, second_size, second_offset);
+    // Physical sector size is the smallest write the device can do without
+    // reading and rewriting a larger sector internally.
+    if (ioctl(image_fd, BLKPBSZGET, &physical_sector_size) == 0 &&
+        physical_sector_size > blkdev_sector_size)
+        blkdev_alignment = physical_sector_size;
+    else
+        blkdev_alignment = blkdev_sector_size;
 
-        if (second_read == -1)
-            return (safeio_ssize_t)-1;
+    if (ioctl(image_fd, BLKSECTGET, &max_sectors) == 0 && max_sectors > 0)
+        max_transfer_size = (safeio_size_t)max_sectors << 9;
 
-        readdone += second_read;
-    }
+    if (!vhd_mode && (devio_info.flags & IMDPROXY_FLAG_RO) == 0 &&
+        blkdev_sector_size != 0)
+        devio_info.flags |=
+        IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ZERO;
 
-    return readdone;
+    printf("Block device. Sector size: " SIZ_FMT "/" SIZ_FMT " bytes. "
+        "Max transfer size: " SIZ_FMT " bytes.\n",
+        blkdev_sector_size, blkdev_alignment, max_transfer_size);
 }
 
-safeio_ssize_t
-vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+// Writes zeros to parts of sectors that native write zeroes cannot handle.
+int
+blkdev_write_zeros(off_t_64 offset, ULONGLONG length)
 {
-    off_t_64 block_number;
-    off_t_64 data_offset;
-    safeio_size_t in_block_offset;
-    uint32_t block_offset;
-    safeio_size_t first_size = size;
-    off_t_64 second_offset = 0;
-    safeio_size_t second_size = 0;
-    safeio_ssize_t readdone;
-    safeio_ssize_t writedone;
-    off_t_64 bitmap_offset;
-    safeio_size_t bitmap_datasize;
-    safeio_size_t first_size_nqwords;
+    static char zeros[4096];
 
-    dbglog((LOG_ERR, "vhd_write: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
-        (off_t_64)size, (off_t_64)offset));
-
-    if (offset + size > current_size)
-        return 0;
-
-    block_number = offset >> block_shift;
-    data_offset = table_offset + (block_number << 2);
-    in_block_offset = (safeio_size_t)offset & (block_size - 1);
-    if (first_size + in_block_offset > block_size)
-    {
-        first_size = block_size - in_block_offset;
-        second_size = size - first_size;
-        second_offset = offset + first_size;
-    }
-    first_size_nqwords = (first_size + 7) >> 3;
-
-    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
-    if (readdone != sizeof(block_offset))
+    while (length > 0)
     {
-        syslog(LOG_ERR, "vhd_write: Error reading block table: %m\n");
+        safeio_size_t chunk = length < sizeof(zeros) ?
+            (safeio_size_t)length : (safeio_size_t)sizeof(zeros);
 
-        if (errno == 0)
-            errno = E2BIG;
+        if (physical_write(zeros, chunk, offset) != (safeio_ssize_t)chunk)
+            return 0;
 
-        return (safeio_ssize_t)-1;
+        offset += chunk;
+        length -= chunk;
     }
 
-    // Alocate a new block if not already defined
-    if (block_offset == 0xFFFFFFFF)
-    {
-        off_t_64 block_offset_bytes;
-        char *new_block_buf;
-        long long *buf_ptr;
+    return 1;
+}
 
-        // First check if new block is all zeroes, in that case don't allocate
-        // a new block in the vhd file
-        for (buf_ptr = (long long*)io_ptr;
-            (buf_ptr < (long long*)io_ptr + first_size_nqwords) ? 0 :
-            (*buf_ptr == 0);
-        buf_ptr++);
-        if (buf_ptr >= (long long*)io_ptr + first_size_nqwords)
-        {
-            dbglog((LOG_ERR, "vhd_write: New empty block not added to vhd file "
-                "backing " SLL_FMT " bytes at " SLL_FMT ".\n",
-                (off_t_64)first_size, (off_t_64)offset));
+// Unmaps or zero-fills a range of a block device. Unmap is a hint, so parts
+// of sectors are left as they are, and devices without discard support
+// silently ignore it.
+int
+blkdev_unmap_or_zero(ULONGLONG request_code, off_t_64 offset,
+    ULONGLONG length)
+{
+    uint64_t range[2];
+    off_t_64 start = (offset + blkdev_sector_size - 1) &
+        ~(off_t_64)(blkdev_sector_size - 1);
+    off_t_64 end = (offset + length) & ~(off_t_64)(blkdev_sector_size - 1);
+
+    if (request_code == IMDPROXY_REQ_ZERO &&
+        (!blkdev_write_zeros(offset, (start < end ? start : offset + length) -
+            offset) ||
+            (start < end && !blkdev_write_zeros(end, offset + length - end))))
+        return 0;
 
-            writedone = first_size;
+    if (start >= end)
+        return 1;
 
-            if (second_size > 0)
-            {
-                safeio_size_t second_write =
-                    vhd_write(io_ptr + first_size, second_size, second_offset);
+    range[0] = (uint64_t)start;
+    range[1] = (uint64_t)(end - start);
 
-                if (second_write == -1)
-                    return (safeio_ssize_t)-1;
+    if (request_code == IMDPROXY_REQ_UNMAP)
+    {
+        if (ioctl(image_fd, BLKDISCARD, range) != 0 && errno != EOPNOTSUPP)
+            return 0;
+    }
+    else if (ioctl(image_fd, BLKZEROOUT, range) != 0)
+        return 0;
 
-                writedone += second_write;
-            }
+    return 1;
+}
 
-            return writedone;
-        }
+#endif
 
-        dbglog((LOG_ERR, "vhd_write: Adding new block to vhd file backing "
-            SLL_FMT " bytes at " SLL_FMT ".\n",
-            (off_t_64)first_size, (off_t_64)offset));
+// Sends a response header, preceded by the tag when serving a tagged
+// request, so that clients can read both at once.
+int
+send_response(const void *resp, safeio_size_t size)
+{
+    char header[sizeof(IMDPROXY_TAGGED_RESP) + sizeof(IMDPROXY_READ_RESP)];
 
-        new_block_buf = (char *)
-            malloc((size_t)sector_size + block_size + sizeof(vhd_info.Footer));
-        if (new_block_buf == NULL)
-        {
-            syslog(LOG_ERR, "vhd_write: Error allocating memory buffer for new "
-                "block: %m\n");
+    if (!tagged_io || size > sizeof(IMDPROXY_READ_RESP))
+        return comm_write(resp, size);
 
-            return (safeio_ssize_t)-1;
-        }
+    memcpy(header, &tagged_resp, sizeof tagged_resp);
+    memcpy(header + sizeof tagged_resp, resp, size);
 
-        // New block is placed where the footer currently is
-        block_offset_bytes =
-            _lseeki64(image_fd, -(off_t_64) sizeof(vhd_info.Footer), SEEK_END);
-        if (block_offset_bytes == -1)
-        {
-            syslog(LOG_ERR, "vhd_write: Error moving file pointer to last "
-                "block: %m\n");
+    return comm_write(header, (safeio_size_t)(sizeof tagged_resp + size));
+}
 
-            free(new_block_buf);
-            return (safeio_ssize_t)-1;
-        }
+int
+send_info()
+{
+    IMDPROXY_INFO_RESP info = devio_info;
 
-        // Store pointer to new block start sector in BAT
-        block_offset = htonl((uint32_t)(block_offset_bytes >> sector_shift));
-        readdone =
-            physical_write(&block_offset, sizeof(block_offset), data_offset);
-        if (readdone != sizeof(block_offset))
-        {
-            syslog(LOG_ERR, "vhd_write: Error updating BAT: %m\n");
+    // Tagged requests are only accepted on stream connections
+    if (!shm_mode && !drv_mode)
+        info.flags |= IMDPROXY_FLAG_QUEUE_DEPTH(queue_depth);
 
-            free(new_block_buf);
+    if (!comm_write(&info, sizeof info))
+        return 0;
 
-            if (errno == 0)
-                errno = E2BIG;
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
 
-            return (safeio_ssize_t)-1;
-        }
+        return 0;
+    }
 
-        // Initialize new block with zeroes followed by the new footer
-        memset(new_block_buf, 0, (size_t)sector_size + block_size);
-        memcpy(new_block_buf + sector_size + block_size, &vhd_info.Footer,
-            sizeof(vhd_info.Footer));
+    return 1;
+}
 
-        readdone =
-            physical_write(new_block_buf,
-                (size_t)sector_size + block_size + sizeof(vhd_info.Footer),
-                block_offset_bytes);
+// Writes part of the changed block bitmap to the bitmap file and waits for
+// it to reach stable storage.
+int
+cbt_flush(ULONGLONG first_byte, ULONGLONG byte_count)
+{
+    if (pwrite(cbt_fd, cbt_bitmap + first_byte, (safeio_size_t)byte_count,
+        DEVIO_CBT_BITMAP_OFFSET + (off_t_64)first_byte) !=
+        (safeio_ssize_t)byte_count ||
+        _commit(cbt_fd) != 0)
+    {
+        syslog(LOG_ERR, "Error writing changed block bitmap: %m\n");
+        return 0;
+    }
 
-        if (readdone != (safeio_ssize_t)(sector_size + block_size) +
-            (safeio_ssize_t)sizeof(vhd_info.Footer))
-        {
-            syslog(LOG_ERR, "vhd_write: Error writing new block: %m\n");
+    return 1;
+}
 
-            free(new_block_buf);
+// Opens or creates a changed block tracking bitmap file. A new bitmap, or
+// one that was created for another image size or block size, has all
+// blocks marked as changed, because nothing is known about which blocks
+// have changed since last backup.
+int
+cbt_open(const char *cbt_path)
+{
+    DEVIO_CBT_HEADER header = { { 0 } };
+    ULONGLONG bitmap_size;
 
-            if (errno == 0)
-                errno = E2BIG;
+    if (devio_info.file_size == 0)
+    {
+        syslog(LOG_ERR,
+            "Changed block tracking requires a known image size.\n");
+        return 0;
+    }
 
-            return (safeio_ssize_t)-1;
-        }
+    for (cbt_block_shift = 9;
+        (cbt_block_shift < 31) &&
+        ((((ULONGLONG)1) << cbt_block_shift) != cbt_block_size);
+        cbt_block_shift++);
 
-        free(new_block_buf);
+    if ((((ULONGLONG)1) << cbt_block_shift) != cbt_block_size)
+    {
+        syslog(LOG_ERR, "Changed block size must be a power of two between "
+            "512 bytes and 1 GB.\n");
+        return 0;
     }
 
-    // Calculate where actual data should be written
-    block_offset = ntohl(block_offset);
-    data_offset = (((off_t_64)block_offset) << sector_shift) + sector_size +
-        in_block_offset;
-
-    // Write data
-    writedone = physical_write(io_ptr, (safeio_size_t)first_size, data_offset);
-    if (writedone == -1)
-        return (safeio_ssize_t)-1;
+    cbt_blocks = (devio_info.file_size + cbt_block_size - 1) >>
+        cbt_block_shift;
 
-    // Calculate where and how many bytes in allocation bitmap we need to update
-    bitmap_offset = ((off_t_64)block_offset << sector_shift) +
-        (in_block_offset >> sector_shift >> 3);
+    bitmap_size = (cbt_blocks + 7) >> 3;
 
-    bitmap_datasize =
-        (((first_size + sector_size - 1) >> sector_shift) + 7) >> 3;
+    // Bitmap is shared by connection threads and updated atomically
+    cbt_bitmap = (uint8_t*)malloc((size_t)bitmap_size);
+    if (cbt_bitmap == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
 
-    // Set bits as 'allocated'
-    memset(buf2, 0xFF, bitmap_datasize);
+    cbt_fd = _open(cbt_path, O_BINARY | O_RDWR | O_CREAT, 0644);
+    if (cbt_fd == -1)
+    {
+        syslog(LOG_ERR, "Cannot open changed block bitmap '%s': %m\n",
+            cbt_path);
+        return 0;
+    }
 
-    // Update allocation bitmap
-    readdone = physical_write(buf2, bitmap_datasize, bitmap_offset);
-    if (readdone != (safeio_ssize_t)bitmap_datasize)
+    if (pread(cbt_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, DEVIO_CBT_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == DEVIO_CBT_VERSION &&
+        header.block_size == cbt_block_size &&
+        header.image_size == devio_info.file_size &&
+        pread(cbt_fd, cbt_bitmap, (safeio_size_t)bitmap_size,
+            DEVIO_CBT_BITMAP_OFFSET) == (safeio_ssize_t)bitmap_size)
     {
-        syslog(LOG_ERR, "vhd_write: Error updating block bitmap: %m\n");
+        printf("Tracking changed blocks in '%s'. Block size " ULL_FMT
+            " bytes.\n", cbt_path, cbt_block_size);
 
-        if (errno == 0)
-            errno = E2BIG;
+        devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_CBT;
 
-        return (safeio_ssize_t)-1;
+        return 1;
     }
 
-    if (second_size > 0)
-    {
-        safeio_size_t second_write =
-            vhd_write(io_ptr + first_size, second_size, second_offset);
+    printf("Creating changed block bitmap '%s'. Block size " ULL_FMT
+        " bytes, all blocks initially marked as changed.\n",
+        cbt_path, cbt_block_size);
 
-        if (second_write == -1)
-            return (safeio_ssize_t)-1;
+    // Bitmap is written before header, so that a crash during
+    // initialization leaves a file that is initialized again next time.
+    memset(cbt_bitmap, 0xFF, (size_t)bitmap_size);
 
-        writedone += second_write;
+    if (!cbt_flush(0, bitmap_size))
+        return 0;
+
+    memcpy(header.magic, DEVIO_CBT_MAGIC, sizeof(header.magic));
+    header.version = DEVIO_CBT_VERSION;
+    header.block_size = cbt_block_size;
+    header.image_size = devio_info.file_size;
+
+    if (pwrite(cbt_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        _commit(cbt_fd) != 0)
+    {
+        syslog(LOG_ERR, "Error writing changed block bitmap: %m\n");
+        return 0;
     }
 
-    return writedone;
-}
+    devio_info.flags |= IMDPROXY_FLAG_SUPPORTS_CBT;
 
-safeio_ssize_t
-logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
-{
-    if (vhd_mode)
-        return vhd_read(io_ptr, size, offset);
-    else
-        return physical_read(io_ptr, size, offset);
+    return 1;
 }
 
-safeio_ssize_t
-logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+void
+cbt_close()
 {
-    if (vhd_mode)
-        return vhd_write(io_ptr, size, offset);
-    else
-        return physical_write(io_ptr, size, offset);
+    if (cbt_fd == -1)
+        return;
+
+    if (_close(cbt_fd) != 0)
+        syslog(LOG_ERR, "Error closing changed block bitmap: %m\n");
+
+    cbt_fd = -1;
 }
 
+// Sets bits of blocks in a range, with cbt_lock held, and writes changed
+// bytes to the bitmap file. Returns 0 if the bitmap file could not be
+// written.
 int
-read_data()
+cbt_set(ULONGLONG offset, ULONGLONG length)
 {
-    IMDPROXY_READ_REQ req_block = { 0 };
-    IMDPROXY_READ_RESP resp_block = { 0 };
-    safeio_size_t size;
-    safeio_ssize_t readdone;
+    ULONGLONG first_block = offset >> cbt_block_shift;
+    ULONGLONG last_block = (offset + length - 1) >> cbt_block_shift;
+    ULONGLONG block;
+    int changed = 0;
 
-    if (!comm_read(&req_block.offset,
-        sizeof(req_block) - sizeof(req_block.request_code)))
+    for (block = first_block; block <= last_block; block++)
     {
-        syslog(LOG_ERR, "Error reading request header.\n");
-        return 0;
-    }
+        uint8_t mask = (uint8_t)(1 << (block & 7));
 
-    if (req_block.length > buffer_size) // we will need larger buffer to complete this request
-    {
-        buf_realloc(req_block.length);
+        if ((cbt_bitmap[block >> 3] & mask) == 0)
+        {
+            cbt_bitmap[block >> 3] |= mask;
+            changed = 1;
+        }
     }
 
-    size = (safeio_size_t)
-        (req_block.length < buffer_size ? req_block.length : buffer_size);
+    if (!changed)
+        return 1;
 
-    dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + "
-        ULL_FMT " = " ULL_FMT ".\n",
-        req_block.length, req_block.offset, image_offset,
-        req_block.offset + image_offset));
+    return cbt_flush(first_block >> 3,
+        (last_block >> 3) - (first_block >> 3) + 1);
+}
 
-    memset(buf, 0, size);
+// Marks blocks touched by a write request as changed. Called before the
+// write is done, and newly set bits are on stable storage before this
+// returns, so that a crash never loses track of a changed block. Writes to
+// blocks that are already marked cost nothing extra.
+int
+cbt_mark(ULONGLONG offset, ULONGLONG length)
+{
+    int result;
 
-    readdone =
-        logical_read(buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block.offset));
+    if (cbt_bitmap == NULL || length == 0)
+        return 1;
 
-    if (readdone == -1)
+#ifndef _WIN32
+    pthread_mutex_lock(&cbt_lock);
+#endif
+
+    result = cbt_set(offset, length);
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&cbt_lock);
+#endif
+
+    return result;
+}
+
+int
+cbt_query()
+{
+    IMDPROXY_CBT_REQ req_block = { 0 };
+    IMDPROXY_CBT_RESP resp_block = { 0 };
+    PIMDPROXY_CBT_RANGE ranges = (PIMDPROXY_CBT_RANGE)buf;
+    size_t max_ranges = buffer_size / sizeof(*ranges);
+    size_t count = 0;
+    ULONGLONG first_block;
+    ULONGLONG end_block;
+    ULONGLONG block;
+
+    if (!comm_read(&req_block.flags,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    trace_record(IMDPROXY_REQ_CBT, 0, 0, NULL);
+
+    resp_block.block_size = cbt_block_size;
+
+#ifndef _WIN32
+    if (cbt_bitmap != NULL)
+        pthread_mutex_lock(&cbt_lock);
+#endif
+
+    if (cbt_bitmap == NULL)
     {
-        resp_block.errorno = errno;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device read: %m\n");
+        resp_block.errorno = ENODEV;
+    }
+    else if (req_block.offset >= devio_info.file_size)
+    {
+        resp_block.end_offset = devio_info.file_size;
     }
     else
     {
-        resp_block.errorno = 0;
-        resp_block.length = size;
+        first_block = req_block.offset >> cbt_block_shift;
 
-        if (req_block.length != readdone)
+        end_block = cbt_blocks;
+        if (req_block.length < devio_info.file_size - req_block.offset)
+            end_block = (req_block.offset + req_block.length +
+                cbt_block_size - 1) >> cbt_block_shift;
+
+        for (block = first_block; block < end_block; block++)
         {
-            syslog(LOG_ERR,
-                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
-                (int64_t)(image_offset + req_block.offset), (int64_t)readdone, req_block.length);
+            if ((cbt_bitmap[block >> 3] & (1 << (block & 7))) == 0)
+                continue;
+
+            if (count > 0 &&
+                ranges[count - 1].offset + ranges[count - 1].length ==
+                block << cbt_block_shift)
+            {
+                ranges[count - 1].length += cbt_block_size;
+            }
+            else if (count < max_ranges)
+            {
+                ranges[count].offset = block << cbt_block_shift;
+                ranges[count].length = cbt_block_size;
+                ++count;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        end_block = block;
+
+        resp_block.end_offset = end_block << cbt_block_shift;
+        if (resp_block.end_offset > devio_info.file_size)
+            resp_block.end_offset = devio_info.file_size;
+
+        if (count > 0 &&
+            ranges[count - 1].offset + ranges[count - 1].length >
+            devio_info.file_size)
+            ranges[count - 1].length =
+                devio_info.file_size - ranges[count - 1].offset;
+
+        if ((req_block.flags & IMDPROXY_CBT_FLAG_RESET) && count > 0)
+        {
+            size_t i;
+
+            for (i = 0; i < count; i++)
+                for (block = ranges[i].offset >> cbt_block_shift;
+                    block < ((ranges[i].offset + ranges[i].length - 1) >>
+                        cbt_block_shift) + 1;
+                    block++)
+                    cbt_bitmap[block >> 3] &= (uint8_t)~(1 << (block & 7));
+
+            if (!cbt_flush(first_block >> 3,
+                ((end_block - 1) >> 3) - (first_block >> 3) + 1))
+            {
+                // Keep the ranges marked, the client should consider them
+                // still changed.
+                for (i = 0; i < count; i++)
+                    cbt_set(ranges[i].offset, ranges[i].length);
+
+                resp_block.errorno = EIO;
+                count = 0;
+            }
         }
+
+        resp_block.length = count * sizeof(*ranges);
     }
 
-    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
-        resp_block.length));
+#ifndef _WIN32
+    if (cbt_bitmap != NULL)
+        pthread_mutex_unlock(&cbt_lock);
+#endif
 
-    if (!comm_write(&resp_block, sizeof resp_block))
+    if (!comm_write(&resp_block, sizeof resp_block) ||
+        (resp_block.length > 0 &&
+            !comm_write(ranges, (safeio_size_t)resp_block.length)))
     {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        syslog(LOG_ERR, "Error sending changed block response to caller.\n");
         return 0;
     }
 
-    if (resp_block.errorno == 0)
-        if (!comm_write(buf, (safeio_size_t)resp_block.length))
-        {
-            syslog(LOG_ERR, "Error sending read response to caller.\n");
-            return 0;
-        }
-
     if (!comm_flush())
     {
         syslog(LOG_ERR, "Error flushing comm data: %m\n");
@@ -1057,157 +1880,2864 @@ read_data()
     return 1;
 }
 
+void
+vhd_alloc_lock();
+
+void
+vhd_alloc_unlock();
+
+void
+vhd_set_file_size(off_t_64 new_size);
+
+void
+vhd_refresh_file_size();
+
+// Block table entries come from the image file, so make sure that an entry
+// points to a complete block that is located after the block table and
+// before the footer. Another connection may have added the block since
+// this one last saw the file size, so it is looked up again before an
+// entry is rejected.
 int
-write_data()
+vhd_check_block(uint32_t block_offset)
 {
-    IMDPROXY_WRITE_REQ req_block = { 0 };
-    IMDPROXY_WRITE_RESP resp_block = { 0 };
-
-    if (!comm_read(&req_block.offset,
-        sizeof(req_block) - sizeof(req_block.request_code)))
-        return 0;
+    off_t_64 block_start = ((off_t_64)block_offset) << sector_shift;
 
-    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + "
-        ULL_FMT " = " ULL_FMT ".\n",
-        req_block.length, req_block.offset, image_offset,
-        req_block.offset + image_offset));
+    if (vhd_file_size != 0 &&
+        block_start + sector_size + block_size >
+        vhd_file_size - (off_t_64)sizeof(vhd_info.Footer))
+        vhd_refresh_file_size();
 
-    if (req_block.length > buffer_size)
+    if (block_start < table_offset + ((off_t_64)table_entries << 2) ||
+        (vhd_file_size != 0 &&
+            block_start + sector_size + block_size >
+            vhd_file_size - (off_t_64)sizeof(vhd_info.Footer)))
     {
-        syslog(LOG_ERR, "Too big block write requested: %u bytes.\n",
-            (int)req_block.length);
+        syslog(LOG_ERR, "Invalid block table entry: " SLL_FMT "\n",
+            (int64_t)block_start);
+
+        errno = EINVAL;
         return 0;
     }
 
-    if (!comm_read(buf, (safeio_size_t)req_block.length))
-    {
-        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+    return 1;
+}
+
+safeio_ssize_t
+vhd_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 block_number;
+    off_t_64 data_offset;
+    safeio_size_t in_block_offset;
+    uint32_t block_offset;
+    safeio_size_t first_size = size;
+    off_t_64 second_offset = 0;
+    safeio_size_t second_size = 0;
+    safeio_ssize_t readdone;
+
+    dbglog((LOG_ERR, "vhd_read: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
+        (off_t_64)size, (off_t_64)offset));
 
+    if (size == 0 || offset + size > current_size)
         return 0;
+
+    block_number = offset >> block_shift;
+    if (block_number >= table_entries)
+    {
+        syslog(LOG_ERR, "vhd_read: Block " SLL_FMT " outside block table.\n",
+            (int64_t)block_number);
+        errno = EINVAL;
+        return (safeio_ssize_t)-1;
     }
 
-    if (devio_info.flags & IMDPROXY_FLAG_RO)
+    data_offset = table_offset + (block_number << 2);
+    in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    if (first_size + in_block_offset > block_size)
     {
-        resp_block.errorno = EBADF;
-        resp_block.length = 0;
-        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+        first_size = block_size - in_block_offset;
+        second_size = size - first_size;
+        second_offset = offset + first_size;
     }
-    else
+
+    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
+    if (readdone != sizeof(block_offset))
     {
-        safeio_ssize_t writedone = logical_write(buf, (safeio_size_t)req_block.length,
-            (off_t_64)(image_offset + req_block.offset));
-        if (writedone == -1)
-        {
-            resp_block.errorno = errno;
-            resp_block.length = writedone;
-#ifdef _WIN32
-            perror("Device write");
-#else
-            syslog(LOG_ERR, "Device write: %m\n");
-#endif
-        }
-        else
-        {
-            resp_block.errorno = 0;
-            resp_block.length = writedone;
-        }
+        syslog(LOG_ERR, "vhd_read: Error reading block table: %m\n");
 
-        if (req_block.length != resp_block.length)
-        {
-            if (writedone < 0)
-            {
-                syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
-                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-            else
-            {
-                syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
-                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
-            }
-        }
+        if (errno == 0)
+            errno = E2BIG;
 
-        dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
-            resp_block.length));
+        return (safeio_ssize_t)-1;
     }
 
-    if (!comm_write(&resp_block, sizeof resp_block))
+    memset(io_ptr, 0, size);
+
+    if (block_offset == 0xFFFFFFFF)
+        readdone = first_size;
+    else
     {
-        syslog(LOG_ERR, "Error sending write response to caller.\n");
+        block_offset = ntohl(block_offset);
 
-        return 0;
+        if (!vhd_check_block(block_offset))
+            return (safeio_ssize_t)-1;
+
+        data_offset =
+            (((off_t_64)block_offset) << sector_shift) + sector_size +
+            in_block_offset;
+
+        readdone = physical_read(io_ptr, (safeio_size_t)first_size, data_offset);
+        if (readdone == -1)
+            return (safeio_ssize_t)-1;
     }
 
-    if (!comm_flush())
+    if (second_size > 0)
     {
-        syslog(LOG_ERR, "Error flushing comm data: %m\n");
-        return 0;
+        safeio_size_t second_read =
+            vhd_read(io_ptr + first_size, second_size, second_offset);
+
+        if (second_read == -1)
+            return (safeio_ssize_t)-1;
+
+        readdone += second_read;
     }
 
-    return 1;
+    return readdone;
 }
 
+// Adds a new block where the footer is and points block table entry at
+// bat_offset to it. Allocations from all connections to the image are
+// serialized, and the entry is read again under the lock, because another
+// connection may have added the block meanwhile. The block is written
+// before the entry, so that other connections never find an entry pointing
+// past end of file. Returns 0 and sets errno on failure.
 int
-do_comm(char *comm_device);
-
-int
-main(int argc, char **argv)
+vhd_alloc_block(off_t_64 bat_offset, uint32_t *block_offset)
 {
-    safeio_ssize_t readdone;
-    int partition_number = 0;
-    char mbr[512];
-    int retval;
-    char *comm_device = NULL;
+    off_t_64 block_offset_bytes;
+    char *new_block_buf = NULL;
+    safeio_ssize_t done;
+    int result = 0;
 
-#ifdef _WIN32
-    WSADATA wsadata;
+    vhd_alloc_lock();
 
-    SetUnhandledExceptionFilter(ExceptionFilter);
+    done = physical_read(block_offset, sizeof(*block_offset), bat_offset);
+    if (done != sizeof(*block_offset))
+    {
+        syslog(LOG_ERR, "vhd_write: Error reading block table: %m\n");
 
-    (void)WSAStartup(0x0101, &wsadata);
-#endif
+        if (errno == 0)
+            errno = E2BIG;
 
-    if (argc > 1 && _stricmp(argv[1], "--dll") == 0)
+        goto done;
+    }
+
+    if (*block_offset != 0xFFFFFFFF)
     {
-        fprintf(stderr,
-            "devio with custom DLL support\n"
-            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
-            "\n"
-            "Usage for unmanaged C/C++ DLL files:\n"
-            "devio --dll=dllfile;procedure other_devio_parameters ...\n"
-            "\n"
-            "dllfile     Name of custom DLL file to use for device I/O.\n"
-            "\n"
-            "procedure   Name of procedure in DLL file to use for opening device. This\n"
-            "            procedure must follow the dllopen_proc typedef as specified in\n"
-            "devio.h.\n"
-            "\n"
-            "Declaration for dllopen is:\n"
-            "void * __cdecl dllopen(const char *str,\n"
-            "                       int read_only,\n"
-            "                       dllread_proc *dllread,\n"
-            "                       dllwrite_proc *dllwrite,\n"
-            "                       dllclose_proc *dllclose,\n"
-            "                       __int64 *size)\n"
-            "\n"
-            "str         Device name to open as specified at devio command line.\n"
-            "\n"
-            "read_only   A non-zero value requests a device to be opened in read only mode.\n"
-            "\n"
-            "dllread     Pointer to memory where dllopen should store address to a function\n"
-            "            that is used when reading from device.\n"
-            "\n"
-            "dllwrite    Pointer to memory where dllopen should store address to a function\n"
-            "            that is used when writing to device. Address is ignored by devio\n"
-            "            if device is opened for read only.\n"
-            "\n"
-            "dllclose    Pointer to memory where dllopen should store address to a function\n"
-            "            that is used when closing device.\n"
-            "\n"
-            "size        Pointer to memory where dllopen should store detected size of\n"
-            "            successfully opened device. This is optional.\n"
-            "\n"
-            "Types for dllread_proc, dllwrite_proc, dllclose_proc are declared in devio.h.\n"
-            "\n"
+        result = 1;
+        goto done;
+    }
+
+    new_block_buf = (char *)
+        malloc((size_t)sector_size + block_size + sizeof(vhd_info.Footer));
+    if (new_block_buf == NULL)
+    {
+        syslog(LOG_ERR, "vhd_write: Error allocating memory buffer for new "
+            "block: %m\n");
+
+        goto done;
+    }
+
+    // New block is placed where the footer currently is
+    block_offset_bytes =
+        _lseeki64(image_fd, -(off_t_64) sizeof(vhd_info.Footer), SEEK_END);
+    if (block_offset_bytes == -1)
+    {
+        syslog(LOG_ERR, "vhd_write: Error moving file pointer to last "
+            "block: %m\n");
+
+        goto done;
+    }
+
+    // Initialize new block with zeroes followed by the new footer
+    memset(new_block_buf, 0, (size_t)sector_size + block_size);
+    memcpy(new_block_buf + sector_size + block_size, &vhd_info.Footer,
+        sizeof(vhd_info.Footer));
+
+    done = physical_write(new_block_buf,
+        (size_t)sector_size + block_size + sizeof(vhd_info.Footer),
+        block_offset_bytes);
+
+    if (done != (safeio_ssize_t)(sector_size + block_size) +
+        (safeio_ssize_t)sizeof(vhd_info.Footer))
+    {
+        syslog(LOG_ERR, "vhd_write: Error writing new block: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        goto done;
+    }
+
+    vhd_set_file_size(block_offset_bytes + sector_size + block_size +
+        sizeof(vhd_info.Footer));
+
+    // Store pointer to new block start sector in BAT
+    *block_offset = htonl((uint32_t)(block_offset_bytes >> sector_shift));
+    done = physical_write(block_offset, sizeof(*block_offset), bat_offset);
+    if (done != sizeof(*block_offset))
+    {
+        syslog(LOG_ERR, "vhd_write: Error updating BAT: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        goto done;
+    }
+
+    result = 1;
+
+done:
+    vhd_alloc_unlock();
+    free(new_block_buf);
+
+    return result;
+}
+
+safeio_ssize_t
+vhd_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    off_t_64 block_number;
+    off_t_64 data_offset;
+    safeio_size_t in_block_offset;
+    uint32_t block_offset;
+    safeio_size_t first_size = size;
+    off_t_64 second_offset = 0;
+    safeio_size_t second_size = 0;
+    safeio_ssize_t readdone;
+    safeio_ssize_t writedone;
+    off_t_64 bitmap_offset;
+    safeio_size_t bitmap_datasize;
+
+    dbglog((LOG_ERR, "vhd_write: Request " SLL_FMT " bytes at " SLL_FMT ".\n",
+        (off_t_64)size, (off_t_64)offset));
+
+    if (size == 0 || offset + size > current_size)
+        return 0;
+
+    block_number = offset >> block_shift;
+    if (block_number >= table_entries)
+    {
+        syslog(LOG_ERR, "vhd_write: Block " SLL_FMT " outside block table.\n",
+            (int64_t)block_number);
+        errno = EINVAL;
+        return (safeio_ssize_t)-1;
+    }
+
+    data_offset = table_offset + (block_number << 2);
+    in_block_offset = (safeio_size_t)offset & (block_size - 1);
+    if (first_size + in_block_offset > block_size)
+    {
+        first_size = block_size - in_block_offset;
+        second_size = size - first_size;
+        second_offset = offset + first_size;
+    }
+
+    readdone = physical_read(&block_offset, sizeof(block_offset), data_offset);
+    if (readdone != sizeof(block_offset))
+    {
+        syslog(LOG_ERR, "vhd_write: Error reading block table: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return (safeio_ssize_t)-1;
+    }
+
+    // Alocate a new block if not already defined
+    if (block_offset == 0xFFFFFFFF)
+    {
+        // First check if new block is all zeroes, in that case don't allocate
+        // a new block in the vhd file
+        if (ImDiskBufferIsZero(io_ptr, first_size))
+        {
+            dbglog((LOG_ERR, "vhd_write: New empty block not added to vhd file "
+                "backing " SLL_FMT " bytes at " SLL_FMT ".\n",
+                (off_t_64)first_size, (off_t_64)offset));
+
+            writedone = first_size;
+
+            if (second_size > 0)
+            {
+                safeio_size_t second_write =
+                    vhd_write(io_ptr + first_size, second_size, second_offset);
+
+                if (second_write == -1)
+                    return (safeio_ssize_t)-1;
+
+                writedone += second_write;
+            }
+
+            return writedone;
+        }
+
+        dbglog((LOG_ERR, "vhd_write: Adding new block to vhd file backing "
+            SLL_FMT " bytes at " SLL_FMT ".\n",
+            (off_t_64)first_size, (off_t_64)offset));
+
+        if (!vhd_alloc_block(data_offset, &block_offset))
+            return (safeio_ssize_t)-1;
+    }
+
+    // Calculate where actual data should be written
+    block_offset = ntohl(block_offset);
+
+    if (!vhd_check_block(block_offset))
+        return (safeio_ssize_t)-1;
+    data_offset = (((off_t_64)block_offset) << sector_shift) + sector_size +
+        in_block_offset;
+
+    // Write data
+    writedone = physical_write(io_ptr, (safeio_size_t)first_size, data_offset);
+    if (writedone == -1)
+        return (safeio_ssize_t)-1;
+
+    // Calculate where and how many bytes in allocation bitmap we need to update
+    bitmap_offset = ((off_t_64)block_offset << sector_shift) +
+        (in_block_offset >> sector_shift >> 3);
+
+    bitmap_datasize =
+        (((first_size + sector_size - 1) >> sector_shift) + 7) >> 3;
+
+    // Set bits as 'allocated'
+    memset(buf2, 0xFF, bitmap_datasize);
+
+    // Update allocation bitmap
+    readdone = physical_write(buf2, bitmap_datasize, bitmap_offset);
+    if (readdone != (safeio_ssize_t)bitmap_datasize)
+    {
+        syslog(LOG_ERR, "vhd_write: Error updating block bitmap: %m\n");
+
+        if (errno == 0)
+            errno = E2BIG;
+
+        return (safeio_ssize_t)-1;
+    }
+
+    if (second_size > 0)
+    {
+        safeio_size_t second_write =
+            vhd_write(io_ptr + first_size, second_size, second_offset);
+
+        if (second_write == -1)
+            return (safeio_ssize_t)-1;
+
+        writedone += second_write;
+    }
+
+    return writedone;
+}
+
+int
+compare_off_t_64(const void *a, const void *b)
+{
+    off_t_64 x = *(const off_t_64*)a;
+    off_t_64 y = *(const off_t_64*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Writes a new footer at new_end and truncates the image file after it. The
+// old footer stays last in the file until the truncation, so the image is
+// valid if interrupted in between.
+int
+vhd_truncate(off_t_64 new_end)
+{
+    if (physical_write(&vhd_info.Footer, sizeof(vhd_info.Footer), new_end) !=
+        sizeof(vhd_info.Footer) ||
+        _commit(image_fd) != 0 ||
+        ftruncate(image_fd, new_end + sizeof(vhd_info.Footer)) != 0)
+    {
+        syslog(LOG_ERR, "VHD compaction: Error truncating image file: %m\n");
+        return 0;
+    }
+
+    vhd_set_file_size(new_end + sizeof(vhd_info.Footer));
+
+    return 1;
+}
+
+// Stores a block table entry and waits until it is on stable storage.
+int
+vhd_set_block_entry(uint32_t block_number, uint32_t entry)
+{
+    if (physical_write(&entry, sizeof(entry),
+        table_offset + ((off_t_64)block_number << 2)) != sizeof(entry) ||
+        _commit(image_fd) != 0)
+    {
+        syslog(LOG_ERR, "VHD compaction: Error updating BAT: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Does one small step of online compaction of a dynamic VHD image. This is
+// called between requests when the client is idle. A step is one of:
+//
+// - Move the block last in the file to the first free slot earlier in the
+//   file, update its BAT entry and truncate the file.
+// - Truncate free space between last block and footer.
+// - Check next allocated block and release it if it only contains zeros.
+//
+// Blocks are copied and synced before the BAT entry that points to them is
+// updated, and BAT entries are four byte writes, so the image is valid if
+// interrupted at any point. Compaction goes idle when all blocks have been
+// checked without finding anything to do, until next write.
+void
+vhd_compact_step()
+{
+    safeio_size_t slot_size = sector_size + block_size;
+    off_t_64 data_start = (table_offset + ((off_t_64)table_entries << 2) +
+        sector_size - 1) & ~(off_t_64)(sector_size - 1);
+    off_t_64 footer_offset = vhd_file_size - sizeof(vhd_info.Footer);
+    uint32_t *table;
+    off_t_64 *blocks = NULL;
+    uint32_t block_count = 0;
+    uint32_t last_block = 0;
+    off_t_64 last_offset = -1;
+    off_t_64 hole = -1;
+    off_t_64 pos;
+    uint32_t i;
+
+    table = (uint32_t*)malloc((size_t)table_entries << 2);
+    if (table != NULL)
+        blocks = (off_t_64*)malloc((size_t)table_entries * sizeof(off_t_64));
+
+    if (table == NULL || blocks == NULL)
+    {
+        syslog(LOG_ERR, "VHD compaction: malloc() failed: %m\n");
+        compact_pending = 0;
+        free(table);
+        return;
+    }
+
+    if (physical_read(table, (safeio_size_t)table_entries << 2,
+        table_offset) != (safeio_ssize_t)table_entries << 2)
+    {
+        syslog(LOG_ERR, "VHD compaction: Error reading BAT: %m\n");
+        compact_pending = 0;
+        goto done;
+    }
+
+    for (i = 0; i < table_entries; i++)
+    {
+        off_t_64 offset;
+
+        if (table[i] == 0xFFFFFFFF)
+            continue;
+
+        offset = ((off_t_64)ntohl(table[i])) << sector_shift;
+
+        if (offset < data_start || offset + slot_size > footer_offset)
+        {
+            syslog(LOG_ERR, "VHD compaction: Invalid BAT entry " SLL_FMT
+                ". Compaction disabled.\n", (int64_t)offset);
+            compact_disabled = 1;
+            compact_pending = 0;
+            goto done;
+        }
+
+        blocks[block_count++] = offset;
+
+        if (offset > last_offset)
+        {
+            last_offset = offset;
+            last_block = i;
+        }
+    }
+
+    if (block_count == 0)
+    {
+        if (footer_offset > data_start && vhd_truncate(data_start))
+            compact_checked = 0;
+        else
+            compact_pending = 0;
+
+        goto done;
+    }
+
+    qsort(blocks, block_count, sizeof(*blocks), compare_off_t_64);
+
+    for (pos = data_start, i = 0; i < block_count; i++)
+    {
+        if (blocks[i] < pos)
+        {
+            syslog(LOG_ERR, "VHD compaction: Overlapping blocks at " SLL_FMT
+                ". Compaction disabled.\n", (int64_t)blocks[i]);
+            compact_disabled = 1;
+            compact_pending = 0;
+            goto done;
+        }
+
+        if (hole == -1 && blocks[i] - pos >= (off_t_64)slot_size)
+            hole = pos;
+
+        pos = blocks[i] + slot_size;
+    }
+
+    if (hole != -1)
+    {
+        off_t_64 new_end;
+
+        dbglog((LOG_ERR, "VHD compaction: Moving block at " SLL_FMT " to "
+            SLL_FMT ".\n", (int64_t)last_offset, (int64_t)hole));
+
+        if (physical_read(compact_buf, slot_size, last_offset) !=
+            (safeio_ssize_t)slot_size ||
+            physical_write(compact_buf, slot_size, hole) !=
+            (safeio_ssize_t)slot_size ||
+            _commit(image_fd) != 0)
+        {
+            syslog(LOG_ERR, "VHD compaction: Error moving block: %m\n");
+            compact_pending = 0;
+            goto done;
+        }
+
+        if (!vhd_set_block_entry(last_block,
+            htonl((uint32_t)(hole >> sector_shift))))
+        {
+            compact_pending = 0;
+            goto done;
+        }
+
+        // Blocks are sorted, so the new end is after the second last block,
+        // or after the moved block if that is now last.
+        new_end = hole + slot_size;
+        if (block_count > 1 && blocks[block_count - 2] + slot_size > new_end)
+            new_end = blocks[block_count - 2] + slot_size;
+
+        if (!vhd_truncate(new_end))
+            compact_pending = 0;
+
+        compact_checked = 0;
+        goto done;
+    }
+
+    if (footer_offset > last_offset + (off_t_64)slot_size)
+    {
+        if (vhd_truncate(last_offset + slot_size))
+            compact_checked = 0;
+        else
+            compact_pending = 0;
+
+        goto done;
+    }
+
+    // Nothing to move, look for a block that can be released
+    for (i = 0; i < table_entries; i++)
+    {
+        uint32_t block_number = (compact_cursor + i) % table_entries;
+
+        if (table[block_number] == 0xFFFFFFFF)
+            continue;
+
+        compact_cursor = block_number + 1;
+
+        if (physical_read(compact_buf, block_size,
+            (((off_t_64)ntohl(table[block_number])) << sector_shift) +
+            sector_size) != (safeio_ssize_t)block_size)
+        {
+            syslog(LOG_ERR, "VHD compaction: Error reading block: %m\n");
+            compact_pending = 0;
+            goto done;
+        }
+
+        if (ImDiskBufferIsZero(compact_buf, block_size))
+        {
+            dbglog((LOG_ERR, "VHD compaction: Releasing empty block "
+                "%u.\n", (unsigned int)block_number));
+
+            if (!vhd_set_block_entry(block_number, 0xFFFFFFFF))
+                compact_pending = 0;
+
+            compact_checked = 0;
+            goto done;
+        }
+
+        if (++compact_checked >= block_count)
+        {
+            printf("VHD compaction done. Image file size " SLL_FMT
+                " bytes.\n", (int64_t)vhd_file_size);
+            compact_pending = 0;
+        }
+
+        break;
+    }
+
+done:
+    free(table);
+    free(blocks);
+}
+
+// Starts over checking blocks after a write, which may have emptied blocks
+// or added blocks at end of file.
+void
+compact_restart()
+{
+    vhd_alloc_lock();
+
+    if (!compact_disabled)
+    {
+        compact_pending = 1;
+        compact_checked = 0;
+    }
+
+    vhd_alloc_unlock();
+}
+
+// Image data encrypted with XTS-AES, from --encrypt. Data units are
+// numbered from start of image file, so partition tables are encrypted too
+// and partitions can be selected as usual.
+const char *crypt_key_path = NULL;
+DEVIO_TLS PDEVCRYPT_XTS crypt_xts = NULL;
+DEVIO_TLS safeio_size_t crypt_unit_size = 0;
+
+// Buffer for partial data units, allocated for each thread when needed
+DEVIO_TLS char *crypt_buf = NULL;
+DEVIO_TLS safeio_size_t crypt_buf_size = 0;
+
+// Reads key and prepares encryption for the opened image. Data unit size
+// is logical sector size of block devices and sector_size otherwise.
+int
+crypt_open(const char *key_path)
+{
+    uint8_t key[65];
+    int key_fd;
+    safeio_ssize_t key_size;
+    int result;
+
+    if (vhd_mode)
+    {
+        fprintf(stderr, "Encryption is not supported for VHD image files.\n");
+        return 0;
+    }
+
+    crypt_unit_size = blkdev_sector_size != 0 ? blkdev_sector_size :
+        sector_size;
+
+    if (devio_info.file_size % crypt_unit_size != 0)
+    {
+        fprintf(stderr, "Image size is not a multiple of " SIZ_FMT
+            " bytes data units.\n", crypt_unit_size);
+        return 0;
+    }
+
+    key_fd = _open(key_path, O_BINARY | O_RDONLY);
+    if (key_fd == -1)
+    {
+        syslog(LOG_ERR, "Cannot open key file '%s': %m\n", key_path);
+        return 0;
+    }
+
+    key_size = pread(key_fd, key, sizeof(key), 0);
+    _close(key_fd);
+
+    crypt_xts = (PDEVCRYPT_XTS)malloc(sizeof(*crypt_xts));
+    if (crypt_xts == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    result = key_size > 0 &&
+        devcrypt_xts_init(crypt_xts, key, (size_t)key_size);
+
+    memset(key, 0, sizeof(key));
+
+    if (!result)
+    {
+        fprintf(stderr, "Key file '%s' needs 32 or 64 bytes of random data, "
+            "for XTS-AES-128 or XTS-AES-256.\n", key_path);
+        return 0;
+    }
+
+    // Ranges unmapped or zeroed by a block device would not read back as
+    // encrypted zeros
+    devio_info.flags &=
+        ~(IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ZERO);
+
+    printf("Encrypting with XTS-AES-%i in " SIZ_FMT " byte data units, "
+        "using %s.\n", (int)key_size * 4, crypt_unit_size,
+        devcrypt_engine_name(crypt_xts->engine));
+
+    return 1;
+}
+
+// Makes sure that crypt_buf of this thread holds a data unit of the image
+// in use. Exports may have different data unit sizes.
+int
+crypt_buf_alloc()
+{
+    char *new_buf;
+
+    if (crypt_buf_size >= crypt_unit_size)
+        return 1;
+
+    new_buf = (char*)realloc(crypt_buf, crypt_unit_size);
+    if (new_buf == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
+    }
+
+    crypt_buf = new_buf;
+    crypt_buf_size = crypt_unit_size;
+
+    return 1;
+}
+
+// Reads and decrypts whole data units in place in io_ptr. Partial data
+// units at start or end of request are decrypted in crypt_buf.
+safeio_ssize_t
+crypt_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t done = 0;
+    safeio_ssize_t readdone = 0;
+
+    if (!crypt_buf_alloc())
+        return -1;
+
+    while (done < size)
+    {
+        off_t_64 position = offset + done;
+        safeio_size_t head = (safeio_size_t)(position % crypt_unit_size);
+        safeio_size_t chunk = size - done;
+
+        if (head != 0 || chunk < crypt_unit_size)
+        {
+            if (chunk > crypt_unit_size - head)
+                chunk = crypt_unit_size - head;
+
+            readdone = physical_read(crypt_buf, crypt_unit_size,
+                position - head);
+
+            if (readdone != (safeio_ssize_t)crypt_unit_size)
+                break;
+
+            devcrypt_xts_decrypt(crypt_xts, (uint8_t*)crypt_buf,
+                crypt_unit_size, 1, (position - head) / crypt_unit_size);
+
+            memcpy(io_ptr + done, crypt_buf + head, chunk);
+        }
+        else
+        {
+            readdone = physical_read(io_ptr + done,
+                chunk - chunk % crypt_unit_size, position);
+
+            if (readdone <= 0)
+                break;
+
+            chunk = (safeio_size_t)readdone -
+                (safeio_size_t)readdone % crypt_unit_size;
+
+            if (chunk == 0)
+                break;
+
+            devcrypt_xts_decrypt(crypt_xts, (uint8_t*)io_ptr + done,
+                crypt_unit_size, chunk / crypt_unit_size,
+                position / crypt_unit_size);
+        }
+
+        done += chunk;
+    }
+
+    if (done == 0 && readdone < 0)
+        return -1;
+
+    return done;
+}
+
+int
+crypt_write_all(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t done = 0;
+
+    while (done < size)
+    {
+        safeio_ssize_t writedone = physical_write(io_ptr + done, size - done,
+            offset + done);
+
+        if (writedone <= 0)
+            return 0;
+
+        done += (safeio_size_t)writedone;
+    }
+
+    return 1;
+}
+
+// Encrypts whole data units in place in io_ptr, so caller cannot use the
+// data after this call. Partial data units at start or end of request are
+// read, decrypted, updated and encrypted again in crypt_buf.
+safeio_ssize_t
+crypt_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    safeio_size_t done = 0;
+
+    if (!crypt_buf_alloc())
+        return -1;
+
+    while (done < size)
+    {
+        off_t_64 position = offset + done;
+        safeio_size_t head = (safeio_size_t)(position % crypt_unit_size);
+        safeio_size_t chunk = size - done;
+        uint64_t unit_number = (position - head) / crypt_unit_size;
+
+        if (head != 0 || chunk < crypt_unit_size)
+        {
+            if (chunk > crypt_unit_size - head)
+                chunk = crypt_unit_size - head;
+
+            if (physical_read(crypt_buf, crypt_unit_size, position - head) !=
+                (safeio_ssize_t)crypt_unit_size)
+                break;
+
+            devcrypt_xts_decrypt(crypt_xts, (uint8_t*)crypt_buf,
+                crypt_unit_size, 1, unit_number);
+
+            memcpy(crypt_buf + head, io_ptr + done, chunk);
+
+            devcrypt_xts_encrypt(crypt_xts, (uint8_t*)crypt_buf,
+                crypt_unit_size, 1, unit_number);
+
+            if (!crypt_write_all(crypt_buf, crypt_unit_size, position - head))
+                break;
+        }
+        else
+        {
+            chunk -= chunk % crypt_unit_size;
+
+            devcrypt_xts_encrypt(crypt_xts, (uint8_t*)io_ptr + done,
+                crypt_unit_size, chunk / crypt_unit_size, unit_number);
+
+            if (!crypt_write_all(io_ptr + done, chunk, position))
+                break;
+        }
+
+        done += chunk;
+    }
+
+    if (done == 0 && size > 0)
+        return -1;
+
+    return done;
+}
+
+safeio_ssize_t
+logical_read(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (crypt_xts != NULL)
+        return crypt_read(io_ptr, size, offset);
+    else if (vhd_mode)
+        return vhd_read(io_ptr, size, offset);
+    else
+        return physical_read(io_ptr, size, offset);
+}
+
+safeio_ssize_t
+logical_write(char *io_ptr, safeio_size_t size, off_t_64 offset)
+{
+    if (crypt_xts != NULL)
+        return crypt_write(io_ptr, size, offset);
+    else if (vhd_mode)
+        return vhd_write(io_ptr, size, offset);
+    else
+        return physical_write(io_ptr, size, offset);
+}
+
+// CRC-32 as used in GUID partition table headers. Only used for a few
+// kilobytes of partition table data at startup, so no lookup table.
+uint32_t
+gpt_crc32(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    int k;
+
+    while (size-- > 0)
+    {
+        crc ^= *data++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+// A GPT disk has an MBR with a single partition of type 0xEE covering the
+// disk, so that GPT unaware tools do not consider it unpartitioned.
+int
+mbr_is_protective(char *mbr)
+{
+    size_t i;
+
+    if ((*(u_char*)(mbr + 0x01FE) != 0x55) ||
+        (*(u_char*)(mbr + 0x01FF) != 0xAA))
+        return 0;
+
+    for (i = 0; i < 4; i++)
+        if (*(u_char*)(mbr + 512 - 66 + (i << 4) + 4) == 0xEE)
+            return 1;
+
+    return 0;
+}
+
+// Reads a GPT header at lba and the partition entry array it points to.
+// Both checksums are verified. Returns the entry array in a malloc'ed
+// buffer, or NULL if there is no valid table at lba.
+uint8_t *
+gpt_read_table(off_t_64 lba, safeio_size_t lba_size,
+    uint32_t *entry_count, uint32_t *entry_size)
+{
+    uint8_t header[4096];
+    uint32_t header_size;
+    uint32_t header_crc;
+    uint64_t entries_lba;
+    safeio_size_t table_size;
+    uint8_t *entries;
+
+    if (logical_read((char*)header, lba_size, lba * lba_size) !=
+        (safeio_ssize_t)lba_size ||
+        memcmp(header, "EFI PART", 8) != 0)
+        return NULL;
+
+    header_size = GetLittleEndian32U(header + 12);
+    header_crc = GetLittleEndian32U(header + 16);
+
+    if (header_size < 92 || header_size > lba_size)
+        return NULL;
+
+    memset(header + 16, 0, 4);
+
+    if (gpt_crc32(header, header_size) != header_crc)
+    {
+        printf("GPT header checksum error at sector " SLL_FMT ".\n",
+            (int64_t)lba);
+        return NULL;
+    }
+
+    entries_lba = GetLittleEndian64U(header + 72);
+    *entry_count = GetLittleEndian32U(header + 80);
+    *entry_size = GetLittleEndian32U(header + 84);
+
+    if (GetLittleEndian64U(header + 24) != (uint64_t)lba ||
+        entries_lba >= ((uint64_t)1 << 63) / lba_size ||
+        *entry_size < 128 || *entry_size > 4096 || (*entry_size & 7) != 0 ||
+        *entry_count == 0 || *entry_count > (1 << 20) / *entry_size)
+    {
+        printf("Invalid GPT header at sector " SLL_FMT ".\n", (int64_t)lba);
+        return NULL;
+    }
+
+    table_size = *entry_count * *entry_size;
+
+    entries = (uint8_t*)malloc(table_size);
+    if (entries == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return NULL;
+    }
+
+    if (logical_read((char*)entries, table_size,
+        (off_t_64)(entries_lba * lba_size)) != (safeio_ssize_t)table_size ||
+        gpt_crc32(entries, table_size) != GetLittleEndian32U(header + 88))
+    {
+        printf("GPT partition entry array checksum error at sector " SLL_FMT
+            ".\n", (int64_t)entries_lba);
+        free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
+
+// Selects partition_number from a GUID partition table. Unused entries are
+// skipped, so partitions are numbered in entry array order the same way as
+// MBR partitions. The backup table at the end of the image is used if the
+// primary one is damaged. Returns 1 if image_offset and file_size were set.
+int
+gpt_select_partition(int partition_number)
+{
+    static const safeio_size_t lba_sizes[] = { 512, 4096 };
+    safeio_size_t lba_size = 0;
+    uint8_t *entries = NULL;
+    uint32_t entry_count = 0;
+    uint32_t entry_size = 0;
+    uint32_t i;
+    int c = 0;
+    int found = 0;
+
+    for (i = 0; entries == NULL && i < 2; i++)
+    {
+        lba_size = lba_sizes[i];
+
+        entries = gpt_read_table(1, lba_size, &entry_count, &entry_size);
+
+        if (entries == NULL && current_size >= (off_t_64)lba_size * 2)
+        {
+            entries = gpt_read_table(current_size / lba_size - 1, lba_size,
+                &entry_count, &entry_size);
+
+            if (entries != NULL)
+                puts("Using backup GPT at end of image.");
+        }
+    }
+
+    if (entries == NULL)
+    {
+        syslog(LOG_ERR, "No valid GUID partition table found.\n");
+        return 0;
+    }
+
+    printf("Detected a GUID partition table with %u entries, %u bytes per "
+        "sector.\n", (unsigned int)entry_count, (unsigned int)lba_size);
+
+    for (i = 0; i < entry_count; i++)
+    {
+        uint8_t *entry = entries + (size_t)i * entry_size;
+        uint64_t first_lba;
+        uint64_t last_lba;
+        int k;
+
+        for (k = 0; k < 16 && entry[k] == 0; k++);
+
+        if (k == 16)
+            continue;
+
+        if (++c != partition_number)
+            continue;
+
+        first_lba = GetLittleEndian64U(entry + 32);
+        last_lba = GetLittleEndian64U(entry + 40);
+
+        if (first_lba > last_lba ||
+            last_lba >= ((uint64_t)1 << 63) / lba_size)
+            break;
+
+        image_offset = (off_t_64)(first_lba * lba_size);
+        devio_info.file_size = (last_lba - first_lba + 1) * lba_size;
+        found = 1;
+
+        break;
+    }
+
+    free(entries);
+
+    return found;
+}
+
+int
+read_data()
+{
+    IMDPROXY_READ_REQ req_block = { 0 };
+    IMDPROXY_READ_RESP resp_block = { 0 };
+    ULONGLONG valid_length;
+    safeio_size_t size;
+    safeio_ssize_t readdone;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    trace_record(IMDPROXY_REQ_READ, req_block.offset, req_block.length, NULL);
+
+    qos_throttle(req_block.length);
+
+    if (!check_request_range(req_block.offset, req_block.length,
+        &valid_length))
+    {
+        syslog(LOG_ERR, "Read request at " ULL_FMT " outside image.\n",
+            req_block.offset);
+
+        errno = EINVAL;
+        readdone = -1;
+        size = 0;
+    }
+    else
+    {
+        if (valid_length > buffer_size) // we will need larger buffer to complete this request
+        {
+            buf_realloc(valid_length);
+        }
+
+        // Larger requests than we can buffer are completed partially. The
+        // client then asks for the rest in another request. Tagged requests
+        // cannot be completed partially, so they fail instead.
+        size = (safeio_size_t)
+            (valid_length < buffer_size ? valid_length : buffer_size);
+
+        if (tagged_io && size < valid_length)
+        {
+            syslog(LOG_ERR, "Too big block read requested: " ULL_FMT " bytes.\n",
+                req_block.length);
+
+            errno = EFBIG;
+            readdone = -1;
+            size = 0;
+        }
+        else
+        {
+            dbglog((LOG_ERR, "read request " ULL_FMT " bytes at " ULL_FMT " + "
+                ULL_FMT " = " ULL_FMT ".\n",
+                req_block.length, req_block.offset, image_offset,
+                req_block.offset + image_offset));
+
+            memset(buf, 0, size);
+
+            readdone =
+                logical_read(buf, (safeio_size_t)size, (off_t_64)(image_offset + req_block.offset));
+        }
+    }
+
+    if (readdone == -1)
+    {
+        resp_block.errorno = errno;
+        resp_block.length = 0;
+        syslog(LOG_ERR, "Device read: %m\n");
+    }
+    else
+    {
+        resp_block.errorno = 0;
+        resp_block.length = size;
+
+        if (req_block.length != readdone)
+        {
+            syslog(LOG_ERR,
+                "Partial read at " SLL_FMT ": Got " SLL_FMT ", req " ULL_FMT ".\n",
+                (int64_t)(image_offset + req_block.offset), (int64_t)readdone, req_block.length);
+        }
+    }
+
+    dbglog((LOG_ERR, "read done reporting/sending " ULL_FMT " bytes.\n",
+        resp_block.length));
+
+    if (!send_response(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
+    }
+
+    if (resp_block.errorno == 0)
+        if (!comm_write(buf, (safeio_size_t)resp_block.length))
+        {
+            syslog(LOG_ERR, "Error sending read response to caller.\n");
+            return 0;
+        }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+write_data()
+{
+    IMDPROXY_WRITE_REQ req_block = { 0 };
+    IMDPROXY_WRITE_RESP resp_block = { 0 };
+    ULONGLONG valid_length;
+
+    if (!comm_read(&req_block.offset,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+        return 0;
+
+    qos_throttle(req_block.length);
+
+    dbglog((LOG_ERR, "write request " ULL_FMT " bytes at " ULL_FMT " + "
+        ULL_FMT " = " ULL_FMT ".\n",
+        req_block.length, req_block.offset, image_offset,
+        req_block.offset + image_offset));
+
+    if (req_block.length > buffer_size)
+    {
+        buf_realloc(req_block.length);
+    }
+
+    if (req_block.length > buffer_size)
+    {
+        // Skip the data so that the connection can be used for further
+        // requests, and fail this one.
+        if (!comm_discard(req_block.length))
+        {
+            syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+            return 0;
+        }
+
+        trace_record(IMDPROXY_REQ_WRITE, req_block.offset, req_block.length,
+            NULL);
+    }
+    else
+    {
+        if (!comm_read(buf, (safeio_size_t)req_block.length))
+        {
+            syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+            return 0;
+        }
+
+        trace_record(IMDPROXY_REQ_WRITE, req_block.offset, req_block.length,
+            buf);
+    }
+
+    if (req_block.length > buffer_size)
+    {
+        syslog(LOG_ERR, "Too big block write requested: " ULL_FMT " bytes.\n",
+            req_block.length);
+
+        resp_block.errorno = EFBIG;
+        resp_block.length = 0;
+    }
+    else if (!check_request_range(req_block.offset, req_block.length,
+        &valid_length) || valid_length != req_block.length)
+    {
+        syslog(LOG_ERR, "Write request at " ULL_FMT " outside image.\n",
+            req_block.offset);
+
+        resp_block.errorno = EINVAL;
+        resp_block.length = 0;
+    }
+    else if (devio_info.flags & IMDPROXY_FLAG_RO)
+    {
+        resp_block.errorno = EBADF;
+        resp_block.length = 0;
+        syslog(LOG_ERR, "Device write attempt on read-only device.\n");
+    }
+    else if (!cbt_mark(req_block.offset, req_block.length))
+    {
+        resp_block.errorno = EIO;
+        resp_block.length = 0;
+    }
+    else
+    {
+        safeio_ssize_t writedone = logical_write(buf, (safeio_size_t)req_block.length,
+            (off_t_64)(image_offset + req_block.offset));
+        if (compact_mode)
+            compact_restart();
+
+        if (writedone == -1)
+        {
+            resp_block.errorno = errno;
+            resp_block.length = writedone;
+#ifdef _WIN32
+            perror("Device write");
+#else
+            syslog(LOG_ERR, "Device write: %m\n");
+#endif
+        }
+        else
+        {
+            resp_block.errorno = 0;
+            resp_block.length = writedone;
+        }
+
+        if (req_block.length != resp_block.length)
+        {
+            if (writedone < 0)
+            {
+                syslog(LOG_ERR, "Write error (code " ULL_FMT ") at " ULL_FMT ": Req " ULL_FMT ".\n",
+                    resp_block.errorno, image_offset + req_block.offset, req_block.length);
+            }
+            else
+            {
+                syslog(LOG_ERR, "Partial write at " ULL_FMT ": Got " ULL_FMT ", req " ULL_FMT ".\n",
+                    image_offset + req_block.offset, resp_block.length, req_block.length);
+            }
+        }
+
+        dbglog((LOG_ERR, "write done reporting/sending " ULL_FMT " bytes.\n",
+            resp_block.length));
+    }
+
+    if (!send_response(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Error sending write response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Unmap and zero requests carry an array of ranges. They are only supported
+// for block devices, where they map to native discard and write zeroes.
+int
+unmap_or_zero(ULONGLONG request_code)
+{
+    IMDPROXY_UNMAP_REQ req_block = { 0 };
+    IMDPROXY_UNMAP_RESP resp_block = { 0 };
+    ULONGLONG flag = request_code == IMDPROXY_REQ_UNMAP ?
+        IMDPROXY_FLAG_SUPPORTS_UNMAP : IMDPROXY_FLAG_SUPPORTS_ZERO;
+
+    if (!comm_read(&req_block.length,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    trace_record(request_code, 0, 0, NULL);
+
+    qos_throttle(0);
+
+    if (req_block.length > buffer_size)
+    {
+        buf_realloc(req_block.length);
+    }
+
+    if (req_block.length > buffer_size)
+    {
+        if (!comm_discard(req_block.length))
+        {
+            syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+            return 0;
+        }
+
+        resp_block.errorno = EFBIG;
+    }
+    else if (!comm_read(buf, (safeio_size_t)req_block.length))
+    {
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+
+        return 0;
+    }
+    else if ((devio_info.flags & flag) == 0)
+    {
+        resp_block.errorno = ENODEV;
+    }
+    else if (req_block.length % sizeof(IMDPROXY_DATA_RANGE) != 0)
+    {
+        resp_block.errorno = EINVAL;
+    }
+    else
+    {
+        PIMDPROXY_DATA_RANGE ranges = (PIMDPROXY_DATA_RANGE)buf;
+        size_t count = (size_t)(req_block.length / sizeof(*ranges));
+        size_t i;
+
+        for (i = 0; i < count; i++)
+        {
+            ULONGLONG valid_length;
+
+            if (ranges[i].length == 0)
+                continue;
+
+            if (!check_request_range(ranges[i].offset, ranges[i].length,
+                &valid_length) || valid_length != ranges[i].length)
+            {
+                resp_block.errorno = EINVAL;
+                break;
+            }
+
+            if (!cbt_mark(ranges[i].offset, ranges[i].length))
+            {
+                resp_block.errorno = EIO;
+                break;
+            }
+
+#ifdef __linux__
+            if (!blkdev_unmap_or_zero(request_code,
+                image_offset + (off_t_64)ranges[i].offset, ranges[i].length))
+            {
+                resp_block.errorno = errno;
+                syslog(LOG_ERR, "Unmap/zero at " ULL_FMT ": %m\n",
+                    image_offset + ranges[i].offset);
+                break;
+            }
+#endif
+        }
+    }
+
+    if (!send_response(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Error sending unmap/zero response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Serves the read, write, unmap or zero request that follows a tagged
+// request header, and sends the tag with the response header.
+int
+tagged_serve(ULONGLONG io_tag, ULONGLONG req)
+{
+    int result;
+
+    tagged_resp.io_tag = io_tag;
+    tagged_io = 1;
+
+    switch (req)
+    {
+    case IMDPROXY_REQ_READ:
+        result = read_data();
+        break;
+
+    case IMDPROXY_REQ_WRITE:
+        result = write_data();
+        break;
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        result = unmap_or_zero(req);
+        break;
+
+    default:
+        // Other requests cannot be tagged. Data that might follow an
+        // unknown request cannot be skipped, so the connection is closed.
+        syslog(LOG_ERR, "Request " ULL_FMT " cannot be tagged.\n", req);
+        result = 0;
+    }
+
+    tagged_io = 0;
+
+    return result;
+}
+
+int
+do_comm(char *comm_device);
+
+// Opens image given as argv[2], detects VHD format, size and partitions and
+// sets alignment and buffer size from remaining command line arguments.
+// Returns 0 on success or an exit code for devio.
+int
+open_image(int argc, char **argv)
+{
+    safeio_ssize_t readdone;
+    int partition_number = 0;
+    char mbr[512];
+
+    if (dll_mode)
+    {
+        if (devio_info.flags & IMDPROXY_FLAG_RO)
+            libhandle = dll_open(argv[2], 1, &dll_read, &dll_write, &dll_close,
+            (off_t_64*)&devio_info.file_size);
+        else
+            libhandle = dll_open(argv[2], 0, &dll_read, &dll_write, &dll_close,
+            (off_t_64*)&devio_info.file_size);
+
+        if (libhandle == NULL)
+        {
+            syslog(LOG_ERR, "Library call failed to open '%s': %m\n", argv[2]);
+            return 1;
+        }
+    }
+    else
+    {
+        if (devio_info.flags & IMDPROXY_FLAG_RO)
+            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDONLY);
+        else
+            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDWR);
+
+        if (image_fd == -1)
+        {
+            syslog(LOG_ERR, "Failed to open '%s': %m\n", argv[2]);
+            return 1;
+        }
+    }
+
+    printf("Successfully opened '%s'.\n", argv[2]);
+
+    nbd_export_name = argv[2];
+
+    // Autodetect Microsoft .vhd files
+    readdone = physical_read(&vhd_info, (safeio_size_t) sizeof(vhd_info), 0);
+
+    if (auto_vhd_detect &&
+        (readdone == sizeof(vhd_info)) &&
+        (strncmp((char*)vhd_info.Header.Cookie, "cxsparse", 8) == 0) &&
+        (strncmp((char*)vhd_info.Footer.Cookie, "conectix", 8) == 0) &&
+        vhd_info.Footer.DiskType == 0x03000000UL)
+    {
+        void *geometry = &vhd_info.Footer.DiskGeometry;
+
+        // VHD I/O uses a secondary buffer
+        if (buf2 == NULL)
+            buf2 = (char*)malloc(buffer_size);
+        if (buf2 == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 2;
+        }
+
+        puts("Detected dynamically expanding Microsoft VHD image file format.");
+
+        // Calculate vhd shifts
+        current_size = GetBigEndian64(vhd_info.Footer.CurrentSize);
+        table_offset = GetBigEndian64(vhd_info.Header.TableOffset);
+
+        sector_size = 512;
+
+        block_size = ntohl(vhd_info.Header.BlockSize);
+        table_entries = ntohl(vhd_info.Header.MaxTableEntries);
+
+        for (block_shift = 0;
+            (block_shift < 31) &&
+            ((((safeio_size_t)1) << block_shift) != block_size);
+        block_shift++);
+
+        if (!dll_mode)
+        {
+            vhd_file_size = _lseeki64(image_fd, 0, SEEK_END);
+        }
+
+        if ((((safeio_size_t)1) << block_shift) != block_size ||
+            block_size < sector_size ||
+            table_offset < (off_t_64)sizeof(vhd_info) ||
+            current_size < 0 ||
+            ((off_t_64)table_entries << block_shift) < current_size ||
+            (vhd_file_size > 0 &&
+                table_offset + ((off_t_64)table_entries << 2) > vhd_file_size))
+        {
+            syslog(LOG_ERR, "Invalid VHD header or footer.\n");
+            return 1;
+        }
+
+        devio_info.file_size = current_size;
+
+        vhd_mode = 1;
+
+        printf("VHD block size: %u bytes. C/H/S geometry: %u/%u/%u.\n",
+            (unsigned int)block_size,
+            (unsigned int)ntohs(*(u_short*)geometry),
+            (unsigned int)((u_char*)geometry)[2],
+            (unsigned int)((u_char*)geometry)[3]);
+    }
+
+    for (sector_shift = 0;
+        (sector_shift < 64) &&
+        ((((safeio_size_t)1) << sector_shift) != sector_size);
+        sector_shift++);
+
+    if (argc > 3)
+    {
+        ULONGLONG spec_size = 0;
+        char suf = 0;
+
+        if (sscanf(argv[3], ULL_FMT "%c", &spec_size, &suf) == 2)
+        {
+            switch (suf)
+            {
+            case 'T':
+                spec_size <<= 10;
+            case 'G':
+                spec_size <<= 10;
+            case 'M':
+                spec_size <<= 10;
+            case 'K':
+                spec_size <<= 10;
+            case 'B':
+                break;
+            case 't':
+                spec_size *= 1000;
+            case 'g':
+                spec_size *= 1000;
+            case 'm':
+                spec_size *= 1000;
+            case 'k':
+                spec_size *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+
+            devio_info.file_size = spec_size;
+        }
+        else if (spec_size < 512)
+        {
+            partition_number = (int)spec_size;
+        }
+        else
+        {
+            devio_info.file_size = spec_size << 9;
+        }
+    }
+    else
+    {
+        partition_number = 1;
+    }
+
+#ifdef _WIN32
+
+    if (devio_info.file_size == 0)
+    {
+        if (dll_mode)
+            syslog(LOG_ERR, "DLL did not return size of image/partition.\n");
+        else
+        {
+            HANDLE h = (HANDLE)_get_osfhandle(image_fd);
+            BY_HANDLE_FILE_INFORMATION by_handle_file_info;
+
+            if ((!GetFileInformationByHandle(h, &by_handle_file_info) &&
+                (by_handle_file_info.nFileSizeLow = GetFileSize(h,
+                    &by_handle_file_info.nFileSizeHigh)) == INVALID_FILE_SIZE) &&
+                GetLastError() != NO_ERROR)
+            {
+                // If not regular disk file, try to lock volume using FSCTL operation.
+
+                DWORD dw;
+                FlushFileBuffers(h);
+                if (DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0,
+                    &dw, NULL))
+                {
+                    if (!DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL,
+                        0, &dw, NULL))
+                    {
+                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
+                            argv[2]);
+
+                        if (~devio_info.flags & IMDPROXY_FLAG_RO)
+                            return 9;
+                    }
+                }
+                else
+                {
+                    switch (GetLastError())
+                    {
+                    case ERROR_NOT_SUPPORTED:
+                    case ERROR_INVALID_FUNCTION:
+                    case ERROR_INVALID_HANDLE:
+                    case ERROR_INVALID_PARAMETER:
+                        break;
+
+                    default:
+                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
+                            argv[2]);
+
+                        if (~devio_info.flags & IMDPROXY_FLAG_RO)
+                            return 9;
+                    }
+                }
+
+                if (devio_info.file_size == 0)
+                {
+                    PARTITION_INFORMATION partition_info = { 0 };
+
+                    if (!DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0,
+                        &partition_info, sizeof(partition_info),
+                        &dw, NULL))
+                    {
+                        syslog(LOG_ERR,
+                            "Cannot determine size of disk volume.\n");
+                    }
+                    else
+                    {
+                        devio_info.file_size =
+                            partition_info.PartitionLength.QuadPart;
+                    }
+                }
+            }
+            else
+            {
+                LARGE_INTEGER file_size = { 0 };
+                file_size.HighPart = by_handle_file_info.nFileSizeHigh;
+                file_size.LowPart = by_handle_file_info.nFileSizeLow;
+
+                devio_info.file_size = file_size.QuadPart;
+            }
+        }
+    }
+#else
+#ifdef __linux__
+    if (!dll_mode)
+        blkdev_probe();
+#endif
+
+    if (devio_info.file_size == 0)
+    {
+        struct stat file_stat = { 0 };
+        if (fstat(image_fd, &file_stat) == 0)
+            devio_info.file_size = file_stat.st_size;
+        else
+            syslog(LOG_ERR, "Cannot determine size of image/partition: %m\n");
+    }
+#endif
+
+    if (current_size == 0)
+        current_size = devio_info.file_size;
+
+    if (devio_info.file_size != 0)
+    {
+        printf("Image size used: " ULL_FMT " bytes.\n", devio_info.file_size);
+    }
+
+    if (crypt_key_path != NULL && !crypt_open(crypt_key_path))
+        return -1;
+
+    if (partition_number >= 1 && partition_number < 512)
+    {
+        if (logical_read(mbr, 512, 0) < 512)
+        {
+            syslog(LOG_ERR, "Error reading device: %m\n");
+        }
+        else if (mbr_is_protective(mbr))
+        {
+            puts("Detected a protective master boot record at sector 0.");
+
+            if (!gpt_select_partition(partition_number) ||
+                ((current_size != 0) &&
+                (image_offset + (off_t_64)devio_info.file_size > current_size)))
+            {
+                syslog(LOG_ERR,
+                    "Partition %i not found.\n", partition_number);
+                return 1;
+            }
+
+            printf("Using partition %i.\n", partition_number);
+        }
+        else if ((*(u_char*)(mbr + 0x01FE) == 0x55) &&
+            (*(u_char*)(mbr + 0x01FF) == 0xAA) &&
+            ((*(u_char*)(mbr + 0x01BE) & 0x7F) == 0) &&
+            ((*(u_char*)(mbr + 0x01CE) & 0x7F) == 0) &&
+            ((*(u_char*)(mbr + 0x01DE) & 0x7F) == 0) &&
+            ((*(u_char*)(mbr + 0x01EE) & 0x7F) == 0))
+        {
+            size_t i = 0;
+            int c = 0;
+
+            puts("Detected a master boot record at sector 0.");
+
+            image_offset = 0;
+
+            for (i = 0; i < 4; i++)
+            {
+                char type = *(mbr + 512 - 66 + (i << 4) + 4);
+
+                if (type == 0)
+                {
+                    continue;
+                }
+
+                if (type == 0x05 || type == 0x0F)
+                {
+                    char read_next_ebr = TRUE;
+
+                    off_t_64 first_ebr_offset =
+                        ((off_t_64)GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 8))
+                        << sector_shift;
+
+                    image_offset = first_ebr_offset;
+
+                    while (read_next_ebr)
+                    {
+                        char ebr[512];
+                        size_t e;
+
+                        read_next_ebr = FALSE;
+
+                        printf("Reading extended partition table at " SLL_FMT
+                            ".\n", (int64_t)image_offset);
+
+                        if (logical_read(ebr, 512, image_offset) == 512 &&
+                            (*(u_char*)(ebr + 0x01FE) == 0x55) &&
+                            (*(u_char*)(ebr + 0x01FF) == 0xAA) &&
+                            ((*(u_char*)(ebr + 0x01BE) & 0x7F) == 0) &&
+                            ((*(u_char*)(ebr + 0x01CE) & 0x7F) == 0) &&
+                            ((*(u_char*)(ebr + 0x01DE) & 0x7F) == 0) &&
+                            ((*(u_char*)(ebr + 0x01EE) & 0x7F) == 0))
+                        {
+                            puts("Found valid extended partition table.");
+                        }
+                        else
+                        {
+                            puts("Invalid extended partition table.");
+                            break;
+                        }
+
+                        for (e = 0; e < 4; e++)
+                        {
+                            type = *(ebr + 512 - 66 + (e << 4) + 4);
+
+                            if (type == 0)
+                            {
+                                continue;
+                            }
+
+                            if (type == 0x05 || type == 0x0F)
+                            {
+                                image_offset =
+                                    first_ebr_offset + (((off_t_64)
+                                        GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 8)) << sector_shift);
+
+                                read_next_ebr = TRUE;
+
+                                break;
+                            }
+
+                            ++c;
+
+                            if (c == partition_number)
+                            {
+                                image_offset += ((off_t_64)
+                                    GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 8))
+                                    << sector_shift;
+                                devio_info.file_size = ((off_t_64)
+                                    GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 12))
+                                    << sector_shift;
+
+                                break;
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    ++c;
+
+                    if (c == partition_number)
+                    {
+                        image_offset = ((off_t_64)
+                            GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 8))
+                            << sector_shift;
+                        devio_info.file_size = ((off_t_64)
+                            GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 12))
+                            << sector_shift;
+
+                        break;
+                    }
+                }
+            }
+
+            if ((devio_info.file_size == 0) ||
+                ((current_size != 0) &&
+                (image_offset + (off_t_64)devio_info.file_size > current_size)))
+            {
+                syslog(LOG_ERR,
+                    "Partition %i not found.\n", partition_number);
+                return 1;
+            }
+
+            printf("Using partition %i.\n", partition_number);
+        }
+        else
+            puts("No master boot record detected. Using entire image.");
+    }
+
+    if (image_offset == 0 && argc > 4)
+    {
+        int64_t offset64 = image_offset;
+
+        char suf = 0;
+        if (sscanf(argv[4], SLL_FMT "%c", &offset64, &suf) == 2)
+            switch (suf)
+            {
+            case 'T':
+                offset64 <<= 10;
+            case 'G':
+                offset64 <<= 10;
+            case 'M':
+                offset64 <<= 10;
+            case 'K':
+                offset64 <<= 10;
+            case 'B':
+                break;
+            case 't':
+                offset64 *= 1000;
+            case 'g':
+                offset64 *= 1000;
+            case 'm':
+                offset64 *= 1000;
+            case 'k':
+                offset64 *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+        else
+            offset64 <<= 9;
+
+        if ((((int64_t)(-1) - (off_t_64)(-1)) & offset64) != 0)
+        {
+            syslog(LOG_ERR, "Offset too big for this system.\n");
+        }
+
+        image_offset = (off_t_64)offset64;
+
+        argc--;
+        argv++;
+    }
+
+    if (argc > 4)
+    {
+        if (sscanf(argv[4], ULL_FMT, &devio_info.req_alignment) != 1)
+        {
+            syslog(LOG_ERR, "Invalid alignment specification: '%s'\n",
+                argv[4]);
+
+            return -1;
+        }
+    }
+    else if (blkdev_alignment != 0)
+    {
+        devio_info.req_alignment = blkdev_alignment;
+    }
+    else if (crypt_xts != NULL)
+    {
+        // Avoids reading and encrypting again partial data units
+        devio_info.req_alignment = crypt_unit_size;
+    }
+    else
+    {
+        devio_info.req_alignment = DEF_REQUIRED_ALIGNMENT;
+    }
+
+    if (argc > 5)
+    {
+        char suf = 0;
+        if (sscanf(argv[5], SIZ_FMT "%c", &buffer_size, &suf) == 2)
+        {
+            switch (suf)
+            {
+            case 'T':
+                buffer_size <<= 10;
+            case 'G':
+                buffer_size <<= 10;
+            case 'M':
+                buffer_size <<= 10;
+            case 'K':
+                buffer_size <<= 10;
+            case 'B':
+                break;
+            case 't':
+                buffer_size *= 1000;
+            case 'g':
+                buffer_size *= 1000;
+            case 'm':
+                buffer_size *= 1000;
+            case 'k':
+                buffer_size *= 1000;
+            case 'b':
+                break;
+            default:
+                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
+            }
+        }
+
+        /*
+        buffer_size = 0;
+        sscanf(argv[5], "%u", &buffer_size);
+        */
+
+        if (buffer_size > max_buffer_size)
+            max_buffer_size = buffer_size;
+    }
+
+    printf("Total size: " SLL_FMT " bytes. Using " ULL_FMT " bytes from offset "
+        SLL_FMT ".\n"
+        "Required alignment: " ULL_FMT " bytes.\n"
+        "Buffer size: " SIZ_FMT " bytes.\n",
+        (int64_t)current_size,
+        devio_info.file_size,
+        (int64_t)image_offset,
+        devio_info.req_alignment,
+        buffer_size);
+
+    return 0;
+}
+
+// CPU and NUMA affinity for threads serving requests, from --cpus and
+// --numa or cpus= and numa= export settings. On Linux, each connection
+// thread binds itself when it selects an export, and tagged workers it
+// starts after that inherit the binding. --cpus and --numa without an
+// export list bind the main thread before it accepts connections, so
+// connection threads start with that binding. The listening thread never
+// takes the binding of an export. On Windows, the whole process is bound.
+// Buffers are allocated before affinity is set, but pages are not touched
+// until first request, so they are allocated on the node of the selected
+// processors. On Linux, memory allocation of the bound thread also prefers
+// the selected node.
+
+#ifdef _WIN32
+typedef DWORD_PTR affinity_word_t;
+#else
+typedef unsigned long affinity_word_t;
+#endif
+
+#define AFFINITY_MAX_CPUS 1024
+#define AFFINITY_WORD_BITS (8 * sizeof(affinity_word_t))
+#define AFFINITY_NUMA_NONE -1
+#define AFFINITY_NUMA_AUTO -2
+
+typedef struct _DEVIO_AFFINITY
+{
+    int numa_node;
+    int has_cpus;
+    affinity_word_t cpus[AFFINITY_MAX_CPUS / (8 * sizeof(affinity_word_t))];
+} DEVIO_AFFINITY, *PDEVIO_AFFINITY;
+
+DEVIO_AFFINITY affinity = { AFFINITY_NUMA_NONE };
+
+// Parses a list of processor numbers and ranges, such as 0-7,16-23, as used
+// on command line and in /sys/devices/system/node.
+int
+affinity_parse_cpus(affinity_word_t *cpus, const char *list)
+{
+    memset(cpus, 0, sizeof(affinity.cpus));
+
+    while (*list != 0 && *list != '\n')
+    {
+        char *end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+
+        if (end == list)
+            return 0;
+
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list)
+                return 0;
+        }
+
+        if (first > last || last >= AFFINITY_MAX_CPUS)
+            return 0;
+
+        for (; first <= last; first++)
+            cpus[first / AFFINITY_WORD_BITS] |=
+                (affinity_word_t)1 << (first % AFFINITY_WORD_BITS);
+
+        list = end;
+        if (*list == ',')
+            list++;
+        else if (*list != 0 && *list != '\n')
+            return 0;
+    }
+
+    return 1;
+}
+
+// Parses cpus=list or numa=node|auto. Returns 0 if setting is unknown or
+// invalid.
+int
+affinity_setting(PDEVIO_AFFINITY aff, const char *setting)
+{
+    if (_strnicmp(setting, "cpus=", 5) == 0)
+    {
+        if (!affinity_parse_cpus(aff->cpus, setting + 5))
+            return 0;
+
+        aff->has_cpus = 1;
+        return 1;
+    }
+    else if (_strnicmp(setting, "numa=", 5) == 0)
+    {
+        char *end;
+
+        if (_stricmp(setting + 5, "auto") == 0)
+        {
+            aff->numa_node = AFFINITY_NUMA_AUTO;
+            return 1;
+        }
+
+        aff->numa_node = (int)strtoul(setting + 5, &end, 10);
+        return end != setting + 5 && *end == 0 && aff->numa_node >= 0;
+    }
+    else
+        return 0;
+}
+
+// Gets processors on a NUMA node.
+int
+affinity_node_cpus(int node, affinity_word_t *cpus)
+{
+#if defined(__linux__)
+    char path[64];
+    char list[4096];
+    FILE *list_file;
+    int result;
+
+    sprintf(path, "/sys/devices/system/node/node%i/cpulist", node);
+
+    list_file = fopen(path, "r");
+    if (list_file == NULL)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", path);
+        return 0;
+    }
+
+    result = fgets(list, sizeof(list), list_file) != NULL &&
+        affinity_parse_cpus(cpus, list);
+
+    fclose(list_file);
+
+    if (!result)
+        syslog(LOG_ERR, "Cannot read processors of NUMA node %i.\n", node);
+
+    return result;
+#elif defined(_WIN32)
+    ULONGLONG mask;
+
+    memset(cpus, 0, sizeof(affinity.cpus));
+
+    if (node > 255 || !GetNumaNodeProcessorMask((UCHAR)node, &mask))
+    {
+        syslog(LOG_ERR, "Cannot get processors of NUMA node %i: %m\n", node);
+        return 0;
+    }
+
+    cpus[0] = (affinity_word_t)mask;
+    return 1;
+#else
+    syslog(LOG_ERR, "NUMA affinity not supported on this platform.\n");
+    return 0;
+#endif
+}
+
+// Finds NUMA node of the device that holds the opened image, such as the
+// node of an NVMe controller, by searching sysfs from the block device
+// towards the root of the device tree. Image files use the device of their
+// file system. Returns AFFINITY_NUMA_NONE if not found.
+int
+affinity_image_node()
+{
+#ifdef __linux__
+    struct stat file_stat;
+    dev_t dev;
+    char path[PATH_MAX + 16];
+    char device_path[PATH_MAX];
+    char *last;
+
+    if (dll_mode || fstat(image_fd, &file_stat) != 0)
+        return AFFINITY_NUMA_NONE;
+
+    dev = S_ISBLK(file_stat.st_mode) ? file_stat.st_rdev : file_stat.st_dev;
+
+    sprintf(path, "/sys/dev/block/%u:%u", major(dev), minor(dev));
+
+    if (realpath(path, device_path) == NULL)
+        return AFFINITY_NUMA_NONE;
+
+    while ((last = strrchr(device_path, '/')) != NULL &&
+        last - device_path > (ptrdiff_t)strlen("/sys/devices"))
+    {
+        FILE *node_file;
+        int node = AFFINITY_NUMA_NONE;
+
+        sprintf(path, "%s/numa_node", device_path);
+
+        node_file = fopen(path, "r");
+        if (node_file != NULL)
+        {
+            if (fscanf(node_file, "%i", &node) != 1)
+                node = AFFINITY_NUMA_NONE;
+
+            fclose(node_file);
+
+            // Devices without NUMA information report -1
+            if (node >= 0)
+                return node;
+        }
+
+        *last = 0;
+    }
+#endif
+
+    return AFFINITY_NUMA_NONE;
+}
+
+// Replaces numa=auto with node of opened image, if it can be found.
+void
+affinity_resolve(PDEVIO_AFFINITY aff)
+{
+    if (aff->numa_node != AFFINITY_NUMA_AUTO)
+        return;
+
+    aff->numa_node = affinity_image_node();
+
+    if (aff->numa_node == AFFINITY_NUMA_NONE)
+        printf("NUMA node of image device not found, not binding to a "
+            "node.\n");
+    else
+        printf("Image device is on NUMA node %i.\n", aff->numa_node);
+}
+
+int
+affinity_count(const affinity_word_t *cpus)
+{
+    int cpu_count = 0;
+    int i;
+
+    for (i = 0; i < AFFINITY_MAX_CPUS; i++)
+        if (cpus[i / AFFINITY_WORD_BITS] &
+            ((affinity_word_t)1 << (i % AFFINITY_WORD_BITS)))
+            cpu_count++;
+
+    return cpu_count;
+}
+
+// Binds the calling thread, or on Windows this process, to selected
+// processors, limited to processors on the selected NUMA node, and prefers
+// memory from that node for allocations of the calling thread.
+int
+affinity_apply(const DEVIO_AFFINITY *aff)
+{
+    affinity_word_t cpus[AFFINITY_MAX_CPUS / (8 * sizeof(affinity_word_t))];
+    int cpu_count;
+    int i;
+
+    if (aff->numa_node < 0 && !aff->has_cpus)
+        return 1;
+
+    if (aff->numa_node >= 0)
+    {
+        if (!affinity_node_cpus(aff->numa_node, cpus))
+            return 0;
+
+        if (aff->has_cpus)
+            for (i = 0; i < AFFINITY_MAX_CPUS / (int)AFFINITY_WORD_BITS; i++)
+                cpus[i] &= aff->cpus[i];
+    }
+    else
+        memcpy(cpus, aff->cpus, sizeof(cpus));
+
+    cpu_count = affinity_count(cpus);
+
+    if (cpu_count == 0)
+    {
+        syslog(LOG_ERR, "No processors selected by CPU and NUMA settings.\n");
+        return 0;
+    }
+
+#if defined(__linux__)
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus) == -1)
+    {
+        syslog(LOG_ERR, "Cannot set CPU affinity: %m\n");
+        return 0;
+    }
+
+    // Processors that do not exist are left out by the kernel
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(cpus), cpus) > 0)
+        cpu_count = affinity_count(cpus);
+
+    if (aff->numa_node >= 0)
+    {
+        unsigned long nodes[AFFINITY_MAX_CPUS / (8 * sizeof(unsigned long))] =
+        { 0 };
+
+        if (aff->numa_node >= AFFINITY_MAX_CPUS)
+            return 0;
+
+        nodes[aff->numa_node / (8 * sizeof(unsigned long))] =
+            1UL << (aff->numa_node % (8 * sizeof(unsigned long)));
+
+        // Memory from other nodes is still used if selected node is full
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes,
+            (unsigned long)AFFINITY_MAX_CPUS + 1) == -1)
+            syslog(LOG_ERR, "Cannot set NUMA memory policy: %m\n");
+    }
+#elif defined(_WIN32)
+    for (i = 1; i < AFFINITY_MAX_CPUS / (int)AFFINITY_WORD_BITS; i++)
+        if (cpus[i] != 0)
+        {
+            syslog(LOG_ERR, "Processor numbers above %i not supported.\n",
+                (int)AFFINITY_WORD_BITS - 1);
+            return 0;
+        }
+
+    if (!SetProcessAffinityMask(GetCurrentProcess(), cpus[0]))
+    {
+        syslog(LOG_ERR, "Cannot set CPU affinity: %m\n");
+        return 0;
+    }
+#else
+    syslog(LOG_ERR, "CPU affinity not supported on this platform.\n");
+    return 0;
+#endif
+
+    if (aff->numa_node >= 0)
+        printf("Bound to %i processors on NUMA node %i.\n", cpu_count,
+            aff->numa_node);
+    else
+        printf("Bound to %i processors.\n", cpu_count);
+
+    return 1;
+}
+
+// Named exports loaded with --exports. All images are opened once at
+// startup, and each connection is served by a thread. The backend keeps
+// image state in thread local globals, so a connection selects an export
+// by copying its state into them. State that changes while serving, the
+// end of VHD image files, is kept in the export and updated under its
+// allocation lock. Without an export list, image_export holds the image
+// given on command line for connection threads.
+
+typedef struct _DEVIO_EXPORT
+{
+    char *name;
+    int image_fd;
+    off_t_64 image_offset;
+    IMDPROXY_INFO_RESP info;
+    char vhd_mode;
+    struct _VHD_INFO vhd_info;
+    safeio_size_t block_size;
+    safeio_size_t sector_size;
+    off_t_64 table_offset;
+    uint32_t table_entries;
+    off_t_64 vhd_file_size;
+    int16_t block_shift;
+    int16_t sector_shift;
+    off_t_64 current_size;
+    char blkdev_mode;
+    safeio_size_t blkdev_sector_size;
+    safeio_size_t max_transfer_size;
+    PDEVCRYPT_XTS crypt_xts;
+    safeio_size_t crypt_unit_size;
+    DEVIO_QOS qos;
+    DEVIO_AFFINITY affinity;
+#ifndef _WIN32
+    pthread_mutex_t alloc_lock;
+#endif
+    int connections;
+} DEVIO_EXPORT, *PDEVIO_EXPORT;
+
+PDEVIO_EXPORT exports = NULL;
+int export_count = 0;
+DEVIO_EXPORT image_export = { 0 };
+DEVIO_TLS PDEVIO_EXPORT current_export = NULL;
+
+// Serializes VHD block allocation and compaction between connections to
+// the image used by this thread. Other I/O, including block table lookups,
+// is done with positional reads and writes without locking.
+void
+vhd_alloc_lock()
+{
+#ifndef _WIN32
+    if (current_export != NULL)
+        pthread_mutex_lock(&current_export->alloc_lock);
+#endif
+}
+
+void
+vhd_alloc_unlock()
+{
+#ifndef _WIN32
+    if (current_export != NULL)
+        pthread_mutex_unlock(&current_export->alloc_lock);
+#endif
+}
+
+// Sets size of VHD image file after blocks were added or removed, for this
+// thread and for other connections to the image. Called with allocation
+// lock held.
+void
+vhd_set_file_size(off_t_64 new_size)
+{
+    vhd_file_size = new_size;
+
+    if (current_export != NULL)
+        current_export->vhd_file_size = new_size;
+}
+
+// Gets size of VHD image file, with blocks added by other connections.
+void
+vhd_refresh_file_size()
+{
+    if (current_export == NULL)
+        return;
+
+    vhd_alloc_lock();
+    vhd_file_size = current_export->vhd_file_size;
+    vhd_alloc_unlock();
+}
+
+// Counts connections using an export. VHD compaction only runs while a
+// connection has the image to itself.
+void
+export_use(PDEVIO_EXPORT export_item, int count)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&export_item->alloc_lock);
+#endif
+
+    export_item->connections += count;
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&export_item->alloc_lock);
+#endif
+}
+
+void
+export_save(PDEVIO_EXPORT export_item)
+{
+    export_item->image_fd = image_fd;
+    export_item->image_offset = image_offset;
+    export_item->info = devio_info;
+    export_item->vhd_mode = vhd_mode;
+    export_item->vhd_info = vhd_info;
+    export_item->block_size = block_size;
+    export_item->sector_size = sector_size;
+    export_item->table_offset = table_offset;
+    export_item->table_entries = table_entries;
+    export_item->vhd_file_size = vhd_file_size;
+    export_item->block_shift = block_shift;
+    export_item->sector_shift = sector_shift;
+    export_item->current_size = current_size;
+    export_item->blkdev_mode = blkdev_mode;
+    export_item->blkdev_sector_size = blkdev_sector_size;
+    export_item->max_transfer_size = max_transfer_size;
+    export_item->crypt_xts = crypt_xts;
+    export_item->crypt_unit_size = crypt_unit_size;
+}
+
+// Copies export state into this thread. End of VHD image file changes when
+// other connections add blocks, so it is read under allocation lock.
+void
+export_load(PDEVIO_EXPORT export_item)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&export_item->alloc_lock);
+#endif
+
+    image_fd = export_item->image_fd;
+    image_offset = export_item->image_offset;
+    devio_info = export_item->info;
+    vhd_mode = export_item->vhd_mode;
+    vhd_info = export_item->vhd_info;
+    block_size = export_item->block_size;
+    sector_size = export_item->sector_size;
+    table_offset = export_item->table_offset;
+    table_entries = export_item->table_entries;
+    vhd_file_size = export_item->vhd_file_size;
+    block_shift = export_item->block_shift;
+    sector_shift = export_item->sector_shift;
+    current_size = export_item->current_size;
+    blkdev_mode = export_item->blkdev_mode;
+    blkdev_sector_size = export_item->blkdev_sector_size;
+    max_transfer_size = export_item->max_transfer_size;
+    crypt_xts = export_item->crypt_xts;
+    crypt_unit_size = export_item->crypt_unit_size;
+
+#ifndef _WIN32
+    pthread_mutex_unlock(&export_item->alloc_lock);
+#endif
+}
+
+void
+export_reset()
+{
+    image_fd = -1;
+    image_offset = 0;
+    memset(&devio_info, 0, sizeof(devio_info));
+    vhd_mode = 0;
+    auto_vhd_detect = 1;
+    memset(&vhd_info, 0, sizeof(vhd_info));
+    block_size = 0;
+    sector_size = 512;
+    table_offset = 0;
+    table_entries = 0;
+    vhd_file_size = 0;
+    block_shift = 0;
+    sector_shift = 0;
+    current_size = 0;
+    blkdev_mode = 0;
+    blkdev_sector_size = 0;
+    blkdev_alignment = 0;
+    max_transfer_size = 0;
+    crypt_key_path = NULL;
+    crypt_xts = NULL;
+    crypt_unit_size = 0;
+}
+
+// Reads export list file. Each line has an export name, an image path and
+// optional settings:
+//
+// ro               Read-only export.
+// novhd            Do not detect VHD format.
+// partition=n      Partition number, as on command line.
+// size=n           Size in blocks or with suffix, as on command line.
+// offset=n         Offset in blocks or with suffix, used with size=.
+// encrypt=path     Key file for XTS-AES encryption of image data.
+// iops=n           Requests per second for all connections to export.
+// bps=n            Bytes per second for all connections to export.
+// burst=ms         Burst allowance for iops= and bps=, as time at full rate.
+// weight=n         Share of --qos-total limits when several exports are
+//                  busy. Default is 1.
+// cpus=list        Processors for connections to export, as --cpus.
+// numa=node|auto   NUMA node for connections to export, as --numa.
+//
+// Empty lines and lines starting with # are ignored.
+int
+exports_load(const char *exports_path, int read_only)
+{
+    FILE *exports_file = fopen(exports_path, "r");
+    char line[1024];
+    int line_number = 0;
+
+    if (exports_file == NULL)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", exports_path);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), exports_file) != NULL)
+    {
+        char *export_argv[6] = { "devio", "", NULL, NULL, NULL, NULL };
+        int export_argc = 3;
+        char *partition = NULL;
+        char *size = NULL;
+        char *offset = "0";
+        char *name;
+        char *option;
+        DEVIO_QOS qos = { 0 };
+        DEVIO_AFFINITY export_affinity = affinity;
+        PDEVIO_EXPORT new_exports;
+        int i;
+
+        ++line_number;
+
+        name = strtok(line, " \t\r\n");
+        if (name == NULL || name[0] == '#')
+            continue;
+
+        export_argv[2] = strtok(NULL, " \t\r\n");
+        if (export_argv[2] == NULL)
+        {
+            syslog(LOG_ERR, "%s:%i: Missing image path.\n", exports_path,
+                line_number);
+            fclose(exports_file);
+            return 0;
+        }
+
+        for (i = 0; i < export_count; i++)
+            if (strcmp(exports[i].name, name) == 0)
+            {
+                syslog(LOG_ERR, "%s:%i: Duplicate export '%s'.\n",
+                    exports_path, line_number, name);
+                fclose(exports_file);
+                return 0;
+            }
+
+        export_reset();
+
+        if (read_only)
+            devio_info.flags |= IMDPROXY_FLAG_RO;
+
+        while ((option = strtok(NULL, " \t\r\n")) != NULL)
+        {
+            if (strcmp(option, "ro") == 0)
+                devio_info.flags |= IMDPROXY_FLAG_RO;
+            else if (strcmp(option, "novhd") == 0)
+                auto_vhd_detect = 0;
+            else if (strncmp(option, "partition=", 10) == 0)
+                partition = option + 10;
+            else if (strncmp(option, "size=", 5) == 0)
+                size = option + 5;
+            else if (strncmp(option, "offset=", 7) == 0)
+                offset = option + 7;
+            else if (strncmp(option, "encrypt=", 8) == 0)
+                crypt_key_path = option + 8;
+            else if (qos_setting(&qos, option))
+                continue;
+            else if (affinity_setting(&export_affinity, option))
+                continue;
+            else
+            {
+                syslog(LOG_ERR, "%s:%i: Unknown setting '%s'.\n",
+                    exports_path, line_number, option);
+                fclose(exports_file);
+                return 0;
+            }
+        }
+
+        if (size != NULL)
+        {
+            export_argv[export_argc++] = size;
+            export_argv[export_argc++] = offset;
+        }
+        else if (partition != NULL)
+        {
+            export_argv[export_argc++] = partition;
+        }
+
+        printf("Export '%s':\n", name);
+
+        if (open_image(export_argc, export_argv) != 0)
+        {
+            fclose(exports_file);
+            return 0;
+        }
+
+        affinity_resolve(&export_affinity);
+
+        new_exports = (PDEVIO_EXPORT)realloc(exports,
+            (export_count + 1) * sizeof(*exports));
+        if (new_exports == NULL || (name = strdup(name)) == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            fclose(exports_file);
+            return 0;
+        }
+
+        exports = new_exports;
+        exports[export_count].name = name;
+        export_save(&exports[export_count]);
+        exports[export_count].qos = qos;
+        exports[export_count].affinity = export_affinity;
+
+        if (qos.weight == 0)
+            exports[export_count].qos.weight = 1;
+        ++export_count;
+    }
+
+    fclose(exports_file);
+
+    if (export_count == 0)
+    {
+        syslog(LOG_ERR, "No exports in '%s'.\n", exports_path);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Selects export by name for this connection. An empty name or NULL selects
+// the first export. Returns 0 and sets errno if export is unknown.
+int
+export_select(const char *name)
+{
+    PDEVIO_EXPORT export_item = NULL;
+    int i;
+
+    // All export names refer to the single image
+    if (export_count == 0)
+        return 1;
+
+    if (name == NULL || name[0] == 0)
+        export_item = exports;
+    else
+        for (i = 0; i < export_count; i++)
+            if (strcmp(exports[i].name, name) == 0)
+            {
+                export_item = exports + i;
+                break;
+            }
+
+    if (export_item == NULL)
+    {
+        syslog(LOG_ERR, "Unknown export '%s'.\n", name);
+        errno = ENOENT;
+        return 0;
+    }
+
+    if (export_item == current_export)
+        return 1;
+
+    if (current_export != NULL)
+        export_use(current_export, -1);
+
+    export_use(export_item, 1);
+
+    export_load(export_item);
+    current_export = export_item;
+
+    if (export_qos_table != NULL)
+        export_qos = export_qos_table + (export_item - exports);
+
+    printf("Using export '%s'.\n", export_item->name);
+
+    // Connection is still served if binding fails
+    affinity_apply(&export_item->affinity);
+
+    return 1;
+}
+
+// Selects export named in an IMDPROXY_REQ_CONNECT request. ImDskSvc sends
+// the part of the connection string after :// as UTF-16, so leading
+// slashes are skipped. Without an export list, all names are accepted.
+int
+connect_export()
+{
+    IMDPROXY_CONNECT_REQ req_block = { 0 };
+    IMDPROXY_CONNECT_RESP resp_block = { 0 };
+    char name[256];
+    size_t i;
+    size_t j = 0;
+
+    if (!comm_read(&req_block.flags,
+        sizeof(req_block) - sizeof(req_block.request_code)))
+    {
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
+    }
+
+    if (req_block.length > buffer_size)
+    {
+        if (!comm_discard(req_block.length))
+            return 0;
+
+        resp_block.error_code = EINVAL;
+    }
+    else if (!comm_read(buf, (safeio_size_t)req_block.length))
+    {
+        return 0;
+    }
+    else
+    {
+        for (i = 0; i + 1 < req_block.length && j < sizeof(name) - 1; i += 2)
+        {
+            uint16_t c = (uint16_t)((uint8_t)buf[i] |
+                ((uint8_t)buf[i + 1] << 8));
+
+            if (c == 0)
+                break;
+
+            if ((c == '/' || c == '\\') && j == 0)
+                continue;
+
+            name[j++] = c < 0x80 ? (char)c : '?';
+        }
+
+        name[j] = 0;
+
+        if (!export_select(name))
+            resp_block.error_code = errno;
+    }
+
+    if (!comm_write(&resp_block, sizeof resp_block))
+    {
+        syslog(LOG_ERR, "Error sending connect response to caller.\n");
+
+        return 0;
+    }
+
+    if (!comm_flush())
+    {
+        syslog(LOG_ERR, "Error flushing comm data: %m\n");
+        return 0;
+    }
+
+    // Connection is closed after a failed connect request
+    return resp_block.error_code == 0;
+}
+
+// Prints throttling statistics for a finished connection and resets them
+// for next connection.
+void
+qos_report()
+{
+    if (!qos_enabled)
+        return;
+
+    printf("QoS: " ULL_FMT " of " ULL_FMT " requests throttled, total delay "
+        ULL_FMT " ms.\n", (ULONGLONG)conn_qos.throttled,
+        (ULONGLONG)conn_qos.requests, (ULONGLONG)conn_qos.delay_us / 1000);
+
+    if (export_qos != NULL)
+        printf("QoS for export '%s': " ULL_FMT " of " ULL_FMT " requests "
+            "throttled, total delay " ULL_FMT " ms.\n", current_export->name,
+            (ULONGLONG)qos_get(&export_qos->throttled),
+            (ULONGLONG)qos_get(&export_qos->requests),
+            (ULONGLONG)qos_get(&export_qos->delay_us) / 1000);
+
+    conn_qos.requests = 0;
+    conn_qos.throttled = 0;
+    conn_qos.delay_us = 0;
+}
+
+int
+do_comm_exports(char *comm_device);
+
+int
+serve_requests();
+
+#ifndef _WIN32
+void
+tagged_stop();
+#endif
+
+#ifndef DEVIO_FUZZ
+
+int
+main(int argc, char **argv)
+{
+    int retval;
+    char *comm_device = NULL;
+    char *trace_path = NULL;
+    char *cbt_path = NULL;
+
+#ifdef _WIN32
+    WSADATA wsadata;
+
+    SetUnhandledExceptionFilter(ExceptionFilter);
+
+    (void)WSAStartup(0x0101, &wsadata);
+#endif
+
+    if (argc > 1 && _stricmp(argv[1], "--dll") == 0)
+    {
+        fprintf(stderr,
+            "devio with custom DLL support\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage for unmanaged C/C++ DLL files:\n"
+            "devio --dll=dllfile;procedure other_devio_parameters ...\n"
+            "\n"
+            "dllfile     Name of custom DLL file to use for device I/O.\n"
+            "\n"
+            "procedure   Name of procedure in DLL file to use for opening device. This\n"
+            "            procedure must follow the dllopen_proc typedef as specified in\n"
+            "devio.h.\n"
+            "\n"
+            "Declaration for dllopen is:\n"
+            "void * __cdecl dllopen(const char *str,\n"
+            "                       int read_only,\n"
+            "                       dllread_proc *dllread,\n"
+            "                       dllwrite_proc *dllwrite,\n"
+            "                       dllclose_proc *dllclose,\n"
+            "                       __int64 *size)\n"
+            "\n"
+            "str         Device name to open as specified at devio command line.\n"
+            "\n"
+            "read_only   A non-zero value requests a device to be opened in read only mode.\n"
+            "\n"
+            "dllread     Pointer to memory where dllopen should store address to a function\n"
+            "            that is used when reading from device.\n"
+            "\n"
+            "dllwrite    Pointer to memory where dllopen should store address to a function\n"
+            "            that is used when writing to device. Address is ignored by devio\n"
+            "            if device is opened for read only.\n"
+            "\n"
+            "dllclose    Pointer to memory where dllopen should store address to a function\n"
+            "            that is used when closing device.\n"
+            "\n"
+            "size        Pointer to memory where dllopen should store detected size of\n"
+            "            successfully opened device. This is optional.\n"
+            "\n"
+            "Types for dllread_proc, dllwrite_proc, dllclose_proc are declared in devio.h.\n"
+            "\n"
             "Return value from dllopen is typed as void * to be able to hold as much data\n"
             "            for some kind of reference as current architecture allows. Devio\n"
             "            practically ignores this value, it is just sent in later calls to\n"
@@ -1215,847 +4745,2123 @@ main(int argc, char **argv)
             "            this value is not (void *)-1. That case is treated as an error\n"
             "            return.\n"
             "\n"
-            "Value returned by dllopen will be passed by devio to to dllread, dllwrite and\n"
-            "dllclose functions.\n"
+            "Value returned by dllopen will be passed by devio to to dllread, dllwrite and\n"
+            "dllclose functions.\n"
+            "\n"
+            "Usage for .NET managed class library files:\n"
+            "devio --dll=iobridge.dll;dllopen other_devio_parameters ...\n"
+            "\n"
+            "Parameter --dll=iobridge.dll;dllopen means to use iobridge.dll which is a\n"
+            "mixed managed/unmanaged DLL that serves as a bridge to transfer requests to a\n"
+            ".NET managed class library.\n"
+            "\n"
+            "The diskdev parameter to devio has somewhat special meaning in this case.\n"
+            "Syntax of diskdev parameter is treated as follows:\n"
+            "classlibraryfile::classname::procedure::devicename\n"
+            "\n"
+            "classlibraryfile\n"
+            "            Name of .NET managed class library DLL file.\n"
+            "\n"
+            "classname::procedure\n"
+            "            Name of class (managed type) and a static method in that class\n"
+            "            to be used to open a Stream object to be used for I/O requests.\n"
+            "\n"
+            "devicename  User specified data, such as a device name, file name or similar,\n"
+            "            that is sent as first parameter to above specified procedure.\n"
+            "\n"
+            "Declaration for classname::procedure:\n"
+            "public static System.IO.Stream open_stream(String devicename, bool read_only)\n"
+            "\n"
+            "devicename  Device name to open as specified as part of diskdev parameter in\n"
+            "            devio command line, as specified above.\n"
+            "\n"
+            "read_only   Value of true requests a device to be opened in read only mode.\n"
+            "\n"
+            "Return value from method needs to be a valid seekable stream object of a type\n"
+            "that derives from System.IO.Stream class. Devio will use Read(), Write() and\n"
+            "Close() methods as well as Position and Length properties on opened Stream\n"
+            "object.\n");
+
+        return -1;
+    }
+
+    if (argc >= 3  && _strnicmp(argv[1], "--dll=", 6) == 0)
+    {
+#ifdef _WIN32
+        char *dllargs = argv[1] + 6;
+
+        char *dllfile = strtok(dllargs, ";");
+        char *dllfunc = strtok(NULL, "");
+
+        HMODULE hDLL;
+
+        hDLL = LoadLibrary(dllfile);
+        if (hDLL == NULL)
+        {
+            syslog(stderr, "Error loading %s: %m\n", dllfile);
+            return 1;
+        }
+
+        dll_open = (dllopen_proc)GetProcAddress(hDLL, dllfunc);
+        if (dll_open == NULL)
+        {
+            syslog(stderr, "Cannot find procedure %s in %s: %m\n",
+                dllfunc,
+                dllfile);
+            return 1;
+        }
+
+        dll_mode = 1;
+
+        argc--;
+        argv++;
+#else
+        fprintf(stderr, "Custom DLL mode only supported on Windows.\n");
+        return -1;
+#endif
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--drv") == 0)
+    {
+        drv_mode = 1;
+        argv++;
+        argc--;
+    }
+
+    // Service options may be given in any order, before --exports or image
+    // options
+    while (argc >= 3)
+    {
+        if (_strnicmp(argv[1], "--qos=", 6) == 0)
+        {
+            if (!qos_settings(&conn_qos, argv[1] + 6))
+                return -1;
+        }
+        else if (_strnicmp(argv[1], "--qos-total=", 12) == 0)
+        {
+            if (!qos_settings(&total_qos, argv[1] + 12))
+                return -1;
+        }
+        else if (_strnicmp(argv[1], "--cpus=", 7) == 0)
+        {
+            if (!affinity_setting(&affinity, argv[1] + 2))
+            {
+                syslog(LOG_ERR, "Invalid processor list '%s'.\n", argv[1] + 7);
+                return -1;
+            }
+        }
+        else if (_strnicmp(argv[1], "--numa=", 7) == 0)
+        {
+            if (!affinity_setting(&affinity, argv[1] + 2))
+            {
+                syslog(LOG_ERR, "Invalid NUMA node '%s'.\n", argv[1] + 7);
+                return -1;
+            }
+        }
+        else if (_strnicmp(argv[1], "--queue-depth=", 14) == 0)
+        {
+            char *endptr;
+            unsigned long depth = strtoul(argv[1] + 14, &endptr, 0);
+
+            if (*endptr != 0 || depth > IMDPROXY_FLAG_QUEUE_DEPTH_MASK)
+            {
+                syslog(LOG_ERR, "Invalid queue depth '%s'.\n", argv[1] + 14);
+                return -1;
+            }
+
+            queue_depth = (unsigned int)depth;
+        }
+        else
+            break;
+
+        argv++;
+        argc--;
+    }
+
+    if (argc >= 3 && _strnicmp(argv[1], "--exports=", 10) == 0)
+    {
+        char *exports_path = argv[1] + 10;
+        int read_only = 0;
+
+        if (argc >= 4 && strcmp(argv[2], "-r") == 0)
+        {
+            read_only = 1;
+            argv++;
+            argc--;
+        }
+
+        if (argc != 3)
+        {
+            fprintf(stderr,
+                "Usage:\n"
+                "devio [--qos=settings] [--qos-total=settings] [--cpus=list]\n"
+                "      [--numa=node|auto] [--queue-depth=n] --exports=exportsfile\n"
+                "      [-r] tcp-port|nbd:[port]\n");
+            return -1;
+        }
+
+        if (!exports_load(exports_path, read_only))
+            return 1;
+
+        return do_comm_exports(argv[2]);
+    }
+
+    // Image options may be given in any order
+    while (argc >= 4)
+    {
+        if (strcmp(argv[1], "--novhd") == 0)
+            auto_vhd_detect = 0;
+        else if (_strnicmp(argv[1], "--record=", 9) == 0)
+            trace_path = argv[1] + 9;
+        else if (strcmp(argv[1], "--record-hash") == 0)
+            trace_hash = 1;
+        else if (_strnicmp(argv[1], "--cbt=", 6) == 0)
+            cbt_path = argv[1] + 6;
+        else if (_strnicmp(argv[1], "--cbt-block=", 12) == 0)
+        {
+            char *endptr;
+
+            cbt_block_size = strtoul(argv[1] + 12, &endptr, 0);
+
+            if (*endptr != 0 || cbt_block_size == 0)
+            {
+                syslog(LOG_ERR, "Invalid CBT block size '%s'.\n",
+                    argv[1] + 12);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[1], "--compact") == 0)
+            compact_mode = 1;
+        else if (_strnicmp(argv[1], "--encrypt=", 10) == 0)
+            crypt_key_path = argv[1] + 10;
+        else if (strcmp(argv[1], "-r") == 0)
+            devio_info.flags |= IMDPROXY_FLAG_RO;
+        else
+            break;
+
+        argv++;
+        argc--;
+    }
+
+    if (trace_hash && trace_path == NULL)
+    {
+        fprintf(stderr, "--record-hash needs --record.\n");
+        return -1;
+    }
+
+    if (argc < 3 || argc > 7)
+    {
+        fprintf(stderr,
+            "devio - Device I/O Service ver " DEVIO_VERSION "\n"
+            "With support for Microsoft VHD format, custom DLL files, shared memory proxy\n"
+            "operation and also for use with DevIO Client Driver, if installed.\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "devio [--qos=settings] [--cpus=list] [--numa=node|auto] [--queue-depth=n]\n"
+            "      [--record=tracefile [--record-hash]] [--cbt=file [--cbt-block=size]]\n"
+            "      [--compact] [--encrypt=keyfile] [-r] tcp-port|commdev\n"
+            "      diskdev [blocks] [offset] [alignm] [buffersize]\n"
+            "devio [--qos=settings] [--cpus=list] [--numa=node|auto] [--queue-depth=n]\n"
+            "      [--record=tracefile [--record-hash]] [--cbt=file [--cbt-block=size]]\n"
+            "      [--compact] [--encrypt=keyfile] [-r] tcp-port|commdev\n"
+            "      diskdev [partitionnumber] [alignm] [buffersize]\n"
+            "devio [--qos=settings] [--qos-total=settings] [--cpus=list]\n"
+            "      [--numa=node|auto] [--queue-depth=n] --exports=exportsfile [-r]\n"
+            "      tcp-port|nbd:[port]\n"
             "\n"
-            "Usage for .NET managed class library files:\n"
-            "devio --dll=iobridge.dll;dllopen other_devio_parameters ...\n"
+            "-r      Open image file in read-only mode.\n"
             "\n"
-            "Parameter --dll=iobridge.dll;dllopen means to use iobridge.dll which is a\n"
-            "mixed managed/unmanaged DLL that serves as a bridge to transfer requests to a\n"
-            ".NET managed class library.\n"
+            "--record=tracefile\n"
+            "        Record all requests with timing to tracefile, for later replay with\n"
+            "        devreplay. Add --record-hash to also store a hash of write data.\n"
             "\n"
-            "The diskdev parameter to devio has somewhat special meaning in this case.\n"
-            "Syntax of diskdev parameter is treated as follows:\n"
-            "classlibraryfile::classname::procedure::devicename\n"
+            "--cbt=file\n"
+            "        Track changed blocks in a persistent bitmap, for incremental backups\n"
+            "        with devcbt. --cbt-block sets block size, default %u bytes. Writes\n"
+            "        done to the image without devio are not tracked.\n"
             "\n"
-            "classlibraryfile\n"
-            "            Name of .NET managed class library DLL file.\n"
+            "--exports=exportsfile\n"
+            "        Serve several images from one process. Each line in exportsfile has\n"
+            "        an export name, an image path and optional settings ro, novhd,\n"
+            "        partition=n, size=n, offset=n, encrypt=keyfile, cpus=list and\n"
+            "        numa=node|auto. Clients select an export by name in a connect\n"
+            "        request, or through NBD export names, and otherwise get the first\n"
+            "        export. Connections are served in parallel by threads that share\n"
+            "        the opened images. Unix only.\n"
             "\n"
-            "classname::procedure\n"
-            "            Name of class (managed type) and a static method in that class\n"
-            "            to be used to open a Stream object to be used for I/O requests.\n"
+            "--qos=settings\n"
+            "        Limit each connection with comma separated settings iops=n for\n"
+            "        requests per second, bps=n for bytes per second and burst=ms for\n"
+            "        how long full rate may be exceeded after idle time, default %u ms.\n"
+            "        Values accept K, M, G and k, m, g suffixes. The same settings,\n"
+            "        and weight=n, can be given for each export in exportsfile to\n"
+            "        limit all connections to an export together.\n"
             "\n"
-            "devicename  User specified data, such as a device name, file name or similar,\n"
-            "            that is sent as first parameter to above specified procedure.\n"
+            "--qos-total=settings\n"
+            "        Limit all exports together. Exports with requests during the last\n"
+            "        second share these limits in proportion to their weights.\n"
+            "        Throttling statistics are printed when connections close.\n"
             "\n"
-            "Declaration for classname::procedure:\n"
-            "public static System.IO.Stream open_stream(String devicename, bool read_only)\n"
+            "--cpus=list\n"
+            "        Run on processors in a comma separated list of numbers and ranges,\n"
+            "        such as 0-7,16-23.\n"
             "\n"
-            "devicename  Device name to open as specified as part of diskdev parameter in\n"
-            "            devio command line, as specified above.\n"
+            "--numa=node|auto\n"
+            "        Run on processors of a NUMA node, and allocate buffers from its\n"
+            "        memory. With auto, the node closest to the image device is used,\n"
+            "        such as the node of an NVMe controller. Linux only for auto.\n"
             "\n"
-            "read_only   Value of true requests a device to be opened in read only mode.\n"
+            "--queue-depth=n\n"
+            "        Number of tagged requests a client may send before reading\n"
+            "        responses, default %u. On Unix, up to %u of them are served in\n"
+            "        parallel by worker threads and may complete in any order. 0\n"
+            "        disables tagged requests. Not used with shm: and drv:.\n"
             "\n"
-            "Return value from method needs to be a valid seekable stream object of a type\n"
-            "that derives from System.IO.Stream class. Devio will use Read(), Write() and\n"
-            "Close() methods as well as Position and Length properties on opened Stream\n"
-            "object.\n");
+            "--compact\n"
+            "        Compact dynamically expanding VHD image file while client is idle.\n"
+            "        Blocks that only contain zeros are released, and remaining blocks\n"
+            "        are moved to fill holes so that the image file can be truncated.\n"
+            "        Needs a tcp-port, stdin or a commdev that can be polled.\n"
+            "\n"
+            "--encrypt=keyfile\n"
+            "        Encrypt image data with XTS-AES, using a key file with 32 bytes for\n"
+            "        XTS-AES-128 or 64 bytes for XTS-AES-256, for example created with\n"
+            "        head -c 64 /dev/urandom. Data units are sectors counted from start\n"
+            "        of image file, so partitions can be selected in encrypted images.\n"
+            "        Existing image data is not converted, so use a new image and\n"
+            "        format it through devio. VHD image files, unmap and zero requests\n"
+            "        are not supported.\n"
+            "\n"
+            "tcp-port can be any free tcp port where this service should listen for incoming\n"
+            "client connections.\n"
+            "\n"
+            "commdev is a path to a communications port, named pipe or similar where this\n"
+            "service should listen for incoming client connections.\n"
+            "\n"
+            "commdev can also start with shm: followed by an section object name for using\n"
+            "shared memory communication. Alternatively, drv: followed by a name for using\n"
+            "DevIO Client Driver to expose a device object connected to this devio instance.\n"
+            "\n"
+            "commdev can also be nbd: followed by an optional tcp port, default %u, to serve\n"
+            "the image to NBD clients such as nbd-client or qemu instead of ImDisk. All\n"
+            "export names refer to the image.\n"
+            "\n"
+            "Default number of blocks is 0. When running on Windows the program will try to\n"
+            "get the size of the image file or partition automatically, otherwise the client\n"
+            "must know the exact size without help from this service. On Linux, size,\n"
+            "sector size and max transfer size of block devices are detected, and unmap\n"
+            "and zero requests use native discard and write zeroes.\n"
+            "\n"
+            "Default number of blocks for dynamically expanding VHD image files are read\n"
+            "automatically from VHD header structure within image file.\n"
+            "\n"
+            "Partition numbers select partitions from either MBR/EBR partition tables or a\n"
+            "GUID partition table, counting used entries in table order from 1.\n"
+            "\n"
+            "Default alignment is %u bytes.\n"
+            "Default buffer size is %i bytes.\n"
+            "\n"
+            "For syntax help with custom I/O DLL under Windows, type:\n"
+            "devio --dll\n",
+            DEF_CBT_BLOCK_SIZE,
+            DEF_QOS_BURST_MS,
+            DEF_QUEUE_DEPTH,
+            MAX_TAGGED_WORKERS,
+            NBD_DEFAULT_PORT,
+            DEF_REQUIRED_ALIGNMENT,
+            DEF_BUFFER_SIZE);
+        return -1;
+    }
+
+    comm_device = argv[1];
+
+    retval = open_image(argc, argv);
+    if (retval != 0)
+        return retval;
+
+    if (trace_path != NULL && !trace_open(trace_path))
+        return 1;
+
+    if (cbt_path != NULL && !cbt_open(cbt_path))
+        return 1;
+
+    affinity_resolve(&affinity);
+
+    if (!affinity_apply(&affinity))
+        return 1;
+
+    if (compact_mode)
+    {
+        if (!vhd_mode || dll_mode || (devio_info.flags & IMDPROXY_FLAG_RO))
+        {
+            fprintf(stderr, "--compact needs a writable dynamic VHD image "
+                "file.\n");
+            return 1;
+        }
+
+        compact_buf = (char*)malloc((size_t)sector_size + block_size);
+        if (compact_buf == NULL)
+        {
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            return 1;
+        }
+
+        compact_pending = 1;
+    }
+
+    retval = do_comm(comm_device);
+
+    trace_close();
+    cbt_close();
+
+    if (crypt_xts != NULL)
+        devcrypt_xts_clear(crypt_xts);
+
+    printf("Image close result: %i\n", physical_close(image_fd));
+
+    return retval;
+}
+
+#endif // DEVIO_FUZZ
+
+#ifdef _WIN32
+int
+do_comm_shm(char *comm_device)
+{
+    HANDLE hFileMap = NULL;
+    MEMORY_BASIC_INFORMATION memory_info = { 0 };
+    safeio_size_t detected_buffer_size = 0;
+    ULARGE_INTEGER map_size = { 0 };
+    char *objname = (char*)malloc(OBJNAME_SIZE);
+    char *namespace_prefix;
+    HANDLE h = CreateFile("\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ((h == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_FILE_NOT_FOUND))
+        namespace_prefix = "";
+    else
+        namespace_prefix = "Global\\";
+
+    if (h != INVALID_HANDLE_VALUE)
+        CloseHandle(h);
+
+    if (objname == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return -1;
+    }
+
+    puts("Shared memory operation.");
+
+    _snprintf(objname, OBJNAME_SIZE,
+        "%s%s", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+
+    map_size.QuadPart = (ULONGLONG)buffer_size + IMDPROXY_HEADER_SIZE;
+
+    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
+        NULL,
+        PAGE_READWRITE | SEC_COMMIT,
+        map_size.HighPart,
+        map_size.LowPart,
+        objname);
+
+    if (hFileMap == NULL)
+    {
+        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
+        return 2;
+    }
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        syslog(LOG_ERR, "A service with this name is already running.\n");
+        return 2;
+    }
+
+    shm_view = (char*)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+
+    if (shm_view == NULL)
+    {
+        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
+        return 2;
+    }
+
+    buf = shm_view + IMDPROXY_HEADER_SIZE;
+
+    if (!VirtualQuery(shm_view, &memory_info, sizeof(memory_info)))
+    {
+        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
+        return 2;
+    }
+
+    detected_buffer_size = (safeio_size_t)
+        (memory_info.RegionSize - IMDPROXY_HEADER_SIZE);
+
+    if (buffer_size != detected_buffer_size)
+    {
+        buffer_size = detected_buffer_size;
+        if (buf2 != NULL)
+        {
+            free(buf2);
+            buf2 = (char*)malloc(buffer_size);
+            if (buf2 == NULL)
+            {
+                syslog(LOG_ERR, "malloc() failed: %m\n");
+                return 2;
+            }
+        }
+    }
+
+    _snprintf(objname, OBJNAME_SIZE,
+        "%s%s_Server", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_server_mutex = CreateMutex(NULL, FALSE, objname);
+
+    if (shm_server_mutex == NULL)
+    {
+        syslog(LOG_ERR, "CreateMutex() failed: %m\n");
+        return 2;
+    }
+
+    if (WaitForSingleObject(shm_server_mutex, 0) != WAIT_OBJECT_0)
+    {
+        syslog(LOG_ERR, "A service with this name is already running.\n");
+        return 2;
+    }
+
+    _snprintf(objname, OBJNAME_SIZE,
+        "%s%s_Request", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_request_event = CreateEvent(NULL, FALSE, FALSE, objname);
+
+    if (shm_request_event == NULL)
+    {
+        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
+        return 2;
+    }
+
+    _snprintf(objname, OBJNAME_SIZE,
+        "%s%s_Response", namespace_prefix, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+    shm_response_event = CreateEvent(NULL, FALSE, FALSE, objname);
+
+    if (shm_response_event == NULL)
+    {
+        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
+        return 2;
+    }
+
+    free(objname);
+    objname = NULL;
+
+    shm_mode = 1;
+
+    printf("Waiting for connection on object %s. Press Ctrl+C to cancel.\n",
+        comm_device);
+
+    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
+    {
+        syslog(LOG_ERR, "Wait failed: %m.\n");
+        return 2;
+    }
 
+    printf("Connection on object %s.\n",
+        comm_device);
+
+    return 0;
+}
+
+int
+do_comm_drv(char *comm_device)
+{
+    int rc;
+
+    char *objname = (char*)malloc(OBJNAME_SIZE);
+    if (objname == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m");
+        return -1;
+    }
+
+    drv_memory_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    drv_request_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (drv_memory_io.hEvent == NULL || drv_request_io.hEvent == NULL)
+    {
+        syslog(LOG_ERR, "Event object create failed: %m");
         return -1;
     }
 
-    if (argc >= 3  && _strnicmp(argv[1], "--dll=", 6) == 0)
-    {
-#ifdef _WIN32
-        char *dllargs = argv[1] + 6;
+    puts("Driver mode.");
+
+    _snprintf(objname, OBJNAME_SIZE,
+        "%ws\\%s", DEVIODRV_DEVICE_DOSDEV_NAME, comm_device);
+    objname[OBJNAME_SIZE - 1] = 0;
+
+    sd = (SOCKET)CreateFile(objname, GENERIC_ALL, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+
+    if (sd == INVALID_SOCKET)
+    {
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            syslog(LOG_ERR, "A service with this name is already running.\n");
+        }
+        else
+        {
+            syslog(LOG_ERR, "Error opening '%s': %m", objname);
+        }
+
+        return 2;
+    }
+
+    free(objname);
+    objname = NULL;
+
+    rc = alloc_drv_buffer();
+    if (rc > 0)
+    {
+        return rc;
+    }
+
+    drv_mode = 1;
+
+    printf("Waiting for client connection on object %s. Press Ctrl+C to cancel.\n",
+        comm_device);
+
+    ((PIMDPROXY_DEVIODRV_BUFFER_HEADER)shm_view)->request_code = IMDPROXY_REQ_INFO;
+
+    if (!send_info())
+    {
+        syslog(LOG_ERR, "Wait failed: %m.\n");
+        return 2;
+    }
+
+    printf("Connection on object %s.\n",
+        comm_device);
+
+    return 0;
+}
+#endif
+
+// Continues VHD compaction for as long as client is idle. Compaction moves
+// blocks and truncates the image file, so it pauses while other
+// connections use the image and checks again after each idle period. Each
+// step holds the allocation lock so that connections that arrive meanwhile
+// wait for it.
+void
+compact_while_idle()
+{
+    int timeout_ms = COMPACT_IDLE_MS;
+    char pending;
+
+    vhd_alloc_lock();
+    pending = compact_pending;
+    vhd_alloc_unlock();
+
+    while (pending && comm_idle(timeout_ms))
+    {
+        int alone;
+
+        vhd_alloc_lock();
+
+        alone = current_export == NULL || current_export->connections <= 1;
+        if (alone && compact_pending)
+        {
+            if (current_export != NULL)
+                vhd_file_size = current_export->vhd_file_size;
+
+            vhd_compact_step();
+        }
+
+        pending = compact_pending;
+
+        vhd_alloc_unlock();
+
+        timeout_ms = alone ? 0 : COMPACT_IDLE_MS;
+    }
+}
+
+// NBD frontend. Serves the same image, partition or VHD through the NBD
+// protocol, so that Linux hosts can connect with nbd-client or qemu. Export
+// names select exports loaded with --exports. Without an export list, all
+// names are accepted and refer to the image given on command line.
+// Requests are served in the order they arrive, which the protocol allows
+// for clients that send several requests before reading replies.
+
+int
+nbd_option_reply(uint32_t option, uint32_t reply_type, const void *data,
+    uint32_t length)
+{
+    unsigned char header[20];
+
+    devnbd_put64(header, NBD_REP_MAGIC);
+    devnbd_put32(header + 8, option);
+    devnbd_put32(header + 12, reply_type);
+    devnbd_put32(header + 16, length);
+
+    return comm_write(header, sizeof(header)) &&
+        (length == 0 || comm_write(data, length));
+}
+
+uint16_t
+nbd_transmission_flags()
+{
+    uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+        NBD_FLAG_SEND_FUA;
+
+    if (devio_info.flags & IMDPROXY_FLAG_RO)
+        flags |= NBD_FLAG_READ_ONLY;
+    else
+    {
+        flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+
+        if (devio_info.flags & IMDPROXY_FLAG_SUPPORTS_UNMAP)
+            flags |= NBD_FLAG_SEND_TRIM;
+    }
+
+    // Reads are always answered with one data chunk
+    if (nbd_structured)
+        flags |= NBD_FLAG_SEND_DF;
+
+    // Connections share the opened image file, so a flush commits writes
+    // done through all of them, including VHD blocks that other
+    // connections have allocated.
+    if (thread_mode && !dll_mode)
+        flags |= NBD_FLAG_CAN_MULTI_CONN;
+
+    return flags;
+}
+
+// Sends NBD_REP_INFO replies describing the export for NBD_OPT_INFO and
+// NBD_OPT_GO.
+int
+nbd_send_export_info(uint32_t option)
+{
+    unsigned char info[14];
+    uint32_t min_block = 1;
+
+    devnbd_put16(info, NBD_INFO_EXPORT);
+    devnbd_put64(info + 2, devio_info.file_size);
+    devnbd_put16(info + 10, nbd_transmission_flags());
+
+    if (!nbd_option_reply(option, NBD_REP_INFO, info, 12))
+        return 0;
+
+    while (min_block < devio_info.req_alignment && min_block < 65536)
+        min_block <<= 1;
+
+    devnbd_put16(info, NBD_INFO_BLOCK_SIZE);
+    devnbd_put32(info + 2, min_block);
+    devnbd_put32(info + 6, min_block > 4096 ? min_block : 4096);
+    devnbd_put32(info + 10, NBD_MAX_PAYLOAD);
+
+    return nbd_option_reply(option, NBD_REP_INFO, info, sizeof(info));
+}
+
+// Answers NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. Only
+// base:allocation is known.
+int
+nbd_meta_context_option(uint32_t option, const unsigned char *data,
+    uint32_t length)
+{
+    static const char context_name[] = NBD_META_BASE_ALLOCATION;
+    unsigned char reply[4 + sizeof(context_name) - 1];
+    uint32_t name_length;
+    uint32_t queries;
+    uint32_t pos;
+    int found = 0;
+
+    if (length < 8 || (name_length = devnbd_get32(data)) > length - 8)
+        return nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0);
+
+    if (option == NBD_OPT_SET_META_CONTEXT && !nbd_structured)
+        return nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0);
+
+    pos = 4 + name_length;
+    queries = devnbd_get32(data + pos);
+    pos += 4;
+
+    // Listing without queries returns all contexts
+    if (queries == 0 && option == NBD_OPT_LIST_META_CONTEXT)
+        found = 1;
+
+    for (; queries > 0; queries--)
+    {
+        uint32_t query_length;
+
+        if (length - pos < 4 ||
+            (query_length = devnbd_get32(data + pos)) > length - pos - 4)
+            return nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0);
+
+        pos += 4;
+
+        if ((query_length == sizeof(context_name) - 1 &&
+            memcmp(data + pos, context_name, query_length) == 0) ||
+            (option == NBD_OPT_LIST_META_CONTEXT && query_length == 5 &&
+                memcmp(data + pos, context_name, 5) == 0))
+            found = 1;
+
+        pos += query_length;
+    }
+
+    if (option == NBD_OPT_SET_META_CONTEXT)
+        nbd_meta_context = (char)found;
+
+    if (found)
+    {
+        devnbd_put32(reply, NBD_META_BASE_ALLOCATION_ID);
+        memcpy(reply + 4, context_name, sizeof(context_name) - 1);
+
+        if (!nbd_option_reply(option, NBD_REP_META_CONTEXT, reply,
+            sizeof(reply)))
+            return 0;
+    }
+
+    return nbd_option_reply(option, NBD_REP_ACK, NULL, 0);
+}
+
+// Negotiation phase. Returns 1 when client enters transmission phase and 0
+// when connection should be closed.
+int
+nbd_negotiate()
+{
+    unsigned char header[18];
+    uint32_t client_flags;
+
+    devnbd_put64(header, NBD_MAGIC);
+    devnbd_put64(header + 8, NBD_OPTS_MAGIC);
+    devnbd_put16(header + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+
+    if (!comm_write(header, sizeof(header)) ||
+        !comm_read(header, 4))
+        return 0;
+
+    client_flags = devnbd_get32(header);
+    if ((client_flags & NBD_FLAG_FIXED_NEWSTYLE) == 0)
+    {
+        syslog(LOG_ERR, "NBD client does not support fixed newstyle "
+            "negotiation.\n");
+        return 0;
+    }
+
+    nbd_structured = 0;
+    nbd_meta_context = 0;
+
+    for (;;)
+    {
+        uint32_t option;
+        uint32_t length;
+        unsigned char *data;
+
+        if (!comm_read(header, 16))
+            return 0;
+
+        if (devnbd_get64(header) != NBD_OPTS_MAGIC)
+        {
+            syslog(LOG_ERR, "Invalid NBD option header.\n");
+            return 0;
+        }
+
+        option = devnbd_get32(header + 8);
+        length = devnbd_get32(header + 12);
+
+        // Options are small, anything large is not from a sane client.
+        // Export names are terminated in the buffer, so it needs one byte
+        // more than the option data.
+        if (length <= 65536 && length >= buffer_size)
+            buf_realloc((ULONGLONG)length + 1);
+
+        if (length > 65536 || length >= buffer_size)
+        {
+            if (!comm_discard(length) ||
+                !nbd_option_reply(option, NBD_REP_ERR_TOO_BIG, NULL, 0))
+                return 0;
+
+            continue;
+        }
+
+        data = (unsigned char*)buf;
+
+        if (!comm_read(data, length))
+            return 0;
+
+        dbglog((LOG_ERR, "NBD option %u, %u bytes.\n",
+            (unsigned int)option, (unsigned int)length));
+
+        switch (option)
+        {
+        case NBD_OPT_EXPORT_NAME:
+        {
+            unsigned char reply[10 + 124] = { 0 };
+
+            // No way to report errors, so just hang up
+            data[length] = 0;
+            if (!export_select((char*)data))
+                return 0;
+
+            devnbd_put64(reply, devio_info.file_size);
+            devnbd_put16(reply + 8, nbd_transmission_flags());
+
+            return comm_write(reply, (client_flags & NBD_FLAG_NO_ZEROES) ?
+                10 : sizeof(reply));
+        }
+
+        case NBD_OPT_ABORT:
+            nbd_option_reply(option, NBD_REP_ACK, NULL, 0);
+            return 0;
+
+        case NBD_OPT_LIST:
+        {
+            int i = 0;
+
+            if (length != 0)
+            {
+                if (!nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0))
+                    return 0;
+
+                break;
+            }
+
+            do
+            {
+                const char *name = export_count > 0 ?
+                    exports[i].name : nbd_export_name;
+                size_t name_length = strlen(name);
+                unsigned char reply[4 + 256];
+
+                if (name_length > 256)
+                    name_length = 256;
 
-        char *dllfile = strtok(dllargs, ";");
-        char *dllfunc = strtok(NULL, "");
+                devnbd_put32(reply, (uint32_t)name_length);
+                memcpy(reply + 4, name, name_length);
 
-        HMODULE hDLL;
+                if (!nbd_option_reply(option, NBD_REP_SERVER, reply,
+                    (uint32_t)(4 + name_length)))
+                    return 0;
+            } while (++i < export_count);
 
-        hDLL = LoadLibrary(dllfile);
-        if (hDLL == NULL)
-        {
-            syslog(stderr, "Error loading %s: %m\n", dllfile);
-            return 1;
+            if (!nbd_option_reply(option, NBD_REP_ACK, NULL, 0))
+                return 0;
+
+            break;
         }
 
-        dll_open = (dllopen_proc)GetProcAddress(hDLL, dllfunc);
-        if (dll_open == NULL)
-        {
-            syslog(stderr, "Cannot find procedure %s in %s: %m\n",
-                dllfunc,
-                dllfile);
-            return 1;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            if (length < 6 || devnbd_get32(data) > length - 6)
+            {
+                if (!nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0))
+                    return 0;
+
+                break;
+            }
+            else
+            {
+                uint32_t name_length = devnbd_get32(data);
+                char name[256];
+
+                if (name_length >= sizeof(name))
+                    name_length = sizeof(name) - 1;
+
+                memcpy(name, data + 4, name_length);
+                name[name_length] = 0;
+
+                if (!export_select(name))
+                {
+                    if (!nbd_option_reply(option, NBD_REP_ERR_UNKNOWN,
+                        NULL, 0))
+                        return 0;
+
+                    break;
+                }
+            }
+
+            if (!nbd_send_export_info(option) ||
+                !nbd_option_reply(option, NBD_REP_ACK, NULL, 0))
+                return 0;
+
+            if (option == NBD_OPT_GO)
+                return 1;
+
+            break;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length != 0)
+            {
+                if (!nbd_option_reply(option, NBD_REP_ERR_INVALID, NULL, 0))
+                    return 0;
+
+                break;
+            }
+
+            nbd_structured = 1;
+
+            if (!nbd_option_reply(option, NBD_REP_ACK, NULL, 0))
+                return 0;
+
+            break;
+
+        case NBD_OPT_LIST_META_CONTEXT:
+        case NBD_OPT_SET_META_CONTEXT:
+            if (!nbd_meta_context_option(option, data, length))
+                return 0;
+
+            break;
+
+        default:
+            if (!nbd_option_reply(option, NBD_REP_ERR_UNSUP, NULL, 0))
+                return 0;
         }
+    }
+}
 
-        dll_mode = 1;
+// Sends a reply without data. With structured replies, errors are sent as
+// error chunks and success as a final empty chunk.
+int
+nbd_reply(uint64_t cookie, int errorno)
+{
+    unsigned char reply[NBD_STRUCTURED_REPLY_SIZE + 6];
+    uint32_t error = devnbd_error(errorno);
 
-        argc--;
-        argv++;
-#else
-        fprintf(stderr, "Custom DLL mode only supported on Windows.\n");
-        return -1;
-#endif
+    if (!nbd_structured)
+    {
+        devnbd_put32(reply, NBD_SIMPLE_REPLY_MAGIC);
+        devnbd_put32(reply + 4, error);
+        devnbd_put64(reply + 8, cookie);
+
+        return comm_write(reply, NBD_SIMPLE_REPLY_SIZE);
     }
 
-    if (argc >= 4 && strcmp(argv[1], "--drv") == 0)
+    devnbd_put32(reply, NBD_STRUCTURED_REPLY_MAGIC);
+    devnbd_put16(reply + 4, NBD_REPLY_FLAG_DONE);
+    devnbd_put16(reply + 6,
+        error != 0 ? NBD_REPLY_TYPE_ERROR : NBD_REPLY_TYPE_NONE);
+    devnbd_put64(reply + 8, cookie);
+    devnbd_put32(reply + 16, error != 0 ? 6 : 0);
+
+    if (error == 0)
+        return comm_write(reply, NBD_STRUCTURED_REPLY_SIZE);
+
+    devnbd_put32(reply + 20, error);
+    devnbd_put16(reply + 24, 0);
+
+    return comm_write(reply, sizeof(reply));
+}
+
+int
+nbd_read(uint64_t cookie, uint64_t offset, uint32_t length)
+{
+    unsigned char reply[NBD_STRUCTURED_REPLY_SIZE + 8];
+    ULONGLONG valid_length;
+    safeio_ssize_t readdone;
+
+    trace_record(IMDPROXY_REQ_READ, offset, length, NULL);
+
+    if (length > NBD_MAX_PAYLOAD ||
+        !check_request_range(offset, length, &valid_length) ||
+        valid_length != length)
+        return nbd_reply(cookie, EINVAL);
+
+    if (length > buffer_size)
+        buf_realloc(length);
+
+    if (length > buffer_size)
+        return nbd_reply(cookie, ENOMEM);
+
+    readdone = logical_read(buf, length, (off_t_64)(image_offset + offset));
+
+    if (readdone < 0)
     {
-        drv_mode = 1;
-        argv++;
-        argc--;
+        syslog(LOG_ERR, "Device read: %m\n");
+        return nbd_reply(cookie, errno);
     }
 
-    if (argc >= 4 && strcmp(argv[1], "--novhd") == 0)
+    // Parts not backed by image read as zeros
+    if ((uint32_t)readdone < length)
+        memset(buf + readdone, 0, length - readdone);
+
+    if (!nbd_structured)
     {
-        auto_vhd_detect = 0;
-        argv++;
-        argc--;
+        devnbd_put32(reply, NBD_SIMPLE_REPLY_MAGIC);
+        devnbd_put32(reply + 4, 0);
+        devnbd_put64(reply + 8, cookie);
+
+        return comm_write(reply, NBD_SIMPLE_REPLY_SIZE) &&
+            comm_write(buf, length);
     }
 
-    if (argc >= 4 && strcmp(argv[1], "-r") == 0)
+    devnbd_put32(reply, NBD_STRUCTURED_REPLY_MAGIC);
+    devnbd_put16(reply + 4, NBD_REPLY_FLAG_DONE);
+    devnbd_put16(reply + 6, NBD_REPLY_TYPE_OFFSET_DATA);
+    devnbd_put64(reply + 8, cookie);
+    devnbd_put32(reply + 16, 8 + length);
+    devnbd_put64(reply + 20, offset);
+
+    return comm_write(reply, sizeof(reply)) && comm_write(buf, length);
+}
+
+// Writes data already in buf, or zeros if zero_fill is set, and returns 0 or
+// an errno value.
+int
+nbd_write_range(uint64_t offset, uint32_t length, int zero_fill)
+{
+    ULONGLONG valid_length;
+    uint32_t done = 0;
+
+    if (!check_request_range(offset, length, &valid_length) ||
+        valid_length != length)
+        return EINVAL;
+
+    if (devio_info.flags & IMDPROXY_FLAG_RO)
+        return EPERM;
+
+    if (!cbt_mark(offset, length))
+        return EIO;
+
+    if (compact_mode)
+        compact_restart();
+
+#ifdef __linux__
+    if (zero_fill && (devio_info.flags & IMDPROXY_FLAG_SUPPORTS_ZERO))
     {
-        devio_info.flags |= IMDPROXY_FLAG_RO;
-        argv++;
-        argc--;
+        if (!blkdev_unmap_or_zero(IMDPROXY_REQ_ZERO,
+            image_offset + (off_t_64)offset, length))
+            return errno;
+
+        return 0;
     }
+#endif
 
-    if (argc < 3 || argc > 7)
+    while (done < length)
     {
-        fprintf(stderr,
-            "devio - Device I/O Service ver " DEVIO_VERSION "\n"
-            "With support for Microsoft VHD format, custom DLL files, shared memory proxy\n"
-            "operation and also for use with DevIO Client Driver, if installed.\n"
-            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
-            "\n"
-            "Usage:\n"
-            "devio [-r] tcp-port|commdev diskdev [blocks] [offset] [alignm] [buffersize]\n"
-            "devio [-r] tcp-port|commdev diskdev [partitionnumber] [alignm] [buffersize]\n"
-            "\n"
-            "-r      Open image file in read-only mode.\n"
-            "\n"
-            "tcp-port can be any free tcp port where this service should listen for incoming\n"
-            "client connections.\n"
-            "\n"
-            "commdev is a path to a communications port, named pipe or similar where this\n"
-            "service should listen for incoming client connections.\n"
-            "\n"
-            "commdev can also start with shm: followed by an section object name for using\n"
-            "shared memory communication. Alternatively, drv: followed by a name for using\n"
-            "DevIO Client Driver to expose a device object connected to this devio instance.\n"
-            "\n"
-            "Default number of blocks is 0. When running on Windows the program will try to\n"
-            "get the size of the image file or partition automatically, otherwise the client\n"
-            "must know the exact size without help from this service.\n"
-            "\n"
-            "Default number of blocks for dynamically expanding VHD image files are read\n"
-            "automatically from VHD header structure within image file.\n"
-            "\n"
-            "Default alignment is %u bytes.\n"
-            "Default buffer size is %i bytes.\n"
-            "\n"
-            "For syntax help with custom I/O DLL under Windows, type:\n"
-            "devio --dll\n",
-            DEF_REQUIRED_ALIGNMENT,
-            DEF_BUFFER_SIZE);
-        return -1;
+        safeio_size_t chunk = length - done;
+        safeio_ssize_t writedone;
+
+        if (zero_fill)
+        {
+            if (chunk > buffer_size)
+                chunk = buffer_size;
+
+            memset(buf, 0, chunk);
+        }
+
+        writedone = logical_write(zero_fill ? buf : buf + done, chunk,
+            (off_t_64)(image_offset + offset + done));
+
+        if (writedone <= 0)
+        {
+            syslog(LOG_ERR, "Device write: %m\n");
+            return writedone < 0 ? errno : ENOSPC;
+        }
+
+        done += (uint32_t)writedone;
     }
 
-    comm_device = argv[1];
+    return 0;
+}
 
-    if (dll_mode)
+int
+nbd_trim(uint64_t offset, uint32_t length)
+{
+    ULONGLONG valid_length;
+
+    if (!check_request_range(offset, length, &valid_length) ||
+        valid_length != length)
+        return EINVAL;
+
+    if (devio_info.flags & IMDPROXY_FLAG_RO)
+        return EPERM;
+
+    if (!cbt_mark(offset, length))
+        return EIO;
+
+#ifdef __linux__
+    if ((devio_info.flags & IMDPROXY_FLAG_SUPPORTS_UNMAP) &&
+        !blkdev_unmap_or_zero(IMDPROXY_REQ_UNMAP,
+            image_offset + (off_t_64)offset, length))
+        return errno;
+#endif
+
+    return 0;
+}
+
+// Answers block status for base:allocation. Unallocated VHD blocks are
+// reported as holes that read as zeros, everything else as data.
+int
+nbd_block_status(uint64_t cookie, uint16_t flags, uint64_t offset,
+    uint32_t length)
+{
+    unsigned char reply[NBD_STRUCTURED_REPLY_SIZE + 4 + 8 * 64];
+    ULONGLONG valid_length;
+    uint32_t descriptors = 0;
+    uint32_t max_descriptors = (flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : 64;
+    uint64_t pos = 0;
+
+    if (!nbd_meta_context)
+        return nbd_reply(cookie, EINVAL);
+
+    if (!check_request_range(offset, length, &valid_length) ||
+        valid_length == 0)
+        return nbd_reply(cookie, EINVAL);
+
+    while (pos < valid_length && descriptors < max_descriptors)
     {
-        if (devio_info.flags & IMDPROXY_FLAG_RO)
-            libhandle = dll_open(argv[2], 1, &dll_read, &dll_write, &dll_close,
-            (off_t_64*)&devio_info.file_size);
+        uint64_t extent = valid_length - pos;
+        uint32_t state = 0;
+
+        if (vhd_mode)
+        {
+            off_t_64 logical_offset = image_offset + (off_t_64)(offset + pos);
+            off_t_64 block_number = logical_offset >> block_shift;
+            uint32_t block_offset;
+
+            extent = block_size - (logical_offset & (block_size - 1));
+            if (extent > valid_length - pos)
+                extent = valid_length - pos;
+
+            if (physical_read(&block_offset, sizeof(block_offset),
+                table_offset + (block_number << 2)) != sizeof(block_offset))
+                return nbd_reply(cookie, EIO);
+
+            if (block_offset == 0xFFFFFFFF)
+                state = NBD_STATE_HOLE | NBD_STATE_ZERO;
+        }
+
+        // Merge with previous descriptor if state is the same. Request
+        // length is 32 bits, so merged lengths fit in descriptors.
+        if (descriptors > 0 &&
+            devnbd_get32(reply + NBD_STRUCTURED_REPLY_SIZE + 4 +
+                (descriptors - 1) * 8 + 4) == state)
+        {
+            unsigned char *desc = reply + NBD_STRUCTURED_REPLY_SIZE + 4 +
+                (descriptors - 1) * 8;
+
+            devnbd_put32(desc, devnbd_get32(desc) + (uint32_t)extent);
+        }
         else
-            libhandle = dll_open(argv[2], 0, &dll_read, &dll_write, &dll_close,
-            (off_t_64*)&devio_info.file_size);
+        {
+            unsigned char *desc = reply + NBD_STRUCTURED_REPLY_SIZE + 4 +
+                descriptors * 8;
 
-        if (libhandle == NULL)
+            devnbd_put32(desc, (uint32_t)extent);
+            devnbd_put32(desc + 4, state);
+            ++descriptors;
+        }
+
+        pos += extent;
+    }
+
+    devnbd_put32(reply, NBD_STRUCTURED_REPLY_MAGIC);
+    devnbd_put16(reply + 4, NBD_REPLY_FLAG_DONE);
+    devnbd_put16(reply + 6, NBD_REPLY_TYPE_BLOCK_STATUS);
+    devnbd_put64(reply + 8, cookie);
+    devnbd_put32(reply + 16, 4 + descriptors * 8);
+    devnbd_put32(reply + 20, NBD_META_BASE_ALLOCATION_ID);
+
+    return comm_write(reply, NBD_STRUCTURED_REPLY_SIZE + 4 + descriptors * 8);
+}
+
+// Transmission phase. Returns when client disconnects.
+int
+nbd_transmission()
+{
+    for (;;)
+    {
+        unsigned char request[NBD_REQUEST_SIZE];
+        uint16_t flags;
+        uint16_t type;
+        uint64_t cookie;
+        uint64_t offset;
+        uint32_t length;
+        int errorno;
+
+        if (compact_mode)
+            compact_while_idle();
+
+        if (!comm_read(request, sizeof(request)))
+            return 0;
+
+        if (devnbd_get32(request) != NBD_REQUEST_MAGIC)
         {
-            syslog(LOG_ERR, "Library call failed to open '%s': %m\n", argv[2]);
+            syslog(LOG_ERR, "Invalid NBD request header.\n");
             return 1;
         }
+
+        flags = devnbd_get16(request + 4);
+        type = devnbd_get16(request + 6);
+        cookie = devnbd_get64(request + 8);
+        offset = devnbd_get64(request + 16);
+        length = devnbd_get32(request + 24);
+
+        dbglog((LOG_ERR, "NBD command %u, " ULL_FMT " bytes at " ULL_FMT
+            ".\n", (unsigned int)type, (ULONGLONG)length, (ULONGLONG)offset));
+
+        switch (type)
+        {
+        case NBD_CMD_READ:
+        case NBD_CMD_WRITE:
+            qos_throttle(length);
+            break;
+
+        case NBD_CMD_WRITE_ZEROES:
+        case NBD_CMD_TRIM:
+            qos_throttle(0);
+        }
+
+        switch (type)
+        {
+        case NBD_CMD_READ:
+            if (!nbd_read(cookie, offset, length))
+                return 1;
+            break;
+
+        case NBD_CMD_WRITE:
+            if (length > NBD_MAX_PAYLOAD)
+            {
+                // Data cannot be skipped reliably, so hang up
+                syslog(LOG_ERR, "NBD write request too large.\n");
+                return 1;
+            }
+
+            if (length > buffer_size)
+                buf_realloc(length);
+
+            if (length > buffer_size)
+            {
+                if (!comm_discard(length) || !nbd_reply(cookie, ENOMEM))
+                    return 1;
+                break;
+            }
+
+            if (!comm_read(buf, length))
+                return 1;
+
+            trace_record(IMDPROXY_REQ_WRITE, offset, length, buf);
+
+            errorno = nbd_write_range(offset, length, 0);
+
+            if (errorno == 0 && (flags & NBD_CMD_FLAG_FUA) && !dll_mode &&
+                _commit(image_fd) != 0)
+                errorno = errno;
+
+            if (!nbd_reply(cookie, errorno))
+                return 1;
+            break;
+
+        case NBD_CMD_WRITE_ZEROES:
+            errorno = nbd_write_range(offset, length, 1);
+
+            if (errorno == 0 && (flags & NBD_CMD_FLAG_FUA) && !dll_mode &&
+                _commit(image_fd) != 0)
+                errorno = errno;
+
+            if (!nbd_reply(cookie, errorno))
+                return 1;
+            break;
+
+        case NBD_CMD_TRIM:
+            if (!nbd_reply(cookie, nbd_trim(offset, length)))
+                return 1;
+            break;
+
+        case NBD_CMD_FLUSH:
+            errorno = 0;
+
+            if (!dll_mode && _commit(image_fd) != 0)
+                errorno = errno;
+
+            if (!nbd_reply(cookie, errorno))
+                return 1;
+            break;
+
+        case NBD_CMD_BLOCK_STATUS:
+            if (!nbd_block_status(cookie, flags, offset, length))
+                return 1;
+            break;
+
+        case NBD_CMD_DISC:
+            return 0;
+
+        default:
+            if (!nbd_reply(cookie, EINVAL))
+                return 1;
+        }
     }
-    else
+}
+
+// Creates a socket listening on a tcp port for NBD or export connections.
+SOCKET
+comm_listen(u_short port)
+{
+    struct sockaddr_in saddr = { 0 };
+    int i = 1;
+    SOCKET ssd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (ssd == -1)
     {
-        if (devio_info.flags & IMDPROXY_FLAG_RO)
-            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDONLY);
-        else
-            image_fd = _open(argv[2], O_BINARY | O_DIRECT | O_FSYNC | O_RDWR);
+        syslog(LOG_ERR, "socket() failed: %m\n");
+        return INVALID_SOCKET;
+    }
 
-        if (image_fd == -1)
-        {
-            syslog(LOG_ERR, "Failed to open '%s': %m\n", argv[2]);
-            return 1;
-        }
+    if (setsockopt(ssd, SOL_SOCKET, SO_REUSEADDR, (const char*)&i, sizeof i))
+        syslog(LOG_ERR, "setsockopt(..., SO_REUSEADDR): %m\n");
+
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    saddr.sin_port = htons(port);
+
+    if (bind(ssd, (struct sockaddr*) &saddr, sizeof saddr) == -1)
+    {
+        syslog(LOG_ERR, "bind() failed port %u: %m\n", (unsigned int)port);
+        closesocket(ssd);
+        return INVALID_SOCKET;
     }
 
-    printf("Successfully opened '%s'.\n", argv[2]);
+    if (listen(ssd, 16) == -1)
+    {
+        syslog(LOG_ERR, "listen() failed port %u: %m\n", (unsigned int)port);
+        closesocket(ssd);
+        return INVALID_SOCKET;
+    }
 
-    // Autodetect Microsoft .vhd files
-    readdone = physical_read(&vhd_info, (safeio_size_t) sizeof(vhd_info), 0);
+    return ssd;
+}
 
-    if (auto_vhd_detect &&
-        (readdone == sizeof(vhd_info)) &&
-        (strncmp((char*)vhd_info.Header.Cookie, "cxsparse", 8) == 0) &&
-        (strncmp((char*)vhd_info.Footer.Cookie, "conectix", 8) == 0) &&
-        vhd_info.Footer.DiskType == 0x03000000UL)
+// Accepts next connection into sd. Returns 0 on failure.
+int
+comm_accept(SOCKET ssd)
+{
+    struct sockaddr_in saddr = { 0 };
+    socklen_t i = sizeof saddr;
+
+    sd = accept(ssd, (struct sockaddr*) &saddr, &i);
+    if (sd == -1)
     {
-        void *geometry = &vhd_info.Footer.DiskGeometry;
+        syslog(LOG_ERR, "accept() failed: %m\n");
+        return 0;
+    }
 
-        // VHD I/O uses a secondary buffer
-        buf2 = (char*)malloc(buffer_size);
-        if (buf2 == NULL)
-        {
-            syslog(LOG_ERR, "malloc() failed: %m\n");
-            return 2;
-        }
+    printf("Got connection from %s:%u.\n",
+        inet_ntoa(saddr.sin_addr),
+        (unsigned int)ntohs(saddr.sin_port));
 
-        puts("Detected dynamically expanding Microsoft VHD image file format.");
+    i = 1;
+    if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char*)&i, sizeof i))
+        syslog(LOG_ERR, "setsockopt(..., TCP_NODELAY): %m\n");
 
-        // Calculate vhd shifts
-        current_size = GetBigEndian64(vhd_info.Footer.CurrentSize);
-        table_offset = GetBigEndian64(vhd_info.Header.TableOffset);
+    comm_selectable = 1;
 
-        sector_size = 512;
+    return 1;
+}
 
-        block_size = ntohl(vhd_info.Header.BlockSize);
+// Serves an accepted NBD connection until client disconnects.
+int
+serve_nbd_connection()
+{
+    int result = 0;
 
-        for (block_shift = 0;
-            (block_shift < 64) &&
-            ((((safeio_size_t)1) << block_shift) != block_size);
-        block_shift++);
+    if (nbd_negotiate())
+        result = nbd_transmission();
 
-        devio_info.file_size = current_size;
+    if (!dll_mode && image_fd != -1)
+        _commit(image_fd);
 
-        vhd_mode = 1;
+    qos_report();
 
-        printf("VHD block size: %u bytes. C/H/S geometry: %u/%u/%u.\n",
-            (unsigned int)block_size,
-            (unsigned int)ntohs(*(u_short*)geometry),
-            (unsigned int)((u_char*)geometry)[2],
-            (unsigned int)((u_char*)geometry)[3]);
-    }
+    puts(result == 0 ? "Connection closed." :
+        "Connection closed after protocol error.");
 
-    for (sector_shift = 0;
-        (sector_shift < 64) &&
-        ((((safeio_size_t)1) << sector_shift) != sector_size);
-        sector_shift++);
+    return result;
+}
 
-    if (argc > 3)
-    {
-        ULONGLONG spec_size = 0;
-        char suf = 0;
+#ifndef _WIN32
+// Connection accepted by the listening thread, with settings that the
+// connection thread starts with.
+typedef struct _DEVIO_CONNECTION
+{
+    SOCKET sd;
+    int nbd;
+    safeio_size_t buffer_size;
+    DEVIO_QOS qos;
+} DEVIO_CONNECTION, *PDEVIO_CONNECTION;
+
+// Serves one connection in its own thread, with NBD or imdproxy requests.
+// Without an export list, the connection uses the image given on command
+// line, otherwise the export selected by the client.
+void *
+serve_connection(void *param)
+{
+    PDEVIO_CONNECTION conn = (PDEVIO_CONNECTION)param;
+    int nbd = conn->nbd;
 
-        if (sscanf(argv[3], ULL_FMT "%c", &spec_size, &suf) == 2)
-        {
-            switch (suf)
-            {
-            case 'T':
-                spec_size <<= 10;
-            case 'G':
-                spec_size <<= 10;
-            case 'M':
-                spec_size <<= 10;
-            case 'K':
-                spec_size <<= 10;
-            case 'B':
-                break;
-            case 't':
-                spec_size *= 1000;
-            case 'g':
-                spec_size *= 1000;
-            case 'm':
-                spec_size *= 1000;
-            case 'k':
-                spec_size *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
-            }
+    sd = conn->sd;
+    comm_selectable = 1;
+    buffer_size = conn->buffer_size;
+    conn_qos = conn->qos;
 
-            devio_info.file_size = spec_size;
-        }
-        else if (spec_size < 512)
-        {
-            partition_number = (int)spec_size;
-        }
-        else
-        {
-            devio_info.file_size = spec_size << 9;
-        }
-    }
-    else
+    free(conn);
+
+    if (export_count == 0)
     {
-        partition_number = 1;
+        export_load(&image_export);
+        export_use(&image_export, 1);
+        current_export = &image_export;
     }
 
-#ifdef _WIN32
+    buf = (char*)malloc(buffer_size);
+    buf2 = (char*)malloc(buffer_size);
 
-    if (devio_info.file_size == 0)
+    if (buf == NULL || buf2 == NULL)
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+    else if (nbd)
+        serve_nbd_connection();
+    else
     {
-        if (dll_mode)
-            syslog(LOG_ERR, "DLL did not return size of image/partition.\n");
-        else
-        {
-            HANDLE h = (HANDLE)_get_osfhandle(image_fd);
-            BY_HANDLE_FILE_INFORMATION by_handle_file_info;
-
-            if ((!GetFileInformationByHandle(h, &by_handle_file_info) &&
-                (by_handle_file_info.nFileSizeLow = GetFileSize(h,
-                    &by_handle_file_info.nFileSizeHigh)) == INVALID_FILE_SIZE) &&
-                GetLastError() != NO_ERROR)
-            {
-                // If not regular disk file, try to lock volume using FSCTL operation.
+        serve_requests();
+        tagged_stop();
+    }
 
-                DWORD dw;
-                FlushFileBuffers(h);
-                if (DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0,
-                    &dw, NULL))
-                {
-                    if (!DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL,
-                        0, &dw, NULL))
-                    {
-                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
-                            argv[2]);
+    if (current_export != NULL)
+        export_use(current_export, -1);
 
-                        if (~devio_info.flags & IMDPROXY_FLAG_RO)
-                            return 9;
-                    }
-                }
-                else
-                {
-                    switch (GetLastError())
-                    {
-                    case ERROR_NOT_SUPPORTED:
-                    case ERROR_INVALID_FUNCTION:
-                    case ERROR_INVALID_HANDLE:
-                    case ERROR_INVALID_PARAMETER:
-                        break;
+    closesocket(sd);
 
-                    default:
-                        syslog(LOG_ERR, "Cannot dismount filesystem on %s.\n",
-                            argv[2]);
+    free(buf);
+    free(buf2);
+    free(crypt_buf);
 
-                        if (~devio_info.flags & IMDPROXY_FLAG_RO)
-                            return 9;
-                    }
-                }
+    return NULL;
+}
 
-                if (devio_info.file_size == 0)
-                {
-                    PARTITION_INFORMATION partition_info = { 0 };
+// Accepts connections and serves each one in a new thread. Returns only if
+// accepting fails.
+int
+serve_threads(SOCKET ssd, int nbd)
+{
+    pthread_attr_t attr;
 
-                    if (!DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0,
-                        &partition_info, sizeof(partition_info),
-                        &dw, NULL))
-                    {
-                        syslog(LOG_ERR,
-                            "Cannot determine size of disk volume.\n");
-                    }
-                    else
-                    {
-                        devio_info.file_size =
-                            partition_info.PartitionLength.QuadPart;
-                    }
-                }
-            }
-            else
-            {
-                LARGE_INTEGER file_size = { 0 };
-                file_size.HighPart = by_handle_file_info.nFileSizeHigh;
-                file_size.LowPart = by_handle_file_info.nFileSizeLow;
+    thread_mode = 1;
 
-                devio_info.file_size = file_size.QuadPart;
-            }
-        }
-    }
-#else
-    if (devio_info.file_size == 0)
+    if (export_count == 0)
     {
-        struct stat file_stat = { 0 };
-        if (fstat(image_fd, &file_stat) == 0)
-            devio_info.file_size = file_stat.st_size;
-        else
-            syslog(LOG_ERR, "Cannot determine size of image/partition: %m\n");
+        export_save(&image_export);
+        pthread_mutex_init(&image_export.alloc_lock, NULL);
     }
+
+    // A client that disconnects while a response is sent must not stop
+    // the process
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef IMDBUF_AVX2
+    // Vector support is detected on first use, do that before threads
+    // start
+    ImDiskBufferHaveAvx2();
 #endif
 
-    if (current_size == 0)
-        current_size = devio_info.file_size;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-    if (devio_info.file_size != 0)
+    for (;;)
     {
-        printf("Image size used: " ULL_FMT " bytes.\n", devio_info.file_size);
-    }
+        PDEVIO_CONNECTION conn;
+        pthread_t thread;
+        int error;
 
-    if (partition_number >= 1 && partition_number < 512)
-    {
-        if (logical_read(mbr, 512, 0) < 512)
+        if (!comm_accept(ssd))
         {
-            syslog(LOG_ERR, "Error reading device: %m\n");
+            if (errno == EINTR)
+                continue;
+
+            return 2;
         }
-        else if ((*(u_char*)(mbr + 0x01FE) == 0x55) &&
-            (*(u_char*)(mbr + 0x01FF) == 0xAA) &&
-            ((*(u_char*)(mbr + 0x01BE) & 0x7F) == 0) &&
-            ((*(u_char*)(mbr + 0x01CE) & 0x7F) == 0) &&
-            ((*(u_char*)(mbr + 0x01DE) & 0x7F) == 0) &&
-            ((*(u_char*)(mbr + 0x01EE) & 0x7F) == 0))
+
+        conn = (PDEVIO_CONNECTION)malloc(sizeof(*conn));
+        if (conn == NULL)
         {
-            size_t i = 0;
-            int c = 0;
+            syslog(LOG_ERR, "malloc() failed: %m\n");
+            closesocket(sd);
+            sd = INVALID_SOCKET;
+            continue;
+        }
 
-            puts("Detected a master boot record at sector 0.");
+        conn->sd = sd;
+        conn->nbd = nbd;
+        conn->buffer_size = buffer_size;
+        conn->qos = conn_qos;
 
-            image_offset = 0;
+        // Library backends are not known to be thread safe
+        if (dll_mode)
+        {
+            serve_connection(conn);
+            sd = INVALID_SOCKET;
+            continue;
+        }
 
-            for (i = 0; i < 4; i++)
-            {
-                char type = *(mbr + 512 - 66 + (i << 4) + 4);
+        error = pthread_create(&thread, &attr, serve_connection, conn);
+        if (error != 0)
+        {
+            errno = error;
+            syslog(LOG_ERR, "pthread_create() failed: %m\n");
+            closesocket(sd);
+            free(conn);
+        }
+
+        sd = INVALID_SOCKET;
+    }
+}
+#endif
+
+// Listens for NBD clients. Clients often connect once to list or query
+// exports and then again to use one, so this continues to accept
+// connections until interrupted. On Unix, connections are served in
+// parallel by threads, otherwise one at a time.
+int
+do_comm_nbd(char *comm_device)
+{
+    u_short port = (u_short)strtoul(comm_device, NULL, 0);
+    SOCKET ssd;
+
+    if (port == 0)
+        port = NBD_DEFAULT_PORT;
+
+    ssd = comm_listen(port);
+    if (ssd == INVALID_SOCKET)
+        return 2;
+
+#ifdef _WIN32
+    for (;;)
+    {
+        printf("Waiting for NBD connection on port %u. Press Ctrl+C to "
+            "cancel.\n", (unsigned int)port);
+
+        if (!comm_accept(ssd))
+            return 2;
+
+        serve_nbd_connection();
+
+        closesocket(sd);
+        sd = INVALID_SOCKET;
+    }
+#else
+    printf("Waiting for NBD connections on port %u. Press Ctrl+C to "
+        "cancel.\n", (unsigned int)port);
 
-                if (type == 0)
-                {
-                    continue;
-                }
+    // Scripts that start the server in background wait for this line
+    fflush(stdout);
 
-                if (type == 0x05 || type == 0x0F)
-                {
-                    char read_next_ebr = TRUE;
+    return serve_threads(ssd, 1);
+#endif
+}
 
-                    off_t_64 first_ebr_offset =
-                        ((off_t_64)GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 8))
-                        << sector_shift;
+// Serves exports loaded with --exports on a tcp port, or through NBD with an
+// nbd: comm device. Each connection is served by a thread.
+int
+do_comm_exports(char *comm_device)
+{
+#ifdef _WIN32
+    fprintf(stderr, "Export lists only supported on Unix.\n");
+    return 2;
+#else
+    int nbd = _strnicmp(comm_device, "nbd:", 4) == 0;
+    u_short port = (u_short)strtoul(nbd ? comm_device + 4 : comm_device,
+        NULL, 0);
+    SOCKET ssd;
+    int i;
 
-                    image_offset = first_ebr_offset;
+    if (nbd && port == 0)
+        port = NBD_DEFAULT_PORT;
 
-                    while (read_next_ebr)
-                    {
-                        char ebr[512];
-                        size_t e;
+    if (port == 0)
+    {
+        fprintf(stderr, "Export lists need a tcp port or nbd: comm device.\n");
+        return 2;
+    }
 
-                        read_next_ebr = FALSE;
+    // Throttling state for exports is shared by connection threads
+    export_qos_table = (PDEVIO_QOS)malloc(
+        export_count * sizeof(*export_qos_table));
+    if (export_qos_table == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 2;
+    }
 
-                        printf("Reading extended partition table at " SLL_FMT
-                            ".\n", (int64_t)image_offset);
+    // Locks are initialized here, because the export array is moved while
+    // exports are loaded
+    for (i = 0; i < export_count; i++)
+    {
+        export_qos_table[i] = exports[i].qos;
+        pthread_mutex_init(&exports[i].alloc_lock, NULL);
+    }
 
-                        if (logical_read(ebr, 512, image_offset) == 512 &&
-                            (*(u_char*)(ebr + 0x01FE) == 0x55) &&
-                            (*(u_char*)(ebr + 0x01FF) == 0xAA) &&
-                            ((*(u_char*)(ebr + 0x01BE) & 0x7F) == 0) &&
-                            ((*(u_char*)(ebr + 0x01CE) & 0x7F) == 0) &&
-                            ((*(u_char*)(ebr + 0x01DE) & 0x7F) == 0) &&
-                            ((*(u_char*)(ebr + 0x01EE) & 0x7F) == 0))
-                        {
-                            puts("Found valid extended partition table.");
-                        }
-                        else
-                        {
-                            puts("Invalid extended partition table.");
-                            break;
-                        }
+    export_qos_count = export_count;
 
-                        for (e = 0; e < 4; e++)
-                        {
-                            type = *(ebr + 512 - 66 + (e << 4) + 4);
+    ssd = comm_listen(port);
+    if (ssd == INVALID_SOCKET)
+        return 2;
 
-                            if (type == 0)
-                            {
-                                continue;
-                            }
+    printf("Serving %i exports on port %u%s. Press Ctrl+C to cancel.\n",
+        export_count, (unsigned int)port, nbd ? " through NBD" : "");
 
-                            if (type == 0x05 || type == 0x0F)
-                            {
-                                image_offset =
-                                    first_ebr_offset + (((off_t_64)
-                                        GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 8)) << sector_shift);
+    return serve_threads(ssd, nbd);
+#endif
+}
 
-                                read_next_ebr = TRUE;
+#ifndef _WIN32
+// Serves requests handed over to one worker, until connection is done.
+void *
+tagged_worker_thread(void *param)
+{
+    PDEVIO_TAGGED_WORKER worker = (PDEVIO_TAGGED_WORKER)param;
+    PDEVIO_TAGGED_QUEUE queue = worker->queue;
 
-                                break;
-                            }
+    tagged_worker = worker;
+    sd = queue->sd;
+    buffer_size = queue->buffer_size;
 
-                            ++c;
+    buf = (char*)malloc(buffer_size);
+    buf2 = (char*)malloc(buffer_size);
 
-                            if (c == partition_number)
-                            {
-                                image_offset += ((off_t_64)
-                                    GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 8))
-                                    << sector_shift;
-                                devio_info.file_size = ((off_t_64)
-                                    GetLittleEndian32U((uint8_t*)ebr + 512 - 66 + (e << 4) + 12))
-                                    << sector_shift;
+    if (buf == NULL || buf2 == NULL)
+        syslog(LOG_ERR, "malloc() failed: %m\n");
 
-                                break;
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    ++c;
+    pthread_mutex_lock(&queue->lock);
 
-                    if (c == partition_number)
-                    {
-                        image_offset = ((off_t_64)
-                            GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 8))
-                            << sector_shift;
-                        devio_info.file_size = ((off_t_64)
-                            GetLittleEndian32U((uint8_t*)mbr + 512 - 66 + (i << 4) + 12))
-                            << sector_shift;
+    for (;;)
+    {
+        int result = 0;
 
-                        break;
-                    }
-                }
-            }
+        while (!worker->busy && !queue->closing)
+            pthread_cond_wait(&queue->work, &queue->lock);
 
-            if ((devio_info.file_size == 0) ||
-                ((current_size != 0) &&
-                (image_offset + (off_t_64)devio_info.file_size > current_size)))
-            {
-                syslog(LOG_ERR,
-                    "Partition %i not found.\n", partition_number);
-                return 1;
-            }
+        if (!worker->busy)
+            break;
 
-            printf("Using partition %i.\n", partition_number);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (current_export != worker->export_item)
+        {
+            export_load(worker->export_item);
+            current_export = worker->export_item;
         }
-        else
-            puts("No master boot record detected. Using entire image.");
-    }
 
-    if (image_offset == 0 && argc > 4)
-    {
-        int64_t offset64 = image_offset;
+        export_qos = worker->export_qos;
 
-        char suf = 0;
-        if (sscanf(argv[4], SLL_FMT "%c", &offset64, &suf) == 2)
-            switch (suf)
-            {
-            case 'T':
-                offset64 <<= 10;
-            case 'G':
-                offset64 <<= 10;
-            case 'M':
-                offset64 <<= 10;
-            case 'K':
-                offset64 <<= 10;
-            case 'B':
-                break;
-            case 't':
-                offset64 *= 1000;
-            case 'g':
-                offset64 *= 1000;
-            case 'm':
-                offset64 *= 1000;
-            case 'k':
-                offset64 *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
-            }
-        else
-            offset64 <<= 9;
+        queued_ptr = worker->request;
+        queued_left = worker->request_length;
 
-        if ((((int64_t)(-1) - (off_t_64)(-1)) & offset64) != 0)
+        if (buf != NULL && buf2 != NULL)
+            result = tagged_serve(worker->io_tag, worker->request_code);
+
+        if (worker->sending)
         {
-            syslog(LOG_ERR, "Offset too big for this system.\n");
+            pthread_mutex_unlock(&queue->send_lock);
+            worker->sending = 0;
         }
 
-        image_offset = (off_t_64)offset64;
+        // Connection thread sees the connection closed and stops reading
+        // requests
+        if (!result)
+            shutdown(queue->sd, SHUT_RDWR);
 
-        argc--;
-        argv++;
+        pthread_mutex_lock(&queue->lock);
+
+        worker->busy = 0;
+        --queue->busy;
+        pthread_cond_broadcast(&queue->done);
     }
 
-    if (argc > 4)
-    {
-        if (sscanf(argv[4], ULL_FMT, &devio_info.req_alignment) != 1)
-        {
-            syslog(LOG_ERR, "Invalid alignment specification: '%s'\n",
-                argv[4]);
+    pthread_mutex_unlock(&queue->lock);
 
-            return -1;
-        }
+    free(buf);
+    free(buf2);
+    free(crypt_buf);
+
+    return NULL;
+}
+
+// Starts workers for tagged requests on this connection. Returns 0 if
+// requests are to be served by connection thread instead, as with library
+// backends that are not known to be thread safe.
+int
+tagged_start()
+{
+    PDEVIO_TAGGED_QUEUE queue;
+    int count = queue_depth < MAX_TAGGED_WORKERS ?
+        (int)queue_depth : MAX_TAGGED_WORKERS;
+    int i;
+
+#ifdef DEVIO_FUZZ
+    return 0;
+#endif
+
+    if (dll_mode || shm_mode || drv_mode)
+        return 0;
+
+    queue = (PDEVIO_TAGGED_QUEUE)calloc(1, sizeof(*queue));
+    if (queue == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed: %m\n");
+        return 0;
     }
-    else
+
+    // A single connection without export list shares the image with its
+    // workers in the same way connection threads do
+    if (current_export == NULL)
     {
-        devio_info.req_alignment = DEF_REQUIRED_ALIGNMENT;
+        export_save(&image_export);
+        pthread_mutex_init(&image_export.alloc_lock, NULL);
+        export_use(&image_export, 1);
+        current_export = &image_export;
     }
 
-    if (argc > 5)
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    pthread_cond_init(&queue->done, NULL);
+    pthread_mutex_init(&queue->send_lock, NULL);
+
+    queue->sd = sd;
+    queue->buffer_size = buffer_size;
+    queue->conn_qos = &conn_qos;
+
+    for (i = 0; i < count; i++)
     {
-        char suf = 0;
-        if (sscanf(argv[5], SIZ_FMT "%c", &buffer_size, &suf) == 2)
+        PDEVIO_TAGGED_WORKER worker = queue->workers + queue->worker_count;
+        int error;
+
+        worker->queue = queue;
+
+        error = pthread_create(&worker->thread, NULL, tagged_worker_thread,
+            worker);
+        if (error != 0)
         {
-            switch (suf)
-            {
-            case 'T':
-                buffer_size <<= 10;
-            case 'G':
-                buffer_size <<= 10;
-            case 'M':
-                buffer_size <<= 10;
-            case 'K':
-                buffer_size <<= 10;
-            case 'B':
-                break;
-            case 't':
-                buffer_size *= 1000;
-            case 'g':
-                buffer_size *= 1000;
-            case 'm':
-                buffer_size *= 1000;
-            case 'k':
-                buffer_size *= 1000;
-            case 'b':
-                break;
-            default:
-                syslog(LOG_ERR, "Unsupported size suffix: %c\n", suf);
-            }
+            errno = error;
+            syslog(LOG_ERR, "pthread_create() failed: %m\n");
+            break;
         }
 
-        /*
-        buffer_size = 0;
-        sscanf(argv[5], "%u", &buffer_size);
-        */
+        ++queue->worker_count;
     }
 
-    printf("Total size: " SLL_FMT " bytes. Using " ULL_FMT " bytes from offset "
-        SLL_FMT ".\n"
-        "Required alignment: " ULL_FMT " bytes.\n"
-        "Buffer size: " SIZ_FMT " bytes.\n",
-        (int64_t)current_size,
-        devio_info.file_size,
-        (int64_t)image_offset,
-        devio_info.req_alignment,
-        buffer_size);
-
-    retval = do_comm(comm_device);
+    if (queue->worker_count == 0)
+    {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->work);
+        pthread_cond_destroy(&queue->done);
+        pthread_mutex_destroy(&queue->send_lock);
+        free(queue);
+        return 0;
+    }
 
-    printf("Image close result: %i\n", physical_close(image_fd));
+    tagged_queue = queue;
 
-    return retval;
+    return 1;
 }
 
-#ifdef _WIN32
-int
-do_comm_shm(char *comm_device)
+// Waits until workers have sent responses to all requests handed to them,
+// so that connection thread can use the connection.
+void
+tagged_drain()
 {
-    HANDLE hFileMap = NULL;
-    MEMORY_BASIC_INFORMATION memory_info = { 0 };
-    safeio_size_t detected_buffer_size = 0;
-    ULARGE_INTEGER map_size = { 0 };
-    char *objname = (char*)malloc(OBJNAME_SIZE);
-    char *namespace_prefix;
-    HANDLE h = CreateFile("\\\\?\\Global", 0, FILE_SHARE_READ, NULL,
-        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if ((h == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_FILE_NOT_FOUND))
-        namespace_prefix = "";
-    else
-        namespace_prefix = "Global\\";
+    if (tagged_queue == NULL)
+        return;
 
-    if (h != INVALID_HANDLE_VALUE)
-        CloseHandle(h);
+    pthread_mutex_lock(&tagged_queue->lock);
 
-    if (objname == NULL)
-    {
-        syslog(LOG_ERR, "Memory allocation failed: %m\n");
-        return -1;
-    }
+    while (tagged_queue->busy > 0)
+        pthread_cond_wait(&tagged_queue->done, &tagged_queue->lock);
 
-    puts("Shared memory operation.");
+    pthread_mutex_unlock(&tagged_queue->lock);
+}
 
-    _snprintf(objname, OBJNAME_SIZE,
-        "%s%s", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
+// Lets workers finish requests in flight and stops them.
+void
+tagged_stop()
+{
+    PDEVIO_TAGGED_QUEUE queue = tagged_queue;
+    int i;
 
-    map_size.QuadPart = (ULONGLONG)buffer_size + IMDPROXY_HEADER_SIZE;
+    if (queue == NULL)
+        return;
 
-    hFileMap = CreateFileMapping(INVALID_HANDLE_VALUE,
-        NULL,
-        PAGE_READWRITE | SEC_COMMIT,
-        map_size.HighPart,
-        map_size.LowPart,
-        objname);
+    tagged_drain();
 
-    if (hFileMap == NULL)
-    {
-        syslog(LOG_ERR, "CreateFileMapping() failed: %m\n");
-        return 2;
-    }
+    pthread_mutex_lock(&queue->lock);
+    queue->closing = 1;
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
 
-    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    for (i = 0; i < queue->worker_count; i++)
     {
-        syslog(LOG_ERR, "A service with this name is already running.\n");
-        return 2;
+        pthread_join(queue->workers[i].thread, NULL);
+        free(queue->workers[i].request);
     }
 
-    shm_view = (char*)MapViewOfFile(hFileMap, FILE_MAP_WRITE, 0, 0, 0);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work);
+    pthread_cond_destroy(&queue->done);
+    pthread_mutex_destroy(&queue->send_lock);
+    free(queue);
 
-    if (shm_view == NULL)
+    tagged_queue = NULL;
+}
+
+// Reads a tagged read, write, unmap or zero request with its data and hands
+// it over to a free worker. Requests with more data than a worker can
+// buffer are served by the connection thread when workers are idle, which
+// fails them in the same way as untagged requests.
+int
+tagged_dispatch(ULONGLONG io_tag, ULONGLONG req)
+{
+    PDEVIO_TAGGED_WORKER worker = NULL;
+    union
     {
-        syslog(LOG_ERR, "MapViewOfFile() failed: %m\n");
-        return 2;
-    }
+        IMDPROXY_READ_REQ read;
+        IMDPROXY_WRITE_REQ write;
+        IMDPROXY_UNMAP_REQ unmap;
+    } req_block = { { 0 } };
+    char *header = (char*)&req_block + sizeof(req_block.read.request_code);
+    safeio_size_t header_size;
+    ULONGLONG data_length;
+    int i;
 
-    buf = shm_view + IMDPROXY_HEADER_SIZE;
+    switch (req)
+    {
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_WRITE:
+        header_size = sizeof(IMDPROXY_READ_REQ) -
+            sizeof(req_block.read.request_code);
+        break;
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        header_size = sizeof(IMDPROXY_UNMAP_REQ) -
+            sizeof(req_block.unmap.request_code);
+        break;
+
+    default:
+        return tagged_serve(io_tag, req);
+    }
 
-    if (!VirtualQuery(shm_view, &memory_info, sizeof(memory_info)))
+    if (!comm_read(header, header_size))
     {
-        syslog(LOG_ERR, "VirtualQuery() failed: %m\n");
-        return 2;
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
     }
 
-    detected_buffer_size = (safeio_size_t)
-        (memory_info.RegionSize - IMDPROXY_HEADER_SIZE);
+    if (req == IMDPROXY_REQ_READ)
+        data_length = 0;
+    else if (req == IMDPROXY_REQ_WRITE)
+        data_length = req_block.write.length;
+    else
+        data_length = req_block.unmap.length;
 
-    if (buffer_size != detected_buffer_size)
+    pthread_mutex_lock(&tagged_queue->lock);
+
+    while (worker == NULL)
     {
-        buffer_size = detected_buffer_size;
-        if (buf2 != NULL)
-        {
-            free(buf2);
-            buf2 = (char*)malloc(buffer_size);
-            if (buf2 == NULL)
+        for (i = 0; i < tagged_queue->worker_count; i++)
+            if (!tagged_queue->workers[i].busy)
             {
-                syslog(LOG_ERR, "malloc() failed: %m\n");
-                return 2;
+                worker = tagged_queue->workers + i;
+                break;
             }
-        }
+
+        if (worker == NULL)
+            pthread_cond_wait(&tagged_queue->done, &tagged_queue->lock);
     }
 
-    _snprintf(objname, OBJNAME_SIZE,
-        "%s%s_Server", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_server_mutex = CreateMutex(NULL, FALSE, objname);
+    pthread_mutex_unlock(&tagged_queue->lock);
 
-    if (shm_server_mutex == NULL)
+    if (data_length <= max_buffer_size &&
+        header_size + data_length > worker->request_size)
     {
-        syslog(LOG_ERR, "CreateMutex() failed: %m\n");
-        return 2;
+        char *request = (char*)realloc(worker->request,
+            (size_t)(header_size + data_length));
+
+        if (request != NULL)
+        {
+            worker->request = request;
+            worker->request_size = (safeio_size_t)(header_size + data_length);
+        }
     }
 
-    if (WaitForSingleObject(shm_server_mutex, 0) != WAIT_OBJECT_0)
+    if (data_length > max_buffer_size ||
+        header_size + data_length > worker->request_size)
     {
-        syslog(LOG_ERR, "A service with this name is already running.\n");
-        return 2;
-    }
+        tagged_drain();
 
-    _snprintf(objname, OBJNAME_SIZE,
-        "%s%s_Request", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_request_event = CreateEvent(NULL, FALSE, FALSE, objname);
+        queued_ptr = header;
+        queued_left = header_size;
 
-    if (shm_request_event == NULL)
-    {
-        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
-        return 2;
+        return tagged_serve(io_tag, req);
     }
 
-    _snprintf(objname, OBJNAME_SIZE,
-        "%s%s_Response", namespace_prefix, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
-    shm_response_event = CreateEvent(NULL, FALSE, FALSE, objname);
+    memcpy(worker->request, header, header_size);
 
-    if (shm_response_event == NULL)
+    if (!comm_read(worker->request + header_size,
+        (safeio_size_t)data_length))
     {
-        syslog(LOG_ERR, "CreateEvent() failed: %m\n");
-        return 2;
+        syslog(LOG_ERR, "Warning: I/O stream inconsistency.\n");
+        return 0;
     }
 
-    free(objname);
-    objname = NULL;
-
-    shm_mode = 1;
+    worker->io_tag = io_tag;
+    worker->request_code = req;
+    worker->request_length = (safeio_size_t)(header_size + data_length);
+    worker->export_item = current_export;
+    worker->export_qos = export_qos;
 
-    printf("Waiting for connection on object %s. Press Ctrl+C to cancel.\n",
-        comm_device);
+    pthread_mutex_lock(&tagged_queue->lock);
 
-    if (WaitForSingleObject(shm_request_event, INFINITE) != WAIT_OBJECT_0)
-    {
-        syslog(LOG_ERR, "Wait failed: %m.\n");
-        return 2;
-    }
+    worker->busy = 1;
+    ++tagged_queue->busy;
+    pthread_cond_broadcast(&tagged_queue->work);
 
-    printf("Connection on object %s.\n",
-        comm_device);
+    pthread_mutex_unlock(&tagged_queue->lock);
 
-    return 0;
+    return 1;
 }
+#endif
 
+// Reads a tagged request header. Tagged requests are served by worker
+// threads where possible and complete in any order, otherwise one at a
+// time in the order they arrive.
 int
-do_comm_drv(char *comm_device)
+tagged_request()
 {
-    int rc;
+    struct
+    {
+        ULONGLONG io_tag;
+        ULONGLONG request_code;
+    } req_block = { 0 };
 
-    char *objname = (char*)malloc(OBJNAME_SIZE);
-    if (objname == NULL)
+    if (!comm_read(&req_block, sizeof req_block))
     {
-        syslog(LOG_ERR, "Memory allocation failed: %m");
-        return -1;
+        syslog(LOG_ERR, "Error reading request header.\n");
+        return 0;
     }
 
-    drv_memory_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    drv_request_io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-    if (drv_memory_io.hEvent == NULL || drv_request_io.hEvent == NULL)
+    if (queue_depth == 0 || req_block.io_tag >= queue_depth)
     {
-        syslog(LOG_ERR, "Event object create failed: %m");
-        return -1;
+        syslog(LOG_ERR, "Invalid tag " ULL_FMT " in tagged request.\n",
+            req_block.io_tag);
+        return 0;
     }
 
-    puts("Driver mode.");
+#ifndef _WIN32
+    if (tagged_queue != NULL || tagged_start())
+        return tagged_dispatch(req_block.io_tag, req_block.request_code);
+#endif
 
-    _snprintf(objname, OBJNAME_SIZE,
-        "%ws\\%s", DEVIODRV_DEVICE_DOSDEV_NAME, comm_device);
-    objname[OBJNAME_SIZE - 1] = 0;
+    return tagged_serve(req_block.io_tag, req_block.request_code);
+}
 
-    sd = (SOCKET)CreateFile(objname, GENERIC_ALL, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+// Serves imdproxy requests on an established connection until it is
+// closed.
+int
+serve_requests()
+{
+    ULONGLONG req = 0;
 
-    if (sd == INVALID_SOCKET)
+    for (;;)
     {
-        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        if (compact_mode)
         {
-            syslog(LOG_ERR, "A service with this name is already running.\n");
+#ifndef _WIN32
+            // Compaction moves blocks, so requests that workers are
+            // serving must be done first
+            if (comm_idle(0))
+                tagged_drain();
+#endif
+            compact_while_idle();
         }
-        else
+
+        if (!comm_read(&req, sizeof(req)))
         {
-            syslog(LOG_ERR, "Error opening '%s': %m", objname);
+#ifndef _WIN32
+            tagged_stop();
+#endif
+            qos_report();
+            puts("Connection closed.");
+            return 0;
         }
 
-        return 2;
-    }
+#ifndef _WIN32
+        // Other requests are served in order, after tagged requests sent
+        // before them
+        if (req != IMDPROXY_REQ_TAGGED)
+            tagged_drain();
+#endif
 
-    free(objname);
-    objname = NULL;
+        // Without a connect request, connection uses first export
+        if (req != IMDPROXY_REQ_CONNECT && current_export == NULL &&
+            export_count > 0 && !export_select(NULL))
+            return 1;
 
-    rc = alloc_drv_buffer();
-    if (rc > 0)
-    {
-        return rc;
-    }
+        switch (req)
+        {
+        case IMDPROXY_REQ_CONNECT:
+            trace_record(req, 0, 0, NULL);
+            if (!connect_export())
+                return 1;
+            break;
 
-    drv_mode = 1;
+        case IMDPROXY_REQ_INFO:
+            trace_record(req, 0, 0, NULL);
+            if (!send_info())
+                return 1;
+            break;
 
-    printf("Waiting for client connection on object %s. Press Ctrl+C to cancel.\n",
-        comm_device);
+        case IMDPROXY_REQ_READ:
+            if (!read_data())
+                return 1;
+            break;
 
-    ((PIMDPROXY_DEVIODRV_BUFFER_HEADER)shm_view)->request_code = IMDPROXY_REQ_INFO;
+        case IMDPROXY_REQ_WRITE:
+            if (!write_data())
+                return 1;
+            break;
 
-    if (!send_info())
-    {
-        syslog(LOG_ERR, "Wait failed: %m.\n");
-        return 2;
-    }
+        case IMDPROXY_REQ_UNMAP:
+        case IMDPROXY_REQ_ZERO:
+            if (!unmap_or_zero(req))
+                return 1;
+            break;
 
-    printf("Connection on object %s.\n",
-        comm_device);
+        case IMDPROXY_REQ_CBT:
+            if (!cbt_query())
+                return 1;
+            break;
 
-    return 0;
+        case IMDPROXY_REQ_TAGGED:
+            if (!tagged_request())
+                return 1;
+            break;
+
+        default:
+            trace_record(req, 0, 0, NULL);
+            req = ENODEV;
+            if (!comm_write(&req, sizeof req))
+            {
+                syslog(LOG_ERR, "stdout: %m\n");
+                return 1;
+            }
+
+            if (!comm_flush())
+            {
+                syslog(LOG_ERR, "Error flushing comm data: %m\n");
+                return 1;
+            }
+        }
+    }
 }
-#endif
 
 int
 do_comm(char *comm_device)
 {
-    ULONGLONG req = 0;
     u_short port = (u_short)strtoul(comm_device, NULL, 0);
+    int retval;
 
     if (_strnicmp(comm_device, "shm:", 4) == 0)
     {
@@ -2092,6 +6898,10 @@ do_comm(char *comm_device)
     if (shm_mode || drv_mode)
     {
     }
+    else if (_strnicmp(comm_device, "nbd:", 4) == 0)
+    {
+        return do_comm_nbd(comm_device + 4);
+    }
     else if (port != 0)
     {
         struct sockaddr_in saddr = { 0 };
@@ -2182,42 +6992,85 @@ do_comm(char *comm_device)
         printf("Waiting for I/O requests on device '%s'.\n", comm_device);
     }
 
-    for (;;)
-    {
-        if (!comm_read(&req, sizeof(req)))
-        {
-            puts("Connection closed.");
-            return 0;
-        }
+#ifdef _WIN32
+    // select() only works with sockets on Windows
+    comm_selectable = port != 0;
+#else
+    comm_selectable = !shm_mode && !drv_mode;
+#endif
 
-        switch (req)
-        {
-        case IMDPROXY_REQ_INFO:
-            if (!send_info())
-                return 1;
-            break;
+    retval = serve_requests();
 
-        case IMDPROXY_REQ_READ:
-            if (!read_data())
-                return 1;
-            break;
+#ifndef _WIN32
+    tagged_stop();
+#endif
 
-        case IMDPROXY_REQ_WRITE:
-            if (!write_data())
-                return 1;
-            break;
+    return retval;
+}
 
-        default:
-            req = ENODEV;
-            if (!comm_write(&req, sizeof req))
-            {
-                syslog(LOG_ERR, "stdout: %m\n");
-                return 1;
-            }
-        }
+#ifdef DEVIO_FUZZ
+
+// Opens an image as with devio command line arguments and serves requests
+// read from data, as imdproxy requests or as an NBD connection from
+// negotiation on, with global state reset so that it can be called again
+// for each fuzz input. Returns result of open_image() or of serving.
+int
+devio_fuzz_serve(int argc, char **argv, int read_only,
+    unsigned int depth, int nbd, const void *data, size_t size)
+{
+    int retval;
+
+    image_fd = -1;
+    buf = NULL;
+    buf2 = NULL;
+    buffer_size = DEF_BUFFER_SIZE;
+    max_buffer_size = DEF_MAX_BUFFER_SIZE;
+    image_offset = 0;
+    memset(&devio_info, 0, sizeof(devio_info));
+    devio_info.flags = read_only ? IMDPROXY_FLAG_RO : 0;
+    vhd_mode = 0;
+    memset(&vhd_info, 0, sizeof(vhd_info));
+    block_size = 0;
+    sector_size = 512;
+    table_offset = 0;
+    table_entries = 0;
+    vhd_file_size = 0;
+    block_shift = 0;
+    sector_shift = 0;
+    current_size = 0;
+    queue_depth = depth;
+    tagged_io = 0;
+
+    fuzz_comm_ptr = (const char*)data;
+    fuzz_comm_left = size;
+
+    retval = open_image(argc, argv);
+
+    if (retval == 0)
+    {
+        buf = (char*)malloc(buffer_size);
+        if (buf == NULL)
+            retval = 2;
+        else if (nbd)
+            retval = nbd_negotiate() ? nbd_transmission() : 0;
+        else
+            retval = serve_requests();
     }
+
+    if (image_fd != -1)
+        physical_close(image_fd);
+
+    free(buf);
+    free(buf2);
+    buf = NULL;
+    buf2 = NULL;
+    image_fd = -1;
+
+    return retval;
 }
 
+#endif // DEVIO_FUZZ
+
 #ifdef _WIN32
 
 LONG
@@ -43,6 +43,8 @@ typedef int socklen_t;
 #define SIZ_FMT         "%u"
 #define SSZ_FMT         "%i"
 
+#define ftruncate       _chsize_s
+
 #else
 
 typedef size_t safeio_size_t;
@@ -60,6 +62,7 @@ typedef int SOCKET;
 #define _flushall       flushall
 #define _open           open
 #define _close          close
+#define _commit         fsync
 #define _stricmp        strcasecmp
 #define _strnicmp       strncasecmp
 
@@ -0,0 +1,585 @@
+/*
+Load generator for devio servers.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devioclnt.h"
+#include "devioq.h"
+#include "devstats.h"
+
+typedef struct _BENCH_PENDING
+{
+    char write;
+    char busy;
+    uint64_t issue_time;
+    ULONGLONG length;
+    struct _BENCH_CONNECTION *conn;
+} BENCH_PENDING;
+
+typedef struct _BENCH_CONNECTION
+{
+    DEVIO_CLIENT client;
+    DEVIO_QUEUE queue;
+    int tagged;
+    pthread_t sender;
+    pthread_t receiver;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    BENCH_PENDING *pending;
+    unsigned int head;
+    unsigned int in_flight;
+    int done_sending;
+    int failed;
+    uint64_t random_state;
+    ULONGLONG next_offset;
+    ULONGLONG errors;
+    char *read_buf;
+    char *write_buf;
+    LATENCY_LIST reads;
+    LATENCY_LIST writes;
+} BENCH_CONNECTION;
+
+char *endpoint = NULL;
+int random_pattern = 0;
+int write_percent = 0;
+ULONGLONG block_size = 4096;
+ULONGLONG span = 0;
+unsigned int queue_depth = 1;
+int untagged = 0;
+unsigned int connections = 1;
+uint64_t duration = 10000000;
+ULONGLONG max_requests = 0;
+uint64_t stop_time = 0;
+
+uint64_t
+bench_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+// Chooses offset and type of next request. Returns non-zero for writes.
+char
+bench_next_request(BENCH_CONNECTION *conn, ULONGLONG *offset)
+{
+    char write =
+        (int)(bench_random(&conn->random_state) % 100) < write_percent;
+
+    if (random_pattern)
+    {
+        *offset = bench_random(&conn->random_state) % (span / block_size) *
+            block_size;
+    }
+    else
+    {
+        if (conn->next_offset + block_size > span)
+            conn->next_offset = 0;
+
+        *offset = conn->next_offset;
+        conn->next_offset += block_size;
+    }
+
+    return write;
+}
+
+void *
+bench_sender(void *arg)
+{
+    BENCH_CONNECTION *conn = (BENCH_CONNECTION*)arg;
+    ULONGLONG sent = 0;
+
+    for (;;)
+    {
+        BENCH_PENDING *entry;
+        ULONGLONG offset;
+        char write;
+        int ok;
+
+        pthread_mutex_lock(&conn->lock);
+
+        while (conn->in_flight == queue_depth && !conn->failed)
+            pthread_cond_wait(&conn->cond, &conn->lock);
+
+        if (conn->failed ||
+            stats_clock() >= stop_time ||
+            (max_requests != 0 && sent >= max_requests))
+        {
+            conn->done_sending = 1;
+            pthread_cond_broadcast(&conn->cond);
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+
+        write = bench_next_request(conn, &offset);
+
+        entry = conn->pending +
+            (conn->head + conn->in_flight) % queue_depth;
+
+        entry->write = write;
+        entry->length = block_size;
+        entry->issue_time = stats_clock();
+
+        ++conn->in_flight;
+
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (write)
+            ok = devio_client_send_write(&conn->client, conn->write_buf,
+                offset, block_size);
+        else
+            ok = devio_client_send_read(&conn->client, offset, block_size);
+
+        if (!ok)
+        {
+            pthread_mutex_lock(&conn->lock);
+            conn->failed = 1;
+            pthread_cond_broadcast(&conn->cond);
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+
+        ++sent;
+    }
+
+    return NULL;
+}
+
+void
+bench_tagged_complete(void *context, ULONGLONG request_code,
+    ULONGLONG errorno, ULONGLONG length)
+{
+    BENCH_PENDING *entry = (BENCH_PENDING*)context;
+    BENCH_CONNECTION *conn = entry->conn;
+    uint64_t latency = stats_clock() - entry->issue_time;
+
+    pthread_mutex_lock(&conn->lock);
+
+    if (errorno != 0)
+        ++conn->errors;
+    else
+        latency_add(entry->write ? &conn->writes : &conn->reads, latency,
+            length);
+
+    entry->busy = 0;
+
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Sends tagged requests through a devio_queue, which reads responses in
+// its own thread and completes them in any order.
+void *
+bench_tagged_sender(void *arg)
+{
+    BENCH_CONNECTION *conn = (BENCH_CONNECTION*)arg;
+    ULONGLONG sent = 0;
+
+    for (;;)
+    {
+        BENCH_PENDING *entry = NULL;
+        ULONGLONG offset;
+        unsigned int i;
+
+        if (stats_clock() >= stop_time ||
+            (max_requests != 0 && sent >= max_requests))
+            break;
+
+        pthread_mutex_lock(&conn->lock);
+
+        for (;;)
+        {
+            for (i = 0; i < conn->queue.depth; i++)
+                if (!conn->pending[i].busy)
+                {
+                    entry = conn->pending + i;
+                    break;
+                }
+
+            if (entry != NULL)
+                break;
+
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        }
+
+        entry->write = bench_next_request(conn, &offset);
+        entry->busy = 1;
+        entry->length = block_size;
+        entry->issue_time = stats_clock();
+
+        pthread_mutex_unlock(&conn->lock);
+
+        if (!devio_queue_submit(&conn->queue,
+            entry->write ? IMDPROXY_REQ_WRITE : IMDPROXY_REQ_READ,
+            entry->write ? conn->write_buf : conn->read_buf,
+            offset, block_size, bench_tagged_complete, entry))
+            break;
+
+        ++sent;
+    }
+
+    if (!devio_queue_stop(&conn->queue))
+    {
+        fprintf(stderr, "Connection lost.\n");
+        conn->failed = 1;
+    }
+
+    return NULL;
+}
+
+void *
+bench_receiver(void *arg)
+{
+    BENCH_CONNECTION *conn = (BENCH_CONNECTION*)arg;
+
+    for (;;)
+    {
+        BENCH_PENDING entry;
+        ULONGLONG errorno;
+        ULONGLONG length;
+        int ok;
+
+        pthread_mutex_lock(&conn->lock);
+
+        while (conn->in_flight == 0 && !conn->done_sending && !conn->failed)
+            pthread_cond_wait(&conn->cond, &conn->lock);
+
+        if (conn->in_flight == 0 || conn->failed)
+        {
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+
+        entry = conn->pending[conn->head];
+
+        pthread_mutex_unlock(&conn->lock);
+
+        if (entry.write)
+        {
+            IMDPROXY_WRITE_RESP resp;
+
+            ok = devio_client_recv_write(&conn->client, &resp);
+            errorno = resp.errorno;
+            length = resp.length;
+        }
+        else
+        {
+            IMDPROXY_READ_RESP resp;
+
+            ok = devio_client_recv_read(&conn->client, conn->read_buf,
+                entry.length, &resp);
+            errorno = resp.errorno;
+            length = resp.length;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+
+        if (!ok)
+        {
+            fprintf(stderr, "Connection lost.\n");
+            conn->failed = 1;
+        }
+        else
+        {
+            conn->head = (conn->head + 1) % queue_depth;
+            --conn->in_flight;
+        }
+
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (!ok)
+            break;
+
+        if (errorno != 0)
+            ++conn->errors;
+        else
+            latency_add(entry.write ? &conn->writes : &conn->reads,
+                stats_clock() - entry.issue_time, length);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    BENCH_CONNECTION *conns;
+    LATENCY_LIST reads = { 0 };
+    LATENCY_LIST writes = { 0 };
+    LATENCY_LIST all = { 0 };
+    ULONGLONG errors = 0;
+    uint64_t start_time;
+    uint64_t end_time;
+    unsigned int i;
+    int failed = 0;
+    int opt;
+
+    openlog("deviobench", LOG_PERROR, LOG_USER);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "p:w:b:s:q:uc:t:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            if (strcmp(optarg, "rand") == 0)
+                random_pattern = 1;
+            else if (strcmp(optarg, "seq") == 0)
+                random_pattern = 0;
+            else
+                argc = 0;
+            break;
+
+        case 'w':
+            write_percent = atoi(optarg);
+            if (write_percent < 0 || write_percent > 100)
+                argc = 0;
+            break;
+
+        case 'b':
+            if (!parse_size(optarg, &block_size) || block_size == 0)
+                return -1;
+            break;
+
+        case 's':
+            if (!parse_size(optarg, &span))
+                return -1;
+            break;
+
+        case 'q':
+            queue_depth = (unsigned int)strtoul(optarg, NULL, 0);
+            if (queue_depth == 0)
+                argc = 0;
+            break;
+
+        case 'u':
+            untagged = 1;
+            break;
+
+        case 'c':
+            connections = (unsigned int)strtoul(optarg, NULL, 0);
+            if (connections == 0)
+                argc = 0;
+            break;
+
+        case 't':
+            duration = (uint64_t)(strtod(optarg, NULL) * 1000000.0);
+            break;
+
+        case 'n':
+            max_requests = strtoull(optarg, NULL, 0);
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        fprintf(stderr,
+            "deviobench - Load generator for devio servers\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "deviobench [-p seq|rand] [-w writepercent] [-b blocksize] [-s span]\n"
+            "           [-q queuedepth [-u]] [-c connections] [-t seconds]\n"
+            "           [-n requests]\n"
+            "           host:port|exec:command|fd:number|nbd:host:port[/export]\n"
+            "\n"
+            "-p      Access pattern, sequential or uniformly random. Default seq.\n"
+            "-w      Percentage of requests that are writes. Default 0.\n"
+            "-b      Block size. Default 4K.\n"
+            "-s      Size of area at start of image to access. Default whole image.\n"
+            "-q      Requests in flight per connection. Default 1. Requests are\n"
+            "        tagged if the server accepts tagged requests, and the number\n"
+            "        in flight is then limited to the queue depth of the server.\n"
+            "-u      Send untagged requests even if the server accepts tagged\n"
+            "        requests, and read responses in request order.\n"
+            "-c      Number of connections. Each connection opens the endpoint\n"
+            "        separately, so exec: endpoints start one server per\n"
+            "        connection. Default 1.\n"
+            "-t      Run time in seconds. Default 10.\n"
+            "-n      Stop after this many requests per connection.\n"
+            "\n"
+            "nbd: endpoints connect to NBD servers, for example devio with an nbd:\n"
+            "commdev, to compare NBD with the devio protocol on the same image.\n"
+            "\n"
+            "Writes overwrite image contents, so only benchmark writes against\n"
+            "scratch images.\n");
+
+        return -1;
+    }
+
+    endpoint = argv[optind];
+
+    conns = (BENCH_CONNECTION*)calloc(connections, sizeof(*conns));
+    if (conns == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    for (i = 0; i < connections; i++)
+    {
+        BENCH_CONNECTION *conn = conns + i;
+
+        if (!devio_client_open(&conn->client, endpoint))
+            return 1;
+
+        if (span == 0 || span > conn->client.info.file_size)
+            span = conn->client.info.file_size;
+
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+
+        conn->pending = (BENCH_PENDING*)
+            calloc(queue_depth, sizeof(*conn->pending));
+        conn->read_buf = (char*)malloc((size_t)block_size);
+        conn->write_buf = (char*)malloc((size_t)block_size);
+
+        if (conn->pending == NULL || conn->read_buf == NULL ||
+            conn->write_buf == NULL)
+        {
+            syslog(LOG_ERR, "Memory allocation failed: %m\n");
+            return 1;
+        }
+
+        memset(conn->write_buf, 0xA5, (size_t)block_size);
+
+        if (queue_depth > 1 && !untagged &&
+            devio_queue_start(&conn->queue, &conn->client, queue_depth))
+        {
+            unsigned int j;
+
+            conn->tagged = 1;
+
+            for (j = 0; j < conn->queue.depth; j++)
+                conn->pending[j].conn = conn;
+        }
+
+        conn->random_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+    }
+
+    if (span < block_size)
+    {
+        fprintf(stderr, "Image size " ULL_FMT " is smaller than block size "
+            ULL_FMT ".\n", span, block_size);
+        return 1;
+    }
+
+    printf("%s %u%% writes, block size " ULL_FMT ", span " ULL_FMT
+        ", queue depth %u%s, %u connection(s).\n",
+        random_pattern ? "Random" : "Sequential",
+        write_percent, block_size, span,
+        conns->tagged ? conns->queue.depth : queue_depth,
+        conns->tagged ? " tagged" : "", connections);
+
+    start_time = stats_clock();
+    stop_time = start_time + duration;
+
+    for (i = 0; i < connections; i++)
+    {
+        BENCH_CONNECTION *conn = conns + i;
+
+        conn->next_offset = span / block_size / connections * i * block_size;
+
+        if (conn->tagged ?
+            pthread_create(&conn->sender, NULL, bench_tagged_sender,
+                conn) != 0 :
+            pthread_create(&conn->receiver, NULL, bench_receiver, conn) != 0 ||
+            pthread_create(&conn->sender, NULL, bench_sender, conn) != 0)
+        {
+            syslog(LOG_ERR, "pthread_create() failed: %m\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < connections; i++)
+    {
+        BENCH_CONNECTION *conn = conns + i;
+
+        pthread_join(conn->sender, NULL);
+
+        if (!conn->tagged)
+            pthread_join(conn->receiver, NULL);
+    }
+
+    end_time = stats_clock();
+
+    for (i = 0; i < connections; i++)
+    {
+        BENCH_CONNECTION *conn = conns + i;
+
+        failed |= conn->failed;
+        errors += conn->errors;
+
+        latency_merge(&reads, &conn->reads);
+        latency_merge(&writes, &conn->writes);
+        latency_merge(&all, &conn->reads);
+        latency_merge(&all, &conn->writes);
+
+        devio_client_close(&conn->client);
+        latency_free(&conn->reads);
+        latency_free(&conn->writes);
+        free(conn->pending);
+        free(conn->read_buf);
+        free(conn->write_buf);
+    }
+
+    free(conns);
+
+    printf("Elapsed %.3f s, " ULL_FMT " errors.\n",
+        (double)(end_time - start_time) / 1000000.0, errors);
+
+    latency_report("Read", &reads, end_time - start_time);
+    latency_report("Write", &writes, end_time - start_time);
+    latency_report("Total", &all, end_time - start_time);
+
+    latency_free(&reads);
+    latency_free(&writes);
+    latency_free(&all);
+
+    return failed || errors != 0 ? 2 : 0;
+}
@@ -0,0 +1,692 @@
+/*
+Client side of the ImDisk proxy protocol, for tools talking to devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "safeio.h"
+#include "devioclnt.h"
+#include "devnbd.h"
+
+static SOCKET
+devio_client_connect_tcp(const char *endpoint)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo *result;
+    struct addrinfo *ai;
+    char *host = strdup(endpoint);
+    char *port;
+    SOCKET sd = INVALID_SOCKET;
+    int rc;
+
+    if (host == NULL)
+        return INVALID_SOCKET;
+
+    port = strrchr(host, ':');
+    if (port == NULL)
+    {
+        fprintf(stderr, "Endpoint must be specified as host:port\n");
+        free(host);
+        return INVALID_SOCKET;
+    }
+
+    *port++ = 0;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, port, &hints, &result);
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+        free(host);
+        return INVALID_SOCKET;
+    }
+
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        int i = 1;
+
+        sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sd == INVALID_SOCKET)
+            continue;
+
+        if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof i);
+            break;
+        }
+
+        closesocket(sd);
+        sd = INVALID_SOCKET;
+    }
+
+    freeaddrinfo(result);
+
+    if (sd == INVALID_SOCKET)
+        syslog(LOG_ERR, "Cannot connect to %s:%s: %m\n", host, port);
+
+    free(host);
+
+    return sd;
+}
+
+static SOCKET
+devio_client_spawn(PDEVIO_CLIENT client, const char *command)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        syslog(LOG_ERR, "socketpair() failed: %m\n");
+        return INVALID_SOCKET;
+    }
+
+    // Servers for other connections must not inherit this end, or they
+    // would keep the connection open after devio_client_close().
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        syslog(LOG_ERR, "fork() failed: %m\n");
+        close(sv[0]);
+        close(sv[1]);
+        return INVALID_SOCKET;
+    }
+
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        if (null_fd != -1)
+        {
+            dup2(null_fd, 1);
+            close(null_fd);
+        }
+
+        dup2(sv[1], 0);
+        close(sv[0]);
+        close(sv[1]);
+
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    client->child_pid = (int)pid;
+
+    return sv[0];
+}
+
+// Sends an NBD request. Cookies are the request length, so that replies,
+// which do not carry a length, can be matched with their data.
+static int
+devio_client_nbd_request(PDEVIO_CLIENT client,
+    uint16_t type,
+    ULONGLONG offset,
+    ULONGLONG length)
+{
+    unsigned char request[NBD_REQUEST_SIZE];
+
+    if (length > NBD_MAX_PAYLOAD)
+    {
+        syslog(LOG_ERR, "NBD request of " ULL_FMT " bytes too large.\n",
+            length);
+        return 0;
+    }
+
+    devnbd_put32(request, NBD_REQUEST_MAGIC);
+    devnbd_put16(request + 4, 0);
+    devnbd_put16(request + 6, type);
+    devnbd_put64(request + 8, length);
+    devnbd_put64(request + 16, offset);
+    devnbd_put32(request + 24, (uint32_t)length);
+
+    return safe_write(client->sd, request, sizeof(request));
+}
+
+// Reads a simple NBD reply and returns error and cookie from it.
+static int
+devio_client_nbd_reply(PDEVIO_CLIENT client,
+    ULONGLONG *errorno,
+    ULONGLONG *cookie)
+{
+    unsigned char reply[NBD_SIMPLE_REPLY_SIZE];
+
+    if (!safe_read(client->sd, reply, sizeof(reply)))
+        return 0;
+
+    if (devnbd_get32(reply) != NBD_SIMPLE_REPLY_MAGIC)
+    {
+        syslog(LOG_ERR, "Invalid NBD reply.\n");
+        return 0;
+    }
+
+    *errorno = devnbd_get32(reply + 4);
+    *cookie = devnbd_get64(reply + 8);
+
+    return 1;
+}
+
+// Fixed newstyle negotiation of an NBD export. Simple replies are used, so
+// replies have the same shape as devio responses.
+static int
+devio_client_nbd_negotiate(PDEVIO_CLIENT client, const char *export_name)
+{
+    unsigned char header[20];
+    unsigned char *option;
+    uint32_t name_length = (uint32_t)strlen(export_name);
+    uint32_t option_length = 4 + name_length + 2 + 2;
+    uint16_t handshake_flags;
+    uint32_t client_flags = NBD_FLAG_FIXED_NEWSTYLE;
+    int ok;
+
+    if (!safe_read(client->sd, header, 18))
+        return 0;
+
+    if (devnbd_get64(header) != NBD_MAGIC ||
+        devnbd_get64(header + 8) != NBD_OPTS_MAGIC)
+    {
+        fprintf(stderr, "Server does not support NBD newstyle negotiation.\n");
+        return 0;
+    }
+
+    handshake_flags = devnbd_get16(header + 16);
+    if ((handshake_flags & NBD_FLAG_FIXED_NEWSTYLE) == 0)
+    {
+        fprintf(stderr, "Server does not support NBD fixed newstyle "
+            "negotiation.\n");
+        return 0;
+    }
+
+    if (handshake_flags & NBD_FLAG_NO_ZEROES)
+        client_flags |= NBD_FLAG_NO_ZEROES;
+
+    option = (unsigned char*)malloc(16 + option_length);
+    if (option == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    // NBD_OPT_GO with export name and a request for block size information
+    devnbd_put32(header, client_flags);
+    devnbd_put64(option, NBD_OPTS_MAGIC);
+    devnbd_put32(option + 8, NBD_OPT_GO);
+    devnbd_put32(option + 12, option_length);
+    devnbd_put32(option + 16, name_length);
+    memcpy(option + 20, export_name, name_length);
+    devnbd_put16(option + 20 + name_length, 1);
+    devnbd_put16(option + 22 + name_length, NBD_INFO_BLOCK_SIZE);
+
+    ok = safe_write(client->sd, header, 4) &&
+        safe_write(client->sd, option, 16 + option_length);
+
+    free(option);
+
+    if (!ok)
+        return 0;
+
+    client->info.req_alignment = 1;
+
+    for (;;)
+    {
+        unsigned char data[64];
+        uint32_t reply_type;
+        uint32_t length;
+
+        if (!safe_read(client->sd, header, 20))
+            return 0;
+
+        if (devnbd_get64(header) != NBD_REP_MAGIC ||
+            devnbd_get32(header + 8) != NBD_OPT_GO)
+        {
+            syslog(LOG_ERR, "Invalid NBD option reply.\n");
+            return 0;
+        }
+
+        reply_type = devnbd_get32(header + 12);
+        length = devnbd_get32(header + 16);
+
+        if (length > sizeof(data))
+        {
+            // Error messages and unknown information are not needed
+            while (length > sizeof(data))
+            {
+                if (!safe_read(client->sd, data, sizeof(data)))
+                    return 0;
+
+                length -= sizeof(data);
+            }
+
+            if (!safe_read(client->sd, data, length))
+                return 0;
+
+            length = 0;
+        }
+        else if (!safe_read(client->sd, data, length))
+            return 0;
+
+        if (reply_type == NBD_REP_ACK)
+            return 1;
+
+        if (reply_type & 0x80000000)
+        {
+            fprintf(stderr, "Server refused NBD export '%s', error 0x%X.\n",
+                export_name, (unsigned int)reply_type);
+            return 0;
+        }
+
+        if (reply_type != NBD_REP_INFO || length < 2)
+            continue;
+
+        switch (devnbd_get16(data))
+        {
+        case NBD_INFO_EXPORT:
+            if (length < 12)
+                break;
+
+            client->info.file_size = devnbd_get64(data + 2);
+
+            if (devnbd_get16(data + 10) & NBD_FLAG_READ_ONLY)
+                client->info.flags |= IMDPROXY_FLAG_RO;
+            if (devnbd_get16(data + 10) & NBD_FLAG_SEND_TRIM)
+                client->info.flags |= IMDPROXY_FLAG_SUPPORTS_UNMAP;
+            if (devnbd_get16(data + 10) & NBD_FLAG_SEND_WRITE_ZEROES)
+                client->info.flags |= IMDPROXY_FLAG_SUPPORTS_ZERO;
+
+            break;
+
+        case NBD_INFO_BLOCK_SIZE:
+            if (length >= 14)
+                client->info.req_alignment = devnbd_get32(data + 2);
+
+            break;
+        }
+    }
+}
+
+int
+devio_client_open(PDEVIO_CLIENT client, const char *endpoint)
+{
+    memset(client, 0, sizeof(*client));
+
+    if (strncmp(endpoint, "nbd:", 4) == 0)
+    {
+        char *address = strdup(endpoint + 4);
+        char *export_name;
+        int ok;
+
+        if (address == NULL)
+            return 0;
+
+        export_name = strchr(address, '/');
+        if (export_name != NULL)
+            *export_name++ = 0;
+        else
+            export_name = "";
+
+        client->nbd = 1;
+        client->sd = devio_client_connect_tcp(address);
+
+        ok = client->sd != INVALID_SOCKET &&
+            devio_client_nbd_negotiate(client, export_name);
+
+        free(address);
+
+        if (!ok)
+        {
+            fprintf(stderr, "NBD negotiation with %s failed.\n", endpoint);
+            devio_client_close(client);
+            return 0;
+        }
+
+        return 1;
+    }
+    else if (strncmp(endpoint, "exec:", 5) == 0)
+    {
+        client->sd = devio_client_spawn(client, endpoint + 5);
+    }
+    else if (strncmp(endpoint, "fd:", 3) == 0)
+    {
+        client->sd = (SOCKET)strtol(endpoint + 3, NULL, 0);
+    }
+    else
+    {
+        client->sd = devio_client_connect_tcp(endpoint);
+    }
+
+    if (client->sd == INVALID_SOCKET)
+        return 0;
+
+    if (!devio_client_info(client))
+    {
+        fprintf(stderr, "Error reading server information from %s.\n",
+            endpoint);
+        devio_client_close(client);
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+devio_client_close(PDEVIO_CLIENT client)
+{
+    if (client->sd != INVALID_SOCKET)
+    {
+        if (client->nbd)
+            devio_client_nbd_request(client, NBD_CMD_DISC, 0, 0);
+
+        closesocket(client->sd);
+        client->sd = INVALID_SOCKET;
+    }
+
+    if (client->child_pid != 0)
+    {
+        waitpid((pid_t)client->child_pid, NULL, 0);
+        client->child_pid = 0;
+    }
+}
+
+int
+devio_client_info(PDEVIO_CLIENT client)
+{
+    ULONGLONG req = IMDPROXY_REQ_INFO;
+
+    // NBD servers send export information during negotiation only
+    if (client->nbd)
+        return 1;
+
+    return safe_write(client->sd, &req, sizeof req) &&
+        safe_read(client->sd, &client->info, sizeof client->info);
+}
+
+int
+devio_client_send_read(PDEVIO_CLIENT client,
+    ULONGLONG offset,
+    ULONGLONG length)
+{
+    IMDPROXY_READ_REQ req;
+
+    if (client->nbd)
+        return devio_client_nbd_request(client, NBD_CMD_READ, offset, length);
+
+    req.request_code = IMDPROXY_REQ_READ;
+    req.offset = offset;
+    req.length = length;
+
+    return safe_write(client->sd, &req, sizeof req);
+}
+
+int
+devio_client_recv_read(PDEVIO_CLIENT client,
+    void *io_ptr,
+    ULONGLONG max_length,
+    PIMDPROXY_READ_RESP resp)
+{
+    if (client->nbd)
+    {
+        if (!devio_client_nbd_reply(client, &resp->errorno, &resp->length))
+            return 0;
+
+        if (resp->errorno != 0)
+            resp->length = 0;
+    }
+    else if (!safe_read(client->sd, resp, sizeof(*resp)))
+        return 0;
+
+    if (resp->errorno != 0)
+        return 1;
+
+    if (resp->length > max_length)
+    {
+        syslog(LOG_ERR, "Server sent " ULL_FMT " bytes, expected " ULL_FMT
+            ".\n", resp->length, max_length);
+        return 0;
+    }
+
+    return safe_read(client->sd, io_ptr, (safeio_size_t)resp->length);
+}
+
+int
+devio_client_send_write(PDEVIO_CLIENT client,
+    const void *io_ptr,
+    ULONGLONG offset,
+    ULONGLONG length)
+{
+    IMDPROXY_WRITE_REQ req;
+
+    if (client->nbd)
+        return devio_client_nbd_request(client, NBD_CMD_WRITE, offset,
+            length) &&
+        safe_write(client->sd, io_ptr, (safeio_size_t)length);
+
+    req.request_code = IMDPROXY_REQ_WRITE;
+    req.offset = offset;
+    req.length = length;
+
+    return safe_write(client->sd, &req, sizeof req) &&
+        safe_write(client->sd, io_ptr, (safeio_size_t)length);
+}
+
+int
+devio_client_recv_write(PDEVIO_CLIENT client,
+    PIMDPROXY_WRITE_RESP resp)
+{
+    if (client->nbd)
+    {
+        if (!devio_client_nbd_reply(client, &resp->errorno, &resp->length))
+            return 0;
+
+        if (resp->errorno != 0)
+            resp->length = 0;
+
+        return 1;
+    }
+
+    return safe_read(client->sd, resp, sizeof(*resp));
+}
+
+// Tagged request header and request header are sent in one write, and
+// tag and response header are read in one read.
+int
+devio_client_send_tagged(PDEVIO_CLIENT client,
+    ULONGLONG io_tag,
+    ULONGLONG request_code,
+    const void *io_ptr,
+    ULONGLONG offset,
+    ULONGLONG length)
+{
+    struct
+    {
+        IMDPROXY_TAGGED_REQ tagged;
+        IMDPROXY_READ_REQ req;
+    } header;
+
+    header.tagged.request_code = IMDPROXY_REQ_TAGGED;
+    header.tagged.io_tag = io_tag;
+    header.req.request_code = request_code;
+    header.req.offset = offset;
+    header.req.length = length;
+
+    if (!safe_write(client->sd, &header, sizeof header))
+        return 0;
+
+    if (request_code == IMDPROXY_REQ_WRITE)
+        return safe_write(client->sd, io_ptr, (safeio_size_t)length);
+
+    return 1;
+}
+
+int
+devio_client_recv_tagged(PDEVIO_CLIENT client,
+    ULONGLONG *io_tag,
+    PIMDPROXY_READ_RESP resp)
+{
+    struct
+    {
+        IMDPROXY_TAGGED_RESP tagged;
+        IMDPROXY_READ_RESP resp;
+    } header;
+
+    if (!safe_read(client->sd, &header, sizeof header))
+        return 0;
+
+    *io_tag = header.tagged.io_tag;
+    *resp = header.resp;
+
+    return 1;
+}
+
+int
+devio_client_recv_data(PDEVIO_CLIENT client,
+    void *io_ptr,
+    ULONGLONG length)
+{
+    return safe_read(client->sd, io_ptr, (safeio_size_t)length);
+}
+
+int
+devio_client_cbt_query(PDEVIO_CLIENT client,
+    ULONGLONG flags,
+    ULONGLONG offset,
+    ULONGLONG length,
+    PIMDPROXY_CBT_RESP resp,
+    PIMDPROXY_CBT_RANGE *ranges)
+{
+    IMDPROXY_CBT_REQ req;
+
+    *ranges = NULL;
+
+    if (client->nbd)
+    {
+        memset(resp, 0, sizeof(*resp));
+        resp->errorno = ENODEV;
+        return 1;
+    }
+
+    req.request_code = IMDPROXY_REQ_CBT;
+    req.flags = flags;
+    req.offset = offset;
+    req.length = length;
+
+    if (!safe_write(client->sd, &req, sizeof req) ||
+        !safe_read(client->sd, resp, sizeof(*resp)))
+        return 0;
+
+    if (resp->errorno != 0 || resp->length == 0)
+        return 1;
+
+    if (resp->length % sizeof(IMDPROXY_CBT_RANGE) != 0 ||
+        resp->length > (ULONGLONG)(safeio_size_t)-1)
+    {
+        syslog(LOG_ERR, "Invalid changed block response length: " ULL_FMT
+            ".\n", resp->length);
+        return 0;
+    }
+
+    *ranges = (PIMDPROXY_CBT_RANGE)malloc((size_t)resp->length);
+    if (*ranges == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    if (!safe_read(client->sd, *ranges, (safeio_size_t)resp->length))
+    {
+        free(*ranges);
+        *ranges = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+safeio_ssize_t
+devio_client_read(PDEVIO_CLIENT client,
+    void *io_ptr,
+    safeio_size_t size,
+    off_t_64 offset)
+{
+    IMDPROXY_READ_RESP resp;
+
+    if (!devio_client_send_read(client, offset, size) ||
+        !devio_client_recv_read(client, io_ptr, size, &resp))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return -1;
+    }
+
+    return (safeio_ssize_t)resp.length;
+}
+
+safeio_ssize_t
+devio_client_write(PDEVIO_CLIENT client,
+    const void *io_ptr,
+    safeio_size_t size,
+    off_t_64 offset)
+{
+    IMDPROXY_WRITE_RESP resp;
+
+    if (!devio_client_send_write(client, io_ptr, offset, size) ||
+        !devio_client_recv_write(client, &resp))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    if (resp.errorno != 0)
+    {
+        errno = (int)resp.errorno;
+        return -1;
+    }
+
+    return (safeio_ssize_t)resp.length;
+}
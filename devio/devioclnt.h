@@ -0,0 +1,134 @@
+/*
+Client side of the ImDisk proxy protocol, for tools talking to devio.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVIOCLNT_
+#define _INC_DEVIOCLNT_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+    Endpoint syntax accepted by devio_client_open():
+
+    host:port           TCP connection to a devio server.
+    exec:command        Runs command through the shell with a connected
+                        socketpair as stdin, for example
+                        "exec:devio - image.vhd".
+    fd:number           Already connected socket or socketpair descriptor.
+    nbd:host:port[/export]
+                        NBD server, for example devio started with an nbd:
+                        comm device. Changed block queries are not
+                        available through NBD.
+
+    devio serves requests in the order they arrive, so several requests can
+    be sent before reading responses. Responses then arrive in the same
+    order. The devio_client_send_* and devio_client_recv_* functions
+    are used for such pipelined operation, where sends and receives may be
+    done from different threads.
+
+    Servers that report a queue depth in info flags also accept tagged
+    requests, sent with devio_client_send_tagged(). Each response starts
+    with the tag of its request, and responses may arrive in any order.
+    devioq.h tracks tags and requests in flight for such operation.
+    */
+
+    typedef struct _DEVIO_CLIENT
+    {
+        SOCKET sd;
+        int child_pid;
+        int nbd;
+        IMDPROXY_INFO_RESP info;
+    } DEVIO_CLIENT, *PDEVIO_CLIENT;
+
+    int devio_client_open(PDEVIO_CLIENT client, const char *endpoint);
+
+    void devio_client_close(PDEVIO_CLIENT client);
+
+    int devio_client_info(PDEVIO_CLIENT client);
+
+    int devio_client_send_read(PDEVIO_CLIENT client,
+        ULONGLONG offset,
+        ULONGLONG length);
+
+    int devio_client_recv_read(PDEVIO_CLIENT client,
+        void *io_ptr,
+        ULONGLONG max_length,
+        PIMDPROXY_READ_RESP resp);
+
+    int devio_client_send_write(PDEVIO_CLIENT client,
+        const void *io_ptr,
+        ULONGLONG offset,
+        ULONGLONG length);
+
+    int devio_client_recv_write(PDEVIO_CLIENT client,
+        PIMDPROXY_WRITE_RESP resp);
+
+    // Sends a tagged read or write request. io_ptr is only used for
+    // writes.
+    int devio_client_send_tagged(PDEVIO_CLIENT client,
+        ULONGLONG io_tag,
+        ULONGLONG request_code,
+        const void *io_ptr,
+        ULONGLONG offset,
+        ULONGLONG length);
+
+    // Reads tag and header of a response to a tagged read or write. Read
+    // responses without error are followed by resp->length bytes of data
+    // to read with devio_client_recv_data().
+    int devio_client_recv_tagged(PDEVIO_CLIENT client,
+        ULONGLONG *io_tag,
+        PIMDPROXY_READ_RESP resp);
+
+    int devio_client_recv_data(PDEVIO_CLIENT client,
+        void *io_ptr,
+        ULONGLONG length);
+
+    // Changed block query. On success, *ranges is a malloc'ed array of
+    // resp->length bytes, or NULL if no ranges were returned.
+    int devio_client_cbt_query(PDEVIO_CLIENT client,
+        ULONGLONG flags,
+        ULONGLONG offset,
+        ULONGLONG length,
+        PIMDPROXY_CBT_RESP resp,
+        PIMDPROXY_CBT_RANGE *ranges);
+
+    safeio_ssize_t devio_client_read(PDEVIO_CLIENT client,
+        void *io_ptr,
+        safeio_size_t size,
+        off_t_64 offset);
+
+    safeio_ssize_t devio_client_write(PDEVIO_CLIENT client,
+        const void *io_ptr,
+        safeio_size_t size,
+        off_t_64 offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_DEVIOCLNT_
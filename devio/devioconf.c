@@ -0,0 +1,762 @@
+/*
+Checks that a devio server follows the imdproxy protocol, with response
+framing for each request type and for invalid requests.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "safeio.h"
+#include "devioclnt.h"
+
+// Larger than the largest buffer devio allocates for a request
+#define CONF_OVERSIZED_LENGTH   ((ULONGLONG)320 << 20)
+
+#define CONF_BLOCK              4096
+
+// Connections and writes for each in CBT parallel check
+#define CONF_CBT_WRITERS        4
+#define CONF_CBT_WRITES         2000
+
+DEVIO_CLIENT client;
+const char *endpoint;
+int failures = 0;
+int checks = 0;
+char *data;
+char *check_data;
+
+void
+conf_result(const char *name, int ok, const char *reason)
+{
+    checks++;
+
+    if (ok)
+    {
+        printf("PASS  %s\n", name);
+        return;
+    }
+
+    failures++;
+    printf("FAIL  %s: %s\n", name, reason);
+}
+
+void
+conf_skip(const char *name, const char *reason)
+{
+    printf("SKIP  %s: %s\n", name, reason);
+}
+
+// Sends an info request and checks that the response is the same as the
+// first one, which shows that responses to earlier requests had the right
+// length.
+int
+conf_in_sync()
+{
+    IMDPROXY_INFO_RESP info = client.info;
+
+    if (!devio_client_info(&client))
+        return 0;
+
+    return memcmp(&info, &client.info, sizeof info) == 0;
+}
+
+// Reads a response that consists of a single errno value
+int
+conf_send_recv_errno(const void *req, size_t size, ULONGLONG *errorno)
+{
+    return safe_write(client.sd, req, (safeio_size_t)size) &&
+        safe_read(client.sd, errorno, sizeof(*errorno));
+}
+
+void
+conf_fill(char *ptr, size_t size, ULONGLONG seed)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        ptr[i] = (char)((seed + i) * 2654435761U >> 13);
+}
+
+int
+conf_read(ULONGLONG offset, ULONGLONG length, PIMDPROXY_READ_RESP resp)
+{
+    return devio_client_send_read(&client, offset, length) &&
+        devio_client_recv_read(&client, check_data, length, resp);
+}
+
+int
+conf_write(const void *ptr, ULONGLONG offset, ULONGLONG length,
+    PIMDPROXY_WRITE_RESP resp)
+{
+    return devio_client_send_write(&client, ptr, offset, length) &&
+        devio_client_recv_write(&client, resp);
+}
+
+void
+check_info()
+{
+    IMDPROXY_INFO_RESP *info = &client.info;
+
+    conf_result("INFO size and alignment",
+        info->file_size > 0 && info->req_alignment >= 1 &&
+        (info->req_alignment & (info->req_alignment - 1)) == 0,
+        "zero size or invalid alignment");
+
+    conf_result("INFO repeated", conf_in_sync(),
+        "second info response differs");
+}
+
+void
+check_null_and_unknown()
+{
+    ULONGLONG req = IMDPROXY_REQ_NULL;
+    ULONGLONG errorno = 0;
+
+    conf_result("NULL",
+        conf_send_recv_errno(&req, sizeof req, &errorno) &&
+        errorno == ENODEV && conf_in_sync(),
+        "expected ENODEV in one errno response");
+
+    req = 0x7FFF;
+
+    conf_result("unknown request",
+        conf_send_recv_errno(&req, sizeof req, &errorno) &&
+        errorno == ENODEV && conf_in_sync(),
+        "expected ENODEV in one errno response");
+}
+
+void
+check_read()
+{
+    ULONGLONG size = client.info.file_size;
+    IMDPROXY_READ_RESP resp;
+    ULONGLONG length = size < CONF_BLOCK ? size : CONF_BLOCK;
+
+    conf_result("READ at start",
+        conf_read(0, length, &resp) && resp.errorno == 0 &&
+        resp.length == length && conf_in_sync(),
+        "short read or error");
+
+    conf_result("READ across end of image",
+        conf_read(size - 512, CONF_BLOCK, &resp) && resp.errorno == 0 &&
+        resp.length == 512 && conf_in_sync(),
+        "expected only data within image");
+
+    conf_result("READ at end of image",
+        conf_read(size, CONF_BLOCK, &resp) && resp.errorno == 0 &&
+        resp.length == 0 && conf_in_sync(),
+        "expected empty read");
+
+    conf_result("READ out of range",
+        conf_read((ULONGLONG)-512, CONF_BLOCK, &resp) &&
+        resp.errorno != 0 && conf_in_sync(),
+        "expected error without data");
+
+    // Untagged reads larger than server buffers may complete partially
+    if (devio_client_send_read(&client, 0, CONF_OVERSIZED_LENGTH) &&
+        safe_read(client.sd, &resp, sizeof resp))
+    {
+        int ok = resp.errorno != 0 ||
+            (resp.length <= CONF_OVERSIZED_LENGTH && resp.length <= size);
+        ULONGLONG left = resp.errorno == 0 ? resp.length : 0;
+
+        while (ok && left > 0)
+        {
+            safeio_size_t chunk = left < CONF_BLOCK ? (safeio_size_t)left :
+                CONF_BLOCK;
+
+            ok = safe_read(client.sd, check_data, chunk);
+            left -= chunk;
+        }
+
+        conf_result("READ oversized", ok && conf_in_sync(),
+            "response longer than request or image");
+    }
+    else
+        conf_result("READ oversized", 0, "connection failed");
+}
+
+void
+check_write()
+{
+    ULONGLONG size = client.info.file_size;
+    int read_only = (client.info.flags & IMDPROXY_FLAG_RO) != 0;
+    IMDPROXY_WRITE_RESP resp;
+    IMDPROXY_READ_RESP read_resp;
+    ULONGLONG offset = size > 3 * CONF_BLOCK ? CONF_BLOCK + 512 : 0;
+    ULONGLONG length = size < CONF_BLOCK ? size : CONF_BLOCK;
+    IMDPROXY_WRITE_REQ req;
+    ULONGLONG left;
+    int ok;
+
+    conf_fill(data, (size_t)length, offset);
+
+    if (read_only)
+    {
+        conf_result("WRITE read-only",
+            conf_write(data, offset, length, &resp) && resp.errorno != 0 &&
+            conf_in_sync(),
+            "expected error");
+    }
+    else
+    {
+        conf_result("WRITE and read back",
+            conf_write(data, offset, length, &resp) && resp.errorno == 0 &&
+            resp.length == length &&
+            conf_read(offset, length, &read_resp) &&
+            read_resp.errorno == 0 && read_resp.length == length &&
+            memcmp(data, check_data, (size_t)length) == 0 && conf_in_sync(),
+            "data read back differs");
+    }
+
+    conf_result("WRITE across end of image",
+        conf_write(data, size - 512, 1024, &resp) && resp.errorno != 0 &&
+        conf_in_sync(),
+        "expected error, with data consumed");
+
+    conf_result("WRITE out of range",
+        conf_write(data, (ULONGLONG)-512, 512, &resp) && resp.errorno != 0 &&
+        conf_in_sync(),
+        "expected error, with data consumed");
+
+    // Data of writes larger than server buffers is read and thrown away
+    req.request_code = IMDPROXY_REQ_WRITE;
+    req.offset = 0;
+    req.length = CONF_OVERSIZED_LENGTH;
+
+    memset(data, 0, CONF_BLOCK);
+
+    ok = safe_write(client.sd, &req, sizeof req);
+
+    for (left = req.length; ok && left > 0; left -= CONF_BLOCK)
+        ok = safe_write(client.sd, data, CONF_BLOCK);
+
+    conf_result("WRITE oversized",
+        ok && devio_client_recv_write(&client, &resp) && resp.errorno != 0 &&
+        conf_in_sync(),
+        "expected error, with data consumed");
+}
+
+void
+check_unmap_zero(ULONGLONG request_code, const char *name, ULONGLONG flag)
+{
+    ULONGLONG size = client.info.file_size;
+    int read_only = (client.info.flags & IMDPROXY_FLAG_RO) != 0;
+    int supported = (client.info.flags & flag) != 0;
+    char test_name[64];
+    struct
+    {
+        IMDPROXY_UNMAP_REQ req;
+        IMDPROXY_DATA_RANGE range;
+    } req;
+    IMDPROXY_UNMAP_RESP resp;
+    IMDPROXY_READ_RESP read_resp;
+    IMDPROXY_WRITE_RESP write_resp;
+    ULONGLONG length = size < CONF_BLOCK ? size : CONF_BLOCK;
+
+    req.req.request_code = request_code;
+    req.req.length = sizeof req.range;
+    req.range.offset = 0;
+    req.range.length = length;
+
+    if (!supported || read_only)
+    {
+        sprintf(test_name, "%s not supported", name);
+        conf_result(test_name,
+            conf_send_recv_errno(&req, sizeof req, &resp.errorno) &&
+            resp.errorno != 0 && conf_in_sync(),
+            "expected error");
+        return;
+    }
+
+    conf_fill(data, (size_t)length, 1);
+
+    sprintf(test_name, "%s range", name);
+    conf_result(test_name,
+        conf_write(data, 0, length, &write_resp) &&
+        write_resp.errorno == 0 &&
+        conf_send_recv_errno(&req, sizeof req, &resp.errorno) &&
+        resp.errorno == 0 && conf_in_sync(),
+        "expected success");
+
+    if (request_code == IMDPROXY_REQ_ZERO)
+    {
+        memset(data, 0, (size_t)length);
+
+        conf_result("ZERO reads back zeros",
+            conf_read(0, length, &read_resp) && read_resp.errorno == 0 &&
+            memcmp(data, check_data, (size_t)length) == 0,
+            "data is not zero");
+    }
+
+    req.range.offset = size;
+    sprintf(test_name, "%s out of range", name);
+    conf_result(test_name,
+        conf_send_recv_errno(&req, sizeof req, &resp.errorno) &&
+        resp.errorno != 0 && conf_in_sync(),
+        "expected error");
+
+    // Range list length that is not a whole number of ranges
+    req.req.length = sizeof req.range - 1;
+    sprintf(test_name, "%s invalid length", name);
+    conf_result(test_name,
+        safe_write(client.sd, &req, sizeof req.req + sizeof req.range - 1) &&
+        safe_read(client.sd, &resp.errorno, sizeof resp.errorno) &&
+        resp.errorno != 0 && conf_in_sync(),
+        "expected error, with ranges consumed");
+}
+
+void
+check_cbt()
+{
+    ULONGLONG size = client.info.file_size;
+    IMDPROXY_CBT_RESP resp;
+    PIMDPROXY_CBT_RANGE ranges;
+    IMDPROXY_WRITE_RESP write_resp;
+    ULONGLONG offset;
+    int ok;
+
+    if (!devio_client_cbt_query(&client, IMDPROXY_CBT_FLAG_RESET, 0, size,
+        &resp, &ranges))
+    {
+        conf_result("CBT", 0, "connection failed");
+        return;
+    }
+
+    free(ranges);
+
+    if (!(client.info.flags & IMDPROXY_FLAG_SUPPORTS_CBT))
+    {
+        conf_result("CBT not supported",
+            resp.errorno != 0 && conf_in_sync(), "expected error");
+        return;
+    }
+
+    if (client.info.flags & IMDPROXY_FLAG_RO)
+    {
+        conf_skip("CBT", "read-only image");
+        return;
+    }
+
+    conf_result("CBT reset", resp.errorno == 0 && resp.block_size > 0 &&
+        conf_in_sync(), "query failed");
+
+    offset = size > 4 * resp.block_size ? 2 * resp.block_size : 0;
+
+    conf_fill(data, 512, 2);
+
+    ok = conf_write(data, offset, 512, &write_resp) &&
+        write_resp.errorno == 0 &&
+        devio_client_cbt_query(&client, 0, 0, size, &resp, &ranges);
+
+    conf_result("CBT reports written block",
+        ok && resp.errorno == 0 &&
+        resp.length == sizeof(IMDPROXY_CBT_RANGE) && ranges != NULL &&
+        ranges[0].offset <= offset &&
+        ranges[0].offset + ranges[0].length >= offset + 512 &&
+        conf_in_sync(),
+        "expected one range with written block");
+
+    free(ranges);
+
+    conf_result("CBT beyond end of image",
+        devio_client_cbt_query(&client, 0, size, CONF_BLOCK, &resp,
+            &ranges) &&
+        resp.errorno == 0 && resp.length == 0 && conf_in_sync(),
+        "expected no ranges");
+
+    free(ranges);
+}
+
+typedef struct _CONF_CBT_WRITER
+{
+    pthread_t thread;
+    DEVIO_CLIENT client;
+    unsigned int number;
+    int ok;
+} CONF_CBT_WRITER;
+
+// Sector written by a writer in its i:th write. Writers write every
+// CONF_CBT_WRITERS:th sector from their number on, each once, so that
+// writers share bitmap bytes but not sectors.
+ULONGLONG
+conf_cbt_sector(ULONGLONG size, unsigned int number, unsigned int i)
+{
+    ULONGLONG sectors = (size >> 9) / CONF_CBT_WRITERS;
+
+    return ((ULONGLONG)i * 7919 % sectors) * CONF_CBT_WRITERS + number;
+}
+
+void *
+conf_cbt_writer(void *param)
+{
+    CONF_CBT_WRITER *writer = (CONF_CBT_WRITER*)param;
+    char sector_data[512];
+    unsigned int i;
+
+    for (i = 0; writer->ok && i < CONF_CBT_WRITES; i++)
+    {
+        ULONGLONG sector = conf_cbt_sector(writer->client.info.file_size,
+            writer->number, i);
+
+        conf_fill(sector_data, sizeof sector_data, sector);
+
+        writer->ok = devio_client_write(&writer->client, sector_data,
+            sizeof sector_data, (off_t_64)(sector << 9)) ==
+            sizeof sector_data;
+    }
+
+    return NULL;
+}
+
+// Writes through several connections at once to parallel_endpoint, a
+// server with changed block tracking in the same bitmap file as endpoint,
+// for example devio serving NBD connections in threads. A new connection
+// to endpoint then reads the bitmap file, and has to report every written
+// block. Bitmap updates written to the file in another order than they
+// were made would lose some of them.
+void
+check_cbt_parallel(const char *parallel_endpoint)
+{
+    CONF_CBT_WRITER writers[CONF_CBT_WRITERS];
+    DEVIO_CLIENT check_client;
+    ULONGLONG size = client.info.file_size;
+    ULONGLONG offset = 0;
+    uint8_t *reported;
+    unsigned int started;
+    unsigned int i;
+    int ok = 1;
+
+    if (!(client.info.flags & IMDPROXY_FLAG_SUPPORTS_CBT) ||
+        (client.info.flags & IMDPROXY_FLAG_RO))
+    {
+        conf_skip("CBT parallel", "no changed block tracking on writable "
+            "image");
+        return;
+    }
+
+    if (parallel_endpoint == NULL)
+    {
+        conf_skip("CBT parallel", "no endpoint for parallel connections");
+        return;
+    }
+
+    for (started = 0; started < CONF_CBT_WRITERS; started++)
+    {
+        writers[started].number = started;
+        writers[started].ok = 1;
+
+        if (!devio_client_open(&writers[started].client, parallel_endpoint))
+            break;
+
+        if (writers[started].client.info.file_size != size ||
+            pthread_create(&writers[started].thread, NULL, conf_cbt_writer,
+                writers + started) != 0)
+        {
+            devio_client_close(&writers[started].client);
+            break;
+        }
+    }
+
+    ok = started == CONF_CBT_WRITERS;
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(writers[i].thread, NULL);
+        devio_client_close(&writers[i].client);
+        ok = ok && writers[i].ok;
+    }
+
+    if (!ok)
+    {
+        conf_result("CBT parallel writes", 0, "parallel writes failed");
+        return;
+    }
+
+    if (!devio_client_open(&check_client, endpoint))
+    {
+        conf_result("CBT parallel writes", 0, "connection failed");
+        return;
+    }
+
+    // One byte for each sector that a range covers
+    reported = (uint8_t*)calloc((size_t)(size >> 9), 1);
+    if (reported == NULL)
+    {
+        devio_client_close(&check_client);
+        conf_skip("CBT parallel", "out of memory");
+        return;
+    }
+
+    while (ok && offset < size)
+    {
+        IMDPROXY_CBT_RESP resp;
+        PIMDPROXY_CBT_RANGE ranges;
+        size_t count;
+        size_t r;
+
+        ok = devio_client_cbt_query(&check_client, 0, offset, size - offset,
+            &resp, &ranges) &&
+            resp.errorno == 0 && resp.end_offset > offset;
+
+        count = ok ? (size_t)(resp.length / sizeof(*ranges)) : 0;
+
+        for (r = 0; r < count; r++)
+        {
+            ULONGLONG sector;
+
+            for (sector = ranges[r].offset >> 9;
+                sector < (ranges[r].offset + ranges[r].length) >> 9 &&
+                sector < (size >> 9);
+                sector++)
+                reported[sector] = 1;
+        }
+
+        free(ranges);
+
+        if (ok)
+            offset = resp.end_offset;
+    }
+
+    for (i = 0; ok && i < CONF_CBT_WRITERS * CONF_CBT_WRITES; i++)
+        ok = reported[conf_cbt_sector(size, i % CONF_CBT_WRITERS,
+            i / CONF_CBT_WRITERS)] != 0;
+
+    conf_result("CBT parallel writes", ok,
+        "written block missing from bitmap file");
+
+    free(reported);
+    devio_client_close(&check_client);
+}
+
+void
+check_tagged()
+{
+    unsigned int depth = IMDPROXY_QUEUE_DEPTH(client.info.flags);
+    int read_only = (client.info.flags & IMDPROXY_FLAG_RO) != 0;
+    ULONGLONG size = client.info.file_size;
+    ULONGLONG seen = 0;
+    unsigned int count;
+    unsigned int i;
+    int ok = 1;
+
+    if (depth == 0)
+    {
+        conf_skip("TAGGED", "server does not report a queue depth");
+        return;
+    }
+
+    if (depth > 64)
+        depth = 64;
+
+    count = depth;
+    if ((ULONGLONG)count * 512 > size)
+        count = (unsigned int)(size / 512);
+
+    // Fills queue with reads, or writes and reads, before reading any
+    // response
+    for (i = 0; ok && i < count; i++)
+    {
+        ULONGLONG code = (!read_only && (i & 1)) ?
+            IMDPROXY_REQ_WRITE : IMDPROXY_REQ_READ;
+
+        conf_fill(data + i * 512, 512, i);
+
+        ok = devio_client_send_tagged(&client, i, code, data + i * 512,
+            (ULONGLONG)i * 512, 512);
+    }
+
+    for (i = 0; ok && i < count; i++)
+    {
+        ULONGLONG io_tag;
+        IMDPROXY_READ_RESP resp;
+
+        ok = devio_client_recv_tagged(&client, &io_tag, &resp) &&
+            io_tag < count && (seen & ((ULONGLONG)1 << io_tag)) == 0 &&
+            resp.errorno == 0;
+
+        if (!ok)
+            break;
+
+        seen |= (ULONGLONG)1 << io_tag;
+
+        if (!read_only && (io_tag & 1))
+            ok = resp.length == 512;
+        else
+            ok = resp.length == 512 &&
+            devio_client_recv_data(&client, check_data, resp.length);
+    }
+
+    conf_result("TAGGED queue depth requests",
+        ok && conf_in_sync(), "missing, repeated or invalid responses");
+
+    if (!read_only)
+    {
+        IMDPROXY_READ_RESP resp;
+
+        conf_result("TAGGED writes read back",
+            conf_read(0, (ULONGLONG)count * 512, &resp) &&
+            resp.errorno == 0 &&
+            memcmp(check_data + 512, data + 512, 512) == 0,
+            "data read back differs");
+    }
+
+    // Tagged reads are never completed partially
+    if (devio_client_send_tagged(&client, 0, IMDPROXY_REQ_READ, NULL, 0,
+        CONF_OVERSIZED_LENGTH))
+    {
+        ULONGLONG io_tag;
+        IMDPROXY_READ_RESP resp;
+
+        ok = devio_client_recv_tagged(&client, &io_tag, &resp) &&
+            io_tag == 0;
+
+        if (ok && resp.errorno == 0)
+        {
+            ULONGLONG left = resp.length;
+
+            ok = resp.length == (size < CONF_OVERSIZED_LENGTH ? size :
+                CONF_OVERSIZED_LENGTH);
+
+            while (ok && left > 0)
+            {
+                safeio_size_t chunk = left < CONF_BLOCK ?
+                    (safeio_size_t)left : CONF_BLOCK;
+
+                ok = safe_read(client.sd, check_data, chunk);
+                left -= chunk;
+            }
+        }
+
+        conf_result("TAGGED oversized read", ok && conf_in_sync(),
+            "expected error or complete data");
+    }
+    else
+        conf_result("TAGGED oversized read", 0, "connection failed");
+
+    // Server closes connection on a tag outside queue depth, since the
+    // request cannot be answered
+    {
+        IMDPROXY_READ_RESP resp;
+        ULONGLONG io_tag;
+
+        conf_result("TAGGED tag outside queue depth",
+            devio_client_send_tagged(&client, depth, IMDPROXY_REQ_READ,
+                NULL, 0, 512) &&
+            !devio_client_recv_tagged(&client, &io_tag, &resp),
+            "expected connection to close");
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *parallel_endpoint = NULL;
+    int opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            parallel_endpoint = optarg;
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc != optind + 1 || strncmp(argv[optind], "nbd:", 4) == 0)
+    {
+        fprintf(stderr,
+            "devioconf - Checks imdproxy protocol conformance of a devio server.\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "devioconf [-p endpoint] host:port|exec:command|fd:number\n"
+            "\n"
+            "Sends each request type, and invalid, oversized and out of range\n"
+            "requests, and checks that each response has the expected length and\n"
+            "status by sending an info request after it. Writes to the image\n"
+            "unless it is read-only. Tagged requests are checked last, since an\n"
+            "invalid tag closes the connection.\n"
+            "\n"
+            "-p endpoint Write through several connections at once to endpoint, a\n"
+            "            server for the same image and changed block bitmap file, such\n"
+            "            as devio with an nbd: comm device. Then checks that a new\n"
+            "            connection to the server checked reports all written blocks.\n");
+        return -1;
+    }
+
+    endpoint = argv[optind];
+
+    data = (char*)malloc(64 * 512 + CONF_BLOCK);
+    check_data = (char*)malloc(64 * 512 + CONF_BLOCK);
+    if (data == NULL || check_data == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    if (!devio_client_open(&client, endpoint))
+        return 1;
+
+    printf("Image size " ULL_FMT " bytes, flags 0x%" PRIx64 ".\n",
+        client.info.file_size, client.info.flags);
+
+    check_info();
+    check_null_and_unknown();
+    check_read();
+    check_write();
+    check_unmap_zero(IMDPROXY_REQ_UNMAP, "UNMAP",
+        IMDPROXY_FLAG_SUPPORTS_UNMAP);
+    check_unmap_zero(IMDPROXY_REQ_ZERO, "ZERO", IMDPROXY_FLAG_SUPPORTS_ZERO);
+    check_cbt();
+    check_cbt_parallel(parallel_endpoint);
+    check_tagged();
+
+    devio_client_close(&client);
+
+    printf("%i of %i checks failed.\n", failures, checks);
+
+    free(data);
+    free(check_data);
+
+    return failures != 0;
+}
@@ -0,0 +1,549 @@
+/*
+Fuzz entry point for devio request handling, with images in memory.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Built together with devio.c compiled with -DDEVIO_FUZZ, where requests are
+read from memory instead of a comm device. Each input creates an image in
+a memfd, raw or dynamic VHD, and runs the devio request loop over it:
+
+byte 0      Flags. 0x01 VHD image, 0x02 read-only, 0x04 select partition 1,
+            0x08 no tagged requests, 0x10 NBD connection with a 512 byte
+            buffer.
+byte 1      Raw image size 64 KB << (byte & 7). VHD block size
+            4 KB << (byte & 3), 4 + ((byte >> 2) & 15) blocks, last block
+            shorter by (byte >> 6) sectors.
+byte 2-3    Little endian length of data that follows, written over start
+            of raw image, or over block table of VHD image.
+rest        Requests as sent by clients.
+
+With -DDEVIO_FUZZ_LIBFUZZER, only LLVMFuzzerTestOneInput is built, for
+clang -fsanitize=fuzzer. Otherwise main runs inputs from files, or stdin,
+which also works with AFL, and can write seed inputs and run a simple
+random mutation loop over them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devnbd.h"
+
+#define FUZZ_VHD            0x01
+#define FUZZ_READ_ONLY      0x02
+#define FUZZ_PARTITION      0x04
+#define FUZZ_NO_TAGGED      0x08
+#define FUZZ_NBD            0x10
+
+#define FUZZ_HEADER_SIZE    4
+#define FUZZ_MAX_INPUT      (1 << 20)
+
+int
+devio_fuzz_serve(int argc, char **argv, int read_only,
+    unsigned int depth, int nbd, const void *data, size_t size);
+
+static void
+put_be32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = (uint8_t)(value >> 24);
+    ptr[1] = (uint8_t)(value >> 16);
+    ptr[2] = (uint8_t)(value >> 8);
+    ptr[3] = (uint8_t)value;
+}
+
+static void
+put_be64(uint8_t *ptr, uint64_t value)
+{
+    put_be32(ptr, (uint32_t)(value >> 32));
+    put_be32(ptr + 4, (uint32_t)value);
+}
+
+// Writes an empty dynamic VHD with footer copy, header, block table and
+// footer. Returns offset of block table.
+static off_t
+fuzz_make_vhd(int fd, uint8_t param)
+{
+    uint8_t footer[512] = { 0 };
+    uint8_t header[1024] = { 0 };
+    uint32_t block_size = 4096U << (param & 3);
+    uint32_t entries = 4 + ((param >> 2) & 15);
+    uint64_t size = (uint64_t)entries * block_size - (param >> 6) * 512;
+    size_t table_size = ((entries << 2) + 511) & ~(size_t)511;
+    uint8_t *table = (uint8_t*)malloc(table_size);
+
+    if (table == NULL)
+        return -1;
+
+    memcpy(footer, "conectix", 8);
+    put_be32(footer + 8, 2);
+    put_be32(footer + 12, 0x00010000);
+    put_be64(footer + 16, 512);
+    put_be64(footer + 40, size);
+    put_be64(footer + 48, size);
+    put_be32(footer + 60, 3);
+
+    memcpy(header, "cxsparse", 8);
+    put_be64(header + 8, (uint64_t)-1);
+    put_be64(header + 16, 1536);
+    put_be32(header + 24, 0x00010000);
+    put_be32(header + 28, entries);
+    put_be32(header + 32, block_size);
+
+    memset(table, 0xFF, table_size);
+
+    if (pwrite(fd, footer, sizeof footer, 0) != sizeof footer ||
+        pwrite(fd, header, sizeof header, 512) != sizeof header ||
+        pwrite(fd, table, table_size, 1536) != (ssize_t)table_size ||
+        pwrite(fd, footer, sizeof footer, 1536 + table_size) !=
+        sizeof footer)
+    {
+        free(table);
+        return -1;
+    }
+
+    free(table);
+    return 1536;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char path[64];
+    char *argv[] = { "devio", "-", path, "0", "0", "1", "64K", NULL };
+    uint8_t flags;
+    size_t overlay;
+    off_t overlay_offset = 0;
+    int fd;
+
+    if (size < FUZZ_HEADER_SIZE)
+        return 0;
+
+    flags = data[0];
+    overlay = data[2] | ((size_t)data[3] << 8);
+
+    if (overlay > size - FUZZ_HEADER_SIZE)
+        overlay = size - FUZZ_HEADER_SIZE;
+
+    fd = memfd_create("deviofuzz", 0);
+    if (fd == -1)
+    {
+        perror("memfd_create");
+        abort();
+    }
+
+    if (flags & FUZZ_VHD)
+        overlay_offset = fuzz_make_vhd(fd, data[1]);
+    else if (ftruncate(fd, (off_t)65536 << (data[1] & 7)) != 0)
+        overlay_offset = -1;
+
+    if (overlay_offset < 0 ||
+        pwrite(fd, data + FUZZ_HEADER_SIZE, overlay, overlay_offset) !=
+        (ssize_t)overlay)
+    {
+        perror("Creating image");
+        abort();
+    }
+
+    sprintf(path, "/proc/self/fd/%i", fd);
+
+    // Partition 1 is selected with a block count below 512
+    if (flags & FUZZ_PARTITION)
+        argv[3] = "1";
+
+    // Smaller buffer than option data that clients may send
+    if (flags & FUZZ_NBD)
+        argv[6] = "512";
+
+    devio_fuzz_serve(7, argv, flags & FUZZ_READ_ONLY,
+        (flags & FUZZ_NO_TAGGED) ? 0 : 16, flags & FUZZ_NBD,
+        data + FUZZ_HEADER_SIZE + overlay,
+        size - FUZZ_HEADER_SIZE - overlay);
+
+    close(fd);
+
+    return 0;
+}
+
+#ifndef DEVIO_FUZZ_LIBFUZZER
+
+typedef struct _FUZZ_SEED
+{
+    uint8_t data[4096];
+    size_t size;
+} FUZZ_SEED;
+
+static void
+seed_begin(FUZZ_SEED *seed, uint8_t flags, uint8_t param)
+{
+    memset(seed, 0, sizeof(*seed));
+    seed->data[0] = flags;
+    seed->data[1] = param;
+    seed->size = FUZZ_HEADER_SIZE;
+}
+
+static void
+seed_put(FUZZ_SEED *seed, const void *data, size_t size)
+{
+    if (size > 0 && seed->size + size <= sizeof(seed->data))
+    {
+        memcpy(seed->data + seed->size, data, size);
+        seed->size += size;
+    }
+}
+
+static void
+seed_request(FUZZ_SEED *seed, ULONGLONG tag, ULONGLONG code,
+    ULONGLONG offset, ULONGLONG length, const void *data, size_t data_size)
+{
+    ULONGLONG header[3];
+
+    if (tag != (ULONGLONG)-1)
+    {
+        header[0] = IMDPROXY_REQ_TAGGED;
+        header[1] = tag;
+        seed_put(seed, header, 2 * sizeof(ULONGLONG));
+    }
+
+    header[0] = code;
+    header[1] = offset;
+    header[2] = length;
+    seed_put(seed, header, sizeof header);
+    seed_put(seed, data, data_size);
+}
+
+static void
+seed_nbd_option(FUZZ_SEED *seed, uint32_t option, const void *data,
+    uint32_t length)
+{
+    unsigned char header[16];
+
+    devnbd_put64(header, NBD_OPTS_MAGIC);
+    devnbd_put32(header + 8, option);
+    devnbd_put32(header + 12, length);
+    seed_put(seed, header, sizeof header);
+    seed_put(seed, data, length);
+}
+
+static void
+seed_nbd_request(FUZZ_SEED *seed, uint16_t type, uint64_t offset,
+    uint32_t length, const void *data, size_t data_size)
+{
+    unsigned char request[NBD_REQUEST_SIZE];
+
+    devnbd_put32(request, NBD_REQUEST_MAGIC);
+    devnbd_put16(request + 4, 0);
+    devnbd_put16(request + 6, type);
+    devnbd_put64(request + 8, type);
+    devnbd_put64(request + 16, offset);
+    devnbd_put32(request + 24, length);
+    seed_put(seed, request, sizeof request);
+    seed_put(seed, data, data_size);
+}
+
+static int
+seed_save(const FUZZ_SEED *seed, const char *dir, unsigned int number)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof path, "%s/seed%u", dir, number);
+
+    f = fopen(path, "wb");
+    if (f == NULL || fwrite(seed->data, seed->size, 1, f) != 1 ||
+        fclose(f) != 0)
+    {
+        perror(path);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Writes seed inputs with typical request sequences on raw and VHD images
+static int
+fuzz_write_seeds(const char *dir)
+{
+    // Raw image, and VHD images with 8 KB blocks, the second with a
+    // shorter last block
+    static const uint8_t images[][2] = {
+        { 0, 1 }, { FUZZ_VHD, 0x01 }, { FUZZ_VHD, 0x45 }
+    };
+    uint8_t pattern[1024];
+    IMDPROXY_DATA_RANGE range = { 512, 1024 };
+    FUZZ_SEED seed;
+    size_t i;
+    unsigned int count = 0;
+
+    for (i = 0; i < sizeof pattern; i++)
+        pattern[i] = (uint8_t)(i * 7 + 1);
+
+    // Untagged requests, with out of range requests, and tagged requests
+    for (i = 0; i < 9; i++)
+    {
+        ULONGLONG tag = (i / 3 == 2) ? 3 : (ULONGLONG)-1;
+        ULONGLONG code = IMDPROXY_REQ_INFO;
+
+        seed_begin(&seed, images[i % 3][0], images[i % 3][1]);
+
+        seed_put(&seed, &code, sizeof code);
+        seed_request(&seed, tag, IMDPROXY_REQ_WRITE, 4000, sizeof pattern,
+            pattern, sizeof pattern);
+        seed_request(&seed, tag, IMDPROXY_REQ_READ, 3584, 2048, NULL, 0);
+
+        if (i / 3 == 1)
+        {
+            seed_request(&seed, tag, IMDPROXY_REQ_READ, (ULONGLONG)-512, 512,
+                NULL, 0);
+            seed_request(&seed, tag, IMDPROXY_REQ_WRITE, 1 << 24, 16,
+                pattern, 16);
+        }
+
+        code = IMDPROXY_REQ_ZERO;
+        seed_put(&seed, &code, sizeof code);
+        code = sizeof range;
+        seed_put(&seed, &code, sizeof code);
+        seed_put(&seed, &range, sizeof range);
+
+        code = IMDPROXY_REQ_NULL;
+        seed_put(&seed, &code, sizeof code);
+
+        if (!seed_save(&seed, dir, count++))
+            return 1;
+    }
+
+    // MBR with one partition, and protective MBR for a GUID partition
+    // table, written over start of raw image
+    for (i = 0; i < 2; i++)
+    {
+        uint8_t mbr[512] = { 0 };
+        ULONGLONG code = IMDPROXY_REQ_INFO;
+
+        mbr[0x1BE + 4] = i == 0 ? 0x83 : 0xEE;
+        mbr[0x1BE + 8] = 1;
+        mbr[0x1BE + 12] = 64;
+        mbr[0x1FE] = 0x55;
+        mbr[0x1FF] = 0xAA;
+
+        seed_begin(&seed, FUZZ_PARTITION, 1);
+        seed.data[2] = (uint8_t)sizeof mbr;
+        seed.data[3] = (uint8_t)(sizeof mbr >> 8);
+        seed_put(&seed, mbr, sizeof mbr);
+        seed_put(&seed, &code, sizeof code);
+        seed_request(&seed, (ULONGLONG)-1, IMDPROXY_REQ_READ, 0, 4096,
+            NULL, 0);
+
+        if (!seed_save(&seed, dir, count++))
+            return 1;
+    }
+
+    // NBD negotiation with options longer than the buffer, ending with
+    // NBD_OPT_GO, or with NBD_OPT_EXPORT_NAME where the name is terminated
+    // in the buffer
+    for (i = 0; i < 2; i++)
+    {
+        unsigned char flags[4];
+        uint8_t name[1024];
+
+        memset(name, 'a', sizeof name);
+        devnbd_put32(name, (uint32_t)(sizeof name - 6));
+        devnbd_put16(name + sizeof name - 2, 0);
+
+        seed_begin(&seed, FUZZ_NBD, 1);
+        devnbd_put32(flags, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+        seed_put(&seed, flags, sizeof flags);
+        seed_nbd_option(&seed, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+        seed_nbd_option(&seed, NBD_OPT_INFO, name, 512);
+        seed_nbd_option(&seed, NBD_OPT_LIST_META_CONTEXT, name, 600);
+
+        if (i == 0)
+            seed_nbd_option(&seed, NBD_OPT_GO, name, sizeof name);
+        else
+            seed_nbd_option(&seed, NBD_OPT_EXPORT_NAME, name + 4,
+                sizeof name - 4);
+
+        seed_nbd_request(&seed, NBD_CMD_WRITE, 4000, sizeof pattern,
+            pattern, sizeof pattern);
+        seed_nbd_request(&seed, NBD_CMD_READ, 3584, 2048, NULL, 0);
+        seed_nbd_request(&seed, NBD_CMD_DISC, 0, 0, NULL, 0);
+
+        if (!seed_save(&seed, dir, count++))
+            return 1;
+    }
+
+    printf("Wrote %u seed inputs to %s.\n", count, dir);
+    return 0;
+}
+
+static size_t
+fuzz_read_file(const char *path, uint8_t *data)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    size_t size;
+
+    if (f == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    size = fread(data, 1, FUZZ_MAX_INPUT, f);
+
+    if (f != stdin)
+        fclose(f);
+
+    return size;
+}
+
+static uint64_t fuzz_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+fuzz_random()
+{
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return fuzz_state;
+}
+
+// Flips bytes, overwrites with interesting values, and cuts or repeats
+// parts of an input
+static size_t
+fuzz_mutate(uint8_t *data, size_t size)
+{
+    static const uint8_t values[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+    int changes = 1 + (int)(fuzz_random() % 8);
+
+    while (changes-- > 0 && size > 0)
+    {
+        size_t pos = (size_t)(fuzz_random() % size);
+
+        switch (fuzz_random() % 5)
+        {
+        case 0:
+            data[pos] ^= (uint8_t)(1 << (fuzz_random() % 8));
+            break;
+
+        case 1:
+            data[pos] = values[fuzz_random() % sizeof values];
+            break;
+
+        case 2:
+            data[pos] = (uint8_t)fuzz_random();
+            break;
+
+        case 3:
+            size = pos + 1;
+            break;
+
+        case 4:
+        {
+            size_t length = (size_t)(fuzz_random() % 64);
+
+            if (pos + length > size)
+                length = size - pos;
+
+            if (size + length <= FUZZ_MAX_INPUT)
+            {
+                memmove(data + pos + length, data + pos, size - pos);
+                size += length;
+            }
+        }
+        }
+    }
+
+    return size;
+}
+
+int
+main(int argc, char **argv)
+{
+    uint8_t *data;
+    unsigned long iterations = 0;
+    int i;
+
+    if (argc == 3 && strcmp(argv[1], "-g") == 0)
+        return fuzz_write_seeds(argv[2]);
+
+    if (argc >= 4 && strcmp(argv[1], "-n") == 0)
+    {
+        iterations = strtoul(argv[2], NULL, 0);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 2)
+    {
+        fprintf(stderr,
+            "deviofuzz - Runs devio request handling on fuzz inputs.\n"
+            "\n"
+            "Usage:\n"
+            "deviofuzz file ...|-\n"
+            "deviofuzz -n iterations file ...\n"
+            "deviofuzz -g directory\n"
+            "\n"
+            "Runs each input file, or stdin. With -n, also runs iterations\n"
+            "random mutations of the files. -g writes seed inputs.\n");
+        return 1;
+    }
+
+    // Requests are logged to stdout by devio
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+
+    data = (uint8_t*)malloc(FUZZ_MAX_INPUT);
+    if (data == NULL)
+        return 1;
+
+    for (i = 1; i < argc; i++)
+    {
+        size_t size = fuzz_read_file(argv[i], data);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    while (iterations-- > 0)
+    {
+        size_t size = fuzz_read_file(argv[1 + fuzz_random() % (argc - 1)],
+            data);
+
+        size = fuzz_mutate(data, size);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    free(data);
+    return 0;
+}
+
+#endif // DEVIO_FUZZ_LIBFUZZER
@@ -0,0 +1,405 @@
+/*
+Queue of tagged requests in flight on a devio client connection.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devioclnt.h"
+#include "devioq.h"
+
+// Called with lock held when both sender and receiver are done with an
+// entry. Frees the entry and returns a copy to complete without lock.
+static DEVIO_QUEUE_ENTRY
+devio_queue_release(PDEVIO_QUEUE queue, PDEVIO_QUEUE_ENTRY entry)
+{
+    DEVIO_QUEUE_ENTRY done = *entry;
+
+    entry->in_use = 0;
+    --queue->in_flight;
+    ++queue->completing;
+
+    pthread_cond_broadcast(&queue->cond);
+
+    return done;
+}
+
+static void
+devio_queue_complete(PDEVIO_QUEUE queue, const DEVIO_QUEUE_ENTRY *done)
+{
+    if (done->completion != NULL)
+        done->completion(done->context, done->request_code, done->errorno,
+            done->resp_length);
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (--queue->completing == 0)
+        pthread_cond_broadcast(&queue->cond);
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Marks connection as failed. Called with lock held.
+static void
+devio_queue_set_failed(PDEVIO_QUEUE queue)
+{
+    if (queue->failed)
+        return;
+
+    queue->failed = 1;
+
+    // Wakes receiver if it waits for a response that will not come, and
+    // sender if it waits for the server to read request data
+    shutdown(queue->client->sd, SHUT_RDWR);
+
+    pthread_cond_broadcast(&queue->cond);
+}
+
+// Completes requests that have been sent and are waiting for responses
+// with EIO, after connection has failed. Requests that are still being
+// sent, or whose response is being read, are completed by the sender and
+// the receiver.
+static void
+devio_queue_abort(PDEVIO_QUEUE queue)
+{
+    for (;;)
+    {
+        DEVIO_QUEUE_ENTRY done;
+        unsigned int i;
+
+        pthread_mutex_lock(&queue->lock);
+
+        for (i = 0; i < queue->depth; i++)
+        {
+            PDEVIO_QUEUE_ENTRY entry = queue->entries + i;
+
+            if (entry->in_use && entry->sent && !entry->responded &&
+                entry != queue->receiving)
+                break;
+        }
+
+        if (i == queue->depth)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return;
+        }
+
+        queue->entries[i].responded = 1;
+        --queue->unanswered;
+        queue->entries[i].errorno = EIO;
+        queue->entries[i].resp_length = 0;
+
+        done = devio_queue_release(queue, queue->entries + i);
+
+        pthread_mutex_unlock(&queue->lock);
+
+        devio_queue_complete(queue, &done);
+    }
+}
+
+// Reads one response and completes its request if it has been sent.
+// Returns 0 if the connection failed.
+static int
+devio_queue_recv(PDEVIO_QUEUE queue)
+{
+    PDEVIO_QUEUE_ENTRY entry;
+    DEVIO_QUEUE_ENTRY done;
+    IMDPROXY_READ_RESP resp;
+    ULONGLONG io_tag;
+    int ok = 1;
+    int sent;
+
+    if (!devio_client_recv_tagged(queue->client, &io_tag, &resp))
+        return 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    entry = io_tag < queue->depth ? queue->entries + io_tag : NULL;
+
+    if (entry == NULL || !entry->in_use || entry->responded)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        syslog(LOG_ERR, "Response with unknown tag " ULL_FMT ".\n", io_tag);
+        return 0;
+    }
+
+    queue->receiving = entry;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    // Request fields are not changed while entry is in use. Tagged reads
+    // are never completed partially, so shorter data than requested is
+    // only returned at end of image.
+    if (resp.errorno != 0 || entry->request_code != IMDPROXY_REQ_READ)
+    {
+    }
+    else if (resp.length > entry->length)
+    {
+        syslog(LOG_ERR, "Server sent " ULL_FMT " bytes, expected " ULL_FMT
+            ".\n", resp.length, entry->length);
+        ok = 0;
+    }
+    else
+        ok = devio_client_recv_data(queue->client, entry->buffer,
+            resp.length);
+
+    if (!ok)
+        resp.errorno = EIO;
+
+    pthread_mutex_lock(&queue->lock);
+
+    queue->receiving = NULL;
+
+    entry->responded = 1;
+    --queue->unanswered;
+    entry->errorno = resp.errorno;
+    entry->resp_length = resp.errorno == 0 ? resp.length : 0;
+
+    sent = entry->sent;
+    if (sent)
+        done = devio_queue_release(queue, entry);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (sent)
+        devio_queue_complete(queue, &done);
+
+    return ok;
+}
+
+static void *
+devio_queue_receiver(void *arg)
+{
+    PDEVIO_QUEUE queue = (PDEVIO_QUEUE)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+
+        // Entries still in use may already have their responses. Reading
+        // then would block after the queue has drained, or take the
+        // response to an untagged request sent after it.
+        while (queue->unanswered == 0 && !queue->stopping && !queue->failed)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+
+        if (queue->failed || queue->unanswered == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&queue->lock);
+
+        if (!devio_queue_recv(queue))
+        {
+            pthread_mutex_lock(&queue->lock);
+
+            if (!queue->failed)
+                syslog(LOG_ERR, "Connection lost.\n");
+
+            devio_queue_set_failed(queue);
+
+            pthread_mutex_unlock(&queue->lock);
+
+            devio_queue_abort(queue);
+
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int
+devio_queue_start(PDEVIO_QUEUE queue,
+    PDEVIO_CLIENT client,
+    unsigned int depth)
+{
+    unsigned int server_depth = client->nbd ? 0 :
+        IMDPROXY_QUEUE_DEPTH(client->info.flags);
+
+    memset(queue, 0, sizeof(*queue));
+
+    if (depth > server_depth)
+        depth = server_depth;
+
+    if (depth == 0)
+        return 0;
+
+    queue->client = client;
+    queue->depth = depth;
+    queue->entries = (PDEVIO_QUEUE_ENTRY)
+        calloc(depth, sizeof(*queue->entries));
+
+    if (queue->entries == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+
+    errno = pthread_create(&queue->receiver, NULL, devio_queue_receiver,
+        queue);
+
+    if (errno != 0)
+    {
+        syslog(LOG_ERR, "pthread_create() failed: %m\n");
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->cond);
+        free(queue->entries);
+        queue->entries = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+devio_queue_submit(PDEVIO_QUEUE queue,
+    ULONGLONG request_code,
+    void *buffer,
+    ULONGLONG offset,
+    ULONGLONG length,
+    DEVIO_QUEUE_COMPLETION completion,
+    void *context)
+{
+    PDEVIO_QUEUE_ENTRY entry = NULL;
+    DEVIO_QUEUE_ENTRY done;
+    unsigned int io_tag;
+    int ok;
+    int responded;
+    int failed;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->in_flight == queue->depth && !queue->failed)
+        pthread_cond_wait(&queue->cond, &queue->lock);
+
+    if (queue->failed)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    for (io_tag = 0; io_tag < queue->depth; io_tag++)
+        if (!queue->entries[io_tag].in_use)
+        {
+            entry = queue->entries + io_tag;
+            break;
+        }
+
+    entry->request_code = request_code;
+    entry->offset = offset;
+    entry->length = length;
+    entry->buffer = buffer;
+    entry->completion = completion;
+    entry->context = context;
+    entry->errorno = 0;
+    entry->resp_length = 0;
+    entry->in_use = 1;
+    entry->sent = 0;
+    entry->responded = 0;
+
+    ++queue->in_flight;
+    ++queue->unanswered;
+
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    ok = devio_client_send_tagged(queue->client, io_tag, request_code,
+        buffer, offset, length);
+
+    pthread_mutex_lock(&queue->lock);
+
+    entry->sent = 1;
+
+    responded = entry->responded;
+    if (responded)
+        done = devio_queue_release(queue, entry);
+
+    if (!ok)
+        devio_queue_set_failed(queue);
+
+    failed = queue->failed;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (responded)
+        devio_queue_complete(queue, &done);
+
+    // Request will not get a response if receiver has stopped
+    if (failed)
+        devio_queue_abort(queue);
+
+    return 1;
+}
+
+void
+devio_queue_drain(PDEVIO_QUEUE queue)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->in_flight > 0 || queue->completing > 0)
+        pthread_cond_wait(&queue->cond, &queue->lock);
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int
+devio_queue_stop(PDEVIO_QUEUE queue)
+{
+    int failed;
+
+    // Once drained, every response has been read, so the receiver waits
+    // on the condition rather than in recv() and wakes up on stopping
+    devio_queue_drain(queue);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->receiver, NULL);
+
+    failed = queue->failed;
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->entries);
+    queue->entries = NULL;
+
+    return !failed;
+}
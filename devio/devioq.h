@@ -0,0 +1,123 @@
+/*
+Queue of tagged requests in flight on a devio client connection.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVIOQ_
+#define _INC_DEVIOQ_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+    User mode counterpart of the tagged proxy request queue in the driver,
+    with the same states, so that the protocol can be tested against devio
+    without Windows.
+
+    Each request in flight holds an entry, and the entry number is its tag.
+    A request is sent by the thread that submits it, and its response is
+    read by a receiver thread that runs while the queue is started. The
+    submitting thread and the receiver each mark the entry when done with
+    it, sent and responded, and whichever of them is last completes the
+    request and frees the entry. A response can therefore arrive and be
+    read before the submitting thread has returned from sending the
+    request.
+
+    When the connection fails, all requests in flight complete with EIO
+    and further submits fail.
+
+    Requests are submitted from one thread at a time. Completion routines
+    are called from the receiver thread or from the submitting thread, with
+    no queue lock held.
+    */
+
+    typedef void (*DEVIO_QUEUE_COMPLETION)(void *context,
+        ULONGLONG request_code,
+        ULONGLONG errorno,
+        ULONGLONG length);
+
+    typedef struct _DEVIO_QUEUE_ENTRY
+    {
+        ULONGLONG request_code;
+        ULONGLONG offset;
+        ULONGLONG length;
+        void *buffer;
+        DEVIO_QUEUE_COMPLETION completion;
+        void *context;
+        ULONGLONG errorno;
+        ULONGLONG resp_length;
+        char in_use;
+        char sent;
+        char responded;
+    } DEVIO_QUEUE_ENTRY, *PDEVIO_QUEUE_ENTRY;
+
+    typedef struct _DEVIO_QUEUE
+    {
+        PDEVIO_CLIENT client;
+        unsigned int depth;
+        unsigned int in_flight;
+        unsigned int unanswered;    // Submitted, response not read yet
+        unsigned int completing;    // Freed entries not yet completed
+        int failed;
+        int stopping;
+        PDEVIO_QUEUE_ENTRY entries;
+        PDEVIO_QUEUE_ENTRY receiving;   // Entry whose response is being read
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t receiver;
+    } DEVIO_QUEUE, *PDEVIO_QUEUE;
+
+    // Starts a queue of at most depth requests in flight, limited to the
+    // queue depth reported by the server. Returns 0 if the server does not
+    // accept tagged requests, or on failure.
+    int devio_queue_start(PDEVIO_QUEUE queue,
+        PDEVIO_CLIENT client,
+        unsigned int depth);
+
+    // Sends a read or write request, first waiting for a free entry if
+    // depth requests are in flight. Read data is stored in buffer, which
+    // needs to stay valid until completion. Returns 0 if the connection
+    // has failed, in which case completion is not called.
+    int devio_queue_submit(PDEVIO_QUEUE queue,
+        ULONGLONG request_code,
+        void *buffer,
+        ULONGLONG offset,
+        ULONGLONG length,
+        DEVIO_QUEUE_COMPLETION completion,
+        void *context);
+
+    // Waits until all submitted requests have completed.
+    void devio_queue_drain(PDEVIO_QUEUE queue);
+
+    // Drains the queue and stops the receiver thread. Returns 0 if the
+    // connection failed while the queue was used.
+    int devio_queue_stop(PDEVIO_QUEUE queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_DEVIOQ_
@@ -0,0 +1,221 @@
+/*
+NBD protocol definitions for devio NBD server and client.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVNBD_
+#define _INC_DEVNBD_
+
+/*
+Fixed newstyle NBD negotiation and transmission, as described in the NBD
+protocol specification. All fields are big endian and packed, so messages
+are built and parsed with the devnbd_put* and devnbd_get* functions
+instead of structures.
+
+Negotiation:
+
+  server: NBD_MAGIC, NBD_OPTS_MAGIC, 16 bit handshake flags
+  client: 32 bit client flags
+  client: NBD_OPTS_MAGIC, 32 bit option, 32 bit length, data
+  server: NBD_REP_MAGIC, 32 bit option, 32 bit reply type, 32 bit length,
+          data
+
+Transmission:
+
+  request:          32 bit NBD_REQUEST_MAGIC, 16 bit command flags,
+                    16 bit type, 64 bit cookie, 64 bit offset, 32 bit
+                    length, followed by data for NBD_CMD_WRITE
+  simple reply:     32 bit NBD_SIMPLE_REPLY_MAGIC, 32 bit error, 64 bit
+                    cookie, followed by data for successful NBD_CMD_READ
+  structured reply: 32 bit NBD_STRUCTURED_REPLY_MAGIC, 16 bit flags, 16 bit
+                    type, 64 bit cookie, 32 bit length, followed by length
+                    bytes of chunk data
+*/
+
+#define NBD_DEFAULT_PORT                10809
+
+#define NBD_MAGIC                       0x4E42444D41474943ULL
+#define NBD_OPTS_MAGIC                  0x49484156454F5054ULL
+#define NBD_REP_MAGIC                   0x0003E889045565A9ULL
+#define NBD_REQUEST_MAGIC               0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC          0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC      0x668E33EF
+
+#define NBD_REQUEST_SIZE                28
+#define NBD_SIMPLE_REPLY_SIZE           16
+#define NBD_STRUCTURED_REPLY_SIZE       20
+
+// Handshake flags from server and client flags from client
+#define NBD_FLAG_FIXED_NEWSTYLE         0x0001
+#define NBD_FLAG_NO_ZEROES              0x0002
+
+// Transmission flags
+#define NBD_FLAG_HAS_FLAGS              0x0001
+#define NBD_FLAG_READ_ONLY              0x0002
+#define NBD_FLAG_SEND_FLUSH             0x0004
+#define NBD_FLAG_SEND_FUA               0x0008
+#define NBD_FLAG_SEND_TRIM              0x0020
+#define NBD_FLAG_SEND_WRITE_ZEROES      0x0040
+#define NBD_FLAG_SEND_DF                0x0080
+#define NBD_FLAG_CAN_MULTI_CONN         0x0100
+
+// Options
+#define NBD_OPT_EXPORT_NAME             1
+#define NBD_OPT_ABORT                   2
+#define NBD_OPT_LIST                    3
+#define NBD_OPT_INFO                    6
+#define NBD_OPT_GO                      7
+#define NBD_OPT_STRUCTURED_REPLY        8
+#define NBD_OPT_LIST_META_CONTEXT       9
+#define NBD_OPT_SET_META_CONTEXT        10
+
+// Option reply types
+#define NBD_REP_ACK                     1
+#define NBD_REP_SERVER                  2
+#define NBD_REP_INFO                    3
+#define NBD_REP_META_CONTEXT            4
+#define NBD_REP_ERR_UNSUP               0x80000001
+#define NBD_REP_ERR_POLICY              0x80000002
+#define NBD_REP_ERR_INVALID             0x80000003
+#define NBD_REP_ERR_UNKNOWN             0x80000006
+#define NBD_REP_ERR_TOO_BIG             0x80000009
+
+// Information types in NBD_REP_INFO replies
+#define NBD_INFO_EXPORT                 0
+#define NBD_INFO_BLOCK_SIZE             3
+
+// Commands and command flags
+#define NBD_CMD_READ                    0
+#define NBD_CMD_WRITE                   1
+#define NBD_CMD_DISC                    2
+#define NBD_CMD_FLUSH                   3
+#define NBD_CMD_TRIM                    4
+#define NBD_CMD_WRITE_ZEROES            6
+#define NBD_CMD_BLOCK_STATUS            7
+
+#define NBD_CMD_FLAG_FUA                0x0001
+#define NBD_CMD_FLAG_NO_HOLE            0x0002
+#define NBD_CMD_FLAG_DF                 0x0004
+#define NBD_CMD_FLAG_REQ_ONE            0x0008
+
+// Structured reply flags and chunk types
+#define NBD_REPLY_FLAG_DONE             0x0001
+
+#define NBD_REPLY_TYPE_NONE             0
+#define NBD_REPLY_TYPE_OFFSET_DATA      1
+#define NBD_REPLY_TYPE_OFFSET_HOLE      2
+#define NBD_REPLY_TYPE_BLOCK_STATUS     5
+#define NBD_REPLY_TYPE_ERROR            0x8001
+
+// The only metadata context served, with its context id and state flags
+#define NBD_META_BASE_ALLOCATION        "base:allocation"
+#define NBD_META_BASE_ALLOCATION_ID     1
+
+#define NBD_STATE_HOLE                  0x0001
+#define NBD_STATE_ZERO                  0x0002
+
+// Error values on the wire. These happen to match Linux errno values.
+#define NBD_EPERM                       1
+#define NBD_EIO                         5
+#define NBD_ENOMEM                      12
+#define NBD_EINVAL                      22
+#define NBD_ENOSPC                      28
+#define NBD_EOVERFLOW                   75
+#define NBD_ENOTSUP                     95
+#define NBD_ESHUTDOWN                   108
+
+// Largest request payload accepted, as recommended by the specification
+#define NBD_MAX_PAYLOAD                 (32 << 20)
+
+static __inline void
+devnbd_put16(unsigned char *ptr, uint16_t value)
+{
+    ptr[0] = (unsigned char)(value >> 8);
+    ptr[1] = (unsigned char)value;
+}
+
+static __inline void
+devnbd_put32(unsigned char *ptr, uint32_t value)
+{
+    devnbd_put16(ptr, (uint16_t)(value >> 16));
+    devnbd_put16(ptr + 2, (uint16_t)value);
+}
+
+static __inline void
+devnbd_put64(unsigned char *ptr, uint64_t value)
+{
+    devnbd_put32(ptr, (uint32_t)(value >> 32));
+    devnbd_put32(ptr + 4, (uint32_t)value);
+}
+
+static __inline uint16_t
+devnbd_get16(const unsigned char *ptr)
+{
+    return (uint16_t)((ptr[0] << 8) | ptr[1]);
+}
+
+static __inline uint32_t
+devnbd_get32(const unsigned char *ptr)
+{
+    return ((uint32_t)devnbd_get16(ptr) << 16) | devnbd_get16(ptr + 2);
+}
+
+static __inline uint64_t
+devnbd_get64(const unsigned char *ptr)
+{
+    return ((uint64_t)devnbd_get32(ptr) << 32) | devnbd_get32(ptr + 4);
+}
+
+// Converts errno values to values defined for NBD. Values without an NBD
+// counterpart are sent as NBD_EIO.
+static __inline uint32_t
+devnbd_error(int errorno)
+{
+    switch (errorno)
+    {
+    case 0:
+        return 0;
+    case EPERM:
+    case EROFS:
+    case EBADF:
+        return NBD_EPERM;
+    case ENOMEM:
+        return NBD_ENOMEM;
+    case EINVAL:
+        return NBD_EINVAL;
+    case ENOSPC:
+    case EFBIG:
+        return NBD_ENOSPC;
+    case EOVERFLOW:
+        return NBD_EOVERFLOW;
+    case ENODEV:
+    case EOPNOTSUPP:
+        return NBD_ENOTSUP;
+    default:
+        return NBD_EIO;
+    }
+}
+
+#endif // _INC_DEVNBD_
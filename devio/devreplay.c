@@ -0,0 +1,532 @@
+/*
+Replays request traces recorded by devio --record against a devio server.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devioclnt.h"
+#include "devioq.h"
+#include "devstats.h"
+#include "devtrace.h"
+
+// Request in flight when replaying with tagged requests
+typedef struct _REPLAY_PENDING
+{
+    char write;
+    char busy;
+    uint64_t issue_time;
+    char *buf;
+    ULONGLONG buffer_size;
+} REPLAY_PENDING;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+LATENCY_LIST reads = { 0 };
+LATENCY_LIST writes = { 0 };
+ULONGLONG failed = 0;
+
+// Makes buffer at least length bytes
+int
+replay_buffer(char **buf, ULONGLONG *buffer_size, ULONGLONG length)
+{
+    char *new_buf;
+
+    if (length <= *buffer_size)
+        return 1;
+
+    new_buf = (char*)realloc(*buf, (size_t)length);
+    if (new_buf == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 0;
+    }
+
+    *buf = new_buf;
+    *buffer_size = length;
+
+    return 1;
+}
+
+// Hash of length zero bytes. Each zero byte only multiplies FNV-1a state by
+// the prime, so this is the offset basis times the prime to the power of
+// length.
+uint64_t
+replay_zero_hash(ULONGLONG length)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint64_t factor = 0x100000001B3ULL;
+
+    for (; length > 0; length >>= 1)
+    {
+        if (length & 1)
+            hash *= factor;
+
+        factor *= factor;
+    }
+
+    return hash;
+}
+
+// Fills data for a replayed write. With write hashes in the trace, writes
+// of zeros are replayed as zeros and other writes get data generated from
+// their hash, so that writes recorded with the same data are also replayed
+// with the same data. Otherwise, all writes get the same fill pattern.
+void
+replay_fill(char *buf, ULONGLONG length, int has_hash, uint64_t hash)
+{
+    uint64_t state;
+    ULONGLONG i;
+
+    if (!has_hash)
+    {
+        memset(buf, 0xA5, (size_t)length);
+        return;
+    }
+
+    if (hash == replay_zero_hash(length))
+    {
+        memset(buf, 0, (size_t)length);
+        return;
+    }
+
+    state = hash | 1;
+
+    for (i = 0; i < length; i += sizeof(state))
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        memcpy(buf + i, &state, (size_t)(length - i < sizeof(state) ?
+            length - i : sizeof(state)));
+    }
+}
+
+void
+replay_complete(void *context, ULONGLONG request_code, ULONGLONG errorno,
+    ULONGLONG length)
+{
+    REPLAY_PENDING *entry = (REPLAY_PENDING*)context;
+    uint64_t latency = stats_clock() - entry->issue_time;
+
+    pthread_mutex_lock(&lock);
+
+    if (errorno != 0)
+        ++failed;
+
+    latency_add(entry->write ? &writes : &reads, latency, length);
+
+    entry->busy = 0;
+    pthread_cond_signal(&cond);
+
+    pthread_mutex_unlock(&lock);
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *trace_file;
+    DEVIO_CLIENT client;
+    DEVIO_QUEUE queue;
+    char magic[sizeof(DEVIO_TRACE_MAGIC) - 1];
+    uint64_t version, flags, trace_size, trace_alignment;
+    double speed = 1.0;
+    int as_fast_as_possible = 0;
+    int skip_writes = 0;
+    unsigned int queue_depth = 0;
+    REPLAY_PENDING *pending = NULL;
+    char *buf = NULL;
+    ULONGLONG buffer_size = 0;
+    ULONGLONG last_end = 0;
+    uint64_t trace_time = 0;
+    uint64_t max_lag = 0;
+    uint64_t start_time;
+    uint64_t end_time;
+    ULONGLONG skipped = 0;
+    int opt;
+
+    openlog("devreplay", LOG_PERROR, LOG_USER);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "s:arq:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (speed <= 0)
+            {
+                fprintf(stderr, "Invalid speed factor: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'a':
+            as_fast_as_possible = 1;
+            break;
+
+        case 'r':
+            skip_writes = 1;
+            break;
+
+        case 'q':
+            queue_depth = (unsigned int)strtoul(optarg, NULL, 0);
+            if (queue_depth == 0)
+                argc = 0;
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        fprintf(stderr,
+            "devreplay - Replays request traces recorded by devio --record\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "devreplay [-s speed] [-a] [-r] [-q queuedepth] tracefile\n"
+            "          host:port|exec:command\n"
+            "\n"
+            "-s speed    Replay at speed times recorded pace, for example 10 to\n"
+            "            compress inter-arrival times by ten.\n"
+            "\n"
+            "-a          Ignore recorded timing and send each request as soon as\n"
+            "            previous one has completed, or with -q, as soon as fewer\n"
+            "            than queuedepth requests are in flight.\n"
+            "\n"
+            "-r          Skip write requests. Without this switch, writes are replayed\n"
+            "            with synthetic data, so only replay against scratch images.\n"
+            "            For traces recorded with --record-hash, writes of zeros are\n"
+            "            replayed as zeros and writes of equal data get equal data.\n"
+            "\n"
+            "-q          Send tagged requests at recorded times without waiting for\n"
+            "            earlier requests to complete, with at most queuedepth, and\n"
+            "            at most the queue depth of the server, in flight. Requests\n"
+            "            recorded from several connections are then replayed with\n"
+            "            about the concurrency they had. Info requests are skipped.\n");
+
+        return -1;
+    }
+
+    trace_file = fopen(argv[optind], "rb");
+    if (trace_file == NULL)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", argv[optind]);
+        return 1;
+    }
+
+    if (fread(magic, sizeof(magic), 1, trace_file) != 1 ||
+        memcmp(magic, DEVIO_TRACE_MAGIC, sizeof(magic)) != 0 ||
+        !devtrace_get_varint(trace_file, &version) ||
+        version != DEVIO_TRACE_VERSION ||
+        !devtrace_get_varint(trace_file, &flags) ||
+        !devtrace_get_varint(trace_file, &trace_size) ||
+        !devtrace_get_varint(trace_file, &trace_alignment))
+    {
+        fprintf(stderr, "'%s' is not a supported trace file.\n", argv[optind]);
+        return 1;
+    }
+
+    if (!devio_client_open(&client, argv[optind + 1]))
+        return 1;
+
+    if (client.info.file_size != trace_size)
+    {
+        fprintf(stderr, "Warning: Trace recorded with image size " ULL_FMT
+            ", server reports " ULL_FMT ".\n", trace_size,
+            client.info.file_size);
+    }
+
+    if (queue_depth > 0)
+    {
+        if (!devio_queue_start(&queue, &client, queue_depth))
+        {
+            fprintf(stderr, "Server does not accept tagged requests.\n");
+            return 1;
+        }
+
+        pending = (REPLAY_PENDING*)calloc(queue.depth, sizeof(*pending));
+        if (pending == NULL)
+        {
+            syslog(LOG_ERR, "Memory allocation failed: %m\n");
+            return 1;
+        }
+    }
+
+    start_time = stats_clock();
+
+    for (;;)
+    {
+        int request_code = getc(trace_file);
+        uint64_t delta;
+        uint64_t zigzag_offset = 0;
+        uint64_t length = 0;
+        ULONGLONG offset = 0;
+        uint64_t hash = 0;
+        uint64_t issue_time;
+        REPLAY_PENDING *entry = NULL;
+
+        if (request_code == EOF)
+            break;
+
+        if (!devtrace_get_varint(trace_file, &delta))
+        {
+            fprintf(stderr, "Truncated trace file.\n");
+            break;
+        }
+
+        trace_time += delta;
+
+        if (request_code == IMDPROXY_REQ_READ ||
+            request_code == IMDPROXY_REQ_WRITE)
+        {
+            if (!devtrace_get_varint(trace_file, &zigzag_offset) ||
+                !devtrace_get_varint(trace_file, &length))
+            {
+                fprintf(stderr, "Truncated trace file.\n");
+                break;
+            }
+
+            offset = last_end + (ULONGLONG)devtrace_unzigzag(zigzag_offset);
+            last_end = offset + length;
+
+            if (request_code == IMDPROXY_REQ_WRITE &&
+                (flags & DEVIO_TRACE_FLAG_HASH))
+            {
+                unsigned char hash_bytes[sizeof(uint64_t)];
+                int i;
+
+                if (fread(hash_bytes, sizeof(hash_bytes), 1, trace_file) != 1)
+                {
+                    fprintf(stderr, "Truncated trace file.\n");
+                    break;
+                }
+
+                for (i = 0; i < sizeof(hash_bytes); i++)
+                    hash |= (uint64_t)hash_bytes[i] << (i << 3);
+            }
+        }
+        else if (request_code != IMDPROXY_REQ_INFO || queue_depth > 0)
+        {
+            ++skipped;
+            continue;
+        }
+
+        if (request_code == IMDPROXY_REQ_WRITE && skip_writes)
+        {
+            ++skipped;
+            continue;
+        }
+
+        if (!as_fast_as_possible)
+        {
+            uint64_t due_time = start_time +
+                (uint64_t)((double)trace_time / speed);
+
+            issue_time = stats_clock();
+
+            if (due_time > issue_time)
+            {
+                struct timespec ts;
+
+                ts.tv_sec = (time_t)((due_time - issue_time) / 1000000);
+                ts.tv_nsec = (long)((due_time - issue_time) % 1000000 * 1000);
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        // Each request in flight has its own buffer
+        if (queue_depth > 0)
+        {
+            unsigned int i;
+
+            pthread_mutex_lock(&lock);
+
+            for (;;)
+            {
+                for (i = 0; i < queue.depth; i++)
+                    if (!pending[i].busy)
+                    {
+                        entry = pending + i;
+                        break;
+                    }
+
+                if (entry != NULL)
+                    break;
+
+                pthread_cond_wait(&cond, &lock);
+            }
+
+            entry->busy = 1;
+
+            pthread_mutex_unlock(&lock);
+
+            if (!replay_buffer(&entry->buf, &entry->buffer_size, length))
+                return 1;
+        }
+        else if (!replay_buffer(&buf, &buffer_size, length))
+            return 1;
+
+        if (request_code == IMDPROXY_REQ_WRITE)
+            replay_fill(entry != NULL ? entry->buf : buf, length,
+                (flags & DEVIO_TRACE_FLAG_HASH) != 0, hash);
+
+        issue_time = stats_clock();
+
+        if (!as_fast_as_possible)
+        {
+            uint64_t due_time = start_time +
+                (uint64_t)((double)trace_time / speed);
+
+            if (issue_time > due_time && issue_time - due_time > max_lag)
+                max_lag = issue_time - due_time;
+        }
+
+        if (entry != NULL)
+        {
+            entry->write = request_code == IMDPROXY_REQ_WRITE;
+            entry->issue_time = issue_time;
+
+            if (!devio_queue_submit(&queue, request_code, entry->buf, offset,
+                length, replay_complete, entry))
+            {
+                fprintf(stderr, "Connection lost.\n");
+                return 1;
+            }
+
+            continue;
+        }
+
+        switch (request_code)
+        {
+        case IMDPROXY_REQ_INFO:
+            if (!devio_client_info(&client))
+            {
+                fprintf(stderr, "Connection lost.\n");
+                return 1;
+            }
+
+            break;
+
+        case IMDPROXY_REQ_READ:
+        {
+            IMDPROXY_READ_RESP resp = { 0 };
+
+            if (!devio_client_send_read(&client, offset, length) ||
+                !devio_client_recv_read(&client, buf, length, &resp))
+            {
+                fprintf(stderr, "Connection lost.\n");
+                return 1;
+            }
+
+            if (resp.errorno != 0)
+                ++failed;
+
+            latency_add(&reads, stats_clock() - issue_time, resp.length);
+
+            break;
+        }
+
+        case IMDPROXY_REQ_WRITE:
+        {
+            IMDPROXY_WRITE_RESP resp = { 0 };
+
+            if (!devio_client_send_write(&client, buf, offset, length) ||
+                !devio_client_recv_write(&client, &resp))
+            {
+                fprintf(stderr, "Connection lost.\n");
+                return 1;
+            }
+
+            if (resp.errorno != 0)
+                ++failed;
+
+            latency_add(&writes, stats_clock() - issue_time, resp.length);
+
+            break;
+        }
+        }
+    }
+
+    if (queue_depth > 0 && !devio_queue_stop(&queue))
+    {
+        fprintf(stderr, "Connection lost.\n");
+        return 1;
+    }
+
+    end_time = stats_clock();
+
+    devio_client_close(&client);
+    fclose(trace_file);
+
+    if (end_time == start_time)
+        end_time++;
+
+    printf("Replayed " SIZ_FMT " requests in %.3f s (recorded %.3f s), "
+        ULL_FMT " failed, " ULL_FMT " skipped.\n",
+        reads.count + writes.count,
+        (double)(end_time - start_time) / 1000000.0,
+        (double)trace_time / 1000000.0,
+        failed,
+        skipped);
+
+    if (!as_fast_as_possible)
+        printf("Max schedule lag: %.3f ms\n", (double)max_lag / 1000.0);
+
+    latency_report("Read", &reads, end_time - start_time);
+    latency_report("Write", &writes, end_time - start_time);
+
+    latency_free(&reads);
+    latency_free(&writes);
+    free(buf);
+
+    if (pending != NULL)
+    {
+        unsigned int i;
+
+        for (i = 0; i < queue.depth; i++)
+            free(pending[i].buf);
+
+        free(pending);
+    }
+
+    return failed == 0 ? 0 : 2;
+}
@@ -0,0 +1,200 @@
+/*
+Latency statistics and shared helpers for devio benchmark and replay tools.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "devstats.h"
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t
+stats_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int
+latency_reserve(PLATENCY_LIST list, size_t count)
+{
+    size_t new_allocated = list->allocated ? list->allocated : 4096;
+    uint64_t *new_samples;
+
+    if (list->count + count <= list->allocated)
+        return 1;
+
+    while (new_allocated < list->count + count)
+        new_allocated <<= 1;
+
+    new_samples = (uint64_t*)
+        realloc(list->samples, new_allocated * sizeof(*new_samples));
+
+    if (new_samples == NULL)
+        return 0;
+
+    list->samples = new_samples;
+    list->allocated = new_allocated;
+
+    return 1;
+}
+
+int
+latency_add(PLATENCY_LIST list, uint64_t sample, ULONGLONG bytes)
+{
+    if (!latency_reserve(list, 1))
+        return 0;
+
+    list->samples[list->count++] = sample;
+    list->bytes += bytes;
+
+    return 1;
+}
+
+int
+latency_merge(PLATENCY_LIST target, const LATENCY_LIST *source)
+{
+    if (!latency_reserve(target, source->count))
+        return 0;
+
+    memcpy(target->samples + target->count, source->samples,
+        source->count * sizeof(*source->samples));
+
+    target->count += source->count;
+    target->bytes += source->bytes;
+
+    return 1;
+}
+
+static int
+latency_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static uint64_t
+latency_percentile(const LATENCY_LIST *list, double percentile)
+{
+    size_t i = (size_t)(percentile / 100.0 * (double)list->count);
+
+    if (i >= list->count)
+        i = list->count - 1;
+
+    return list->samples[i];
+}
+
+void
+latency_report(const char *name, PLATENCY_LIST list, uint64_t elapsed)
+{
+    double seconds = (double)elapsed / 1000000.0;
+
+    if (list->count == 0)
+        return;
+
+    if (seconds <= 0)
+        seconds = 0.000001;
+
+    qsort(list->samples, list->count, sizeof(*list->samples),
+        latency_compare);
+
+    printf("%-6s " SIZ_FMT " requests, %.0f IOPS, %.2f MB/s\n"
+        "       latency us: p50 " ULL_FMT " p90 " ULL_FMT " p99 " ULL_FMT
+        " p99.9 " ULL_FMT " max " ULL_FMT "\n",
+        name,
+        list->count,
+        (double)list->count / seconds,
+        (double)list->bytes / seconds / 1048576.0,
+        latency_percentile(list, 50.0),
+        latency_percentile(list, 90.0),
+        latency_percentile(list, 99.0),
+        latency_percentile(list, 99.9),
+        list->samples[list->count - 1]);
+}
+
+void
+latency_free(PLATENCY_LIST list)
+{
+    free(list->samples);
+    memset(list, 0, sizeof(*list));
+}
+
+int
+parse_size(const char *arg, ULONGLONG *size)
+{
+    char suf = 0;
+
+    switch (sscanf(arg, ULL_FMT "%c", size, &suf))
+    {
+    case 1:
+        return 1;
+
+    case 2:
+        switch (suf)
+        {
+        case 'T':
+            *size <<= 10;
+        case 'G':
+            *size <<= 10;
+        case 'M':
+            *size <<= 10;
+        case 'K':
+            *size <<= 10;
+        case 'B':
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "Invalid size: %s\n", arg);
+    return 0;
+}
+
+void
+seed_random(uint64_t seed)
+{
+    // Zero state would make generator return zero forever.
+    random_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t
+next_random()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
@@ -0,0 +1,68 @@
+/*
+Latency statistics and shared helpers for devio benchmark and replay tools.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVSTATS_
+#define _INC_DEVSTATS_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _LATENCY_LIST
+    {
+        uint64_t *samples;
+        size_t count;
+        size_t allocated;
+        ULONGLONG bytes;
+    } LATENCY_LIST, *PLATENCY_LIST;
+
+    // Monotonic clock in microseconds.
+    uint64_t stats_clock();
+
+    int latency_add(PLATENCY_LIST list, uint64_t sample, ULONGLONG bytes);
+
+    int latency_merge(PLATENCY_LIST target, const LATENCY_LIST *source);
+
+    void latency_report(const char *name, PLATENCY_LIST list, uint64_t elapsed);
+
+    void latency_free(PLATENCY_LIST list);
+
+    // Parses a byte count with optional K, M, G or T suffix. Prints a
+    // message and returns 0 if arg is not a valid size.
+    int parse_size(const char *arg, ULONGLONG *size);
+
+    // Xorshift generator shared by the benchmark tools. Seeding makes runs
+    // repeatable; without it, all tools start from the same fixed state.
+    void seed_random(uint64_t seed);
+
+    uint64_t next_random();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_DEVSTATS_
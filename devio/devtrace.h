@@ -0,0 +1,127 @@
+/*
+Request trace format for devio record and replay.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_DEVTRACE_
+#define _INC_DEVTRACE_
+
+/*
+Trace file layout:
+
+  8 bytes       DEVIO_TRACE_MAGIC
+  varint        DEVIO_TRACE_VERSION
+  varint        flags (DEVIO_TRACE_FLAG_*)
+  varint        image size at time of recording
+  varint        required alignment at time of recording
+
+followed by one record per request:
+
+  1 byte        request code (IMDPROXY_REQ_*)
+  varint        microseconds since previous request
+  For IMDPROXY_REQ_READ and IMDPROXY_REQ_WRITE only:
+  varint        zigzag encoded distance from end of previous request
+  varint        length in bytes
+  For IMDPROXY_REQ_WRITE and DEVIO_TRACE_FLAG_HASH only:
+  8 bytes       FNV-1a 64 hash of write payload, little endian
+
+Varints are unsigned LEB128. Sequential access therefore costs about four
+bytes per request.
+*/
+
+#define DEVIO_TRACE_MAGIC       "DEVIOTRC"
+#define DEVIO_TRACE_VERSION     1
+
+#define DEVIO_TRACE_FLAG_HASH   0x01
+
+#define DEVIO_TRACE_MAX_VARINT  10
+
+static __inline int
+devtrace_put_varint(unsigned char *ptr, uint64_t value)
+{
+    int i = 0;
+
+    while (value >= 0x80)
+    {
+        ptr[i++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+
+    ptr[i++] = (unsigned char)value;
+
+    return i;
+}
+
+static __inline int
+devtrace_get_varint(FILE *stream, uint64_t *value)
+{
+    int shift;
+
+    *value = 0;
+
+    for (shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(stream);
+
+        if (c == EOF)
+            return 0;
+
+        *value |= (uint64_t)(c & 0x7F) << shift;
+
+        if ((c & 0x80) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static __inline uint64_t
+devtrace_zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static __inline int64_t
+devtrace_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static __inline uint64_t
+devtrace_hash(const void *data, size_t size)
+{
+    const unsigned char *ptr = (const unsigned char*)data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    while (size-- > 0)
+    {
+        hash ^= *ptr++;
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+#endif // _INC_DEVTRACE_
@@ -0,0 +1,587 @@
+/*
+Converts disk images between raw and dynamically expanding VHD format,
+using devio for reading and writing image formats.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdbuf.h"
+#include "safeio.h"
+#include "devioclnt.h"
+#include "devstats.h"
+
+#define VHD_BLOCK_SIZE (2 << 20)
+
+// Seconds between 1970-01-01 and 2000-01-01, the VHD time stamp epoch
+#define VHD_EPOCH 946684800
+
+typedef struct _CONV_THREAD
+{
+    pthread_t thread;
+    DEVIO_CLIENT client;
+    char *buf;
+} CONV_THREAD;
+
+const char *devio_path = "devio";
+ULONGLONG chunk_size = 1 << 20;
+ULONGLONG image_size = 0;
+ULONGLONG next_chunk = 0;
+ULONGLONG copied_bytes = 0;
+ULONGLONG skipped_bytes = 0;
+int failed = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Target is either a raw file, or a devio connection for VHD targets.
+// Writes to a devio connection are serialized with target_lock.
+int target_fd = -1;
+int target_skip_zero = 0;
+DEVIO_CLIENT target_client;
+pthread_mutex_t target_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Builds an "exec:" endpoint that runs devio with arguments, with path
+// quoted for the shell.
+char *
+devio_endpoint(const char *options, const char *path, const char *size_arg)
+{
+    size_t length = strlen(devio_path) + strlen(options) + strlen(size_arg) +
+        strlen(path) * 4 + 32;
+    char *endpoint = (char*)malloc(length);
+    char *ptr;
+
+    if (endpoint == NULL)
+        return NULL;
+
+    ptr = endpoint + sprintf(endpoint, "exec:%s %s - '", devio_path, options);
+
+    for (; *path != 0; path++)
+    {
+        if (*path == '\'')
+        {
+            strcpy(ptr, "'\\''");
+            ptr += 4;
+        }
+        else
+            *ptr++ = *path;
+    }
+
+    sprintf(ptr, "' %s", size_arg);
+
+    return endpoint;
+}
+
+void
+put_be32(uint8_t *storage, uint32_t number)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        storage[i] = (uint8_t)(number >> ((3 - i) << 3));
+}
+
+void
+put_be64(uint8_t *storage, uint64_t number)
+{
+    put_be32(storage, (uint32_t)(number >> 32));
+    put_be32(storage + 4, (uint32_t)number);
+}
+
+uint32_t
+vhd_checksum(const uint8_t *data, size_t size)
+{
+    uint32_t sum = 0;
+
+    while (size-- > 0)
+        sum += *data++;
+
+    return ~sum;
+}
+
+// CHS geometry as calculated in the VHD specification.
+uint32_t
+vhd_geometry(ULONGLONG size)
+{
+    ULONGLONG total_sectors = size >> 9;
+    ULONGLONG cylinder_times_heads;
+    uint32_t sectors_per_track;
+    uint32_t heads;
+
+    if (total_sectors > 65535ULL * 16 * 255)
+        total_sectors = 65535ULL * 16 * 255;
+
+    if (total_sectors >= 65535ULL * 16 * 63)
+    {
+        sectors_per_track = 255;
+        heads = 16;
+        cylinder_times_heads = total_sectors / sectors_per_track;
+    }
+    else
+    {
+        sectors_per_track = 17;
+        cylinder_times_heads = total_sectors / sectors_per_track;
+        heads = (uint32_t)((cylinder_times_heads + 1023) / 1024);
+
+        if (heads < 4)
+            heads = 4;
+
+        if (cylinder_times_heads >= (ULONGLONG)heads * 1024 || heads > 16)
+        {
+            sectors_per_track = 31;
+            heads = 16;
+            cylinder_times_heads = total_sectors / sectors_per_track;
+        }
+
+        if (cylinder_times_heads >= (ULONGLONG)heads * 1024)
+        {
+            sectors_per_track = 63;
+            heads = 16;
+            cylinder_times_heads = total_sectors / sectors_per_track;
+        }
+    }
+
+    return (uint32_t)((cylinder_times_heads / heads) << 16) |
+        (heads << 8) | sectors_per_track;
+}
+
+// Creates an empty dynamically expanding VHD file, with footer copy, dynamic
+// disk header, block allocation table with all blocks unallocated, and
+// footer.
+int
+vhd_create(const char *path, ULONGLONG size)
+{
+    uint8_t footer[512] = { 0 };
+    uint8_t header[1024] = { 0 };
+    uint32_t entries = (uint32_t)((size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE);
+    size_t table_size = (((size_t)entries << 2) + 511) & ~(size_t)511;
+    uint8_t *table;
+    int fd;
+    int i;
+
+    memcpy(footer, "conectix", 8);
+    put_be32(footer + 8, 2);
+    put_be32(footer + 12, 0x00010000);
+    put_be64(footer + 16, 512);
+    put_be32(footer + 24, (uint32_t)(time(NULL) - VHD_EPOCH));
+    memcpy(footer + 28, "imdk", 4);
+    put_be32(footer + 32, 0x00010000);
+    put_be32(footer + 36, 0x5769326B);
+    put_be64(footer + 40, size);
+    put_be64(footer + 48, size);
+    put_be32(footer + 56, vhd_geometry(size));
+    put_be32(footer + 60, 3);
+
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    for (i = 0; i < 16; i++)
+        footer[68 + i] = (uint8_t)rand();
+
+    put_be32(footer + 64, vhd_checksum(footer, sizeof(footer)));
+
+    memcpy(header, "cxsparse", 8);
+    put_be64(header + 8, (uint64_t)-1);
+    put_be64(header + 16, sizeof(footer) + sizeof(header));
+    put_be32(header + 24, 0x00010000);
+    put_be32(header + 28, entries);
+    put_be32(header + 32, VHD_BLOCK_SIZE);
+    put_be32(header + 36, vhd_checksum(header, sizeof(header)));
+
+    table = (uint8_t*)malloc(table_size);
+    if (table == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return -1;
+    }
+
+    memset(table, 0xFF, table_size);
+
+    fd = open(path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "Cannot create '%s': %m\n", path);
+        free(table);
+        return -1;
+    }
+
+    if (!safe_write(fd, footer, sizeof(footer)) ||
+        !safe_write(fd, header, sizeof(header)) ||
+        !safe_write(fd, table, table_size) ||
+        !safe_write(fd, footer, sizeof(footer)) ||
+        close(fd) != 0)
+    {
+        syslog(LOG_ERR, "Error writing '%s': %m\n", path);
+        free(table);
+        return -1;
+    }
+
+    free(table);
+
+    return 0;
+}
+
+int
+target_write(const char *data, ULONGLONG length, ULONGLONG offset)
+{
+    if (target_fd != -1)
+    {
+        return pwrite(target_fd, data, (safeio_size_t)length,
+            (off_t_64)offset) == (safeio_ssize_t)length;
+    }
+    else
+    {
+        safeio_ssize_t writedone;
+
+        pthread_mutex_lock(&target_lock);
+        writedone = devio_client_write(&target_client, data,
+            (safeio_size_t)length, (off_t_64)offset);
+        pthread_mutex_unlock(&target_lock);
+
+        return writedone == (safeio_ssize_t)length;
+    }
+}
+
+void *
+conv_thread(void *arg)
+{
+    CONV_THREAD *conv = (CONV_THREAD*)arg;
+
+    for (;;)
+    {
+        ULONGLONG offset;
+        ULONGLONG length;
+        ULONGLONG done = 0;
+
+        pthread_mutex_lock(&lock);
+        offset = next_chunk;
+        if (offset < image_size && !failed)
+            next_chunk += chunk_size;
+        pthread_mutex_unlock(&lock);
+
+        if (offset >= image_size || failed)
+            break;
+
+        length = image_size - offset;
+        if (length > chunk_size)
+            length = chunk_size;
+
+        while (done < length)
+        {
+            safeio_ssize_t readdone = devio_client_read(&conv->client,
+                conv->buf + done, (safeio_size_t)(length - done),
+                (off_t_64)(offset + done));
+
+            if (readdone <= 0)
+            {
+                syslog(LOG_ERR, "Read error at " ULL_FMT ": %m\n",
+                    offset + done);
+                failed = 1;
+                return NULL;
+            }
+
+            done += readdone;
+        }
+
+        if (target_skip_zero && ImDiskBufferIsZero(conv->buf, length))
+        {
+            pthread_mutex_lock(&lock);
+            skipped_bytes += length;
+            pthread_mutex_unlock(&lock);
+
+            continue;
+        }
+
+        if (!target_write(conv->buf, length, offset))
+        {
+            syslog(LOG_ERR, "Write error at " ULL_FMT ": %m\n", offset);
+            failed = 1;
+            return NULL;
+        }
+
+        pthread_mutex_lock(&lock);
+        copied_bytes += length;
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    CONV_THREAD *threads;
+    unsigned int thread_count = 4;
+    unsigned int i;
+    const char *source_partition = "0";
+    const char *target_format = NULL;
+    const char *source_path;
+    const char *target_path;
+    char *endpoint;
+    int source_is_endpoint = 0;
+    uint64_t start_time;
+    uint64_t elapsed;
+    int opt;
+
+    openlog("imgconv", LOG_PERROR, LOG_USER);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "d:ef:p:t:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            devio_path = optarg;
+            break;
+
+        case 'e':
+            source_is_endpoint = 1;
+            break;
+
+        case 'f':
+            target_format = optarg;
+            break;
+
+        case 'p':
+            source_partition = optarg;
+            break;
+
+        case 't':
+            thread_count = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            if (!parse_size(optarg, &chunk_size))
+                return -1;
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 2 || thread_count == 0 || chunk_size < 512 ||
+        chunk_size > (64 << 20) ||
+        (target_format != NULL && strcmp(target_format, "raw") != 0 &&
+            strcmp(target_format, "vhd") != 0))
+    {
+        fprintf(stderr,
+            "imgconv - Converts disk images between raw and dynamically expanding VHD\n"
+            "format.\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "imgconv [-d devio] [-t threads] [-b chunksize] [-p partition] [-f raw|vhd]\n"
+            "        source target\n"
+            "imgconv -e [-t threads] [-b chunksize] [-f raw|vhd] host:port|exec:command\n"
+            "        target\n"
+            "\n"
+            "-d devio       Path to devio executable, used to read source image and to\n"
+            "               write VHD targets. Default is devio in PATH.\n"
+            "-t threads     Number of threads, each with its own source connection.\n"
+            "               Default is 4.\n"
+            "-b chunksize   Size of each read, default 1M. All-zero chunks are not\n"
+            "               written, which leaves unallocated ranges in targets.\n"
+            "-p partition   Convert only this partition of source image, MBR or GPT.\n"
+            "-f raw|vhd     Target format. Default is vhd if target name ends with\n"
+            "               .vhd, otherwise raw.\n"
+            "-e             Source is a devio server endpoint instead of an image file.\n"
+            "\n"
+            "Source can be in any format devio reads, for example raw or dynamically\n"
+            "expanding VHD.\n");
+
+        return -1;
+    }
+
+    source_path = argv[optind];
+    target_path = argv[optind + 1];
+
+    if (target_format == NULL)
+    {
+        size_t length = strlen(target_path);
+
+        if (length > 4 && _stricmp(target_path + length - 4, ".vhd") == 0)
+            target_format = "vhd";
+        else
+            target_format = "raw";
+    }
+
+    threads = (CONV_THREAD*)calloc(thread_count, sizeof(*threads));
+    if (threads == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    if (source_is_endpoint)
+        endpoint = strdup(source_path);
+    else
+        endpoint = devio_endpoint("-r", source_path, source_partition);
+
+    if (endpoint == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        threads[i].buf = (char*)malloc((size_t)chunk_size);
+        if (threads[i].buf == NULL)
+        {
+            syslog(LOG_ERR, "Memory allocation failed: %m\n");
+            return 1;
+        }
+
+        if (!devio_client_open(&threads[i].client, endpoint))
+            return 1;
+    }
+
+    free(endpoint);
+
+    image_size = threads[0].client.info.file_size;
+
+    if (image_size == 0)
+    {
+        fprintf(stderr, "Source size is unknown or zero.\n");
+        return 1;
+    }
+
+    if (strcmp(target_format, "vhd") == 0)
+    {
+        if (vhd_create(target_path, image_size) != 0)
+            return 1;
+
+        endpoint = devio_endpoint("", target_path, "0");
+        if (endpoint == NULL)
+        {
+            syslog(LOG_ERR, "Memory allocation failed: %m\n");
+            return 1;
+        }
+
+        if (!devio_client_open(&target_client, endpoint))
+            return 1;
+
+        free(endpoint);
+
+        if (target_client.info.file_size != image_size)
+        {
+            fprintf(stderr, "Created VHD has unexpected size " ULL_FMT ".\n",
+                target_client.info.file_size);
+            return 1;
+        }
+
+        // New VHD blocks are zero filled when allocated
+        target_skip_zero = 1;
+    }
+    else
+    {
+        struct stat target_stat;
+
+        target_fd = open(target_path, O_BINARY | O_WRONLY | O_CREAT, 0644);
+        if (target_fd == -1)
+        {
+            syslog(LOG_ERR, "Cannot open '%s': %m\n", target_path);
+            return 1;
+        }
+
+        // Only regular files can be left sparse. Existing contents of other
+        // targets, such as block devices, are overwritten in full.
+        if (fstat(target_fd, &target_stat) == 0 &&
+            S_ISREG(target_stat.st_mode))
+        {
+            if (ftruncate(target_fd, 0) != 0 ||
+                ftruncate(target_fd, (off_t_64)image_size) != 0)
+            {
+                syslog(LOG_ERR, "Cannot set size of '%s': %m\n",
+                    target_path);
+                return 1;
+            }
+
+            target_skip_zero = 1;
+        }
+    }
+
+    printf("Converting " ULL_FMT " bytes to %s image '%s' with %u threads.\n",
+        image_size, target_format, target_path, thread_count);
+
+    start_time = stats_clock();
+
+    for (i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&threads[i].thread, NULL, conv_thread,
+            threads + i) != 0)
+        {
+            syslog(LOG_ERR, "pthread_create() failed: %m\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        devio_client_close(&threads[i].client);
+        free(threads[i].buf);
+    }
+
+    if (target_fd != -1)
+    {
+        if (fsync(target_fd) != 0 || close(target_fd) != 0)
+        {
+            syslog(LOG_ERR, "Error writing '%s': %m\n", target_path);
+            failed = 1;
+        }
+    }
+    else
+    {
+        devio_client_close(&target_client);
+    }
+
+    elapsed = stats_clock() - start_time;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%s " ULL_FMT " bytes in %.3f s, %.2f MB/s. " ULL_FMT
+        " bytes written, " ULL_FMT " zero bytes skipped.\n",
+        failed ? "Failed after" : "Converted",
+        copied_bytes + skipped_bytes,
+        (double)elapsed / 1000000.0,
+        (double)(copied_bytes + skipped_bytes) / (double)elapsed,
+        copied_bytes,
+        skipped_bytes);
+
+    free(threads);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,408 @@
+/*
+Replays request traces recorded by devio --record through the request
+merging and elevator ordering of the driver, against a simple model of
+backend cost, to compare backend calls and latency with FIFO serving.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdmerge.h"
+#include "devstats.h"
+#include "devtrace.h"
+
+// Same limit as the driver uses for each batch
+#define MAX_BATCH 16
+
+typedef struct _TRACE_REQUEST
+{
+    uint64_t arrival;           // Microseconds from start of trace
+    IMDMERGE_REQUEST request;
+    int barrier;                // Other request, served alone in order
+} TRACE_REQUEST, *PTRACE_REQUEST;
+
+PTRACE_REQUEST trace = NULL;
+size_t trace_count = 0;
+
+unsigned int batch_size = MAX_BATCH;
+double op_latency = 100.0;      // Microseconds for each backend call
+double bandwidth = 500.0;       // MB/s
+double seek_cost = 0.0;         // Microseconds for each GB of head movement
+
+int
+load_trace(const char *name)
+{
+    char magic[sizeof(DEVIO_TRACE_MAGIC) - 1];
+    uint64_t version, flags, trace_size, trace_alignment;
+    uint64_t trace_time = 0;
+    ULONGLONG last_end = 0;
+    size_t allocated = 0;
+    FILE *trace_file;
+
+    trace_file = fopen(name, "rb");
+    if (trace_file == NULL)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", name);
+        return 0;
+    }
+
+    if (fread(magic, sizeof(magic), 1, trace_file) != 1 ||
+        memcmp(magic, DEVIO_TRACE_MAGIC, sizeof(magic)) != 0 ||
+        !devtrace_get_varint(trace_file, &version) ||
+        version != DEVIO_TRACE_VERSION ||
+        !devtrace_get_varint(trace_file, &flags) ||
+        !devtrace_get_varint(trace_file, &trace_size) ||
+        !devtrace_get_varint(trace_file, &trace_alignment))
+    {
+        fprintf(stderr, "'%s' is not a supported trace file.\n", name);
+        fclose(trace_file);
+        return 0;
+    }
+
+    for (;;)
+    {
+        int request_code = getc(trace_file);
+        uint64_t delta;
+        uint64_t zigzag_offset = 0;
+        uint64_t length = 0;
+        ULONGLONG offset = 0;
+        PTRACE_REQUEST entry;
+
+        if (request_code == EOF)
+            break;
+
+        if (!devtrace_get_varint(trace_file, &delta))
+        {
+            fprintf(stderr, "Truncated trace file.\n");
+            break;
+        }
+
+        trace_time += delta;
+
+        if (request_code == IMDPROXY_REQ_READ ||
+            request_code == IMDPROXY_REQ_WRITE)
+        {
+            if (!devtrace_get_varint(trace_file, &zigzag_offset) ||
+                !devtrace_get_varint(trace_file, &length))
+            {
+                fprintf(stderr, "Truncated trace file.\n");
+                break;
+            }
+
+            offset = last_end + (ULONGLONG)devtrace_unzigzag(zigzag_offset);
+            last_end = offset + length;
+
+            if (request_code == IMDPROXY_REQ_WRITE &&
+                (flags & DEVIO_TRACE_FLAG_HASH))
+            {
+                char hash[sizeof(uint64_t)];
+
+                if (fread(hash, sizeof(hash), 1, trace_file) != 1)
+                {
+                    fprintf(stderr, "Truncated trace file.\n");
+                    break;
+                }
+            }
+        }
+        else if (request_code == IMDPROXY_REQ_INFO)
+            continue;
+
+        if (trace_count == allocated)
+        {
+            size_t new_allocated = allocated ? allocated * 2 : 65536;
+            PTRACE_REQUEST new_trace = (PTRACE_REQUEST)
+                realloc(trace, new_allocated * sizeof(*trace));
+
+            if (new_trace == NULL)
+            {
+                syslog(LOG_ERR, "Memory allocation failed: %m\n");
+                fclose(trace_file);
+                return 0;
+            }
+
+            trace = new_trace;
+            allocated = new_allocated;
+        }
+
+        entry = trace + trace_count++;
+        entry->arrival = trace_time;
+        entry->request.offset = (long long)offset;
+        entry->request.length = (unsigned int)length;
+        entry->request.write = request_code == IMDPROXY_REQ_WRITE;
+        entry->barrier = request_code != IMDPROXY_REQ_READ &&
+            request_code != IMDPROXY_REQ_WRITE;
+    }
+
+    fclose(trace_file);
+
+    return 1;
+}
+
+// Checks that a plan serves each request once, keeps conflicting requests
+// in arrival order and only merges what can be merged. Returns number of
+// errors found.
+unsigned int
+check_plan(const IMDMERGE_REQUEST *requests, unsigned int count,
+    unsigned int max_length, const unsigned int *order,
+    const unsigned int *runs, unsigned int run_count)
+{
+    unsigned int served_at[MAX_BATCH];
+    unsigned int errors = 0;
+    unsigned int first = 0;
+    unsigned int i, j, r;
+
+    for (i = 0; i < count; i++)
+        served_at[i] = count;
+
+    for (i = 0; i < count; i++)
+        if (order[i] >= count || served_at[order[i]] != count)
+            errors++;
+        else
+            served_at[order[i]] = i;
+
+    for (i = 0; i < count; i++)
+        for (j = i + 1; j < count; j++)
+            if (served_at[i] < count && served_at[j] < count &&
+                ImDiskMergeConflict(requests + i, requests + j) &&
+                served_at[i] > served_at[j])
+                errors++;
+
+    for (r = 0; r < run_count; first += runs[r], r++)
+    {
+        unsigned long long length = requests[order[first]].length;
+
+        if (runs[r] == 0 || first + runs[r] > count)
+            return errors + 1;
+
+        for (i = first + 1; i < first + runs[r]; i++)
+        {
+            const IMDMERGE_REQUEST *previous = requests + order[i - 1];
+            const IMDMERGE_REQUEST *request = requests + order[i];
+
+            if (request->write != previous->write ||
+                request->offset != previous->offset + previous->length)
+                errors++;
+
+            length += request->length;
+        }
+
+        if (runs[r] > 1 && length > max_length)
+            errors++;
+    }
+
+    if (first != count)
+        errors++;
+
+    return errors;
+}
+
+// Returns number of errors found in plans
+unsigned int
+simulate(const char *name, int sort, unsigned int max_length)
+{
+    LATENCY_LIST list = { 0 };
+    unsigned long long backend_ops = 0;
+    unsigned long long backend_bytes = 0;
+    double head_movement = 0.0;
+    double clock = 0.0;
+    long long head = 0;
+    long long position = 0;
+    unsigned int errors = 0;
+    size_t next = 0;
+
+    while (next < trace_count)
+    {
+        IMDMERGE_REQUEST requests[MAX_BATCH];
+        unsigned int order[MAX_BATCH];
+        unsigned int runs[MAX_BATCH];
+        unsigned int run_count;
+        unsigned int count = 0;
+        unsigned int first = 0;
+        unsigned int r;
+
+        if ((double)trace[next].arrival > clock)
+            clock = (double)trace[next].arrival;
+
+        if (trace[next].barrier)
+        {
+            next++;
+            continue;
+        }
+
+        // Requests that arrived while backend was busy are served together
+        while (next + count < trace_count &&
+            count < batch_size &&
+            !trace[next + count].barrier &&
+            (double)trace[next + count].arrival <= clock)
+        {
+            requests[count] = trace[next + count].request;
+            count++;
+        }
+
+        run_count = ImDiskMergePlan(requests, count, sort, max_length,
+            &position, order, runs);
+
+        errors += check_plan(requests, count, max_length, order, runs,
+            run_count);
+
+        for (r = 0; r < run_count; first += runs[r], r++)
+        {
+            const IMDMERGE_REQUEST *start = requests + order[first];
+            unsigned long long length = 0;
+            unsigned int i;
+
+            for (i = first; i < first + runs[r]; i++)
+                length += requests[order[i]].length;
+
+            head_movement += (double)(start->offset > head ?
+                start->offset - head : head - start->offset);
+
+            clock += op_latency + (double)length / (bandwidth * 1.048576) +
+                seek_cost * (double)(start->offset > head ?
+                    start->offset - head : head - start->offset) /
+                (1024.0 * 1024.0 * 1024.0);
+
+            head = start->offset + (long long)length;
+
+            backend_ops++;
+            backend_bytes += length;
+
+            for (i = first; i < first + runs[r]; i++)
+                latency_add(&list,
+                    (uint64_t)(clock - (double)trace[next + order[i]].arrival),
+                    requests[order[i]].length);
+        }
+
+        next += count;
+    }
+
+    latency_report(name, &list, (uint64_t)clock);
+
+    printf("       backend calls %llu, %.1f KB each, head movement %.1f GB\n",
+        backend_ops,
+        backend_ops ? (double)backend_bytes / 1024.0 / backend_ops : 0.0,
+        head_movement / (1024.0 * 1024.0 * 1024.0));
+
+    if (errors != 0)
+        printf("       %u errors in plans\n", errors);
+
+    latency_free(&list);
+
+    return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+    ULONGLONG max_length = 1 << 20;
+    unsigned int errors = 0;
+    int opt;
+
+    openlog("mergesim", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "q:m:l:b:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            batch_size = (unsigned int)strtoul(optarg, NULL, 0);
+            if (batch_size == 0 || batch_size > MAX_BATCH)
+                argc = 0;
+            break;
+
+        case 'm':
+            if (!parse_size(optarg, &max_length) || max_length > 0xFFFFFFFF)
+                return -1;
+            break;
+
+        case 'l':
+            op_latency = strtod(optarg, NULL);
+            break;
+
+        case 'b':
+            bandwidth = strtod(optarg, NULL);
+            if (bandwidth <= 0)
+                argc = 0;
+            break;
+
+        case 's':
+            seek_cost = strtod(optarg, NULL);
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        fprintf(stderr,
+            "mergesim - Request merging and elevator ordering simulator\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "mergesim [-q batch] [-m maxlength] [-l latency] [-b MB/s] [-s seekcost]\n"
+            "         tracefile\n"
+            "\n"
+            "Replays a trace recorded by devio --record with arrival times as\n"
+            "recorded, against a backend that serves one call at a time. Requests\n"
+            "that arrive while the backend is busy are planned together, as the\n"
+            "driver does, first in arrival order, then with adjacent requests\n"
+            "merged, and then also sorted by offset. Each plan is checked to serve\n"
+            "every request once, in arrival order where requests conflict. Exit\n"
+            "status is nonzero if any errors were found.\n"
+            "\n"
+            "-q      Most requests planned together, at most 16. Default 16.\n"
+            "-m      Most bytes in a merged call. Default 1M.\n"
+            "-l      Microseconds for each backend call. Default 100.\n"
+            "-b      Backend transfer rate in MB/s. Default 500.\n"
+            "-s      Microseconds for each GB between end of last call and start\n"
+            "        of next, for rotating or remote backends. Default 0.\n");
+
+        return -1;
+    }
+
+    if (!load_trace(argv[optind]))
+        return 1;
+
+    printf(SIZ_FMT " requests, call %.0f us, %.0f MB/s, seek %.0f us/GB.\n",
+        trace_count, op_latency, bandwidth, seek_cost);
+
+    errors += simulate("FIFO", 0, 0);
+    errors += simulate("Merge", 0, (unsigned int)max_length);
+    errors += simulate("Sort", 1, (unsigned int)max_length);
+
+    free(trace);
+
+    return errors != 0 ? 2 : 0;
+}
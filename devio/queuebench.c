@@ -0,0 +1,348 @@
+/*
+Stress test and benchmark of the lock free request queue used by the
+driver, compared to a list with a lock and a wakeup for each request, as
+the driver used before.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdqueue.h"
+#include "devstats.h"
+
+// Entries of each producer are reused when the consumer is done with them,
+// like IRP-s, so entries popped a moment ago are pushed again.
+#define ENTRIES_PER_PRODUCER 64
+
+typedef struct _ITEM
+{
+    IMDQUEUE_ENTRY entry;       // First, like ListEntry in IRP
+    struct _ITEM *next;         // Link in locked list
+    unsigned int producer;
+    unsigned long long seq;
+    volatile int busy;
+} ITEM, *PITEM;
+
+unsigned int producers = 0;
+unsigned long long items_per_producer = 1000000;
+PITEM items = NULL;
+
+int use_lock = 0;
+
+// Lock free queue, lock and condition only used for wakeups
+IMDQUEUE queue;
+
+// Locked list
+PITEM list_head = NULL;
+PITEM list_tail = NULL;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+int wake = 0;
+unsigned long long wakeups = 0;
+unsigned long long waits = 0;
+
+void
+push(PITEM item)
+{
+    if (use_lock)
+    {
+        pthread_mutex_lock(&lock);
+
+        item->next = NULL;
+        if (list_tail == NULL)
+            list_head = item;
+        else
+            list_tail->next = item;
+        list_tail = item;
+
+        ++wakeups;
+        pthread_cond_signal(&cond);
+
+        pthread_mutex_unlock(&lock);
+
+        return;
+    }
+
+    if (!ImDiskQueuePush(&queue, &item->entry))
+        return;
+
+    pthread_mutex_lock(&lock);
+
+    wake = 1;
+    ++wakeups;
+    pthread_cond_signal(&cond);
+
+    pthread_mutex_unlock(&lock);
+}
+
+PITEM
+pop()
+{
+    PITEM item;
+
+    if (use_lock)
+    {
+        pthread_mutex_lock(&lock);
+
+        while (list_head == NULL)
+        {
+            ++waits;
+            pthread_cond_wait(&cond, &lock);
+        }
+
+        item = list_head;
+        list_head = item->next;
+        if (list_head == NULL)
+            list_tail = NULL;
+
+        pthread_mutex_unlock(&lock);
+
+        return item;
+    }
+
+    for (;;)
+    {
+        PIMDQUEUE_ENTRY entry = ImDiskQueuePop(&queue);
+
+        if (entry != NULL)
+            return (PITEM)entry;
+
+        pthread_mutex_lock(&lock);
+
+        if (ImDiskQueuePrepareWait(&queue))
+        {
+            ++waits;
+
+            while (!wake)
+                pthread_cond_wait(&cond, &lock);
+
+            wake = 0;
+        }
+
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void *
+producer_thread(void *arg)
+{
+    unsigned int producer = (unsigned int)(size_t)arg;
+    PITEM own = items + (size_t)producer * ENTRIES_PER_PRODUCER;
+    unsigned long long seq;
+
+    for (seq = 0; seq < items_per_producer; seq++)
+    {
+        PITEM item = own + seq % ENTRIES_PER_PRODUCER;
+
+        while (__atomic_load_n(&item->busy, __ATOMIC_ACQUIRE))
+            sched_yield();
+
+        item->producer = producer;
+        item->seq = seq;
+        item->busy = 1;
+
+        push(item);
+    }
+
+    return NULL;
+}
+
+// Returns number of errors found
+unsigned long long
+run(const char *name)
+{
+    unsigned long long total = items_per_producer * producers;
+    unsigned long long *next_seq;
+    unsigned long long errors = 0;
+    unsigned long long count;
+    pthread_t *threads;
+    uint64_t start_time;
+    uint64_t elapsed;
+    unsigned int i;
+
+    next_seq = (unsigned long long *)calloc(producers, sizeof(*next_seq));
+    threads = (pthread_t *)calloc(producers, sizeof(*threads));
+
+    if (next_seq == NULL || threads == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        exit(1);
+    }
+
+    memset(items, 0, sizeof(*items) * ENTRIES_PER_PRODUCER * producers);
+    ImDiskQueueInitialize(&queue);
+    wakeups = 0;
+    waits = 0;
+    wake = 0;
+
+    start_time = stats_clock();
+
+    for (i = 0; i < producers; i++)
+    {
+        errno = pthread_create(threads + i, NULL, producer_thread,
+            (void *)(size_t)i);
+
+        if (errno != 0)
+        {
+            syslog(LOG_ERR, "pthread_create() failed: %m\n");
+            exit(1);
+        }
+    }
+
+    // Requests of each producer need to arrive in order, each once
+    for (count = 0; count < total; count++)
+    {
+        PITEM item = pop();
+
+        if (item->producer >= producers ||
+            item->seq != next_seq[item->producer])
+        {
+            if (errors++ < 10)
+                fprintf(stderr, "Producer %u item %llu out of order.\n",
+                    item->producer, item->seq);
+        }
+        else
+            next_seq[item->producer]++;
+
+        __atomic_store_n(&item->busy, 0, __ATOMIC_RELEASE);
+    }
+
+    for (i = 0; i < producers; i++)
+        pthread_join(threads[i], NULL);
+
+    elapsed = stats_clock() - start_time;
+
+    if (!use_lock && ImDiskQueuePop(&queue) != NULL)
+    {
+        fprintf(stderr, "Queue not empty after all items.\n");
+        errors++;
+    }
+
+    printf("%-8s %.2f M requests/s, %llu wakeups, %llu waits, "
+        "%llu errors\n",
+        name,
+        elapsed ? (double)total / (double)elapsed : 0.0,
+        wakeups, waits, errors);
+
+    free(next_seq);
+    free(threads);
+
+    return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long errors = 0;
+    unsigned int rounds = 1;
+    unsigned int r;
+    int opt;
+
+    openlog("queuebench", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "p:n:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            producers = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            items_per_producer = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'r':
+            rounds = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc != optind || items_per_producer == 0)
+    {
+        fprintf(stderr,
+            "queuebench - Lock free request queue stress test and benchmark\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "queuebench [-p producers] [-n requests] [-r rounds]\n"
+            "\n"
+            "Producer threads queue requests to one consumer, through the lock\n"
+            "free queue of the driver and through a list with a lock and a\n"
+            "wakeup for each request. The consumer checks that requests of each\n"
+            "producer arrive in order, exactly once. Exit status is nonzero if\n"
+            "any errors were found.\n"
+            "\n"
+            "-p      Producer threads. Default number of processors.\n"
+            "-n      Requests from each producer in each run. Default 1000000.\n"
+            "-r      Rounds of runs. Default 1.\n");
+
+        return -1;
+    }
+
+    if (producers == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        producers = n > 0 ? (unsigned int)n : 1;
+    }
+
+    items = (PITEM)malloc(sizeof(*items) * ENTRIES_PER_PRODUCER * producers);
+
+    if (items == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    printf("%u producers, %llu requests each.\n", producers,
+        items_per_producer);
+
+    for (r = 0; r < rounds; r++)
+    {
+        use_lock = 0;
+        errors += run("LockFree");
+
+        use_lock = 1;
+        errors += run("Locked");
+    }
+
+    free(items);
+
+    return errors != 0 ? 2 : 0;
+}
@@ -0,0 +1,423 @@
+/*
+Measures compression ratio, throughput and latency of the compressed tier
+for cold blocks of memory backed disks, and memory use of a disk where
+accesses go mostly to a small hot set.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "devio_types.h"
+#include "../inc/imdproxy.h"
+#include "../inc/imdtier.h"
+#include "devstats.h"
+
+#define WORDS 256
+
+ULONGLONG block_size = 65536;
+ULONGLONG data_size = 256 << 20;
+unsigned int random_percent = 10;
+unsigned int hot_percent = 10;
+unsigned int age = 4;
+unsigned int ticks = 32;
+size_t accesses_per_tick = 4096;
+unsigned char *data = NULL;     // Original contents of all blocks
+size_t blocks = 0;
+
+// Fills blocks with words from a small vocabulary, like text and object
+// files, except random_percent of blocks that are filled with random data,
+// like already compressed files.
+void
+generate_data()
+{
+    unsigned char words[WORDS][32];
+    size_t lengths[WORDS];
+    size_t i;
+
+    for (i = 0; i < WORDS; i++)
+    {
+        size_t j;
+
+        lengths[i] = 4 + next_random() % 28;
+
+        for (j = 0; j < lengths[i]; j++)
+            words[i][j] = (unsigned char)next_random();
+    }
+
+    for (i = 0; i < blocks; i++)
+    {
+        unsigned char *block = data + i * (size_t)block_size;
+        size_t pos = 0;
+
+        if (next_random() % 100 < random_percent)
+        {
+            for (; pos < block_size; pos++)
+                block[pos] = (unsigned char)next_random();
+
+            continue;
+        }
+
+        while (pos < block_size)
+        {
+            size_t word = next_random() % WORDS;
+            size_t length = lengths[word];
+
+            if (length > block_size - pos)
+                length = (size_t)block_size - pos;
+
+            memcpy(block + pos, words[word], length);
+            pos += length;
+        }
+    }
+}
+
+int
+load_data(const char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    size_t done = 0;
+
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "Cannot open '%s': %m\n", file_name);
+        return 0;
+    }
+
+    while (done < blocks * (size_t)block_size)
+    {
+        ssize_t got = read(fd, data + done,
+            blocks * (size_t)block_size - done);
+
+        if (got < 0)
+        {
+            syslog(LOG_ERR, "Read error in '%s': %m\n", file_name);
+            close(fd);
+            return 0;
+        }
+
+        if (got == 0)
+            break;
+
+        done += got;
+    }
+
+    close(fd);
+
+    blocks = done / (size_t)block_size;
+
+    return 1;
+}
+
+void
+report_store(const char *name, PIMDTIER tier)
+{
+    printf("%-8s %zu of %zu blocks compressed, " ULL_FMT " rejected.\n"
+        "         data %.1f MB in %.1f MB of slabs, ratio %.2f, "
+        "%.1f%% slab use\n",
+        name, tier->compressed_blocks, blocks,
+        (ULONGLONG)tier->rejected,
+        tier->data_bytes / 1048576.0, tier->store_bytes / 1048576.0,
+        tier->store_bytes ? (double)tier->compressed_blocks *
+        (double)block_size / (double)tier->store_bytes : 0.0,
+        tier->store_bytes ? 100.0 * tier->data_bytes / tier->store_bytes :
+        0.0);
+}
+
+// Compresses all blocks, then decompresses them in random order and checks
+// that data is unchanged. Returns 0 if data differs.
+int
+run_codec(PIMDTIER tier, unsigned char *buffer)
+{
+    LATENCY_LIST list = { 0 };
+    uint64_t start_time;
+    size_t i;
+
+    start_time = stats_clock();
+
+    for (i = 0; i < blocks; i++)
+    {
+        uint64_t issue_time = stats_clock();
+
+        ImDiskTierCompress(tier, i, data + i * (size_t)block_size,
+            (size_t)block_size);
+
+        latency_add(&list, stats_clock() - issue_time, block_size);
+    }
+
+    latency_report("Compress", &list, stats_clock() - start_time);
+    latency_free(&list);
+
+    report_store("Store", tier);
+
+    start_time = stats_clock();
+
+    for (i = 0; i < blocks; i++)
+    {
+        size_t block = next_random() % blocks;
+        uint64_t issue_time;
+
+        if (!ImDiskTierIsCompressed(tier, block))
+            continue;
+
+        issue_time = stats_clock();
+
+        if (!ImDiskTierDecompress(tier, block, buffer, (size_t)block_size) ||
+            memcmp(buffer, data + block * (size_t)block_size,
+                (size_t)block_size) != 0)
+        {
+            syslog(LOG_ERR, "Block %zu differs after decompression.\n",
+                block);
+            latency_free(&list);
+            return 0;
+        }
+
+        latency_add(&list, stats_clock() - issue_time, block_size);
+    }
+
+    latency_report("Decomp", &list, stats_clock() - start_time);
+    latency_free(&list);
+
+    for (i = 0; i < blocks; i++)
+        ImDiskTierDrop(tier, i);
+
+    return 1;
+}
+
+// Simulates a disk where hot_percent of blocks get 90% of accesses. Blocks
+// not accessed for age ticks are compressed at end of each tick, and a
+// compressed block that is accessed is decompressed and becomes hot again,
+// as when it is written to. Reports memory use at end, and latency of
+// accesses to hot and compressed blocks.
+int
+run_tiered(PIMDTIER tier, unsigned char *buffer)
+{
+    LATENCY_LIST hot_list = { 0 };
+    LATENCY_LIST cold_list = { 0 };
+    size_t hot_blocks = blocks * hot_percent / 100;
+    size_t resident = blocks;
+    uint64_t start_time = stats_clock();
+    unsigned int now;
+    size_t i;
+
+    if (hot_blocks == 0)
+        hot_blocks = 1;
+
+    for (i = 0; i < blocks; i++)
+        ImDiskTierTouch(tier, i, 0);
+
+    for (now = 1; now <= ticks; now++)
+    {
+        for (i = 0; i < accesses_per_tick; i++)
+        {
+            size_t block = next_random() % 10 != 0 ?
+                next_random() % hot_blocks : next_random() % blocks;
+            uint64_t issue_time = stats_clock();
+
+            if (ImDiskTierIsCompressed(tier, block))
+            {
+                if (!ImDiskTierDecompress(tier, block, buffer,
+                    (size_t)block_size) ||
+                    memcmp(buffer, data + block * (size_t)block_size,
+                        (size_t)block_size) != 0)
+                {
+                    syslog(LOG_ERR, "Block %zu differs after "
+                        "decompression.\n", block);
+                    return 0;
+                }
+
+                ImDiskTierDrop(tier, block);
+                resident++;
+
+                latency_add(&cold_list, stats_clock() - issue_time,
+                    block_size);
+            }
+            else
+            {
+                memcpy(buffer, data + block * (size_t)block_size,
+                    (size_t)block_size);
+
+                latency_add(&hot_list, stats_clock() - issue_time,
+                    block_size);
+            }
+
+            ImDiskTierTouch(tier, block, now);
+        }
+
+        for (i = 0; i < blocks; i++)
+            if (!ImDiskTierIsCompressed(tier, i) &&
+                ImDiskTierIsCold(tier, i, now, age))
+            {
+                if (ImDiskTierCompress(tier, i,
+                    data + i * (size_t)block_size, (size_t)block_size))
+                    resident--;
+                else
+                    ImDiskTierTouch(tier, i, now);
+            }
+    }
+
+    latency_report("Hot", &hot_list, stats_clock() - start_time);
+    latency_report("Cold", &cold_list, stats_clock() - start_time);
+
+    report_store("Tiered", tier);
+
+    printf("         memory %.1f MB of %.1f MB, %zu blocks uncompressed\n",
+        ((double)resident * block_size + tier->store_bytes) / 1048576.0,
+        (double)blocks * block_size / 1048576.0, resident);
+
+    latency_free(&hot_list);
+    latency_free(&cold_list);
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    IMDTIER tier;
+    unsigned char *buffer;
+    int opt;
+
+    openlog("tierbench", LOG_PERROR, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "b:s:r:h:a:t:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if (!parse_size(optarg, &block_size) || block_size == 0 ||
+                block_size > IMDTIER_MAX_BLOCK_SIZE)
+                return -1;
+            break;
+
+        case 's':
+            if (!parse_size(optarg, &data_size))
+                return -1;
+            break;
+
+        case 'r':
+            random_percent = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'h':
+            hot_percent = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'a':
+            age = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 't':
+            ticks = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            accesses_per_tick = (size_t)strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind > 1 || data_size < block_size ||
+        random_percent > 100 || hot_percent > 100)
+    {
+        fprintf(stderr,
+            "tierbench - Compressed tier for cold blocks of memory disks\n"
+            "Copyright (C) 2005-2023 Olof Lagerkvist.\n"
+            "\n"
+            "Usage:\n"
+            "tierbench [-b blocksize] [-s size] [-r percent] [-h percent]\n"
+            "          [-a ticks] [-t ticks] [-n accesses] [imagefile]\n"
+            "\n"
+            "Compresses all blocks of data, and decompresses them in random order,\n"
+            "reporting throughput, latency and compression ratio. Then simulates a\n"
+            "disk where blocks not accessed for some ticks are compressed, and\n"
+            "reports memory use and latency of accesses to uncompressed and\n"
+            "compressed blocks. Data is read from image file if given, otherwise it\n"
+            "is generated.\n"
+            "\n"
+            "-b      Block size, at most 64K. Default 64K.\n"
+            "-s      Size of data. Default 256M.\n"
+            "-r      Percent of generated blocks with random data. Default 10.\n"
+            "-h      Percent of blocks that get 90%% of accesses. Default 10.\n"
+            "-a      Ticks without access before block is compressed. Default 4.\n"
+            "-t      Ticks to simulate. Default 32.\n"
+            "-n      Accesses in each tick. Default 4096.\n");
+
+        return -1;
+    }
+
+    blocks = (size_t)(data_size / block_size);
+
+    data = (unsigned char *)malloc(blocks * (size_t)block_size);
+    buffer = (unsigned char *)malloc((size_t)block_size);
+
+    if (data == NULL || buffer == NULL)
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    if (argc - optind == 1)
+    {
+        if (!load_data(argv[optind]))
+            return 1;
+
+        if (blocks == 0)
+        {
+            fprintf(stderr, "Image is smaller than block size.\n");
+            return 1;
+        }
+    }
+    else
+        generate_data();
+
+    if (!ImDiskTierInitialize(&tier, (unsigned int)block_size, blocks))
+    {
+        syslog(LOG_ERR, "Memory allocation failed: %m\n");
+        return 1;
+    }
+
+    printf("%zu blocks of " ULL_FMT " bytes.\n", blocks, block_size);
+
+    if (!run_codec(&tier, buffer) ||
+        !run_tiered(&tier, buffer))
+        return 2;
+
+    ImDiskTierFree(&tier);
+    free(data);
+    free(buffer);
+
+    return 0;
+}
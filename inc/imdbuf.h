@@ -0,0 +1,350 @@
+/*
+ImDisk buffer operations shared between driver and user mode components.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_IMDBUF_
+#define _INC_IMDBUF_
+
+/*
+Zero detection, byte pair swapping and comparison of I/O buffers.
+
+ImDiskBufferIsZero      Returns non-zero if all Length bytes are zero.
+ImDiskBufferSwap16      Swaps bytes in each pair of bytes, for byte-swapped
+                        images. An odd last byte is left as it is.
+ImDiskBufferCompare     Returns number of equal bytes at start of buffers,
+                        like RtlCompareMemory.
+
+SSE2 is used on x86/x64 and NEON on ARM. In user mode on x64, AVX2 is used
+when the processor supports it. Kernel mode builds never use AVX2, because
+that would require saving extended processor state around each call. AVX2
+routines clear upper halves of registers before returning, since GCC does
+not do that for functions with a target attribute, and SSE2 code that runs
+after them would otherwise be slowed down. Buffers need no particular
+alignment.
+*/
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMDBUF_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(_M_X64) || defined(__x86_64__)) && \
+    !defined(_KERNEL_MODE) && !defined(_NTDDK_) && \
+    (defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1700))
+#define IMDBUF_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define IMDBUF_AVX2_FUNC
+#else
+#define IMDBUF_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(_M_ARM64) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMDBUF_NEON
+#if defined(_MSC_VER) && defined(_M_ARM64)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef IMDBUF_AVX2
+
+    static int ImDiskBufferAvx2Support = -1;
+
+    static __inline int
+        ImDiskBufferHaveAvx2()
+    {
+        if (ImDiskBufferAvx2Support < 0)
+        {
+#ifdef _MSC_VER
+            int regs[4];
+
+            __cpuid(regs, 0);
+
+            ImDiskBufferAvx2Support = 0;
+
+            if (regs[0] >= 7)
+            {
+                __cpuid(regs, 1);
+
+                // OSXSAVE and AVX, and OS saves YMM state
+                if ((regs[2] & 0x18000000) == 0x18000000 &&
+                    (_xgetbv(0) & 6) == 6)
+                {
+                    __cpuidex(regs, 7, 0);
+                    ImDiskBufferAvx2Support = (regs[1] & 0x20) != 0;
+                }
+            }
+#else
+            __builtin_cpu_init();
+            ImDiskBufferAvx2Support = __builtin_cpu_supports("avx2") != 0;
+#endif
+        }
+
+        return ImDiskBufferAvx2Support;
+    }
+
+    static __inline IMDBUF_AVX2_FUNC size_t
+        ImDiskBufferIsZeroAvx2(const unsigned char *ptr, size_t length)
+    {
+        size_t i;
+
+        for (i = 0; i + 128 <= length; i += 128)
+        {
+            __m256i acc = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i*)(ptr + i)),
+                    _mm256_loadu_si256((const __m256i*)(ptr + i + 32))),
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i*)(ptr + i + 64)),
+                    _mm256_loadu_si256((const __m256i*)(ptr + i + 96))));
+
+            if (!_mm256_testz_si256(acc, acc))
+            {
+                _mm256_zeroupper();
+                return (size_t)-1;
+            }
+        }
+
+        _mm256_zeroupper();
+        return i;
+    }
+
+    static __inline IMDBUF_AVX2_FUNC size_t
+        ImDiskBufferSwap16Avx2(unsigned char *ptr, size_t length)
+    {
+        size_t i;
+
+        for (i = 0; i + 32 <= length; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(ptr + i));
+
+            v = _mm256_or_si256(_mm256_slli_epi16(v, 8),
+                _mm256_srli_epi16(v, 8));
+
+            _mm256_storeu_si256((__m256i*)(ptr + i), v);
+        }
+
+        _mm256_zeroupper();
+        return i;
+    }
+
+    static __inline IMDBUF_AVX2_FUNC size_t
+        ImDiskBufferCompareAvx2(const unsigned char *ptr1,
+            const unsigned char *ptr2, size_t length)
+    {
+        size_t i;
+
+        for (i = 0; i + 32 <= length; i += 32)
+        {
+            __m256i eq = _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i*)(ptr1 + i)),
+                _mm256_loadu_si256((const __m256i*)(ptr2 + i)));
+
+            if (_mm256_movemask_epi8(eq) != -1)
+                break;
+        }
+
+        _mm256_zeroupper();
+        return i;
+    }
+
+#endif
+
+    // Each vector routine processes whole vectors from the start of the
+    // buffers and returns how far it got, leaving the rest to the scalar
+    // loops. ImDiskBufferIsZero* return (size_t)-1 if a non-zero byte was
+    // found.
+
+    static __inline size_t
+        ImDiskBufferIsZeroVector(const unsigned char *ptr, size_t length)
+    {
+        size_t i = 0;
+
+#ifdef IMDBUF_AVX2
+        if (length >= 128 && ImDiskBufferHaveAvx2())
+        {
+            i = ImDiskBufferIsZeroAvx2(ptr, length);
+            if (i == (size_t)-1)
+                return i;
+        }
+#endif
+
+#if defined(IMDBUF_SSE2)
+        for (; i + 64 <= length; i += 64)
+        {
+            __m128i acc = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i*)(ptr + i)),
+                    _mm_loadu_si128((const __m128i*)(ptr + i + 16))),
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i*)(ptr + i + 32)),
+                    _mm_loadu_si128((const __m128i*)(ptr + i + 48))));
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+                0xFFFF)
+                return (size_t)-1;
+        }
+#elif defined(IMDBUF_NEON)
+        for (; i + 64 <= length; i += 64)
+        {
+            uint8x16_t acc = vorrq_u8(
+                vorrq_u8(vld1q_u8(ptr + i), vld1q_u8(ptr + i + 16)),
+                vorrq_u8(vld1q_u8(ptr + i + 32), vld1q_u8(ptr + i + 48)));
+            uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+
+            if ((vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) != 0)
+                return (size_t)-1;
+        }
+#endif
+
+        return i;
+    }
+
+    static __inline int
+        ImDiskBufferIsZero(const void *buffer, size_t length)
+    {
+        const unsigned char *ptr = (const unsigned char*)buffer;
+        size_t i = ImDiskBufferIsZeroVector(ptr, length);
+
+        if (i == (size_t)-1)
+            return 0;
+
+        for (; i + sizeof(size_t) <= length; i += sizeof(size_t))
+        {
+            size_t word;
+            memcpy(&word, ptr + i, sizeof(word));
+            if (word != 0)
+                return 0;
+        }
+
+        for (; i < length; i++)
+            if (ptr[i] != 0)
+                return 0;
+
+        return 1;
+    }
+
+    static __inline void
+        ImDiskBufferSwap16(void *buffer, size_t length)
+    {
+        unsigned char *ptr = (unsigned char*)buffer;
+        size_t i = 0;
+
+#ifdef IMDBUF_AVX2
+        if (length >= 32 && ImDiskBufferHaveAvx2())
+            i = ImDiskBufferSwap16Avx2(ptr, length);
+#endif
+
+#if defined(IMDBUF_SSE2)
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i));
+
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+            _mm_storeu_si128((__m128i*)(ptr + i), v);
+        }
+#elif defined(IMDBUF_NEON)
+        for (; i + 16 <= length; i += 16)
+        {
+            vst1q_u8(ptr + i, vrev16q_u8(vld1q_u8(ptr + i)));
+        }
+#endif
+
+        for (; i + 2 <= length; i += 2)
+        {
+            unsigned char b1 = ptr[i + 1];
+            ptr[i + 1] = ptr[i];
+            ptr[i] = b1;
+        }
+    }
+
+    static __inline size_t
+        ImDiskBufferCompare(const void *buffer1, const void *buffer2,
+            size_t length)
+    {
+        const unsigned char *ptr1 = (const unsigned char*)buffer1;
+        const unsigned char *ptr2 = (const unsigned char*)buffer2;
+        size_t i = 0;
+
+#ifdef IMDBUF_AVX2
+        if (length >= 32 && ImDiskBufferHaveAvx2())
+            i = ImDiskBufferCompareAvx2(ptr1, ptr2, length);
+#endif
+
+#if defined(IMDBUF_SSE2)
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i eq = _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i*)(ptr1 + i)),
+                _mm_loadu_si128((const __m128i*)(ptr2 + i)));
+
+            if (_mm_movemask_epi8(eq) != 0xFFFF)
+                break;
+        }
+#elif defined(IMDBUF_NEON)
+        for (; i + 16 <= length; i += 16)
+        {
+            uint64x2_t eq = vreinterpretq_u64_u8(
+                vceqq_u8(vld1q_u8(ptr1 + i), vld1q_u8(ptr2 + i)));
+
+            if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) !=
+                ~(uint64_t)0)
+                break;
+        }
+#endif
+
+        for (; i + sizeof(size_t) <= length; i += sizeof(size_t))
+        {
+            size_t word1;
+            size_t word2;
+            memcpy(&word1, ptr1 + i, sizeof(word1));
+            memcpy(&word2, ptr2 + i, sizeof(word2));
+            if (word1 != word2)
+                break;
+        }
+
+        for (; i < length && ptr1[i] == ptr2[i]; i++);
+
+        return i;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDBUF_
@@ -0,0 +1,346 @@
+/*
+ImDisk block cache shared between driver and user mode components.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_IMDCACHE_
+#define _INC_IMDCACHE_
+
+/*
+Set associative read cache of fixed size image data blocks. A block with
+number n is stored in one of IMDCACHE_WAYS entries in set n modulo number
+of sets, and the least recently used entry in a set is replaced. All
+memory is allocated when the cache is initialized, so memory use never
+exceeds the size given then.
+
+ImDiskCacheInitialize   Allocates a cache of at most MaxBytes of block data.
+                        Returns zero if there is not enough memory.
+ImDiskCacheFree         Frees memory of an initialized cache.
+ImDiskCacheLookup       Copies a range to a buffer if all blocks in the
+                        range are cached. Returns zero otherwise.
+ImDiskCacheFillable     Checks if ImDiskCacheInsert would store any block
+                        of a range, so that callers can skip keeping a
+                        copy of data that would not be cached anyway.
+ImDiskCacheGeneration   Gets value to pass to ImDiskCacheInsert for data
+                        read from image after this call.
+ImDiskCacheInsert       Stores all whole blocks in a range read from image,
+                        unless the cache was invalidated after the read was
+                        started, in which case data read could be stale.
+ImDiskCacheInvalidate   Drops blocks in a range. Called when a write, unmap
+                        or zero request completes, successfully or not.
+ImDiskCacheClear        Drops all blocks.
+
+Functions do no locking, callers serialize calls for a cache. Blocks are
+identified by offset in device, which need not be block aligned.
+
+Memory is allocated with IMDCACHE_ALLOC and IMDCACHE_FREE, which default
+to non-paged pool in kernel mode and to malloc and free in user mode.
+*/
+
+#include <string.h>
+
+#ifndef IMDCACHE_ALLOC
+#if defined(_KERNEL_MODE) || defined(_NTDDK_)
+#define IMDCACHE_ALLOC(size) ExAllocatePoolWithTag(NonPagedPool, (size), 'cDmI')
+#define IMDCACHE_FREE(ptr) ExFreePoolWithTag((ptr), 'cDmI')
+#else
+#include <stdlib.h>
+#define IMDCACHE_ALLOC(size) malloc(size)
+#define IMDCACHE_FREE(ptr) free(ptr)
+#endif
+#endif
+
+#define IMDCACHE_WAYS 8
+
+#define IMDCACHE_EMPTY (-1LL)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _IMDCACHE
+    {
+        unsigned char *data;        // Block data, NULL if cache is not used
+        long long *tags;            // Block number in entry, or IMDCACHE_EMPTY
+        unsigned int *stamps;       // Clock value at last use of entry
+        size_t entries;
+        size_t set_mask;
+        unsigned int block_shift;
+        unsigned int clock;
+        unsigned int generation;    // Changed by every invalidation
+        unsigned long long hits;
+        unsigned long long misses;
+    } IMDCACHE, *PIMDCACHE;
+
+    static __inline void
+        ImDiskCacheClear(PIMDCACHE Cache)
+    {
+        size_t i;
+
+        for (i = 0; i < Cache->entries; i++)
+            Cache->tags[i] = IMDCACHE_EMPTY;
+
+        Cache->generation++;
+    }
+
+    static __inline void
+        ImDiskCacheFree(PIMDCACHE Cache)
+    {
+        if (Cache->data != NULL)
+            IMDCACHE_FREE(Cache->data);
+        if (Cache->tags != NULL)
+            IMDCACHE_FREE(Cache->tags);
+        if (Cache->stamps != NULL)
+            IMDCACHE_FREE(Cache->stamps);
+
+        memset(Cache, 0, sizeof(*Cache));
+    }
+
+    // BlockSize needs to be a power of two. Number of sets is rounded down
+    // to a power of two that fits within MaxBytes.
+    static __inline int
+        ImDiskCacheInitialize(PIMDCACHE Cache, size_t BlockSize,
+            size_t MaxBytes)
+    {
+        size_t sets = 1;
+
+        memset(Cache, 0, sizeof(*Cache));
+
+        while (((size_t)1 << Cache->block_shift) < BlockSize)
+            Cache->block_shift++;
+
+        if (BlockSize == 0 || MaxBytes / BlockSize < IMDCACHE_WAYS)
+            return 0;
+
+        while (sets * 2 <= MaxBytes / BlockSize / IMDCACHE_WAYS)
+            sets *= 2;
+
+        Cache->set_mask = sets - 1;
+        Cache->entries = sets * IMDCACHE_WAYS;
+
+        Cache->tags = (long long *)
+            IMDCACHE_ALLOC(Cache->entries * sizeof(*Cache->tags));
+        Cache->stamps = (unsigned int *)
+            IMDCACHE_ALLOC(Cache->entries * sizeof(*Cache->stamps));
+        Cache->data = (unsigned char *)
+            IMDCACHE_ALLOC(Cache->entries << Cache->block_shift);
+
+        if (Cache->tags == NULL || Cache->stamps == NULL ||
+            Cache->data == NULL)
+        {
+            ImDiskCacheFree(Cache);
+            return 0;
+        }
+
+        memset(Cache->stamps, 0, Cache->entries * sizeof(*Cache->stamps));
+
+        ImDiskCacheClear(Cache);
+
+        return 1;
+    }
+
+    // Returns entry that holds Block, or entries count if not cached.
+    static __inline size_t
+        ImDiskCacheFind(PIMDCACHE Cache, long long Block)
+    {
+        size_t first = ((size_t)Block & Cache->set_mask) * IMDCACHE_WAYS;
+        size_t i;
+
+        for (i = first; i < first + IMDCACHE_WAYS; i++)
+            if (Cache->tags[i] == Block)
+                return i;
+
+        return Cache->entries;
+    }
+
+    static __inline int
+        ImDiskCacheLookup(PIMDCACHE Cache, long long Offset, void *Buffer,
+            size_t Length)
+    {
+        unsigned char *ptr = (unsigned char *)Buffer;
+        size_t block_size = (size_t)1 << Cache->block_shift;
+
+        if (Cache->data == NULL || Offset < 0 || Length == 0)
+            return 0;
+
+        while (Length > 0)
+        {
+            long long block = Offset >> Cache->block_shift;
+            size_t in_block = (size_t)Offset & (block_size - 1);
+            size_t chunk = block_size - in_block;
+            size_t entry = ImDiskCacheFind(Cache, block);
+
+            if (entry == Cache->entries)
+            {
+                Cache->misses++;
+                return 0;
+            }
+
+            if (chunk > Length)
+                chunk = Length;
+
+            memcpy(ptr,
+                Cache->data + (entry << Cache->block_shift) + in_block,
+                chunk);
+
+            Cache->stamps[entry] = ++Cache->clock;
+
+            ptr += chunk;
+            Offset += chunk;
+            Length -= chunk;
+        }
+
+        Cache->hits++;
+        return 1;
+    }
+
+    static __inline int
+        ImDiskCacheFillable(PIMDCACHE Cache, long long Offset, size_t Length)
+    {
+        size_t block_size = (size_t)1 << Cache->block_shift;
+        size_t head;
+
+        if (Cache->data == NULL || Offset < 0)
+            return 0;
+
+        head = (block_size - ((size_t)Offset & (block_size - 1))) &
+            (block_size - 1);
+
+        return head < Length && Length - head >= block_size;
+    }
+
+    static __inline unsigned int
+        ImDiskCacheGeneration(PIMDCACHE Cache)
+    {
+        return Cache->generation;
+    }
+
+    static __inline void
+        ImDiskCacheInsert(PIMDCACHE Cache, unsigned int Generation,
+            long long Offset, const void *Buffer, size_t Length)
+    {
+        const unsigned char *ptr = (const unsigned char *)Buffer;
+        size_t block_size = (size_t)1 << Cache->block_shift;
+        size_t head;
+
+        if (Cache->data == NULL || Offset < 0 ||
+            Generation != Cache->generation)
+            return;
+
+        // Partial blocks at start and end are not stored
+        head = (block_size - ((size_t)Offset & (block_size - 1))) &
+            (block_size - 1);
+
+        if (head >= Length)
+            return;
+
+        ptr += head;
+        Offset += head;
+        Length -= head;
+
+        for (; Length >= block_size;
+            ptr += block_size, Offset += block_size, Length -= block_size)
+        {
+            long long block = Offset >> Cache->block_shift;
+            size_t first = ((size_t)block & Cache->set_mask) * IMDCACHE_WAYS;
+            size_t entry = ImDiskCacheFind(Cache, block);
+
+            if (entry == Cache->entries)
+            {
+                size_t i;
+
+                // Empty entry, or the one unused for longest time
+                entry = first;
+                for (i = first; i < first + IMDCACHE_WAYS; i++)
+                {
+                    if (Cache->tags[i] == IMDCACHE_EMPTY)
+                    {
+                        entry = i;
+                        break;
+                    }
+
+                    if (Cache->clock - Cache->stamps[i] >
+                        Cache->clock - Cache->stamps[entry])
+                        entry = i;
+                }
+            }
+
+            memcpy(Cache->data + (entry << Cache->block_shift), ptr,
+                block_size);
+
+            Cache->tags[entry] = block;
+            Cache->stamps[entry] = ++Cache->clock;
+        }
+    }
+
+    static __inline void
+        ImDiskCacheInvalidate(PIMDCACHE Cache, long long Offset,
+            unsigned long long Length)
+    {
+        long long first;
+        long long last;
+
+        if (Cache->data == NULL || Length == 0)
+            return;
+
+        Cache->generation++;
+
+        if (Offset < 0)
+            Offset = 0;
+
+        if (Length > (unsigned long long)0x7FFFFFFFFFFFFFFFLL - Offset)
+            Length = (unsigned long long)0x7FFFFFFFFFFFFFFFLL - Offset + 1;
+
+        first = Offset >> Cache->block_shift;
+        last = (long long)(((unsigned long long)Offset + Length - 1) >>
+            Cache->block_shift);
+
+        // Large ranges, such as trim of a whole volume, are checked entry
+        // by entry instead of block by block
+        if ((unsigned long long)(last - first) >= Cache->entries)
+        {
+            size_t i;
+
+            for (i = 0; i < Cache->entries; i++)
+                if (Cache->tags[i] >= first && Cache->tags[i] <= last)
+                    Cache->tags[i] = IMDCACHE_EMPTY;
+
+            return;
+        }
+
+        for (; first <= last; first++)
+        {
+            size_t entry = ImDiskCacheFind(Cache, first);
+
+            if (entry != Cache->entries)
+                Cache->tags[entry] = IMDCACHE_EMPTY;
+        }
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDCACHE_
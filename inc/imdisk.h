@@ -91,6 +91,14 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define IMDISK_CFG_MAX_DEVICES_VALUE              _T("MaxDevices")
 #define IMDISK_CFG_LOAD_DEVICES_VALUE             _T("LoadDevices")
 #define IMDISK_CFG_DISALLOWED_DRIVE_LETTERS_VALUE _T("DisallowedDriveLetters")
+#define IMDISK_CFG_PROXY_QUEUE_DEPTH_VALUE        _T("ProxyQueueDepth")
+#define IMDISK_CFG_FILE_WORKER_THREADS_VALUE      _T("FileWorkerThreads")
+#define IMDISK_CFG_SHARED_THREAD_POOL_VALUE       _T("SharedThreadPool")
+#define IMDISK_CFG_MERGE_MAX_LENGTH_VALUE         _T("MergeMaxLength")
+#define IMDISK_CFG_SORT_REQUESTS_VALUE            _T("SortRequests")
+#define IMDISK_CFG_COMPRESS_AFTER_VALUE           _T("CompressAfterSeconds")
+#define IMDISK_CFG_CACHE_SIZE_VALUE               _T("CacheSize")
+#define IMDISK_CFG_CACHE_TOTAL_SIZE_VALUE         _T("CacheTotalSize")
 #define IMDISK_CFG_IMAGE_FILE_PREFIX              _T("FileName")
 #define IMDISK_CFG_SIZE_PREFIX                    _T("Size")
 #define IMDISK_CFG_FLAGS_PREFIX                   _T("Flags")
@@ -164,7 +172,8 @@ OTHER DEALINGS IN THE SOFTWARE.
 /// Check if flags specifies removable
 #define IMDISK_REMOVABLE(x)             ((ULONG)(x) & 0x00000002)
 
-/// Specifies that image file is created with sparse attribute.
+/// Specifies that image file is created with sparse attribute. For vm type
+/// devices, memory is committed when first written to.
 #define IMDISK_OPTION_SPARSE_FILE       0x00000004
 
 /// Check if flags specifies sparse
@@ -1196,7 +1205,9 @@ extern "C" {
     can be opened for operation without intermediate buffering
     but performance is usually better if the handle is opened
     with intermediate buffering. The handle cannot be opened for
-    overlapped operation.
+    overlapped operation. Zero-filled ranges that would be
+    written beyond existing end of the image file are skipped
+    and left unallocated in a sparse file.
 
     BufferSize      I/O buffer size to use when reading source disk. This
     parameter is optional, if it is zero the buffer size to use
@@ -0,0 +1,170 @@
+/*
+Merging and ordering of queued read and write requests, shared between
+driver and user mode components.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef _INC_IMDMERGE_
+#define _INC_IMDMERGE_
+
+/*
+A batch of queued read and write requests is planned with ImDiskMergePlan
+before it is served. Requests are divided into groups in arrival order. A
+group ends before a request that overlaps an earlier request in the group
+where either of them is a write, so requests within a group give the same
+result in any order.
+
+Within a group, requests are served in arrival order, or if Sort is
+nonzero, by ascending offset starting at Position and then wrapping around
+to the lowest offset, like an elevator that only moves one way. Requests of
+the same kind next to each other in that order, each starting where the
+previous one ends, are merged into runs of at most MaxLength bytes, to be
+served by one backend read or write. No requests are merged if MaxLength
+is zero.
+
+ImDiskMergePlan     Fills Order with indexes of Requests in the order to
+                    serve them, and Runs with number of requests in each
+                    run, which are next to each other in Order. Returns
+                    number of runs. Position is updated to end of last
+                    request, to pass with next batch.
+
+Order and Runs need room for Count elements. Sorting is done by insertion,
+which is intended for batches of a few tens of requests.
+*/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _IMDMERGE_REQUEST
+    {
+        long long offset;
+        unsigned int length;
+        int write;
+    } IMDMERGE_REQUEST, *PIMDMERGE_REQUEST;
+
+    static __inline int
+        ImDiskMergeConflict(const IMDMERGE_REQUEST *First,
+            const IMDMERGE_REQUEST *Second)
+    {
+        return (First->write || Second->write) &&
+            First->offset < Second->offset + (long long)Second->length &&
+            Second->offset < First->offset + (long long)First->length;
+    }
+
+    // Returns nonzero if First is served before Second by the elevator
+    static __inline int
+        ImDiskMergeBefore(const IMDMERGE_REQUEST *First,
+            const IMDMERGE_REQUEST *Second, long long Position)
+    {
+        int first_ahead = First->offset >= Position;
+        int second_ahead = Second->offset >= Position;
+
+        if (first_ahead != second_ahead)
+            return first_ahead;
+
+        return First->offset < Second->offset;
+    }
+
+    static __inline unsigned int
+        ImDiskMergePlan(const IMDMERGE_REQUEST *Requests, unsigned int Count,
+            int Sort, unsigned int MaxLength, long long *Position,
+            unsigned int *Order, unsigned int *Runs)
+    {
+        unsigned int runs = 0;
+        unsigned int first = 0;
+
+        while (first < Count)
+        {
+            const IMDMERGE_REQUEST *previous = NULL;
+            unsigned long long run_length = 0;
+            unsigned int end;
+            unsigned int i;
+
+            for (end = first + 1; end < Count; end++)
+            {
+                for (i = first; i < end; i++)
+                    if (ImDiskMergeConflict(Requests + i, Requests + end))
+                        break;
+
+                if (i < end)
+                    break;
+            }
+
+            for (i = first; i < end; i++)
+                Order[i] = i;
+
+            if (Sort)
+                for (i = first + 1; i < end; i++)
+                {
+                    unsigned int index = Order[i];
+                    unsigned int j;
+
+                    for (j = i; j > first &&
+                        ImDiskMergeBefore(Requests + index,
+                            Requests + Order[j - 1], *Position); j--)
+                        Order[j] = Order[j - 1];
+
+                    Order[j] = index;
+                }
+
+            for (i = first; i < end; i++)
+            {
+                const IMDMERGE_REQUEST *request = Requests + Order[i];
+
+                if (previous != NULL &&
+                    request->write == previous->write &&
+                    request->offset ==
+                    previous->offset + (long long)previous->length &&
+                    run_length + request->length <= MaxLength)
+                {
+                    Runs[runs - 1]++;
+                    run_length += request->length;
+                }
+                else
+                {
+                    Runs[runs++] = 1;
+                    run_length = request->length;
+                }
+
+                previous = request;
+            }
+
+            *Position = previous->offset + (long long)previous->length;
+
+            first = end;
+        }
+
+        return runs;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDMERGE_
@@ -51,6 +51,19 @@ typedef u_char UCHAR;
 #define IMDPROXY_FLAG_SUPPORTS_ZERO     0x04 // Zero-fill ranges
 #define IMDPROXY_FLAG_SUPPORTS_SCSI     0x08 // SCSI SRB operations
 #define IMDPROXY_FLAG_SUPPORTS_SHARED   0x10 // Shared image access with reservations
+#define IMDPROXY_FLAG_SUPPORTS_CBT      0x20 // Changed block tracking queries
+
+// Bits 32-47 of flags are the number of tagged requests the server accepts
+// in flight on one connection. Zero means that the server does not support
+// tagged requests.
+#define IMDPROXY_FLAG_QUEUE_DEPTH_SHIFT 32
+#define IMDPROXY_FLAG_QUEUE_DEPTH_MASK  0xFFFF
+#define IMDPROXY_QUEUE_DEPTH(flags)     \
+    ((ULONG)(((flags) >> IMDPROXY_FLAG_QUEUE_DEPTH_SHIFT) & \
+    IMDPROXY_FLAG_QUEUE_DEPTH_MASK))
+#define IMDPROXY_FLAG_QUEUE_DEPTH(depth) \
+    (((ULONGLONG)(depth) & IMDPROXY_FLAG_QUEUE_DEPTH_MASK) << \
+    IMDPROXY_FLAG_QUEUE_DEPTH_SHIFT)
 
 typedef enum _IMDPROXY_REQ
 {
@@ -63,7 +76,9 @@ typedef enum _IMDPROXY_REQ
     IMDPROXY_REQ_UNMAP,
     IMDPROXY_REQ_ZERO,
     IMDPROXY_REQ_SCSI,
-    IMDPROXY_REQ_SHARED
+    IMDPROXY_REQ_SHARED,
+    IMDPROXY_REQ_CBT,
+    IMDPROXY_REQ_TAGGED
 } IMDPROXY_REQ, *PIMDPROXY_REQ;
 
 typedef struct _IMDPROXY_CLOSE_REQ
@@ -117,6 +132,14 @@ typedef struct _IMDPROXY_WRITE_RESP
     ULONGLONG length;
 } IMDPROXY_WRITE_RESP, *PIMDPROXY_WRITE_RESP;
 
+// Unmap and zero requests are followed by length bytes of ranges, laid out
+// like DEVICE_DATA_SET_RANGE.
+typedef struct _IMDPROXY_DATA_RANGE
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_DATA_RANGE, *PIMDPROXY_DATA_RANGE;
+
 typedef struct _IMDPROXY_UNMAP_REQ
 {
     ULONGLONG request_code;
@@ -177,6 +200,36 @@ typedef struct _IMDPROXY_SHARED_RESP
 
 #define IMDPROXY_RESERVATION_KEY_ANY MAXULONGLONG
 
+// Changed block tracking. Returns changed ranges within offset/length as an
+// array of IMDPROXY_CBT_RANGE, length bytes in total, following the response
+// structure. If there are more ranges than fit in one response, end_offset
+// is where the next query should continue. With IMDPROXY_CBT_FLAG_RESET,
+// returned ranges are cleared, so that next query only returns ranges
+// written after this one.
+#define IMDPROXY_CBT_FLAG_RESET         0x01
+
+typedef struct _IMDPROXY_CBT_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG flags;
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_CBT_REQ, *PIMDPROXY_CBT_REQ;
+
+typedef struct _IMDPROXY_CBT_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG block_size;
+    ULONGLONG end_offset;
+    ULONGLONG length;
+} IMDPROXY_CBT_RESP, *PIMDPROXY_CBT_RESP;
+
+typedef struct _IMDPROXY_CBT_RANGE
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_CBT_RANGE, *PIMDPROXY_CBT_RANGE;
+
 typedef enum _IMDPROXY_SHARED_OP_CODE
 {
     GetUniqueId,
@@ -196,6 +249,26 @@ typedef enum _IMDPROXY_SHARED_RESP_CODE
     IOError
 } IMDPROXY_SHARED_RESP_CODE, *PIMDPROXY_SHARED_RESP_CODE;
 
+// Tagged requests, for stream connections to servers that report a queue
+// depth in IMDPROXY_INFO_RESP flags. IMDPROXY_TAGGED_REQ is followed by a
+// complete read, write, unmap or zero request, and the response to it is
+// IMDPROXY_TAGGED_RESP followed by the usual response. Clients can send up
+// to queue depth requests before reading responses, and servers can send
+// responses in any order. io_tag is chosen by client and is copied to the
+// response. Tags of requests in flight are unique, and are less than queue
+// depth. Tagged read responses contain all requested data that is within
+// the image, or an error, never a partial read.
+typedef struct _IMDPROXY_TAGGED_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_TAGGED
+    ULONGLONG io_tag;
+} IMDPROXY_TAGGED_REQ, *PIMDPROXY_TAGGED_REQ;
+
+typedef struct _IMDPROXY_TAGGED_RESP
+{
+    ULONGLONG io_tag;
+} IMDPROXY_TAGGED_RESP, *PIMDPROXY_TAGGED_RESP;
+
 // For shared memory proxy communication only. Offset to data area in
 // shared memory.
 #define IMDPROXY_HEADER_SIZE 4096
@@ -0,0 +1,189 @@
+/*
+Lock free queue with many producers and one consumer, shared between
+driver and user mode components.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_IMDQUEUE_
+#define _INC_IMDQUEUE_
+
+/*
+Producers push entries on a shared list with one compare and exchange
+each. The consumer takes all pushed entries at once with one exchange, and
+keeps them in a list of its own in the order they were pushed, so entries
+are removed in the same order as from a locked FIFO list.
+
+Before the consumer waits for more entries, it marks the shared list as
+waited on. Only the producer that pushes the first entry after that is
+told to wake the consumer, so there is one wakeup for each wait, and none
+while the consumer is running.
+
+ImDiskQueueInitialize   Initializes an empty queue.
+ImDiskQueuePush         Adds an entry. Returns nonzero if the consumer waits
+                        and needs to be woken by caller. Called by any
+                        thread, at any time.
+ImDiskQueuePop          Removes oldest entry. Returns NULL if queue is
+                        empty.
+ImDiskQueuePeek         Returns oldest entry without removing it, or NULL
+                        if queue is empty.
+ImDiskQueuePrepareWait  Marks queue as waited on if it is empty. Returns zero
+                        if there are entries to pop, in which case the
+                        consumer pops them instead of waiting.
+
+Pop, peek and prepare wait are called by one thread at a time. The consumer can
+change between threads if something that orders memory, such as a lock,
+is between calls by different threads.
+
+Entries only need to stay valid while in the queue, and pushing entries
+that have been popped again does not confuse producers.
+*/
+
+#include <stddef.h>
+
+#ifndef IMDQUEUE_CAS
+#if defined(_KERNEL_MODE) || defined(_NTDDK_) || defined(_WIN32)
+#define IMDQUEUE_CAS(target, exchange, comparand) \
+    ((PIMDQUEUE_ENTRY)InterlockedCompareExchangePointer( \
+    (PVOID volatile *)(target), (exchange), (comparand)))
+#define IMDQUEUE_XCHG(target, value) \
+    ((PIMDQUEUE_ENTRY)InterlockedExchangePointer( \
+    (PVOID volatile *)(target), (value)))
+#else
+#define IMDQUEUE_CAS(target, exchange, comparand) \
+    __sync_val_compare_and_swap((target), (comparand), (exchange))
+#define IMDQUEUE_XCHG(target, value) \
+    __atomic_exchange_n((target), (value), __ATOMIC_SEQ_CST)
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct _IMDQUEUE_ENTRY
+    {
+        struct _IMDQUEUE_ENTRY *next;
+    } IMDQUEUE_ENTRY, *PIMDQUEUE_ENTRY;
+
+    typedef struct _IMDQUEUE
+    {
+        PIMDQUEUE_ENTRY volatile pushed;    // Newest first, shared
+        PIMDQUEUE_ENTRY head;               // Oldest first, consumer only
+    } IMDQUEUE, *PIMDQUEUE;
+
+    // Value of pushed while consumer waits
+#define IMDQUEUE_WAITING ((PIMDQUEUE_ENTRY)(size_t)1)
+
+    static __inline void
+        ImDiskQueueInitialize(PIMDQUEUE Queue)
+    {
+        Queue->pushed = NULL;
+        Queue->head = NULL;
+    }
+
+    static __inline int
+        ImDiskQueuePush(PIMDQUEUE Queue, PIMDQUEUE_ENTRY Entry)
+    {
+        PIMDQUEUE_ENTRY old = Queue->pushed;
+
+        for (;;)
+        {
+            PIMDQUEUE_ENTRY seen;
+
+            Entry->next = old == IMDQUEUE_WAITING ? NULL : old;
+
+            seen = IMDQUEUE_CAS(&Queue->pushed, Entry, old);
+
+            if (seen == old)
+                return old == IMDQUEUE_WAITING;
+
+            old = seen;
+        }
+    }
+
+    static __inline PIMDQUEUE_ENTRY
+        ImDiskQueuePop(PIMDQUEUE Queue)
+    {
+        PIMDQUEUE_ENTRY entry = Queue->head;
+
+        if (entry == NULL)
+        {
+            PIMDQUEUE_ENTRY pushed = Queue->pushed;
+
+            // Checked first so that polling an empty queue does not write
+            // to the shared list
+            if (pushed == NULL || pushed == IMDQUEUE_WAITING)
+                return NULL;
+
+            pushed = IMDQUEUE_XCHG(&Queue->pushed, NULL);
+
+            // Pushed entries are newest first
+            while (pushed != NULL)
+            {
+                PIMDQUEUE_ENTRY next = pushed->next;
+
+                pushed->next = entry;
+                entry = pushed;
+                pushed = next;
+            }
+        }
+
+        Queue->head = entry->next;
+
+        return entry;
+    }
+
+    static __inline PIMDQUEUE_ENTRY
+        ImDiskQueuePeek(PIMDQUEUE Queue)
+    {
+        PIMDQUEUE_ENTRY entry = ImDiskQueuePop(Queue);
+
+        if (entry != NULL)
+        {
+            entry->next = Queue->head;
+            Queue->head = entry;
+        }
+
+        return entry;
+    }
+
+    static __inline int
+        ImDiskQueuePrepareWait(PIMDQUEUE Queue)
+    {
+        PIMDQUEUE_ENTRY seen;
+
+        if (Queue->head != NULL)
+            return 0;
+
+        seen = IMDQUEUE_CAS(&Queue->pushed, IMDQUEUE_WAITING, NULL);
+
+        return seen == NULL || seen == IMDQUEUE_WAITING;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDQUEUE_
@@ -0,0 +1,669 @@
+/*
+ImDisk compressed tier for cold blocks of memory backed disks, shared
+between driver and user mode components.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INC_IMDTIER_
+#define _INC_IMDTIER_
+
+/*
+Blocks of a memory backed disk that have not been accessed for some time
+are compressed into a store, so that the memory holding them uncompressed
+can be released. The caller keeps uncompressed blocks and decides when to
+compress them. This header keeps the compressed data, the time each block
+was last accessed, and statistics.
+
+Blocks are compressed in LZ4 block format. Compressed data is kept in
+slots of a few size classes, carved from slabs of IMDTIER_SLAB_SIZE bytes
+or more, so that the store does not need one allocation for each block.
+A slab is freed when none of its slots are used.
+
+ImDiskTierInitialize    Allocates block arrays for Blocks blocks of at most
+                        BlockSize bytes, at most 65536. Returns zero if there
+                        is not enough memory.
+ImDiskTierFree          Frees all memory of an initialized tier.
+ImDiskTierResize        Changes number of blocks. Compressed blocks beyond
+                        the new number are dropped. Returns zero if there is
+                        not enough memory, in which case nothing is changed.
+ImDiskTierTouch         Records access to a block at time Now, in units
+                        chosen by the caller.
+ImDiskTierIsCold        Checks if a block was last accessed at least Age
+                        time units before Now.
+ImDiskTierIsCompressed  Checks if a block is held compressed.
+ImDiskTierCompress      Stores a block compressed. Returns zero if data did
+                        not compress to at most IMDTIER_MAX_RATIO percent of
+                        its size, or if there is not enough memory.
+ImDiskTierDecompress    Copies a compressed block to a buffer. The block is
+                        kept compressed. Returns zero if stored data is not
+                        valid for Length bytes.
+ImDiskTierDrop          Frees compressed data of a block.
+
+ImDiskLz4Compress and ImDiskLz4Decompress can also be used by themselves.
+
+Functions do no locking, callers serialize calls for a tier. Memory is
+allocated with IMDTIER_ALLOC and IMDTIER_FREE, which default to non-paged
+pool in kernel mode and to malloc and free in user mode.
+*/
+
+#include <string.h>
+
+#ifndef IMDTIER_ALLOC
+#if defined(_KERNEL_MODE) || defined(_NTDDK_)
+#define IMDTIER_ALLOC(size) ExAllocatePoolWithTag(NonPagedPool, (size), 'tDmI')
+#define IMDTIER_FREE(ptr) ExFreePoolWithTag((ptr), 'tDmI')
+#else
+#include <stdlib.h>
+#define IMDTIER_ALLOC(size) malloc(size)
+#define IMDTIER_FREE(ptr) free(ptr)
+#endif
+#endif
+
+#define IMDTIER_LZ4_HASH_BITS       12
+#define IMDTIER_LZ4_MIN_MATCH       4
+#define IMDTIER_LZ4_LAST_LITERALS   5
+#define IMDTIER_LZ4_MFLIMIT         12
+
+// Worst case size of compressed data for Length bytes of input
+#define IMDTIER_LZ4_BOUND(length)   ((length) + (length) / 255 + 16)
+
+#define IMDTIER_MAX_BLOCK_SIZE      65536
+#define IMDTIER_MAX_RATIO           75
+#define IMDTIER_CLASS_GRAIN         256
+#define IMDTIER_SLAB_SIZE           65536
+#define IMDTIER_MIN_SLAB_SLOTS      4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    static __inline unsigned int
+        ImDiskLz4Read32(const unsigned char *Ptr)
+    {
+        unsigned int value;
+
+        memcpy(&value, Ptr, sizeof(value));
+
+        return value;
+    }
+
+    static __inline unsigned int
+        ImDiskLz4Hash(unsigned int Value)
+    {
+        return (Value * 2654435761U) >> (32 - IMDTIER_LZ4_HASH_BITS);
+    }
+
+    // Stores a literal or match length continuation
+    static __inline unsigned char *
+        ImDiskLz4PutLength(unsigned char *Out, size_t Length)
+    {
+        for (; Length >= 255; Length -= 255)
+            *Out++ = 255;
+
+        *Out++ = (unsigned char)Length;
+
+        return Out;
+    }
+
+    // Compresses Length bytes, at most 65536, in LZ4 block format. Table
+    // needs room for 1 << IMDTIER_LZ4_HASH_BITS elements. Returns size of
+    // compressed data, or zero if it would be larger than MaxOutput.
+    static __inline size_t
+        ImDiskLz4Compress(const void *Source, size_t Length,
+            void *Target, size_t MaxOutput, unsigned short *Table)
+    {
+        const unsigned char *src = (const unsigned char *)Source;
+        const unsigned char *end = src + Length;
+        const unsigned char *ip = src;
+        const unsigned char *anchor = src;
+        unsigned char *op = (unsigned char *)Target;
+        unsigned char *oend = op + MaxOutput;
+        size_t literals;
+
+        if (Length > IMDTIER_MAX_BLOCK_SIZE)
+            return 0;
+
+        if (Length > IMDTIER_LZ4_MFLIMIT)
+        {
+            // Last match starts at least MFLIMIT bytes before end, and
+            // ends at least LAST_LITERALS bytes before end
+            const unsigned char *mflimit = end - IMDTIER_LZ4_MFLIMIT;
+            const unsigned char *match_limit =
+                end - IMDTIER_LZ4_LAST_LITERALS;
+
+            memset(Table, 0, sizeof(*Table) << IMDTIER_LZ4_HASH_BITS);
+
+            for (ip = src + 1; ip <= mflimit;)
+            {
+                unsigned int sequence = ImDiskLz4Read32(ip);
+                unsigned int hash = ImDiskLz4Hash(sequence);
+                const unsigned char *ref = src + Table[hash];
+                const unsigned char *match_end;
+                unsigned char *token;
+                size_t match_length;
+                size_t offset;
+
+                Table[hash] = (unsigned short)(ip - src);
+
+                if (ImDiskLz4Read32(ref) != sequence || ref >= ip)
+                {
+                    // Data without matches is skipped faster
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+
+                while (ip > anchor && ref > src && ip[-1] == ref[-1])
+                {
+                    ip--;
+                    ref--;
+                }
+
+                for (match_end = ip + IMDTIER_LZ4_MIN_MATCH,
+                    ref += IMDTIER_LZ4_MIN_MATCH;
+                    match_end < match_limit && *match_end == *ref;
+                    match_end++, ref++);
+
+                literals = ip - anchor;
+                match_length = match_end - ip - IMDTIER_LZ4_MIN_MATCH;
+                offset = match_end - ref;
+
+                if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals +
+                    2 + match_length / 255 + 1)
+                    return 0;
+
+                token = op++;
+
+                if (literals >= 15)
+                {
+                    *token = 15 << 4;
+                    op = ImDiskLz4PutLength(op, literals - 15);
+                }
+                else
+                    *token = (unsigned char)(literals << 4);
+
+                memcpy(op, anchor, literals);
+                op += literals;
+
+                *op++ = (unsigned char)offset;
+                *op++ = (unsigned char)(offset >> 8);
+
+                if (match_length >= 15)
+                {
+                    *token |= 15;
+                    op = ImDiskLz4PutLength(op, match_length - 15);
+                }
+                else
+                    *token |= (unsigned char)match_length;
+
+                ip = anchor = match_end;
+            }
+        }
+
+        literals = end - anchor;
+
+        if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals)
+            return 0;
+
+        if (literals >= 15)
+        {
+            *op++ = 15 << 4;
+            op = ImDiskLz4PutLength(op, literals - 15);
+        }
+        else
+            *op++ = (unsigned char)(literals << 4);
+
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        return op - (unsigned char *)Target;
+    }
+
+    // Decompresses LZ4 block format data into at most MaxOutput bytes.
+    // Returns number of bytes decompressed, or (size_t)-1 if data is not
+    // valid or does not fit.
+    static __inline size_t
+        ImDiskLz4Decompress(const void *Source, size_t Length,
+            void *Target, size_t MaxOutput)
+    {
+        const unsigned char *ip = (const unsigned char *)Source;
+        const unsigned char *iend = ip + Length;
+        unsigned char *dst = (unsigned char *)Target;
+        unsigned char *op = dst;
+        unsigned char *oend = dst + MaxOutput;
+
+        for (;;)
+        {
+            size_t literals;
+            size_t match_length;
+            size_t offset;
+            const unsigned char *match;
+            unsigned char token;
+            unsigned char next;
+
+            if (ip >= iend)
+                return (size_t)-1;
+
+            token = *ip++;
+
+            literals = token >> 4;
+            if (literals == 15)
+                do
+                {
+                    if (ip >= iend)
+                        return (size_t)-1;
+
+                    next = *ip++;
+                    literals += next;
+                } while (next == 255);
+
+            if (literals > (size_t)(iend - ip) ||
+                literals > (size_t)(oend - op))
+                return (size_t)-1;
+
+            memcpy(op, ip, literals);
+            op += literals;
+            ip += literals;
+
+            // Last sequence has literals only
+            if (ip == iend)
+                break;
+
+            if (iend - ip < 2)
+                return (size_t)-1;
+
+            offset = ip[0] | ((size_t)ip[1] << 8);
+            ip += 2;
+
+            if (offset == 0 || offset > (size_t)(op - dst))
+                return (size_t)-1;
+
+            match_length = token & 15;
+            if (match_length == 15)
+                do
+                {
+                    if (ip >= iend)
+                        return (size_t)-1;
+
+                    next = *ip++;
+                    match_length += next;
+                } while (next == 255);
+
+            match_length += IMDTIER_LZ4_MIN_MATCH;
+
+            if (match_length > (size_t)(oend - op))
+                return (size_t)-1;
+
+            match = op - offset;
+
+            // Overlapping matches repeat data, so they are copied forward
+            // byte by byte
+            if (offset >= match_length)
+            {
+                memcpy(op, match, match_length);
+                op += match_length;
+            }
+            else
+                for (; match_length > 0; match_length--)
+                    *op++ = *match++;
+        }
+
+        return op - dst;
+    }
+
+    typedef struct _IMDTIER_SLAB
+    {
+        struct _IMDTIER_SLAB *next;     // In list of slabs with free slots
+        struct _IMDTIER_SLAB *prev;
+        void *free_slots;               // Linked through first pointer
+        unsigned int used;
+        unsigned int total;
+        unsigned int size_class;
+        unsigned int slab_size;
+    } IMDTIER_SLAB, *PIMDTIER_SLAB;
+
+    // Header of a used slot, followed by compressed data
+    typedef struct _IMDTIER_SLOT
+    {
+        PIMDTIER_SLAB slab;
+        unsigned int length;            // Bytes of compressed data
+    } IMDTIER_SLOT, *PIMDTIER_SLOT;
+
+    typedef struct _IMDTIER
+    {
+        PIMDTIER_SLOT *slots;           // NULL for blocks not compressed
+        unsigned int *stamps;           // Time of last access to block
+        size_t blocks;
+        unsigned int block_size;
+        unsigned int max_length;        // Largest compressed data stored
+        unsigned int classes;
+        PIMDTIER_SLAB *partial;         // Slabs with free slots, by class
+        unsigned short *table;          // Hash table for compression
+        unsigned char *work;            // Output of compression
+        size_t compressed_blocks;
+        unsigned long long data_bytes;  // Compressed data in store
+        unsigned long long store_bytes; // Memory of slabs
+        unsigned long long compressions;
+        unsigned long long decompressions;
+        unsigned long long rejected;    // Blocks that did not compress
+    } IMDTIER, *PIMDTIER;
+
+    static __inline unsigned int
+        ImDiskTierSlotSize(unsigned int SizeClass)
+    {
+        return (unsigned int)(((SizeClass + 1) * IMDTIER_CLASS_GRAIN +
+            sizeof(IMDTIER_SLOT) + sizeof(void *) - 1) &
+            ~(sizeof(void *) - 1));
+    }
+
+    static __inline void
+        ImDiskTierDrop(PIMDTIER Tier, size_t Block)
+    {
+        PIMDTIER_SLOT slot = Tier->slots[Block];
+        PIMDTIER_SLAB slab;
+
+        if (slot == NULL)
+            return;
+
+        Tier->slots[Block] = NULL;
+        Tier->compressed_blocks--;
+        Tier->data_bytes -= slot->length;
+
+        slab = slot->slab;
+
+        *(void **)slot = slab->free_slots;
+        slab->free_slots = slot;
+
+        if (--slab->used == 0)
+        {
+            // Empty slabs are freed, but full slabs are not in list
+            if (slab->total > 1)
+            {
+                if (slab->prev != NULL)
+                    slab->prev->next = slab->next;
+                else
+                    Tier->partial[slab->size_class] = slab->next;
+
+                if (slab->next != NULL)
+                    slab->next->prev = slab->prev;
+            }
+
+            Tier->store_bytes -= slab->slab_size;
+
+            IMDTIER_FREE(slab);
+        }
+        else if (slab->used == slab->total - 1)
+        {
+            slab->prev = NULL;
+            slab->next = Tier->partial[slab->size_class];
+
+            if (slab->next != NULL)
+                slab->next->prev = slab;
+
+            Tier->partial[slab->size_class] = slab;
+        }
+    }
+
+    static __inline PIMDTIER_SLOT
+        ImDiskTierAllocSlot(PIMDTIER Tier, unsigned int SizeClass)
+    {
+        PIMDTIER_SLAB slab = Tier->partial[SizeClass];
+        PIMDTIER_SLOT slot;
+
+        if (slab == NULL)
+        {
+            unsigned int slot_size = ImDiskTierSlotSize(SizeClass);
+            unsigned int total = IMDTIER_SLAB_SIZE / slot_size;
+            unsigned int offset = (unsigned int)((sizeof(IMDTIER_SLAB) +
+                sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+            unsigned int i;
+
+            if (total < IMDTIER_MIN_SLAB_SLOTS)
+                total = IMDTIER_MIN_SLAB_SLOTS;
+
+            slab = (PIMDTIER_SLAB)IMDTIER_ALLOC(offset + total * slot_size);
+
+            if (slab == NULL)
+                return NULL;
+
+            slab->next = NULL;
+            slab->prev = NULL;
+            slab->free_slots = NULL;
+            slab->used = 0;
+            slab->total = total;
+            slab->size_class = SizeClass;
+            slab->slab_size = offset + total * slot_size;
+
+            for (i = total; i > 0; i--)
+            {
+                void **free_slot = (void **)
+                    ((unsigned char *)slab + offset + (i - 1) * slot_size);
+
+                *free_slot = slab->free_slots;
+                slab->free_slots = free_slot;
+            }
+
+            Tier->partial[SizeClass] = slab;
+            Tier->store_bytes += slab->slab_size;
+        }
+
+        slot = (PIMDTIER_SLOT)slab->free_slots;
+        slab->free_slots = *(void **)slot;
+
+        if (++slab->used == slab->total)
+        {
+            Tier->partial[SizeClass] = slab->next;
+
+            if (slab->next != NULL)
+                slab->next->prev = NULL;
+
+            slab->next = NULL;
+        }
+
+        slot->slab = slab;
+
+        return slot;
+    }
+
+    static __inline void
+        ImDiskTierFree(PIMDTIER Tier)
+    {
+        size_t i;
+
+        if (Tier->slots != NULL)
+            for (i = 0; i < Tier->blocks; i++)
+                ImDiskTierDrop(Tier, i);
+
+        if (Tier->slots != NULL)
+            IMDTIER_FREE(Tier->slots);
+        if (Tier->stamps != NULL)
+            IMDTIER_FREE(Tier->stamps);
+        if (Tier->partial != NULL)
+            IMDTIER_FREE(Tier->partial);
+        if (Tier->table != NULL)
+            IMDTIER_FREE(Tier->table);
+        if (Tier->work != NULL)
+            IMDTIER_FREE(Tier->work);
+
+        memset(Tier, 0, sizeof(*Tier));
+    }
+
+    static __inline int
+        ImDiskTierInitialize(PIMDTIER Tier, unsigned int BlockSize,
+            size_t Blocks)
+    {
+        memset(Tier, 0, sizeof(*Tier));
+
+        if (BlockSize == 0 || BlockSize > IMDTIER_MAX_BLOCK_SIZE ||
+            Blocks == 0)
+            return 0;
+
+        Tier->block_size = BlockSize;
+        Tier->max_length = (unsigned int)
+            ((unsigned long long)BlockSize * IMDTIER_MAX_RATIO / 100);
+        Tier->classes = (Tier->max_length + IMDTIER_CLASS_GRAIN - 1) /
+            IMDTIER_CLASS_GRAIN;
+        Tier->blocks = Blocks;
+
+        Tier->slots = (PIMDTIER_SLOT *)
+            IMDTIER_ALLOC(Blocks * sizeof(*Tier->slots));
+        Tier->stamps = (unsigned int *)
+            IMDTIER_ALLOC(Blocks * sizeof(*Tier->stamps));
+        Tier->partial = (PIMDTIER_SLAB *)
+            IMDTIER_ALLOC(Tier->classes * sizeof(*Tier->partial));
+        Tier->table = (unsigned short *)
+            IMDTIER_ALLOC(sizeof(*Tier->table) << IMDTIER_LZ4_HASH_BITS);
+        Tier->work = (unsigned char *)IMDTIER_ALLOC(Tier->max_length);
+
+        if (Tier->slots == NULL || Tier->stamps == NULL ||
+            Tier->partial == NULL || Tier->table == NULL ||
+            Tier->work == NULL)
+        {
+            Tier->blocks = 0;
+            ImDiskTierFree(Tier);
+            return 0;
+        }
+
+        memset(Tier->slots, 0, Blocks * sizeof(*Tier->slots));
+        memset(Tier->stamps, 0, Blocks * sizeof(*Tier->stamps));
+        memset(Tier->partial, 0, Tier->classes * sizeof(*Tier->partial));
+
+        return 1;
+    }
+
+    static __inline int
+        ImDiskTierResize(PIMDTIER Tier, size_t Blocks)
+    {
+        PIMDTIER_SLOT *slots;
+        unsigned int *stamps;
+        size_t keep = Blocks < Tier->blocks ? Blocks : Tier->blocks;
+        size_t i;
+
+        slots = (PIMDTIER_SLOT *)IMDTIER_ALLOC(Blocks * sizeof(*slots));
+        stamps = (unsigned int *)IMDTIER_ALLOC(Blocks * sizeof(*stamps));
+
+        if (slots == NULL || stamps == NULL)
+        {
+            if (slots != NULL)
+                IMDTIER_FREE(slots);
+            if (stamps != NULL)
+                IMDTIER_FREE(stamps);
+
+            return 0;
+        }
+
+        for (i = keep; i < Tier->blocks; i++)
+            ImDiskTierDrop(Tier, i);
+
+        memcpy(slots, Tier->slots, keep * sizeof(*slots));
+        memcpy(stamps, Tier->stamps, keep * sizeof(*stamps));
+        memset(slots + keep, 0, (Blocks - keep) * sizeof(*slots));
+        memset(stamps + keep, 0, (Blocks - keep) * sizeof(*stamps));
+
+        IMDTIER_FREE(Tier->slots);
+        IMDTIER_FREE(Tier->stamps);
+
+        Tier->slots = slots;
+        Tier->stamps = stamps;
+        Tier->blocks = Blocks;
+
+        return 1;
+    }
+
+    static __inline void
+        ImDiskTierTouch(PIMDTIER Tier, size_t Block, unsigned int Now)
+    {
+        if (Tier->stamps != NULL)
+            Tier->stamps[Block] = Now;
+    }
+
+    static __inline int
+        ImDiskTierIsCold(PIMDTIER Tier, size_t Block, unsigned int Now,
+            unsigned int Age)
+    {
+        return Now - Tier->stamps[Block] >= Age;
+    }
+
+    static __inline int
+        ImDiskTierIsCompressed(PIMDTIER Tier, size_t Block)
+    {
+        return Tier->slots[Block] != NULL;
+    }
+
+    static __inline int
+        ImDiskTierCompress(PIMDTIER Tier, size_t Block, const void *Data,
+            size_t Length)
+    {
+        PIMDTIER_SLOT slot;
+        size_t compressed;
+
+        ImDiskTierDrop(Tier, Block);
+
+        Tier->compressions++;
+
+        compressed = ImDiskLz4Compress(Data, Length, Tier->work,
+            Length * IMDTIER_MAX_RATIO / 100, Tier->table);
+
+        if (compressed == 0)
+        {
+            Tier->rejected++;
+            return 0;
+        }
+
+        slot = ImDiskTierAllocSlot(Tier, (unsigned int)
+            ((compressed - 1) / IMDTIER_CLASS_GRAIN));
+
+        if (slot == NULL)
+            return 0;
+
+        slot->length = (unsigned int)compressed;
+        memcpy(slot + 1, Tier->work, compressed);
+
+        Tier->slots[Block] = slot;
+        Tier->compressed_blocks++;
+        Tier->data_bytes += compressed;
+
+        return 1;
+    }
+
+    static __inline int
+        ImDiskTierDecompress(PIMDTIER Tier, size_t Block, void *Data,
+            size_t Length)
+    {
+        PIMDTIER_SLOT slot = Tier->slots[Block];
+
+        if (slot == NULL)
+            return 0;
+
+        Tier->decompressions++;
+
+        return ImDiskLz4Decompress(slot + 1, slot->length, Data, Length) ==
+            Length;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _INC_IMDTIER_
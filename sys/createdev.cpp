@@ -151,6 +151,65 @@ ImDiskFindFreeDeviceNumber(PDRIVER_OBJECT DriverObject,
     ImDiskReleaseLock(&lock_handle);
 }
 
+//
+// Bytes of block data allocated by caches of all devices.
+//
+static volatile LONG CacheBytesInUse = 0;
+
+// Allocates block cache of at most CacheSize bytes, within what is left of
+// CacheTotalSize. The device gets no cache if too little is left.
+VOID
+ImDiskCacheCreate(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LONG in_use;
+    LONG reserved;
+    LONG used;
+
+    if (CacheSize < IMDCACHE_WAYS * IMDISK_CACHE_BLOCK_SIZE)
+        return;
+
+    do
+    {
+        in_use = CacheBytesInUse;
+
+        if ((ULONG)in_use >= CacheTotalSize)
+        {
+            KdPrint(("ImDisk: Cache memory limit reached, no read cache.\n"));
+            return;
+        }
+
+        reserved = (LONG)min(CacheSize, CacheTotalSize - (ULONG)in_use);
+    } while (InterlockedCompareExchange(&CacheBytesInUse,
+        in_use + reserved, in_use) != in_use);
+
+    if (!ImDiskCacheInitialize(&DeviceExtension->cache,
+        IMDISK_CACHE_BLOCK_SIZE, (size_t)reserved))
+    {
+        KdPrint(("ImDisk: Not enough memory for read cache.\n"));
+    }
+
+    // Number of sets is rounded down, so return what was not used
+    used = (LONG)(DeviceExtension->cache.entries <<
+        DeviceExtension->cache.block_shift);
+
+    InterlockedExchangeAdd(&CacheBytesInUse, used - reserved);
+
+    KdPrint(("ImDisk: Read cache of %i bytes, %i bytes used by all caches.\n",
+        used, CacheBytesInUse));
+}
+
+VOID
+ImDiskCacheDelete(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LONG used = (LONG)(DeviceExtension->cache.entries <<
+        DeviceExtension->cache.block_shift);
+
+    ImDiskCacheFree(&DeviceExtension->cache);
+
+    if (used != 0)
+        InterlockedExchangeAdd(&CacheBytesInUse, -used);
+}
+
 #pragma code_seg("PAGE")
 
 // Parses BPB formatted geometry to a DISK_GEOMETRY structure.
@@ -429,6 +488,7 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     PDEVICE_EXTENSION device_extension;
     BOOLEAN proxy_supports_unmap = FALSE;
     BOOLEAN proxy_supports_zero = FALSE;
+    ULONG proxy_queue_depth = 0;
     DEVICE_TYPE device_type;
     ULONG device_characteristics;
     HANDLE file_handle = NULL;
@@ -1178,12 +1238,15 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
                 max_size = CreateData->DiskGeometry.Cylinders.LowPart;
 #endif
 
+                // Sparse VM disks only reserve memory here, and commit it
+                // when written to.
                 status =
                     ZwAllocateVirtualMemory(NtCurrentProcess(),
                         (PVOID*)&image_buffer,
                         0,
                         &max_size,
-                        MEM_COMMIT,
+                        IMDISK_SPARSE_FILE(CreateData->Flags) ?
+                        MEM_RESERVE : MEM_COMMIT,
                         PAGE_READWRITE);
 
                 if (!NT_SUCCESS(status))
@@ -1473,6 +1536,17 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
             if (proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_ZERO)
                 proxy_supports_zero = TRUE;
 
+            // Tagged requests need a stream where responses can be read
+            // while requests are written
+            if (proxy.connection_type ==
+                PROXY_CONNECTION::PROXY_CONNECTION_DEVICE)
+            {
+                proxy_queue_depth = IMDPROXY_QUEUE_DEPTH(proxy_info.flags);
+
+                if (proxy_queue_depth > ProxyQueueDepth)
+                    proxy_queue_depth = ProxyQueueDepth;
+            }
+
             KdPrint(("ImDisk: Got from proxy: Siz=0x%.8x%.8x Flg=%#x Alg=%#x.\n",
                 CreateData->DiskGeometry.Cylinders.HighPart,
                 CreateData->DiskGeometry.Cylinders.LowPart,
@@ -1529,7 +1603,8 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
                 (PVOID*)&image_buffer,
                 0,
                 &max_size,
-                MEM_COMMIT,
+                IMDISK_SPARSE_FILE(CreateData->Flags) ?
+                MEM_RESERVE : MEM_COMMIT,
                 PAGE_READWRITE);
 
         if (!NT_SUCCESS(status))
@@ -2067,11 +2142,13 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     if ((*DeviceObject)->Characteristics & FILE_READ_ONLY_DEVICE)
         device_extension->read_only = TRUE;
 
-    InitializeListHead(&device_extension->list_head);
+    ImDiskQueueInitialize(&device_extension->irp_queue);
 
-    KeInitializeSpinLock(&device_extension->list_lock);
+    KeInitializeSpinLock(&device_extension->cache_lock);
 
-    KeInitializeSpinLock(&device_extension->last_io_lock);
+    KeInitializeSpinLock(&device_extension->proxy_queue_lock);
+
+    KeInitializeSpinLock(&device_extension->file_worker_lock);
 
     KeInitializeEvent(&device_extension->request_event,
         NotificationEvent, FALSE);
@@ -2079,6 +2156,15 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     KeInitializeEvent(&device_extension->terminate_thread,
         NotificationEvent, FALSE);
 
+    KeInitializeEvent(&device_extension->proxy_request_sent,
+        SynchronizationEvent, FALSE);
+
+    KeInitializeEvent(&device_extension->proxy_entry_freed,
+        SynchronizationEvent, FALSE);
+
+    KeInitializeEvent(&device_extension->file_worker_done,
+        SynchronizationEvent, FALSE);
+
     device_extension->device_number = CreateData->DeviceNumber;
 
     device_extension->file_name = file_name;
@@ -2117,6 +2203,12 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     else
         device_extension->shared_image = FALSE;
 
+    // Read cache. Not used for memory backed images, or for images that
+    // other processes or computers may write to.
+    if (!device_extension->vm_disk && !device_extension->awealloc_disk &&
+        !device_extension->shared_image)
+        ImDiskCacheCreate(device_extension);
+
     device_extension->image_buffer = image_buffer;
     device_extension->file_handle = file_handle;
 
@@ -2133,6 +2225,9 @@ ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
 
     device_extension->proxy_zero = proxy_supports_zero;
 
+    // Receiver thread for tagged requests is started by device thread
+    device_extension->proxy_queue_depth = proxy_queue_depth;
+
     device_extension->media_change_count++;
 
     device_extension->drive_letter = CreateData->DriveLetter;
@@ -43,10 +43,121 @@ Copyright (C) The Regents of the University of California.
 
 #include "imdsksys.h"
 
+// Returns buffer for image I/O of at least Length bytes. The buffer is
+// only used by the device thread, or by Worker if not NULL, and kept
+// between requests.
+PUCHAR
+ImDiskGetIoBuffer(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PFILE_WORKER Worker OPTIONAL,
+    IN ULONG Length)
+{
+    PUCHAR *io_buffer = Worker != NULL ?
+        &Worker->io_buffer : &DeviceExtension->io_buffer;
+    PULONG io_buffer_size = Worker != NULL ?
+        &Worker->io_buffer_size : &DeviceExtension->io_buffer_size;
+
+    if (*io_buffer_size >= Length)
+        return *io_buffer;
+
+    if (*io_buffer != NULL)
+    {
+        ExFreePoolWithTag(*io_buffer, POOL_TAG);
+        *io_buffer = NULL;
+        *io_buffer_size = 0;
+    }
+
+    *io_buffer = (PUCHAR)
+        ExAllocatePoolWithTag(NonPagedPool, Length, POOL_TAG);
+
+    if (*io_buffer != NULL)
+        *io_buffer_size = Length;
+
+    return *io_buffer;
+}
+
+// Reads or writes image file in a worker thread. Requests are sent to the
+// image FILE_OBJECT, so that workers are not serialized on the synchronous
+// image file handle.
+NTSTATUS
+ImDiskFileWorkerIo(IN PDEVICE_EXTENSION DeviceExtension,
+    IN UCHAR MajorFunction,
+    OUT PIO_STATUS_BLOCK IoStatusBlock,
+    IN OUT PVOID Buffer,
+    IN ULONG Length,
+    IN PLARGE_INTEGER ByteOffset)
+{
+    NTSTATUS status;
+    PIRP image_irp;
+    KEVENT io_complete_event;
+    PIO_STACK_LOCATION image_io_stack;
+
+    KeInitializeEvent(&io_complete_event,
+        NotificationEvent,
+        FALSE);
+
+    image_irp = IoBuildSynchronousFsdRequest(
+        MajorFunction,
+        DeviceExtension->dev_object,
+        Buffer,
+        Length,
+        ByteOffset,
+        &io_complete_event,
+        IoStatusBlock);
+
+    if (image_irp == NULL)
+    {
+        KdPrint(("ImDisk: IoBuildSynchronousFsdRequest failed for image object.\n"));
+
+        IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    image_io_stack = IoGetNextIrpStackLocation(image_irp);
+    image_io_stack->FileObject = DeviceExtension->file_object;
+
+    status = IoCallDriver(DeviceExtension->dev_object, image_irp);
+
+    if (status == STATUS_PENDING)
+    {
+        KeWaitForSingleObject(&io_complete_event,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+
+        status = IoStatusBlock->Status;
+    }
+
+    return status;
+}
+
+// Drops cached blocks after an operation that may have changed image data,
+// whether it succeeded or not.
 VOID
+ImDiskInvalidateCache(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Offset,
+    IN ULONGLONG Length)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if (DeviceExtension->cache.data == NULL)
+        return;
+
+    ImDiskAcquireLock(&DeviceExtension->cache_lock, &lock_handle);
+
+    ImDiskCacheInvalidate(&DeviceExtension->cache, Offset, Length);
+
+    ImDiskReleaseLock(&lock_handle);
+}
+
+// Returns TRUE if request was sent as a tagged proxy request, in which case
+// it is completed later and must not be accessed by the caller.
+BOOLEAN
 ImDiskDeviceThreadRead(IN PIRP Irp,
     IN PDEVICE_EXTENSION DeviceExtension,
-    IN PDEVICE_OBJECT DeviceObject)
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PFILE_WORKER Worker OPTIONAL)
 {
     PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
     PUCHAR system_buffer =
@@ -54,6 +165,10 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
             NormalPagePriority);
     LARGE_INTEGER offset = { 0 };
     KLOCK_QUEUE_HANDLE lock_handle = { 0 };
+    PUCHAR io_buffer;
+    BOOLEAN fill_cache;
+    BOOLEAN tagged;
+    unsigned int cache_generation = 0;
 
     UNREFERENCED_PARAMETER(DeviceObject);
 
@@ -61,7 +176,7 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
     {
         Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
         Irp->IoStatus.Information = 0;
-        return;
+        return FALSE;
     }
 
     if (DeviceExtension->vm_disk)
@@ -74,12 +189,29 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
             io_stack->Parameters.Read.ByteOffset.LowPart;
 #endif
 
-        RtlCopyMemory(system_buffer,
-            DeviceExtension->image_buffer +
-            vm_offset,
-            io_stack->Parameters.Read.Length);
+        if (DeviceExtension->vm_chunks != NULL)
+        {
+            Irp->IoStatus.Status = ImDiskVmRead(DeviceExtension,
+                system_buffer,
+                vm_offset,
+                io_stack->Parameters.Read.Length);
+
+            if (!NT_SUCCESS(Irp->IoStatus.Status))
+            {
+                Irp->IoStatus.Information = 0;
+                return FALSE;
+            }
+        }
+        else
+        {
+            RtlCopyMemory(system_buffer,
+                DeviceExtension->image_buffer +
+                vm_offset,
+                io_stack->Parameters.Read.Length);
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+        }
 
-        Irp->IoStatus.Status = STATUS_SUCCESS;
         Irp->IoStatus.Information = io_stack->Parameters.Read.Length;
 
         if (io_stack->FileObject != NULL)
@@ -88,47 +220,72 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
                 Irp->IoStatus.Information;
         }
 
-        return;
+        return FALSE;
     }
 
     offset.QuadPart = io_stack->Parameters.Read.ByteOffset.QuadPart +
         DeviceExtension->image_offset.QuadPart;
 
-    ImDiskAcquireLock(&DeviceExtension->last_io_lock, &lock_handle);
+    // Data is read directly into request buffer unless it is to be cached
+    fill_cache = IMDISK_CACHE_FILL(DeviceExtension,
+        io_stack->Parameters.Read.ByteOffset.QuadPart,
+        io_stack->Parameters.Read.Length);
+
+    // Tagged requests in flight need their own buffers
+    tagged = DeviceExtension->proxy_queue != NULL &&
+        io_stack->Parameters.Read.Length <= IMDISK_PROXY_QUEUE_MAX_LENGTH;
 
-    if ((DeviceExtension->last_io_data != NULL) &&
-        (DeviceExtension->last_io_length <
-            io_stack->Parameters.Read.Length))
+    if (fill_cache)
     {
-        ExFreePoolWithTag(DeviceExtension->last_io_data, POOL_TAG);
-        DeviceExtension->last_io_data = NULL;
-    }
+        if (tagged)
+            io_buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool,
+                io_stack->Parameters.Read.Length, POOL_TAG);
+        else
+            io_buffer = ImDiskGetIoBuffer(DeviceExtension, Worker,
+                io_stack->Parameters.Read.Length);
+
+        if (io_buffer == NULL)
+        {
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            Irp->IoStatus.Information = 0;
+            return FALSE;
+        }
 
-    DeviceExtension->last_io_offset = 0;
-    DeviceExtension->last_io_length = 0;
+        // Data read is only cached if no write completes while reading
+        ImDiskAcquireLock(&DeviceExtension->cache_lock, &lock_handle);
 
-    ImDiskReleaseLock(&lock_handle);
+        cache_generation = ImDiskCacheGeneration(&DeviceExtension->cache);
 
-    if (DeviceExtension->last_io_data == NULL)
-        DeviceExtension->last_io_data = (PUCHAR)
-        ExAllocatePoolWithTag(NonPagedPool,
-            io_stack->Parameters.Read.Length,
-            POOL_TAG);
+        ImDiskReleaseLock(&lock_handle);
+    }
+    else
+    {
+        io_buffer = system_buffer;
+    }
 
-    if (DeviceExtension->last_io_data == NULL)
+    if (tagged)
     {
-        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        return;
+        ImDiskSendProxyQueue(DeviceExtension,
+            Irp,
+            IMDPROXY_REQ_READ,
+            io_buffer,
+            fill_cache ? io_buffer : NULL,
+            system_buffer,
+            cache_generation,
+            &offset);
+
+        return TRUE;
     }
 
     if (DeviceExtension->use_proxy)
     {
+        ImDiskDrainProxyQueue(DeviceExtension);
+
         Irp->IoStatus.Status =
             ImDiskReadProxy(&DeviceExtension->proxy,
                 &Irp->IoStatus,
                 &DeviceExtension->terminate_thread,
-                DeviceExtension->last_io_data,
+                io_buffer,
                 io_stack->Parameters.Read.Length,
                 &offset);
 
@@ -142,6 +299,16 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
             Irp->IoStatus.Information = 0;
         }
     }
+    else if (Worker != NULL)
+    {
+        Irp->IoStatus.Status =
+            ImDiskFileWorkerIo(DeviceExtension,
+                IRP_MJ_READ,
+                &Irp->IoStatus,
+                io_buffer,
+                io_stack->Parameters.Read.Length,
+                &offset);
+    }
     else
     {
         Irp->IoStatus.Status =
@@ -150,7 +317,7 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
                 NULL,
                 NULL,
                 &Irp->IoStatus,
-                DeviceExtension->last_io_data,
+                io_buffer,
                 io_stack->Parameters.Read.Length,
                 &offset,
                 NULL);
@@ -158,38 +325,41 @@ ImDiskDeviceThreadRead(IN PIRP Irp,
 
     if (NT_SUCCESS(Irp->IoStatus.Status))
     {
-        RtlCopyMemory(system_buffer, DeviceExtension->last_io_data,
-            Irp->IoStatus.Information);
+        if (fill_cache)
+        {
+            ImDiskAcquireLock(&DeviceExtension->cache_lock, &lock_handle);
+
+            ImDiskCacheInsert(&DeviceExtension->cache, cache_generation,
+                io_stack->Parameters.Read.ByteOffset.QuadPart,
+                io_buffer, Irp->IoStatus.Information);
+
+            ImDiskReleaseLock(&lock_handle);
+
+            RtlCopyMemory(system_buffer, io_buffer,
+                Irp->IoStatus.Information);
+        }
 
         if (DeviceExtension->byte_swap)
             ImDiskByteSwapBuffer(system_buffer,
                 Irp->IoStatus.Information);
 
-        DeviceExtension->last_io_offset =
-            io_stack->Parameters.Read.ByteOffset.QuadPart;
-
-        DeviceExtension->last_io_length =
-            (ULONG)Irp->IoStatus.Information;
-
         if (io_stack->FileObject != NULL)
         {
             io_stack->FileObject->CurrentByteOffset.QuadPart +=
                 Irp->IoStatus.Information;
         }
     }
-    else
-    {
-        ExFreePoolWithTag(DeviceExtension->last_io_data, POOL_TAG);
-        DeviceExtension->last_io_data = NULL;
-    }
 
-    return;
+    return FALSE;
 }
 
-VOID
+// Returns TRUE if request was sent as a tagged proxy request, like
+// ImDiskDeviceThreadRead.
+BOOLEAN
 ImDiskDeviceThreadWrite(IN PIRP Irp,
     IN PDEVICE_EXTENSION DeviceExtension,
-    IN PDEVICE_OBJECT DeviceObject)
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PFILE_WORKER Worker OPTIONAL)
 {
     PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
     PUCHAR system_buffer =
@@ -197,7 +367,8 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
             NormalPagePriority);
     LARGE_INTEGER offset = { 0 };
     BOOLEAN set_zero_data = FALSE;
-    KLOCK_QUEUE_HANDLE lock_handle = { 0 };
+    BOOLEAN tagged;
+    PUCHAR io_buffer;
 
     UNREFERENCED_PARAMETER(DeviceObject);
 
@@ -205,7 +376,7 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
     {
         Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
         Irp->IoStatus.Information = 0;
-        return;
+        return FALSE;
     }
 
     if (!DeviceExtension->image_modified)
@@ -227,12 +398,29 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
             io_stack->Parameters.Write.ByteOffset.LowPart;
 #endif
 
-        RtlCopyMemory(DeviceExtension->image_buffer +
-            vm_offset,
-            system_buffer,
-            io_stack->Parameters.Write.Length);
+        if (DeviceExtension->vm_chunks != NULL)
+        {
+            Irp->IoStatus.Status = ImDiskVmWrite(DeviceExtension,
+                system_buffer,
+                vm_offset,
+                io_stack->Parameters.Write.Length);
+
+            if (!NT_SUCCESS(Irp->IoStatus.Status))
+            {
+                Irp->IoStatus.Information = 0;
+                return FALSE;
+            }
+        }
+        else
+        {
+            RtlCopyMemory(DeviceExtension->image_buffer +
+                vm_offset,
+                system_buffer,
+                io_stack->Parameters.Write.Length);
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+        }
 
-        Irp->IoStatus.Status = STATUS_SUCCESS;
         Irp->IoStatus.Information = io_stack->Parameters.Write.Length;
 
         if (io_stack->FileObject != NULL)
@@ -241,49 +429,46 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
                 Irp->IoStatus.Information;
         }
 
-        return;
+        return FALSE;
     }
 
     offset.QuadPart = io_stack->Parameters.Write.ByteOffset.QuadPart +
         DeviceExtension->image_offset.QuadPart;
 
-    ImDiskAcquireLock(&DeviceExtension->last_io_lock, &lock_handle);
+    // Tagged requests in flight need their own buffers
+    tagged = DeviceExtension->proxy_queue != NULL &&
+        io_stack->Parameters.Write.Length <= IMDISK_PROXY_QUEUE_MAX_LENGTH;
 
-    if ((DeviceExtension->last_io_data != NULL) &&
-        (DeviceExtension->last_io_length <
-            io_stack->Parameters.Write.Length))
+    // Data is written directly from request buffer, unless it needs to be
+    // byte-swapped, which must not change the caller's data.
+    if (DeviceExtension->byte_swap)
     {
-        ExFreePoolWithTag(DeviceExtension->last_io_data, POOL_TAG);
-        DeviceExtension->last_io_data = NULL;
-    }
-
-    DeviceExtension->last_io_offset = 0;
-    DeviceExtension->last_io_length = 0;
+        if (tagged)
+            io_buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool,
+                io_stack->Parameters.Write.Length, POOL_TAG);
+        else
+            io_buffer = ImDiskGetIoBuffer(DeviceExtension, Worker,
+                io_stack->Parameters.Write.Length);
 
-    ImDiskReleaseLock(&lock_handle);
+        if (io_buffer == NULL)
+        {
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            Irp->IoStatus.Information = 0;
+            return FALSE;
+        }
 
-    if (DeviceExtension->last_io_data == NULL)
-    {
-        DeviceExtension->last_io_data = (PUCHAR)
-            ExAllocatePoolWithTag(NonPagedPool,
-                io_stack->Parameters.Write.Length,
-                POOL_TAG);
+        RtlCopyMemory(io_buffer, system_buffer,
+            io_stack->Parameters.Write.Length);
     }
-
-    if (DeviceExtension->last_io_data == NULL)
+    else
     {
-        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        return;
+        io_buffer = system_buffer;
     }
 
-    RtlCopyMemory(DeviceExtension->last_io_data, system_buffer,
-        io_stack->Parameters.Write.Length);
-
     if ((DeviceExtension->use_set_zero_data ||
         (DeviceExtension->use_proxy &&
             DeviceExtension->proxy_zero)) &&
-        ImDiskIsBufferZero(DeviceExtension->last_io_data,
+        ImDiskIsBufferZero(io_buffer,
             io_stack->Parameters.Write.Length))
     {
         set_zero_data = TRUE;
@@ -291,12 +476,28 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
 
     if ((!set_zero_data) && DeviceExtension->byte_swap)
     {
-        ImDiskByteSwapBuffer(DeviceExtension->last_io_data,
-            Irp->IoStatus.Information);
+        ImDiskByteSwapBuffer(io_buffer,
+            io_stack->Parameters.Write.Length);
+    }
+
+    if (tagged && !set_zero_data)
+    {
+        ImDiskSendProxyQueue(DeviceExtension,
+            Irp,
+            IMDPROXY_REQ_WRITE,
+            io_buffer,
+            DeviceExtension->byte_swap ? io_buffer : NULL,
+            system_buffer,
+            0,
+            &offset);
+
+        return TRUE;
     }
 
     if (DeviceExtension->use_proxy)
     {
+        ImDiskDrainProxyQueue(DeviceExtension);
+
         if (set_zero_data && DeviceExtension->proxy_zero)
         {
             DEVICE_DATA_SET_RANGE range = { 0 };
@@ -323,7 +524,7 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
                 ImDiskWriteProxy(&DeviceExtension->proxy,
                     &Irp->IoStatus,
                     &DeviceExtension->terminate_thread,
-                    DeviceExtension->last_io_data,
+                    io_buffer,
                     io_stack->Parameters.Write.Length,
                     &offset);
         }
@@ -377,7 +578,17 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
             }
         }
 
-        if (!set_zero_data)
+        if ((!set_zero_data) && (Worker != NULL))
+        {
+            Irp->IoStatus.Status =
+                ImDiskFileWorkerIo(DeviceExtension,
+                    IRP_MJ_WRITE,
+                    &Irp->IoStatus,
+                    io_buffer,
+                    io_stack->Parameters.Write.Length,
+                    &offset);
+        }
+        else if (!set_zero_data)
         {
             Irp->IoStatus.Status = NtWriteFile(
                 DeviceExtension->file_handle,
@@ -385,33 +596,30 @@ ImDiskDeviceThreadWrite(IN PIRP Irp,
                 NULL,
                 NULL,
                 &Irp->IoStatus,
-                DeviceExtension->last_io_data,
+                io_buffer,
                 io_stack->Parameters.Write.Length,
                 &offset,
                 NULL);
         }
     }
 
+    if (tagged && DeviceExtension->byte_swap)
+        ExFreePoolWithTag(io_buffer, POOL_TAG);
+
+    ImDiskInvalidateCache(DeviceExtension,
+        io_stack->Parameters.Write.ByteOffset.QuadPart,
+        io_stack->Parameters.Write.Length);
+
     if (NT_SUCCESS(Irp->IoStatus.Status))
     {
-        DeviceExtension->last_io_offset =
-            io_stack->Parameters.Write.ByteOffset.QuadPart;
-        DeviceExtension->last_io_length =
-            io_stack->Parameters.Write.Length;
-
         if (io_stack->FileObject != NULL)
         {
             io_stack->FileObject->CurrentByteOffset.QuadPart +=
                 Irp->IoStatus.Information;
         }
     }
-    else
-    {
-        ExFreePoolWithTag(DeviceExtension->last_io_data, POOL_TAG);
-        DeviceExtension->last_io_data = NULL;
-    }
 
-    return;
+    return FALSE;
 }
 
 VOID
@@ -680,6 +888,9 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
             Irp->IoStatus.Status = status;
         }
 
+        // Lower driver may have changed any part of image
+        ImDiskInvalidateCache(DeviceExtension, 0, ~0ULL);
+
         KdPrint(("ImDisk: IOCTL_IMDISK_IOCTL/FSCTL_PASS_THROUGH for device %i control code %#x result status %#x.\n",
             DeviceExtension->device_number, ctl_code, status));
 
@@ -694,6 +905,8 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
         NTSTATUS status =
             ImDiskFloppyFormat(DeviceExtension, Irp);
 
+        ImDiskInvalidateCache(DeviceExtension, 0, ~0ULL);
+
         if (!NT_SUCCESS(status))
         {
             Irp->IoStatus.Status = STATUS_DEVICE_DOES_NOT_EXIST;
@@ -721,6 +934,24 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
         int items = attrs->DataSetRangesLength /
             sizeof(DEVICE_DATA_SET_RANGE);
 
+        if (DeviceExtension->vm_disk)
+        {
+            PDEVICE_DATA_SET_RANGE vm_range = (PDEVICE_DATA_SET_RANGE)
+                ((PUCHAR)attrs + attrs->DataSetRangesOffset);
+
+            for (int i = 0; i < items; i++)
+            {
+                ImDiskVmTrim(DeviceExtension,
+                    vm_range[i].StartingOffset, vm_range[i].LengthInBytes);
+            }
+
+            KdPrint(("ImDisk: Device %i has %I64u committed chunks after "
+                "trim.\n", DeviceExtension->device_number,
+                (ULONGLONG)DeviceExtension->vm_committed_chunks));
+
+            break;
+        }
+
         PDEVICE_DATA_SET_RANGE range = (PDEVICE_DATA_SET_RANGE)
             ExAllocatePoolWithTag(PagedPool,
                 items * sizeof(DEVICE_DATA_SET_RANGE), POOL_TAG);
@@ -734,6 +965,12 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
         RtlCopyMemory(range, (PUCHAR)attrs + attrs->DataSetRangesOffset,
             items * sizeof(DEVICE_DATA_SET_RANGE));
 
+        for (int i = 0; i < items; i++)
+        {
+            ImDiskInvalidateCache(DeviceExtension,
+                range[i].StartingOffset, range[i].LengthInBytes);
+        }
+
         if (DeviceExtension->image_offset.QuadPart > 0)
         {
             for (int i = 0; i < items; i++)
@@ -812,31 +1049,46 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
             KdPrint(("ImDisk: Allocating %I64u bytes.\n",
                 (ULONGLONG)max_size));
 
-            status = ZwAllocateVirtualMemory(NtCurrentProcess(),
-                &new_image_buffer,
-                0,
-                &max_size,
-                MEM_COMMIT,
-                PAGE_READWRITE);
-
-            if (!NT_SUCCESS(status))
+            if (DeviceExtension->vm_chunks != NULL)
             {
-                status = STATUS_NO_MEMORY;
-                Irp->IoStatus.Status = status;
-                Irp->IoStatus.Information = 0;
-                break;
+                status = ImDiskVmGrowSparse(DeviceExtension, max_size);
+
+                if (!NT_SUCCESS(status))
+                {
+                    Irp->IoStatus.Status = status;
+                    Irp->IoStatus.Information = 0;
+                    break;
+                }
+            }
+            else
+            {
+                status = ZwAllocateVirtualMemory(NtCurrentProcess(),
+                    &new_image_buffer,
+                    0,
+                    &max_size,
+                    MEM_COMMIT,
+                    PAGE_READWRITE);
+
+                if (!NT_SUCCESS(status))
+                {
+                    status = STATUS_NO_MEMORY;
+                    Irp->IoStatus.Status = status;
+                    Irp->IoStatus.Information = 0;
+                    break;
+                }
+
+                RtlCopyMemory(new_image_buffer,
+                    DeviceExtension->image_buffer,
+                    min(old_size, max_size));
+
+                ZwFreeVirtualMemory(NtCurrentProcess(),
+                    (PVOID*)&DeviceExtension->image_buffer,
+                    &free_size,
+                    MEM_RELEASE);
+
+                DeviceExtension->image_buffer = (PUCHAR)new_image_buffer;
             }
 
-            RtlCopyMemory(new_image_buffer,
-                DeviceExtension->image_buffer,
-                min(old_size, max_size));
-
-            ZwFreeVirtualMemory(NtCurrentProcess(),
-                (PVOID*)&DeviceExtension->image_buffer,
-                &free_size,
-                MEM_RELEASE);
-
-            DeviceExtension->image_buffer = (PUCHAR)new_image_buffer;
             DeviceExtension->disk_geometry.Cylinders =
                 new_size.EndOfFile;
 
@@ -941,63 +1193,883 @@ ImDiskDeviceThreadDeviceControl(IN PIRP Irp,
     }
 }
 
+// Completes a request run by the device thread or a worker thread.
 VOID
-ImDiskDeviceThread(IN PVOID Context)
+ImDiskCompleteDeviceThreadIrp(IN PIRP Irp,
+    IN PDEVICE_OBJECT DeviceObject)
 {
-    PDEVICE_THREAD_DATA device_thread_data;
-    PDEVICE_OBJECT device_object;
-    PDEVICE_EXTENSION device_extension;
-    LARGE_INTEGER time_out = { 0 };
-    BOOLEAN system_drive_letter;
-
-    ASSERT(Context != NULL);
+    // If indicating that proxy connection died we can do
+    // nothing else but remove this device.
+    switch (Irp->IoStatus.Status)
+    {
+    case STATUS_CONNECTION_RESET:
+    case STATUS_DEVICE_REMOVED:
+    case STATUS_DEVICE_DOES_NOT_EXIST:
+    case STATUS_PIPE_BROKEN:
+    case STATUS_PIPE_DISCONNECTED:
+    case STATUS_PORT_DISCONNECTED:
+    case STATUS_REMOTE_DISCONNECT:
+        ImDiskRemoveVirtualDisk(DeviceObject);
+        Irp->IoStatus.Status = STATUS_DEVICE_DOES_NOT_EXIST;
+        Irp->IoStatus.Information = 0;
 
-    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+    }
 
-    device_thread_data = (PDEVICE_THREAD_DATA)Context;
+    IoCompleteRequest(Irp,
+        NT_SUCCESS(Irp->IoStatus.Status) ?
+        IO_DISK_INCREMENT : IO_NO_INCREMENT);
+}
 
-    KdPrint(("ImDisk: Worker thread %p created for device %u\n",
-        KeGetCurrentThread(), device_thread_data->create_data->DeviceNumber));
+VOID
+ImDiskFileWorkerThread(IN PVOID Context)
+{
+    PFILE_WORKER worker = (PFILE_WORKER)Context;
+    PDEVICE_EXTENSION device_extension = worker->device_extension;
 
-    system_drive_letter = !device_thread_data->caller_waiting;
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 
-    // This is in case this thread is created by
-    // ImDiskAddVirtualDiskAfterInitialization() when called from DriverEntry().
-    // That indicates that no-one is waiting for us to return any status
-    // in the device_thread_data members and that there is no-one freeing the
-    // init structures after we are finished with them.
-    // It also means that we need to wait for the control device to get ready for
-    // I/O (in case a proxy or something need to call this driver during device
-    // initialization).
-    while (ImDiskCtlDevice->Flags & DO_DEVICE_INITIALIZING)
+    for (;;)
     {
-        LARGE_INTEGER wait_time = { 0 };
+        KLOCK_QUEUE_HANDLE lock_handle;
+        PIRP irp;
+        BOOLEAN stop;
 
-        KdPrint2(("ImDisk: Driver still initializing, waiting 100 ms...\n"));
+        KeWaitForSingleObject(&worker->start_event,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
 
-        wait_time.QuadPart = -1000000;
-        KeDelayExecutionThread(KernelMode, FALSE, &wait_time);
-    }
+        ImDiskAcquireLock(&device_extension->file_worker_lock, &lock_handle);
 
-    device_thread_data->status = ImDiskCreateDevice(
-        device_thread_data->driver_object,
-        device_thread_data->create_data,
-        device_thread_data->client_thread,
-        &device_object);
+        irp = worker->irp;
+        stop = worker->stop;
 
-    if (!NT_SUCCESS(device_thread_data->status))
-    {
-        if (device_thread_data->caller_waiting)
-            KeSetEvent(&device_thread_data->created_event, (KPRIORITY)0, FALSE);
-        else
+        ImDiskReleaseLock(&lock_handle);
+
+        if (irp == NULL)
         {
-            ExFreePoolWithTag(device_thread_data->create_data, POOL_TAG);
-            ExFreePoolWithTag(device_thread_data, POOL_TAG);
+            if (stop)
+                break;
+
+            continue;
         }
 
-        ImDiskLogError((device_thread_data->driver_object,
-            0,
-            0,
+        if (IoGetCurrentIrpStackLocation(irp)->MajorFunction == IRP_MJ_READ)
+            ImDiskDeviceThreadRead(irp, device_extension,
+                worker->device_object, worker);
+        else
+            ImDiskDeviceThreadWrite(irp, device_extension,
+                worker->device_object, worker);
+
+        ImDiskCompleteDeviceThreadIrp(irp, worker->device_object);
+
+        ImDiskAcquireLock(&device_extension->file_worker_lock, &lock_handle);
+
+        worker->irp = NULL;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        KeSetEvent(&device_extension->file_worker_done, 0, FALSE);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Starts up to Count worker threads for a queued file device. If no worker
+// can be started, all requests are run by the device thread.
+VOID
+ImDiskStartFileWorkers(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_OBJECT DeviceObject,
+    IN ULONG Count)
+{
+    PFILE_WORKER workers;
+    NTSTATUS status;
+    ULONG i;
+
+    if (DeviceExtension->file_object == NULL)
+    {
+        status = ObReferenceObjectByHandle(
+            DeviceExtension->file_handle,
+            FILE_WRITE_ATTRIBUTES |
+            FILE_WRITE_DATA |
+            SYNCHRONIZE,
+            *IoFileObjectType,
+            KernelMode,
+            (PVOID*)&DeviceExtension->file_object,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: ObReferenceObjectByHandle failed on image handle: %#x\n",
+                status));
+
+            return;
+        }
+
+        DeviceExtension->dev_object = IoGetRelatedDeviceObject(
+            DeviceExtension->file_object);
+    }
+
+    workers = (PFILE_WORKER)ExAllocatePoolWithTag(NonPagedPool,
+        Count * sizeof(FILE_WORKER), POOL_TAG);
+
+    if (workers == NULL)
+        return;
+
+    RtlZeroMemory(workers, Count * sizeof(FILE_WORKER));
+
+    for (i = 0; i < Count; i++)
+    {
+        HANDLE thread_handle;
+
+        workers[i].device_extension = DeviceExtension;
+        workers[i].device_object = DeviceObject;
+
+        KeInitializeEvent(&workers[i].start_event,
+            SynchronizationEvent,
+            FALSE);
+
+        status = PsCreateSystemThread(&thread_handle,
+            (ACCESS_MASK)0L,
+            NULL,
+            NULL,
+            NULL,
+            ImDiskFileWorkerThread,
+            workers + i);
+
+        if (!NT_SUCCESS(status))
+            break;
+
+        status = ObReferenceObjectByHandle(thread_handle,
+            SYNCHRONIZE,
+            *PsThreadType,
+            KernelMode,
+            (PVOID*)&workers[i].thread,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            workers[i].stop = TRUE;
+            KeSetEvent(&workers[i].start_event, 0, FALSE);
+
+            ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+            ZwClose(thread_handle);
+            break;
+        }
+
+        ZwClose(thread_handle);
+    }
+
+    if (i == 0)
+    {
+        KdPrint(("ImDisk: Cannot create worker threads. (%#x)\n", status));
+
+        ExFreePoolWithTag(workers, POOL_TAG);
+        return;
+    }
+
+    KdPrint(("ImDisk: Device %i runs requests in %u worker threads.\n",
+        DeviceExtension->device_number, i));
+
+    DeviceExtension->file_workers = workers;
+    DeviceExtension->file_worker_count = i;
+}
+
+// Hands a read or write request to an idle worker. Requests that overlap a
+// request in flight, where either of them is a write, wait until that
+// request has completed, so that overlapping requests run in the order
+// they were queued. Returns FALSE if device has no workers.
+BOOLEAN
+ImDiskQueueFileWorker(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp)
+{
+    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+    LONGLONG offset = io_stack->Parameters.Read.ByteOffset.QuadPart;
+    ULONG length = io_stack->Parameters.Read.Length;
+    BOOLEAN write = io_stack->MajorFunction == IRP_MJ_WRITE;
+
+    if (DeviceExtension->file_workers == NULL)
+        return FALSE;
+
+    for (;;)
+    {
+        KLOCK_QUEUE_HANDLE lock_handle;
+        PFILE_WORKER idle = NULL;
+        BOOLEAN overlap = FALSE;
+        ULONG i;
+
+        ImDiskAcquireLock(&DeviceExtension->file_worker_lock, &lock_handle);
+
+        for (i = 0; i < DeviceExtension->file_worker_count; i++)
+        {
+            PFILE_WORKER worker = DeviceExtension->file_workers + i;
+
+            if (worker->irp == NULL)
+            {
+                if (idle == NULL)
+                    idle = worker;
+            }
+            else if ((write || worker->write) &&
+                (offset < worker->offset + worker->length) &&
+                (worker->offset < offset + length))
+            {
+                overlap = TRUE;
+                break;
+            }
+        }
+
+        if ((!overlap) && (idle != NULL))
+        {
+            idle->irp = Irp;
+            idle->offset = offset;
+            idle->length = length;
+            idle->write = write;
+
+            ImDiskReleaseLock(&lock_handle);
+
+            KeSetEvent(&idle->start_event, 0, FALSE);
+
+            return TRUE;
+        }
+
+        ImDiskReleaseLock(&lock_handle);
+
+        KeWaitForSingleObject(&DeviceExtension->file_worker_done,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+    }
+}
+
+// Waits until all worker threads are idle. Called before requests that the
+// device thread runs itself, such as flush, so that they are ordered after
+// reads and writes queued before them.
+VOID
+ImDiskDrainFileWorkers(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->file_workers == NULL)
+        return;
+
+    for (;;)
+    {
+        KLOCK_QUEUE_HANDLE lock_handle;
+        BOOLEAN busy = FALSE;
+        ULONG i;
+
+        ImDiskAcquireLock(&DeviceExtension->file_worker_lock, &lock_handle);
+
+        for (i = 0; i < DeviceExtension->file_worker_count; i++)
+            if (DeviceExtension->file_workers[i].irp != NULL)
+                busy = TRUE;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        if (!busy)
+            return;
+
+        KeWaitForSingleObject(&DeviceExtension->file_worker_done,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+    }
+}
+
+VOID
+ImDiskStopFileWorkers(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    ULONG i;
+
+    if (DeviceExtension->file_workers == NULL)
+        return;
+
+    ImDiskDrainFileWorkers(DeviceExtension);
+
+    for (i = 0; i < DeviceExtension->file_worker_count; i++)
+    {
+        ImDiskAcquireLock(&DeviceExtension->file_worker_lock, &lock_handle);
+
+        DeviceExtension->file_workers[i].stop = TRUE;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        KeSetEvent(&DeviceExtension->file_workers[i].start_event, 0, FALSE);
+    }
+
+    for (i = 0; i < DeviceExtension->file_worker_count; i++)
+    {
+        PFILE_WORKER worker = DeviceExtension->file_workers + i;
+
+        KeWaitForSingleObject(worker->thread,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+
+        ObDereferenceObject(worker->thread);
+
+        if (worker->io_buffer != NULL)
+            ExFreePoolWithTag(worker->io_buffer, POOL_TAG);
+    }
+
+    ExFreePoolWithTag(DeviceExtension->file_workers, POOL_TAG);
+    DeviceExtension->file_workers = NULL;
+    DeviceExtension->file_worker_count = 0;
+}
+
+// Reads or writes image of a file or proxy device from the device thread.
+NTSTATUS
+ImDiskDeviceThreadImageIo(IN PDEVICE_EXTENSION DeviceExtension,
+    IN UCHAR MajorFunction,
+    OUT PIO_STATUS_BLOCK IoStatusBlock,
+    IN OUT PVOID Buffer,
+    IN ULONG Length,
+    IN PLARGE_INTEGER ByteOffset)
+{
+    if (DeviceExtension->use_proxy)
+    {
+        if (MajorFunction == IRP_MJ_READ)
+            IoStatusBlock->Status =
+                ImDiskReadProxy(&DeviceExtension->proxy,
+                    IoStatusBlock,
+                    &DeviceExtension->terminate_thread,
+                    Buffer,
+                    Length,
+                    ByteOffset);
+        else
+            IoStatusBlock->Status =
+                ImDiskWriteProxy(&DeviceExtension->proxy,
+                    IoStatusBlock,
+                    &DeviceExtension->terminate_thread,
+                    Buffer,
+                    Length,
+                    ByteOffset);
+
+        if (!NT_SUCCESS(IoStatusBlock->Status))
+        {
+            KdPrint(("ImDisk: I/O failed on device %i: %#x.\n",
+                DeviceExtension->device_number,
+                IoStatusBlock->Status));
+
+            IoStatusBlock->Status = STATUS_DEVICE_DOES_NOT_EXIST;
+            IoStatusBlock->Information = 0;
+        }
+    }
+    else if (MajorFunction == IRP_MJ_READ)
+    {
+        IoStatusBlock->Status =
+            NtReadFile(DeviceExtension->file_handle,
+                NULL,
+                NULL,
+                NULL,
+                IoStatusBlock,
+                Buffer,
+                Length,
+                ByteOffset,
+                NULL);
+    }
+    else
+    {
+        IoStatusBlock->Status =
+            NtWriteFile(DeviceExtension->file_handle,
+                NULL,
+                NULL,
+                NULL,
+                IoStatusBlock,
+                Buffer,
+                Length,
+                ByteOffset,
+                NULL);
+    }
+
+    return IoStatusBlock->Status;
+}
+
+// Requests are merged and sorted where the device thread does image I/O
+// itself, one request at a time. Byte swapped images are left out, since
+// they are copied through a buffer anyway.
+BOOLEAN
+ImDiskMergeEnabled(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    return (MergeMaxLength != 0 || SortRequests != 0) &&
+        (!DeviceExtension->vm_disk) &&
+        (!DeviceExtension->parallel_io) &&
+        (!DeviceExtension->byte_swap) &&
+        (DeviceExtension->proxy_queue == NULL) &&
+        (DeviceExtension->file_worker_count == 0) &&
+        (DeviceExtension->use_proxy ||
+            DeviceExtension->file_handle != NULL);
+}
+
+// Serves a run of adjacent requests of the same kind with one image read or
+// write, through the device I/O buffer. Returns FALSE without serving any
+// request if that cannot be done, in which case requests are served one by
+// one instead.
+BOOLEAN
+ImDiskDeviceThreadMergedIo(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP *Irps,
+    IN PIMDMERGE_REQUEST Requests,
+    IN unsigned int *Order,
+    IN ULONG Count)
+{
+    PUCHAR system_buffers[IMDISK_MERGE_MAX_REQUESTS];
+    PIMDMERGE_REQUEST first = Requests + Order[0];
+    BOOLEAN write = first->write ? TRUE : FALSE;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    unsigned int cache_generation = 0;
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER offset;
+    PUCHAR io_buffer;
+    ULONG length = 0;
+    ULONG position;
+    ULONG i;
+
+    // Writes of all zeros are detected one by one
+    if (write &&
+        (DeviceExtension->use_set_zero_data ||
+            (DeviceExtension->use_proxy && DeviceExtension->proxy_zero)))
+        return FALSE;
+
+    for (i = 0; i < Count; i++)
+    {
+        system_buffers[i] = (PUCHAR)
+            MmGetSystemAddressForMdlSafe(Irps[Order[i]]->MdlAddress,
+                NormalPagePriority);
+
+        if (system_buffers[i] == NULL)
+            return FALSE;
+
+        length += Requests[Order[i]].length;
+    }
+
+    io_buffer = ImDiskGetIoBuffer(DeviceExtension, NULL, length);
+
+    if (io_buffer == NULL)
+        return FALSE;
+
+    offset.QuadPart = first->offset + DeviceExtension->image_offset.QuadPart;
+
+    if (write)
+    {
+        for (i = 0, position = 0; i < Count;
+            position += Requests[Order[i]].length, i++)
+            RtlCopyMemory(io_buffer + position, system_buffers[i],
+                Requests[Order[i]].length);
+
+        if (!DeviceExtension->image_modified)
+        {
+            DeviceExtension->image_modified = TRUE;
+
+            // Fire refresh event
+            if (RefreshEvent != NULL)
+                KePulseEvent(RefreshEvent, 0, FALSE);
+        }
+
+        ImDiskDeviceThreadImageIo(DeviceExtension, IRP_MJ_WRITE,
+            &io_status, io_buffer, length, &offset);
+
+        ImDiskInvalidateCache(DeviceExtension, first->offset, length);
+    }
+    else
+    {
+        // Data read is only cached if no write completes while reading
+        if (DeviceExtension->cache.data != NULL)
+        {
+            ImDiskAcquireLock(&DeviceExtension->cache_lock, &lock_handle);
+
+            cache_generation =
+                ImDiskCacheGeneration(&DeviceExtension->cache);
+
+            ImDiskReleaseLock(&lock_handle);
+        }
+
+        ImDiskDeviceThreadImageIo(DeviceExtension, IRP_MJ_READ,
+            &io_status, io_buffer, length, &offset);
+    }
+
+    // Each request gets its part of the result, so requests after end of
+    // a short read complete with less or no data
+    for (i = 0, position = 0; i < Count;
+        position += Requests[Order[i]].length, i++)
+    {
+        PIRP irp = Irps[Order[i]];
+        PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(irp);
+        ULONG done = 0;
+
+        if (NT_SUCCESS(io_status.Status) &&
+            io_status.Information > position)
+        {
+            done = Requests[Order[i]].length;
+
+            if (io_status.Information - position < done)
+                done = (ULONG)(io_status.Information - position);
+        }
+
+        if ((!write) && (done != 0))
+        {
+            if (IMDISK_CACHE_FILL(DeviceExtension,
+                Requests[Order[i]].offset, done))
+            {
+                ImDiskAcquireLock(&DeviceExtension->cache_lock,
+                    &lock_handle);
+
+                ImDiskCacheInsert(&DeviceExtension->cache, cache_generation,
+                    Requests[Order[i]].offset, io_buffer + position, done);
+
+                ImDiskReleaseLock(&lock_handle);
+            }
+
+            RtlCopyMemory(system_buffers[i], io_buffer + position, done);
+        }
+
+        irp->IoStatus.Status = io_status.Status;
+        irp->IoStatus.Information = done;
+
+        if (NT_SUCCESS(io_status.Status) && (io_stack->FileObject != NULL))
+        {
+            io_stack->FileObject->CurrentByteOffset.QuadPart += done;
+        }
+
+        ImDiskCompleteDeviceThreadIrp(irp, DeviceObject);
+    }
+
+    return TRUE;
+}
+
+// Serves a read or write request together with read and write requests
+// queued after it, up to the next request of another kind. Requests are
+// ordered and merged as planned by ImDiskMergePlan.
+VOID
+ImDiskDeviceThreadMerge(IN PIRP Irp,
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_OBJECT DeviceObject)
+{
+    PIRP irps[IMDISK_MERGE_MAX_REQUESTS];
+    IMDMERGE_REQUEST requests[IMDISK_MERGE_MAX_REQUESTS];
+    unsigned int order[IMDISK_MERGE_MAX_REQUESTS];
+    unsigned int runs[IMDISK_MERGE_MAX_REQUESTS];
+    unsigned int run_count;
+    ULONG count = 0;
+    ULONG first;
+    ULONG r;
+
+    for (;;)
+    {
+        PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+        PIMDQUEUE_ENTRY entry;
+        UCHAR major_function;
+
+        irps[count] = Irp;
+
+        if (io_stack->MajorFunction == IRP_MJ_WRITE)
+        {
+            requests[count].offset =
+                io_stack->Parameters.Write.ByteOffset.QuadPart;
+            requests[count].length = io_stack->Parameters.Write.Length;
+            requests[count].write = TRUE;
+        }
+        else
+        {
+            requests[count].offset =
+                io_stack->Parameters.Read.ByteOffset.QuadPart;
+            requests[count].length = io_stack->Parameters.Read.Length;
+            requests[count].write = FALSE;
+        }
+
+        if (++count == IMDISK_MERGE_MAX_REQUESTS)
+            break;
+
+        // Called by the consumer of the device queue
+        entry = ImDiskQueuePeek(&DeviceExtension->irp_queue);
+
+        if (entry == NULL)
+            break;
+
+        Irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+        major_function = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+
+        if ((major_function != IRP_MJ_READ) &&
+            (major_function != IRP_MJ_WRITE))
+            break;
+
+        ImDiskQueuePop(&DeviceExtension->irp_queue);
+    }
+
+    run_count = ImDiskMergePlan(requests, count, SortRequests != 0,
+        MergeMaxLength, &DeviceExtension->merge_position, order, runs);
+
+    for (r = 0, first = 0; r < run_count; first += runs[r], r++)
+    {
+        ULONG i;
+
+        if ((runs[r] > 1) &&
+            ImDiskDeviceThreadMergedIo(DeviceExtension, DeviceObject, irps,
+                requests, order + first, runs[r]))
+            continue;
+
+        for (i = first; i < first + runs[r]; i++)
+        {
+            PIRP irp = irps[order[i]];
+
+            if (requests[order[i]].write ?
+                ImDiskDeviceThreadWrite(irp, DeviceExtension, DeviceObject,
+                    NULL) :
+                ImDiskDeviceThreadRead(irp, DeviceExtension, DeviceObject,
+                    NULL))
+                continue;
+
+            ImDiskCompleteDeviceThreadIrp(irp, DeviceObject);
+        }
+    }
+}
+
+// Runs a request taken from the device queue, in the device thread or in a
+// shared pool thread.
+VOID
+ImDiskDeviceThreadRequest(IN PIRP Irp,
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_OBJECT DeviceObject)
+{
+    UCHAR major_function = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+
+    if (((major_function == IRP_MJ_READ) ||
+        (major_function == IRP_MJ_WRITE)) &&
+        ImDiskMergeEnabled(DeviceExtension))
+    {
+        ImDiskDeviceThreadMerge(Irp, DeviceExtension, DeviceObject);
+        return;
+    }
+
+    switch (major_function)
+    {
+    case IRP_MJ_FLUSH_BUFFERS:
+        ImDiskDrainProxyQueue(DeviceExtension);
+        ImDiskDrainFileWorkers(DeviceExtension);
+        ImDiskDeviceThreadFlushBuffers(Irp, DeviceExtension);
+        break;
+
+    case IRP_MJ_READ:
+        if (ImDiskQueueFileWorker(DeviceExtension, Irp) ||
+            ImDiskDeviceThreadRead(Irp, DeviceExtension, DeviceObject,
+                NULL))
+            return;
+        break;
+
+    case IRP_MJ_WRITE:
+        if (ImDiskQueueFileWorker(DeviceExtension, Irp) ||
+            ImDiskDeviceThreadWrite(Irp, DeviceExtension, DeviceObject,
+                NULL))
+            return;
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        ImDiskDrainProxyQueue(DeviceExtension);
+        ImDiskDrainFileWorkers(DeviceExtension);
+        ImDiskDeviceThreadDeviceControl(Irp, DeviceExtension, DeviceObject);
+        break;
+
+    default:
+        Irp->IoStatus.Status = STATUS_DRIVER_INTERNAL_ERROR;
+    }
+
+    ImDiskCompleteDeviceThreadIrp(Irp, DeviceObject);
+}
+
+// Frees resources of a device that is being removed and has no queued
+// requests, and deletes the device object. If the device object is still
+// referenced, it is not deleted and FALSE is returned. The caller then
+// serves requests that may still arrive, and calls again later.
+BOOLEAN
+ImDiskDeviceThreadShutdown(IN PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION device_extension =
+        (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    PWCHAR symlink_name_buffer;
+    NTSTATUS status;
+
+    KdPrint(("ImDisk: Device %i thread is shutting down.\n",
+        device_extension->device_number));
+
+    // Fire refresh event
+    if (RefreshEvent != NULL)
+        KePulseEvent(RefreshEvent, 0, FALSE);
+
+    if (device_extension->drive_letter != 0)
+        if (device_extension->system_drive_letter)
+            ImDiskRemoveDriveLetter(device_extension->drive_letter);
+
+    ImDiskStopProxyQueue(device_extension);
+
+    ImDiskStopFileWorkers(device_extension);
+
+    ImDiskCloseProxy(&device_extension->proxy);
+
+    ImDiskCacheDelete(device_extension);
+
+    if (device_extension->io_buffer != NULL)
+    {
+        ExFreePoolWithTag(device_extension->io_buffer, POOL_TAG);
+        device_extension->io_buffer = NULL;
+        device_extension->io_buffer_size = 0;
+    }
+
+    if (device_extension->vm_disk)
+    {
+        SIZE_T free_size = 0;
+
+        ImDiskVmFreeSparse(device_extension);
+
+        if (device_extension->image_buffer != NULL)
+            ZwFreeVirtualMemory(NtCurrentProcess(),
+                (PVOID*)&device_extension->image_buffer,
+                &free_size, MEM_RELEASE);
+
+        device_extension->image_buffer = NULL;
+    }
+    else
+    {
+        if (device_extension->file_handle != NULL)
+            ZwClose(device_extension->file_handle);
+
+        device_extension->file_handle = NULL;
+
+        if (device_extension->file_object != NULL)
+            ObDereferenceObject(device_extension->file_object);
+
+        device_extension->file_object = NULL;
+    }
+
+    if (device_extension->file_name.Buffer != NULL)
+    {
+        ExFreePoolWithTag(device_extension->file_name.Buffer, POOL_TAG);
+        device_extension->file_name.Buffer = NULL;
+        device_extension->file_name.Length = 0;
+        device_extension->file_name.MaximumLength = 0;
+    }
+
+    // If ReferenceCount is not zero, this device may have outstanding
+    // IRP-s or otherwise unfinished things to do.
+#pragma warning(suppress: 28175)
+    if (DeviceObject->ReferenceCount != 0)
+    {
+#if DBG
+#pragma warning(suppress: 28175)
+        LONG ref_count = DeviceObject->ReferenceCount;
+        DbgPrint("ImDisk: Device %i has %i references. Waiting.\n",
+            device_extension->device_number,
+            ref_count);
+#endif
+
+        return FALSE;
+    }
+
+    KdPrint(("ImDisk: Deleting symlink for device %i.\n",
+        device_extension->device_number));
+
+    symlink_name_buffer = (PWCHAR)
+        ExAllocatePoolWithTag(PagedPool,
+            MAXIMUM_FILENAME_LENGTH * sizeof(WCHAR), POOL_TAG);
+
+    if (symlink_name_buffer == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        UNICODE_STRING symlink_name;
+
+        _snwprintf(symlink_name_buffer, MAXIMUM_FILENAME_LENGTH - 1,
+            IMDISK_SYMLNK_NATIVE_BASE_NAME L"%u", device_extension->device_number);
+        symlink_name_buffer[MAXIMUM_FILENAME_LENGTH - 1] = 0;
+
+        RtlInitUnicodeString(&symlink_name, symlink_name_buffer);
+
+        KdPrint(("ImDisk: Deleting symlink '%ws'.\n", symlink_name_buffer));
+
+        status = IoDeleteSymbolicLink(&symlink_name);
+
+        ExFreePoolWithTag(symlink_name_buffer, POOL_TAG);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk: Cannot delete symlink. (%#x)\n", status));
+    }
+
+    KdPrint(("ImDisk: Deleting device object %i.\n",
+        device_extension->device_number));
+
+    IoDeleteDevice(DeviceObject);
+
+    // Fire refresh event
+    if (RefreshEvent != NULL)
+        KePulseEvent(RefreshEvent, 0, FALSE);
+
+    return TRUE;
+}
+
+VOID
+ImDiskDeviceThread(IN PVOID Context)
+{
+    PDEVICE_THREAD_DATA device_thread_data;
+    PDEVICE_OBJECT device_object;
+    PDEVICE_EXTENSION device_extension;
+    LARGE_INTEGER time_out = { 0 };
+    BOOLEAN system_drive_letter;
+
+    ASSERT(Context != NULL);
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    device_thread_data = (PDEVICE_THREAD_DATA)Context;
+
+    KdPrint(("ImDisk: Worker thread %p created for device %u\n",
+        KeGetCurrentThread(), device_thread_data->create_data->DeviceNumber));
+
+    system_drive_letter = !device_thread_data->caller_waiting;
+
+    // This is in case this thread is created by
+    // ImDiskAddVirtualDiskAfterInitialization() when called from DriverEntry().
+    // That indicates that no-one is waiting for us to return any status
+    // in the device_thread_data members and that there is no-one freeing the
+    // init structures after we are finished with them.
+    // It also means that we need to wait for the control device to get ready for
+    // I/O (in case a proxy or something need to call this driver during device
+    // initialization).
+    while (ImDiskCtlDevice->Flags & DO_DEVICE_INITIALIZING)
+    {
+        LARGE_INTEGER wait_time = { 0 };
+
+        KdPrint2(("ImDisk: Driver still initializing, waiting 100 ms...\n"));
+
+        wait_time.QuadPart = -1000000;
+        KeDelayExecutionThread(KernelMode, FALSE, &wait_time);
+    }
+
+    device_thread_data->status = ImDiskCreateDevice(
+        device_thread_data->driver_object,
+        device_thread_data->create_data,
+        device_thread_data->client_thread,
+        &device_object);
+
+    if (!NT_SUCCESS(device_thread_data->status))
+    {
+        if (device_thread_data->caller_waiting)
+            KeSetEvent(&device_thread_data->created_event, (KPRIORITY)0, FALSE);
+        else
+        {
+            ExFreePoolWithTag(device_thread_data->create_data, POOL_TAG);
+            ExFreePoolWithTag(device_thread_data, POOL_TAG);
+        }
+
+        ImDiskLogError((device_thread_data->driver_object,
+            0,
+            0,
             NULL,
             0,
             1000,
@@ -1037,12 +2109,29 @@ ImDiskDeviceThread(IN PVOID Context)
 
     device_extension = (PDEVICE_EXTENSION)device_object->DeviceExtension;
 
+    device_extension->system_drive_letter = system_drive_letter;
+
     time_out.QuadPart = -1000000;
 
+    // Sparse VM disks commit memory when written to, and load any image file
+    // while they are used.
+    if (device_extension->vm_disk && device_extension->use_set_zero_data)
+    {
+        NTSTATUS status = ImDiskVmInitializeSparse(device_extension);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Cannot allocate chunk states (%#x).\n",
+                status));
+
+            ImDiskRemoveVirtualDisk(device_object);
+        }
+    }
     // If this is a VM backed disk that should be pre-loaded with an image file
     // we have to load the contents of that file now before entering the service
     // loop.
-    if (device_extension->vm_disk && (device_extension->file_handle != NULL))
+    else if (device_extension->vm_disk &&
+        (device_extension->file_handle != NULL))
     {
         LARGE_INTEGER byte_offset = device_extension->image_offset;
         IO_STATUS_BLOCK io_status;
@@ -1085,25 +2174,58 @@ ImDiskDeviceThread(IN PVOID Context)
         }
     }
 
-    for (;;)
+    if (device_extension->proxy_queue_depth != 0)
+        ImDiskStartProxyQueue(device_extension,
+            device_extension->proxy_queue_depth);
+
+    // Workers are not used where the dispatch routine sends requests to the
+    // image FILE_OBJECT itself
+    if ((!device_extension->vm_disk) &&
+        (!device_extension->use_proxy) &&
+        (!device_extension->parallel_io) &&
+        (device_extension->file_handle != NULL) &&
+        (FileWorkerThreads > 1))
+        ImDiskStartFileWorkers(device_extension, device_object,
+            FileWorkerThreads);
+
+    // Devices in the shared thread pool have no threads of their own, so
+    // this thread exits here and the pool serves requests from now on.
+    // File workers are started before that, so pool devices use them too.
+    if (ImDiskPoolAddDevice(device_object))
     {
-        PLIST_ENTRY request;
+        KdPrint(("ImDisk: Device %i is served by shared thread pool.\n",
+            device_extension->device_number));
+
+        PsTerminateSystemThread(STATUS_SUCCESS);
+
+        return;
+    }
 
-        KeClearEvent(&device_extension->request_event);
+    for (;;)
+    {
+        PIMDQUEUE_ENTRY request;
 
-        request =
-            ImDiskInterlockedRemoveHeadList(&device_extension->list_head,
-                &device_extension->list_lock);
+        request = ImDiskQueuePop(&device_extension->irp_queue);
 
         if (request == NULL)
         {
-            PWCHAR symlink_name_buffer;
             NTSTATUS status;
             PKEVENT wait_objects[] = {
                 &device_extension->request_event,
                 &device_extension->terminate_thread
             };
 
+            // Image of a sparse VM disk is loaded, and cold chunks are
+            // compressed, while no requests are queued
+            if (ImDiskVmBackground(device_object))
+                continue;
+
+            KeClearEvent(&device_extension->request_event);
+
+            // Requests queued after last pop are served before waiting
+            if (!ImDiskQueuePrepareWait(&device_extension->irp_queue))
+                continue;
+
             KdPrint2(("ImDisk: No pending requests. Waiting.\n"));
 
             status = KeWaitForMultipleObjects(sizeof(wait_objects) /
@@ -1121,167 +2243,24 @@ ImDiskDeviceThread(IN PVOID Context)
             if (KeReadStateEvent(&device_extension->request_event))
                 continue;
 
-            KdPrint(("ImDisk: Device %i thread is shutting down.\n",
-                device_extension->device_number));
-
-            // Fire refresh event
-            if (RefreshEvent != NULL)
-                KePulseEvent(RefreshEvent, 0, FALSE);
-
-            if (device_extension->drive_letter != 0)
-                if (system_drive_letter)
-                    ImDiskRemoveDriveLetter(device_extension->drive_letter);
-
-            ImDiskCloseProxy(&device_extension->proxy);
-
-            if (device_extension->last_io_data != NULL)
-            {
-                ExFreePoolWithTag(device_extension->last_io_data, POOL_TAG);
-                device_extension->last_io_data = NULL;
-            }
-
-            if (device_extension->vm_disk)
-            {
-                SIZE_T free_size = 0;
-                if (device_extension->image_buffer != NULL)
-                    ZwFreeVirtualMemory(NtCurrentProcess(),
-                        (PVOID*)&device_extension->image_buffer,
-                        &free_size, MEM_RELEASE);
-
-                device_extension->image_buffer = NULL;
-            }
-            else
-            {
-                if (device_extension->file_handle != NULL)
-                    ZwClose(device_extension->file_handle);
-
-                device_extension->file_handle = NULL;
-
-                if (device_extension->file_object != NULL)
-                    ObDereferenceObject(device_extension->file_object);
-
-                device_extension->file_object = NULL;
-            }
-
-            if (device_extension->file_name.Buffer != NULL)
-            {
-                ExFreePoolWithTag(device_extension->file_name.Buffer, POOL_TAG);
-                device_extension->file_name.Buffer = NULL;
-                device_extension->file_name.Length = 0;
-                device_extension->file_name.MaximumLength = 0;
-            }
-
-            // If ReferenceCount is not zero, this device may have outstanding
-            // IRP-s or otherwise unfinished things to do. Let IRP-s be done by
-            // continuing this dispatch loop until ReferenceCount is zero.
-#pragma warning(suppress: 28175)
-            if (device_object->ReferenceCount != 0)
-            {
-#if DBG
-#pragma warning(suppress: 28175)
-                LONG ref_count = device_object->ReferenceCount;
-                DbgPrint("ImDisk: Device %i has %i references. Waiting.\n",
-                    device_extension->device_number,
-                    ref_count);
-#endif
-
-                KeDelayExecutionThread(KernelMode, FALSE, &time_out);
-
-                time_out.LowPart <<= 4;
-                continue;
-            }
-
-            KdPrint(("ImDisk: Deleting symlink for device %i.\n",
-                device_extension->device_number));
-
-            symlink_name_buffer = (PWCHAR)
-                ExAllocatePoolWithTag(PagedPool,
-                    MAXIMUM_FILENAME_LENGTH * sizeof(WCHAR), POOL_TAG);
-
-            if (symlink_name_buffer == NULL)
-            {
-                status = STATUS_INSUFFICIENT_RESOURCES;
-            }
-            else
+            if (ImDiskDeviceThreadShutdown(device_object))
             {
-                UNICODE_STRING symlink_name;
-
-                _snwprintf(symlink_name_buffer, MAXIMUM_FILENAME_LENGTH - 1,
-                    IMDISK_SYMLNK_NATIVE_BASE_NAME L"%u", device_extension->device_number);
-                symlink_name_buffer[MAXIMUM_FILENAME_LENGTH - 1] = 0;
-
-                RtlInitUnicodeString(&symlink_name, symlink_name_buffer);
-
-                KdPrint(("ImDisk: Deleting symlink '%ws'.\n", symlink_name_buffer));
+                PsTerminateSystemThread(STATUS_SUCCESS);
 
-                status = IoDeleteSymbolicLink(&symlink_name);
-
-                ExFreePoolWithTag(symlink_name_buffer, POOL_TAG);
-            }
-
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint(("ImDisk: Cannot delete symlink. (%#x)\n", status));
+                return;
             }
 
-            KdPrint(("ImDisk: Deleting device object %i.\n",
-                device_extension->device_number));
-
-            IoDeleteDevice(device_object);
-
-            // Fire refresh event
-            if (RefreshEvent != NULL)
-                KePulseEvent(RefreshEvent, 0, FALSE);
-
-            PsTerminateSystemThread(STATUS_SUCCESS);
-
-            return;
-        }
-
-        PIRP Irp = CONTAINING_RECORD(request, IRP, Tail.Overlay.ListEntry);
-
-        switch (IoGetCurrentIrpStackLocation(Irp)->MajorFunction)
-        {
-        case IRP_MJ_FLUSH_BUFFERS:
-            ImDiskDeviceThreadFlushBuffers(Irp, device_extension);
-            break;
-
-        case IRP_MJ_READ:
-            ImDiskDeviceThreadRead(Irp, device_extension, device_object);
-            break;
-
-        case IRP_MJ_WRITE:
-            ImDiskDeviceThreadWrite(Irp, device_extension, device_object);
-            break;
-
-        case IRP_MJ_DEVICE_CONTROL:
-            ImDiskDeviceThreadDeviceControl(Irp, device_extension, device_object);
-            break;
+            // Let IRP-s be done by continuing this dispatch loop until
+            // ReferenceCount is zero.
+            KeDelayExecutionThread(KernelMode, FALSE, &time_out);
 
-        default:
-            Irp->IoStatus.Status = STATUS_DRIVER_INTERNAL_ERROR;
+            time_out.LowPart <<= 4;
+            continue;
         }
 
-        // If indicating that proxy connection died we can do
-        // nothing else but remove this device.
-        switch (Irp->IoStatus.Status)
-        {
-        case STATUS_CONNECTION_RESET:
-        case STATUS_DEVICE_REMOVED:
-        case STATUS_DEVICE_DOES_NOT_EXIST:
-        case STATUS_PIPE_BROKEN:
-        case STATUS_PIPE_DISCONNECTED:
-        case STATUS_PORT_DISCONNECTED:
-        case STATUS_REMOTE_DISCONNECT:
-            ImDiskRemoveVirtualDisk(device_object);
-            Irp->IoStatus.Status = STATUS_DEVICE_DOES_NOT_EXIST;
-            Irp->IoStatus.Information = 0;
-
-        }
-
-        IoCompleteRequest(Irp,
-            NT_SUCCESS(Irp->IoStatus.Status) ?
-            IO_DISK_INCREMENT : IO_NO_INCREMENT);
+        ImDiskDeviceThreadRequest(
+            CONTAINING_RECORD(request, IRP, Tail.Overlay.ListEntry),
+            device_extension,
+            device_object);
     }
 }
-
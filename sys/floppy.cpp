@@ -85,9 +85,23 @@ ImDiskFloppyFormat(IN PDEVICE_EXTENSION Extension,
     {
         LARGE_INTEGER wait_time = { 0 };
 
-        RtlFillMemory(((PUCHAR)Extension->image_buffer) + start_offset.LowPart,
-            (SIZE_T)end_offset.LowPart - start_offset.LowPart + track_length,
-            MEDIA_FORMAT_FILL_DATA);
+        if (Extension->vm_chunks != NULL)
+        {
+            status = ImDiskVmFill(Extension,
+                MEDIA_FORMAT_FILL_DATA,
+                start_offset.LowPart,
+                (SIZE_T)end_offset.LowPart - start_offset.LowPart + track_length);
+
+            if (!NT_SUCCESS(status))
+            {
+                Irp->IoStatus.Information = 0;
+                return status;
+            }
+        }
+        else
+            RtlFillMemory(((PUCHAR)Extension->image_buffer) + start_offset.LowPart,
+                (SIZE_T)end_offset.LowPart - start_offset.LowPart + track_length,
+                MEDIA_FORMAT_FILL_DATA);
 
         wait_time.QuadPart = -1;
         KeDelayExecutionThread(KernelMode, FALSE, &wait_time);
@@ -61,6 +61,45 @@ PDEVICE_OBJECT ImDiskCtlDevice;
 //
 ULONG MaxDevices;
 
+//
+// Max number of tagged requests in flight for each proxy device.
+//
+ULONG ProxyQueueDepth;
+
+//
+// Number of worker threads for each queued file device.
+//
+ULONG FileWorkerThreads;
+
+//
+// Nonzero if devices are served by the shared thread pool instead of a
+// thread each.
+//
+ULONG SharedThreadPool;
+
+//
+// Most bytes in merged image I/O of queued requests, zero if not merged.
+//
+ULONG MergeMaxLength;
+
+//
+// Nonzero if queued requests are served in offset order.
+//
+ULONG SortRequests;
+
+//
+// Seconds without access before chunks of sparse vm disks are compressed,
+// zero if not compressed.
+//
+ULONG CompressAfterSeconds;
+
+//
+// Most memory for block cache of each file or proxy device, and of all
+// devices together.
+//
+ULONG CacheSize;
+ULONG CacheTotalSize;
+
 //
 // An array of boolean values for each drive letter where TRUE means a
 // drive letter disallowed for use by ImDisk devices.
@@ -249,6 +288,226 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject,
             return STATUS_INVALID_PARAMETER;
         }
 
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_PROXY_QUEUE_DEPTH_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_PROXY_QUEUE_DEPTH_VALUE));
+
+            ProxyQueueDepth = IMDISK_DEFAULT_PROXY_QUEUE_DEPTH;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            ProxyQueueDepth = *(PULONG)value_info->Data;
+            if (ProxyQueueDepth > IMDISK_MAX_PROXY_QUEUE_DEPTH)
+                ProxyQueueDepth = IMDISK_MAX_PROXY_QUEUE_DEPTH;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_FILE_WORKER_THREADS_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_FILE_WORKER_THREADS_VALUE));
+
+            FileWorkerThreads = IMDISK_DEFAULT_FILE_WORKER_THREADS;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            FileWorkerThreads = *(PULONG)value_info->Data;
+            if (FileWorkerThreads > IMDISK_MAX_FILE_WORKER_THREADS)
+                FileWorkerThreads = IMDISK_MAX_FILE_WORKER_THREADS;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_SHARED_THREAD_POOL_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_SHARED_THREAD_POOL_VALUE));
+
+            SharedThreadPool = IMDISK_DEFAULT_SHARED_THREAD_POOL;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            SharedThreadPool = *(PULONG)value_info->Data;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_MERGE_MAX_LENGTH_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_MERGE_MAX_LENGTH_VALUE));
+
+            MergeMaxLength = IMDISK_DEFAULT_MERGE_MAX_LENGTH;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            MergeMaxLength = *(PULONG)value_info->Data;
+            if (MergeMaxLength > IMDISK_MAX_MERGE_MAX_LENGTH)
+                MergeMaxLength = IMDISK_MAX_MERGE_MAX_LENGTH;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_SORT_REQUESTS_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_SORT_REQUESTS_VALUE));
+
+            SortRequests = IMDISK_DEFAULT_SORT_REQUESTS;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            SortRequests = *(PULONG)value_info->Data;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_COMPRESS_AFTER_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_COMPRESS_AFTER_VALUE));
+
+            CompressAfterSeconds = IMDISK_DEFAULT_COMPRESS_AFTER;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            CompressAfterSeconds = *(PULONG)value_info->Data;
+            if (CompressAfterSeconds > IMDISK_MAX_COMPRESS_AFTER)
+                CompressAfterSeconds = IMDISK_MAX_COMPRESS_AFTER;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_CACHE_SIZE_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_CACHE_SIZE_VALUE));
+
+            CacheSize = IMDISK_DEFAULT_CACHE_SIZE;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            CacheSize = *(PULONG)value_info->Data;
+            if (CacheSize > IMDISK_MAX_CACHE_SIZE)
+                CacheSize = IMDISK_MAX_CACHE_SIZE;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RtlInitUnicodeString(&value_name,
+            IMDISK_CFG_CACHE_TOTAL_SIZE_VALUE);
+
+        status = ZwQueryValueKey(key_handle, &value_name,
+            KeyValuePartialInformation, value_info,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) +
+            sizeof(ULONG), &required_size);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Using default value for '%ws'.\n",
+                IMDISK_CFG_CACHE_TOTAL_SIZE_VALUE));
+
+            CacheTotalSize = IMDISK_DEFAULT_CACHE_TOTAL_SIZE;
+        }
+        else if (value_info->Type == REG_DWORD)
+        {
+            CacheTotalSize = *(PULONG)value_info->Data;
+            if (CacheTotalSize > IMDISK_MAX_CACHE_TOTAL_SIZE)
+                CacheTotalSize = IMDISK_MAX_CACHE_TOTAL_SIZE;
+        }
+        else
+        {
+            ExFreePoolWithTag(value_info, POOL_TAG);
+            ZwClose(key_handle);
+            return STATUS_INVALID_PARAMETER;
+        }
+
         ExFreePoolWithTag(value_info, POOL_TAG);
     }
     else
@@ -259,6 +518,14 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject,
 
         n_devices = IMDISK_DEFAULT_LOAD_DEVICES;
         MaxDevices = IMDISK_DEFAULT_MAX_DEVICES;
+        ProxyQueueDepth = IMDISK_DEFAULT_PROXY_QUEUE_DEPTH;
+        FileWorkerThreads = IMDISK_DEFAULT_FILE_WORKER_THREADS;
+        SharedThreadPool = IMDISK_DEFAULT_SHARED_THREAD_POOL;
+        MergeMaxLength = IMDISK_DEFAULT_MERGE_MAX_LENGTH;
+        SortRequests = IMDISK_DEFAULT_SORT_REQUESTS;
+        CompressAfterSeconds = IMDISK_DEFAULT_COMPRESS_AFTER;
+        CacheSize = IMDISK_DEFAULT_CACHE_SIZE;
+        CacheTotalSize = IMDISK_DEFAULT_CACHE_TOTAL_SIZE;
     }
 
     // Create the control device.
@@ -305,6 +572,20 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject,
     RtlInitUnicodeString(&sym_link, IMDISK_CTL_SYMLINK_NAME);
     IoCreateUnprotectedSymbolicLink(&sym_link, &ctl_device_name);
 
+    // Started once the control device exists, since DriverEntry does not
+    // fail after that and ImDiskUnload stops the pool. Devices get threads
+    // of their own if the pool cannot be started.
+    if (SharedThreadPool != 0)
+    {
+        NTSTATUS pool_status = ImDiskStartThreadPool();
+
+        if (!NT_SUCCESS(pool_status))
+        {
+            KdPrint(("ImDisk: Cannot start shared thread pool (%#x).\n",
+                pool_status));
+        }
+    }
+
     // If the registry settings told us to create devices here in the start
     // procedure, do that now.
     for (n = 0; n < n_devices; n++)
@@ -1163,6 +1444,14 @@ ImDiskUnload(IN PDRIVER_OBJECT DriverObject)
             IoDeleteSymbolicLink(&sym_link);
             IoDeleteDevice(device_object);
         }
+        else if (device_extension->pool_device)
+        {
+            // Deleted by a pool thread, ImDiskStopThreadPool waits for that
+            KdPrint(("ImDisk: Shutting down pool device %i.\n",
+                device_extension->device_number));
+
+            ImDiskRemoveVirtualDisk(device_object);
+        }
         else
         {
             PKTHREAD device_thread;
@@ -1191,6 +1480,8 @@ ImDiskUnload(IN PDRIVER_OBJECT DriverObject)
         device_object = next_device;
     }
 
+    ImDiskStopThreadPool();
+
     KdPrint
         (("ImDisk: No more devices to delete. Leaving ImDiskUnload.\n"));
 }
@@ -1328,5 +1619,8 @@ ImDiskRemoveVirtualDisk(IN PDEVICE_OBJECT DeviceObject)
             ImDiskRemoveDriveLetter(device_extension->drive_letter);
 
     KeSetEvent(&device_extension->terminate_thread, (KPRIORITY)0, FALSE);
+
+    if (device_extension->pool_device)
+        ImDiskPoolSignalDevice(device_extension);
 }
 
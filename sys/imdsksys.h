@@ -80,6 +80,11 @@ Copyright (C) The Regents of the University of California.
 #include "..\inc\ntkmapi.h"
 #include "..\inc\imdisk.h"
 #include "..\inc\imdproxy.h"
+#include "..\inc\imdbuf.h"
+#include "..\inc\imdcache.h"
+#include "..\inc\imdqueue.h"
+#include "..\inc\imdmerge.h"
+#include "..\inc\imdtier.h"
 #include "..\inc\wkmem.hpp"
 
 #pragma warning(disable: 28719)
@@ -87,6 +92,83 @@ Copyright (C) The Regents of the University of California.
 #define IMDISK_DEFAULT_LOAD_DEVICES      0
 #define IMDISK_DEFAULT_MAX_DEVICES       64000
 
+// Tagged requests in flight for each proxy device, if proxy service accepts
+// tagged requests. Zero in registry turns off tagged requests.
+#define IMDISK_DEFAULT_PROXY_QUEUE_DEPTH 16
+#define IMDISK_MAX_PROXY_QUEUE_DEPTH     256
+
+// Larger proxy requests are sent untagged, which allows the service to
+// complete them in parts.
+#define IMDISK_PROXY_QUEUE_MAX_LENGTH    (1 << 20)
+
+// Worker threads for each queued file device, that run reads and writes
+// that do not overlap concurrently. One or zero in registry turns off
+// worker threads.
+#define IMDISK_DEFAULT_FILE_WORKER_THREADS 4
+#define IMDISK_MAX_FILE_WORKER_THREADS     64
+
+// Devices are served by a driver-wide pool of one thread per processor
+// instead of a thread each, if nonzero in registry. A pool thread serves at
+// most IMDISK_POOL_BATCH_REQUESTS requests of a device before it serves
+// other devices with queued requests.
+#define IMDISK_DEFAULT_SHARED_THREAD_POOL  0
+#define IMDISK_POOL_BATCH_REQUESTS         16
+
+// Adjacent reads or writes queued together for file and proxy devices are
+// merged into one image I/O of at most this many bytes, if nonzero in
+// registry. If SortRequests is nonzero in registry, queued requests are
+// also served in offset order, for rotating or remote backends. At most
+// IMDISK_MERGE_MAX_REQUESTS are planned together.
+#define IMDISK_DEFAULT_MERGE_MAX_LENGTH    0
+#define IMDISK_MAX_MERGE_MAX_LENGTH        (4 << 20)
+#define IMDISK_DEFAULT_SORT_REQUESTS       0
+#define IMDISK_MERGE_MAX_REQUESTS          16
+
+// Sparse vm disks commit memory in chunks of this size when first written
+// to. Chunks of a disk created from an image file are loaded from the file
+// when first accessed, or IMDISK_VM_LOAD_BATCH_CHUNKS at a time while no
+// requests are queued.
+#define IMDISK_VM_CHUNK_SHIFT              16
+#define IMDISK_VM_CHUNK_SIZE               ((ULONG_PTR)1 << IMDISK_VM_CHUNK_SHIFT)
+#define IMDISK_VM_LOAD_BATCH_CHUNKS        16
+
+// States of chunks in sparse vm disks
+#define IMDISK_VM_CHUNK_ZERO               0   // Not committed, reads as zeros
+#define IMDISK_VM_CHUNK_IMAGE              1   // Not yet loaded from image file
+#define IMDISK_VM_CHUNK_COMMITTED          2
+#define IMDISK_VM_CHUNK_COMPRESSED         3   // Not committed, held compressed
+
+// Chunks of sparse vm disks that have not been accessed for this many
+// seconds are compressed, if nonzero in registry. Compressed chunks are
+// decompressed for each read, and kept uncompressed again when written to.
+// Chunks are checked once a second, at most IMDISK_VM_SCAN_BATCH_CHUNKS
+// and compressing at most IMDISK_VM_COMPRESS_BATCH_CHUNKS at a time before
+// queued requests are served.
+#define IMDISK_DEFAULT_COMPRESS_AFTER      0
+#define IMDISK_MAX_COMPRESS_AFTER          86400
+#define IMDISK_VM_SCAN_BATCH_CHUNKS        4096
+#define IMDISK_VM_COMPRESS_BATCH_CHUNKS    16
+
+// Block cache for file and proxy devices. CacheSize in registry is the most
+// non-paged memory used for cached data by each device, and zero turns off
+// the cache. Caches of all devices together use at most CacheTotalSize, and
+// devices created when that is used up get a smaller cache or none.
+#define IMDISK_CACHE_BLOCK_SIZE          4096
+#define IMDISK_DEFAULT_CACHE_SIZE        (4 << 20)
+#define IMDISK_MAX_CACHE_SIZE            (256 << 20)
+#define IMDISK_DEFAULT_CACHE_TOTAL_SIZE  (64 << 20)
+#define IMDISK_MAX_CACHE_TOTAL_SIZE      (1 << 30)
+
+// Larger reads are not cached. They are read directly into request buffer,
+// and would mostly replace cached blocks with data read only once.
+#define IMDISK_CACHE_MAX_FILL            (64 << 10)
+
+// Reads that fill cache go through an intermediate buffer, because request
+// buffers can be mapped from pages that the caller may change.
+#define IMDISK_CACHE_FILL(DeviceExtension, Offset, Length) \
+    (((Length) <= IMDISK_CACHE_MAX_FILL) && \
+    ImDiskCacheFillable(&(DeviceExtension)->cache, (Offset), (Length)))
+
 ///
 /// Constants for synthetic geometry of the virtual disks
 ///
@@ -148,11 +230,28 @@ typedef struct _PROXY_CONNECTION
     };
 } PROXY_CONNECTION, *PPROXY_CONNECTION;
 
+// Request in flight to a proxy service that accepts tagged requests. The
+// entry number is used as tag.
+typedef struct _PROXY_QUEUE_ENTRY
+{
+    PIRP irp;
+    ULONGLONG request_code;     // IMDPROXY_REQ_READ or IMDPROXY_REQ_WRITE
+    ULONG length;
+    PUCHAR buffer;              // Data to write or buffer to read into
+    PUCHAR allocated_buffer;    // Freed when request completes, if not NULL
+    PUCHAR system_buffer;       // Request buffer, read data is copied here
+                                // from allocated_buffer
+    unsigned int cache_generation;
+    BOOLEAN in_use;
+    BOOLEAN sent;               // Device thread is done sending request
+    BOOLEAN responded;          // Receiver thread is done with response
+    IO_STATUS_BLOCK io_status;
+} PROXY_QUEUE_ENTRY, *PPROXY_QUEUE_ENTRY;
+
 typedef struct _DEVICE_EXTENSION
 {
-    LIST_ENTRY list_head;
-    KSPIN_LOCK list_lock;
-    KEVENT request_event;
+    IMDQUEUE irp_queue;          // Queued IRP-s, linked by ListEntry
+    KEVENT request_event;        // Set when device thread needs to wake
     KEVENT terminate_thread;
 
     ULONG device_number;
@@ -186,13 +285,75 @@ typedef struct _DEVICE_EXTENSION
 
     PKTHREAD device_thread;      // Pointer to the worker thread object
 
-    KSPIN_LOCK last_io_lock;     // Last I/O buffer for fast re-reads
-    PUCHAR last_io_data;
-    LONGLONG last_io_offset;
-    ULONG last_io_length;
+    KSPIN_LOCK cache_lock;       // Block cache for fast re-reads, not used
+    IMDCACHE cache;              // for vm and shared image devices
+
+    PUCHAR io_buffer;            // Buffer for image I/O in device thread
+    ULONG io_buffer_size;
+
+    ULONG proxy_queue_depth;     // Tagged proxy requests, 0 if not used
+    PPROXY_QUEUE_ENTRY proxy_queue;
+    ULONG proxy_in_flight;
+    ULONG proxy_unanswered;      // Queued requests whose response is not read
+    BOOLEAN proxy_queue_failed;  // Connection failed, or queue stopping
+    KSPIN_LOCK proxy_queue_lock;
+    KEVENT proxy_request_sent;   // Wakes receiver thread
+    KEVENT proxy_entry_freed;    // Wakes device thread waiting for an entry
+    PPROXY_QUEUE_ENTRY proxy_receiving; // Entry whose response is being read
+    PKTHREAD proxy_receiver;     // Thread reading tagged responses
+
+    ULONG file_worker_count;     // Worker threads, 0 if not used
+    struct _FILE_WORKER *file_workers;
+    KSPIN_LOCK file_worker_lock;
+    KEVENT file_worker_done;     // Wakes device thread waiting for a worker
+
+    PDEVICE_OBJECT device_object; // This device, for pool threads
+    BOOLEAN system_drive_letter; // Drive letter is removed with device
+    BOOLEAN pool_device;         // Served by shared thread pool
+    BOOLEAN pool_queued;         // In pool ready list
+    BOOLEAN pool_running;        // Being served by a pool thread
+    BOOLEAN pool_signalled;      // Requests queued while running
+    BOOLEAN pool_retry_set;      // Retry timer used since device removal
+    LIST_ENTRY pool_list_entry;
+    KTIMER pool_retry_timer;     // Retries removal of referenced device
+    KDPC pool_retry_dpc;
+
+    LONGLONG merge_position;     // End of last request, for sorting
+
+    PUCHAR vm_chunks;            // Chunk states of sparse vm disk, or NULL
+    ULONG_PTR vm_chunk_count;
+    ULONG_PTR vm_committed_chunks;
+    ULONG_PTR vm_image_chunks;   // Chunks not yet loaded from image file
+    ULONG_PTR vm_load_next;      // Next chunk to load in background
+
+    IMDTIER vm_tier;             // Compressed chunks, not used if blocks is 0
+    PUCHAR vm_tier_buffer;       // For reads of part of compressed chunks
+    KTIMER vm_tier_timer;
+    KDPC vm_tier_dpc;
+    volatile ULONG vm_tier_clock; // Seconds since tier was started
+    volatile BOOLEAN vm_tier_due; // Set each second to check chunks
+    ULONG_PTR vm_compress_next;  // Next chunk to check
 
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+// Worker thread of a queued file device. Image I/O of workers is sent to
+// the image FILE_OBJECT, because the I/O manager serializes all calls on
+// the synchronous image file handle.
+typedef struct _FILE_WORKER
+{
+    PDEVICE_EXTENSION device_extension;
+    PDEVICE_OBJECT device_object;
+    PKTHREAD thread;
+    KEVENT start_event;
+    PIRP irp;                    // Request being run, NULL if idle
+    LONGLONG offset;             // Range of request, for overlap checks
+    ULONG length;
+    BOOLEAN write;
+    BOOLEAN stop;
+    PUCHAR io_buffer;            // Like io_buffer in DEVICE_EXTENSION
+    ULONG io_buffer_size;
+} FILE_WORKER, *PFILE_WORKER;
+
 typedef struct _REFERENCED_OBJECT
 {
     LIST_ENTRY list_entry;
@@ -270,11 +431,79 @@ DRIVER_DISPATCH ImDiskDispatchFlushBuffers;
 
 KSTART_ROUTINE ImDiskDeviceThread;
 
+KSTART_ROUTINE ImDiskProxyReceiverThread;
+
+KSTART_ROUTINE ImDiskFileWorkerThread;
+
+KSTART_ROUTINE ImDiskPoolThread;
+
 IO_COMPLETION_ROUTINE ImDiskReadWriteLowerDeviceCompletion;
 
 VOID
 ImDiskQueueIrp(PDEVICE_EXTENSION DeviceExtension, PIRP Irp);
 
+VOID
+ImDiskDeviceThreadRequest(IN PIRP Irp,
+    IN PDEVICE_EXTENSION DeviceExtension,
+    IN PDEVICE_OBJECT DeviceObject);
+
+BOOLEAN
+ImDiskDeviceThreadShutdown(IN PDEVICE_OBJECT DeviceObject);
+
+NTSTATUS
+ImDiskStartThreadPool();
+
+VOID
+ImDiskStopThreadPool();
+
+BOOLEAN
+ImDiskPoolAddDevice(IN PDEVICE_OBJECT DeviceObject);
+
+VOID
+ImDiskPoolSignalDevice(IN PDEVICE_EXTENSION DeviceExtension);
+
+VOID
+ImDiskCacheCreate(IN PDEVICE_EXTENSION DeviceExtension);
+
+VOID
+ImDiskCacheDelete(IN PDEVICE_EXTENSION DeviceExtension);
+
+NTSTATUS
+ImDiskVmInitializeSparse(IN PDEVICE_EXTENSION DeviceExtension);
+
+VOID
+ImDiskVmFreeSparse(IN PDEVICE_EXTENSION DeviceExtension);
+
+NTSTATUS
+ImDiskVmRead(IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Buffer,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length);
+
+NTSTATUS
+ImDiskVmWrite(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PUCHAR Buffer,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length);
+
+NTSTATUS
+ImDiskVmFill(IN PDEVICE_EXTENSION DeviceExtension,
+    IN UCHAR Fill,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length);
+
+BOOLEAN
+ImDiskVmBackground(IN PDEVICE_OBJECT DeviceObject);
+
+VOID
+ImDiskVmTrim(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Offset,
+    IN LONGLONG Length);
+
+NTSTATUS
+ImDiskVmGrowSparse(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR NewSize);
+
 NTSTATUS
 ImDiskCreateDevice(__in PDRIVER_OBJECT DriverObject,
     __inout __deref PIMDISK_CREATE_DATA CreateData,
@@ -323,6 +552,26 @@ ImDiskWriteProxy(IN PPROXY_CONNECTION Proxy,
     IN ULONG Length,
     IN PLARGE_INTEGER ByteOffset);
 
+NTSTATUS
+ImDiskStartProxyQueue(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG QueueDepth);
+
+VOID
+ImDiskStopProxyQueue(IN PDEVICE_EXTENSION DeviceExtension);
+
+VOID
+ImDiskSendProxyQueue(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp,
+    IN ULONGLONG RequestCode,
+    IN PUCHAR Buffer,
+    IN PUCHAR AllocatedBuffer OPTIONAL,
+    IN PUCHAR SystemBuffer,
+    IN unsigned int CacheGeneration,
+    IN PLARGE_INTEGER ByteOffset);
+
+VOID
+ImDiskDrainProxyQueue(IN PDEVICE_EXTENSION DeviceExtension);
+
 NTSTATUS
 ImDiskUnmapOrZeroProxy(IN PPROXY_CONNECTION Proxy,
     IN ULONGLONG RequestCode,
@@ -344,6 +593,11 @@ ImDiskSafeReadFile(IN HANDLE FileHandle,
 NTSTATUS
 ImDiskReadWriteLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension);
 
+VOID
+ImDiskInvalidateCache(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Offset,
+    IN ULONGLONG Length);
+
 NTSTATUS
 ImDiskDeviceControlLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension);
 
@@ -361,45 +615,6 @@ ImDiskFloppyFormat(IN PDEVICE_EXTENSION Extension,
 
 #define ImDiskReleaseLock KeReleaseInStackQueuedSpinLock
 
-FORCEINLINE
-VOID
-ImDiskInterlockedInsertTailList(
-    PLIST_ENTRY ListHead,
-    PLIST_ENTRY ListEntry,
-    PKSPIN_LOCK SpinLock)
-{
-    KLOCK_QUEUE_HANDLE lock_handle;
-
-    KeAcquireInStackQueuedSpinLock(SpinLock, &lock_handle);
-
-    InsertTailList(ListHead, ListEntry);
-
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-}
-
-FORCEINLINE
-PLIST_ENTRY
-ImDiskInterlockedRemoveHeadList(
-    PLIST_ENTRY ListHead,
-    PKSPIN_LOCK SpinLock)
-{
-    KLOCK_QUEUE_HANDLE lock_handle;
-    PLIST_ENTRY item;
-
-    KeAcquireInStackQueuedSpinLock(SpinLock, &lock_handle);
-
-    item = RemoveHeadList(ListHead);
-
-    if (item == ListHead)
-    {
-        item = NULL;
-    }
-
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    return item;
-}
-
 #else
 
 #define ImDiskAcquireLock(SpinLock, LockHandle) \
@@ -413,54 +628,21 @@ ImDiskInterlockedRemoveHeadList(
         KeReleaseSpinLock((LockHandle)->LockQueue.Lock, (LockHandle)->OldIrql); \
     }
 
-#define ImDiskInterlockedInsertTailList (VOID)ExInterlockedInsertTailList
-
-#define ImDiskInterlockedRemoveHeadList ExInterlockedRemoveHeadList
-
 #endif
 
-#if _M_ARM64
-
-#define ImDiskIsBufferZero RtlIsZeroMemory
-
-#else
-
 FORCEINLINE
 BOOLEAN
 ImDiskIsBufferZero(PVOID Buffer, SIZE_T Length)
 {
-    if (((LONG_PTR)Buffer & (sizeof(ULONG) - 1)) == 0 &&
-        (Length & (sizeof(ULONG) - 1)) == 0)
-    {
-        SIZE_T length = RtlCompareMemoryUlong(Buffer, Length, 0);
-        return length == Length;
-    }
-
-    PUCHAR ptr;
-
-    for (ptr = (PUCHAR)Buffer;
-        (ptr <= (PUCHAR)Buffer + Length) && (*ptr == 0); ptr++);
-    
-    return ptr == (PUCHAR)Buffer + Length;
+    return ImDiskBufferIsZero(Buffer, Length) ? TRUE : FALSE;
 }
 
-#endif
-
 FORCEINLINE
 VOID
 ImDiskByteSwapBuffer(IN OUT PUCHAR Buffer,
     IN ULONG_PTR Length)
 {
-    PUCHAR ptr;
-
-    for (ptr = Buffer;
-    (ULONG_PTR)(ptr - Buffer) < Length;
-        ptr += 2)
-    {
-        UCHAR b1 = ptr[1];
-        ptr[1] = ptr[0];
-        ptr[0] = b1;
-    }
+    ImDiskBufferSwap16(Buffer, Length);
 }
 
 //
@@ -481,6 +663,25 @@ extern PDEVICE_OBJECT ImDiskCtlDevice;
 //
 extern ULONG MaxDevices;
 
+//
+// Max number of tagged requests in flight for each proxy device.
+//
+extern ULONG ProxyQueueDepth;
+
+extern ULONG FileWorkerThreads;
+
+extern ULONG SharedThreadPool;
+
+extern ULONG MergeMaxLength;
+
+extern ULONG SortRequests;
+
+extern ULONG CompressAfterSeconds;
+
+extern ULONG CacheSize;
+
+extern ULONG CacheTotalSize;
+
 //
 // Device list lock
 //
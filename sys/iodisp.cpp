@@ -216,34 +216,40 @@ ImDiskDispatchReadWrite(IN PDEVICE_OBJECT DeviceObject,
 
     status = STATUS_PENDING;
 
+    // Reads larger than what is ever filled into cache cannot be served
+    // from it, so skip copying under the spinlock for them.
     if ((io_stack->MajorFunction == IRP_MJ_READ) &&
-        (device_extension->last_io_data != NULL) &&
-        !device_extension->shared_image)
+        (device_extension->cache.data != NULL) &&
+        (io_stack->Parameters.Read.Length <= IMDISK_CACHE_MAX_FILL))
     {
         KLOCK_QUEUE_HANDLE lock_handle = { 0 };
+        BOOLEAN cache_hit;
 
-        ImDiskAcquireLock(&device_extension->last_io_lock, &lock_handle);
+        PUCHAR system_buffer =
+            (PUCHAR)MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                NormalPagePriority);
 
-        if ((io_stack->Parameters.Read.ByteOffset.QuadPart >=
-            device_extension->last_io_offset) &&
-            ((io_stack->Parameters.Read.ByteOffset.QuadPart +
-                io_stack->Parameters.Read.Length) <=
-                (device_extension->last_io_offset +
-                    device_extension->last_io_length)))
+        if (system_buffer == NULL)
         {
-            PUCHAR system_buffer =
-                (PUCHAR)MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
-                    NormalPagePriority);
-            if (system_buffer == NULL)
-            {
-                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                Irp->IoStatus.Information = 0;
-                status = STATUS_INSUFFICIENT_RESOURCES;
-            }
-            else
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            Irp->IoStatus.Information = 0;
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        else
+        {
+            ImDiskAcquireLock(&device_extension->cache_lock, &lock_handle);
+
+            cache_hit = (BOOLEAN)ImDiskCacheLookup(&device_extension->cache,
+                io_stack->Parameters.Read.ByteOffset.QuadPart,
+                system_buffer,
+                io_stack->Parameters.Read.Length);
+
+            ImDiskReleaseLock(&lock_handle);
+
+            if (cache_hit)
             {
-                KdPrint(("ImDisk: Device %i read Offset=0x%.8x%.8x Len=%#x, "
-                    "intermediate cache hit.\n",
+                KdPrint2(("ImDisk: Device %i read Offset=0x%.8x%.8x Len=%#x, "
+                    "cache hit.\n",
                     device_extension->device_number,
                     io_stack->Parameters.Read.ByteOffset.HighPart,
                     io_stack->Parameters.Read.ByteOffset.LowPart,
@@ -252,12 +258,6 @@ ImDiskDispatchReadWrite(IN PDEVICE_OBJECT DeviceObject,
                 Irp->IoStatus.Status = STATUS_SUCCESS;
                 Irp->IoStatus.Information = io_stack->Parameters.Read.Length;
 
-                RtlCopyMemory(system_buffer,
-                    device_extension->last_io_data +
-                    io_stack->Parameters.Read.ByteOffset.QuadPart -
-                    device_extension->last_io_offset,
-                    Irp->IoStatus.Information);
-
                 if (device_extension->byte_swap)
                     ImDiskByteSwapBuffer(system_buffer,
                         Irp->IoStatus.Information);
@@ -270,8 +270,6 @@ ImDiskDispatchReadWrite(IN PDEVICE_OBJECT DeviceObject,
                 status = STATUS_SUCCESS;
             }
         }
-
-        ImDiskReleaseLock(&lock_handle);
     }
 
     // In-thread I/O using a FILE_OBJECT
@@ -1461,13 +1459,13 @@ ImDiskDispatchDeviceControl(IN PDEVICE_OBJECT DeviceObject,
         }
 
         if ((device_extension->use_proxy && !device_extension->proxy_unmap) ||
-            device_extension->vm_disk ||
             device_extension->awealloc_disk)
         {
             break;
         }
 
-        if (device_extension->use_proxy)
+        // Memory of vm disks is released by the thread serving requests
+        if (device_extension->use_proxy || device_extension->vm_disk)
         {
             status = STATUS_PENDING;
             break;
@@ -1483,6 +1481,9 @@ ImDiskDispatchDeviceControl(IN PDEVICE_OBJECT DeviceObject,
             KdPrint(("ImDisk: Trim request 0x%I64X bytes at 0x%I64X\n",
                 range[i].LengthInBytes, range[i].StartingOffset));
 
+            ImDiskInvalidateCache(device_extension,
+                range[i].StartingOffset, range[i].LengthInBytes);
+
             zerodata.FileOffset.QuadPart = range[i].StartingOffset +
                 device_extension->image_offset.QuadPart;
 
@@ -1870,11 +1871,16 @@ ImDiskQueueIrp(PDEVICE_EXTENSION DeviceExtension, PIRP Irp)
 {
     IoMarkIrpPending(Irp);
 
-    ImDiskInterlockedInsertTailList(&DeviceExtension->list_head,
-        &Irp->Tail.Overlay.ListEntry,
-        &DeviceExtension->list_lock);
+    // Device thread, or pool thread serving device, is only woken if it
+    // waits for requests
+    if (!ImDiskQueuePush(&DeviceExtension->irp_queue,
+        (PIMDQUEUE_ENTRY)&Irp->Tail.Overlay.ListEntry))
+        return;
 
-    KeSetEvent(&DeviceExtension->request_event, (KPRIORITY)0, FALSE);
+    if (DeviceExtension->pool_device)
+        ImDiskPoolSignalDevice(DeviceExtension);
+    else
+        KeSetEvent(&DeviceExtension->request_event, (KPRIORITY)0, FALSE);
 }
 
 NTSTATUS
@@ -51,6 +51,7 @@ typedef struct _LOWER_DEVICE_WORK_ITEM
     PUCHAR AllocatedBuffer;
     PUCHAR SystemBuffer;
     BOOLEAN CopyBack;
+    unsigned int CacheGeneration;
 } LOWER_DEVICE_WORK_ITEM, *PLOWER_DEVICE_WORK_ITEM;
 
 VOID
@@ -89,6 +90,13 @@ ImDiskReadWriteLowerDeviceCompletion(PDEVICE_OBJECT DeviceObject,
 
     item->OriginalIrp->IoStatus = Irp->IoStatus;
 
+    if (Irp->Flags & IRP_WRITE_OPERATION)
+    {
+        ImDiskInvalidateCache(item->DeviceExtension, item->OriginalOffset,
+            IoGetCurrentIrpStackLocation(item->OriginalIrp)->
+            Parameters.Write.Length);
+    }
+
     if (!NT_SUCCESS(Irp->IoStatus.Status))
     {
         KdPrint(("ImDiskReadWriteLowerDeviceCompletion: Parallel I/O failed with status %#x\n",
@@ -126,31 +134,22 @@ ImDiskReadWriteLowerDeviceCompletion(PDEVICE_OBJECT DeviceObject,
 
         if (item->AllocatedBuffer != NULL)
         {
-            if (item->DeviceExtension->shared_image)
-            {
-                ExFreePoolWithTag(item->AllocatedBuffer, POOL_TAG);
-            }
-            else
+            if (item->CopyBack &&
+                (item->DeviceExtension->cache.data != NULL))
             {
                 KLOCK_QUEUE_HANDLE lock_handle;
 
-                ImDiskAcquireLock(&item->DeviceExtension->last_io_lock,
+                ImDiskAcquireLock(&item->DeviceExtension->cache_lock,
                     &lock_handle);
 
-                if (item->DeviceExtension->last_io_data != NULL)
-                {
-                    ExFreePoolWithTag(item->DeviceExtension->last_io_data,
-                        POOL_TAG);
-                }
-
-                item->DeviceExtension->last_io_data = item->AllocatedBuffer;
-
-                item->DeviceExtension->last_io_offset = item->OriginalOffset;
-                item->DeviceExtension->last_io_length =
-                    (ULONG)Irp->IoStatus.Information;
+                ImDiskCacheInsert(&item->DeviceExtension->cache,
+                    item->CacheGeneration, item->OriginalOffset,
+                    item->AllocatedBuffer, Irp->IoStatus.Information);
 
                 ImDiskReleaseLock(&lock_handle);
             }
+
+            ExFreePoolWithTag(item->AllocatedBuffer, POOL_TAG);
         }
     }
 
@@ -172,6 +171,28 @@ ImDiskReadWriteLowerDeviceCompletion(PDEVICE_OBJECT DeviceObject,
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+// Completion routine for writes forwarded to a direct I/O image device.
+NTSTATUS
+ImDiskWriteLowerDeviceCompletion(PDEVICE_OBJECT DeviceObject,
+    PIRP Irp, PVOID Context)
+{
+    PDEVICE_EXTENSION device_extension = (PDEVICE_EXTENSION)Context;
+    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    if (Irp->PendingReturned)
+    {
+        IoMarkIrpPending(Irp);
+    }
+
+    ImDiskInvalidateCache(device_extension,
+        io_stack->Parameters.Write.ByteOffset.QuadPart,
+        io_stack->Parameters.Write.Length);
+
+    return STATUS_CONTINUE_COMPLETION;
+}
+
 NTSTATUS
 ImDiskDeviceControlLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension)
 {
@@ -232,12 +253,20 @@ ImDiskReadWriteLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension)
                 KePulseEvent(RefreshEvent, 0, FALSE);
         }
 
+        if ((io_stack->MajorFunction == IRP_MJ_WRITE) &&
+            (DeviceExtension->cache.data != NULL))
+        {
+            IoSetCompletionRoutine(Irp, ImDiskWriteLowerDeviceCompletion,
+                DeviceExtension, TRUE, TRUE, TRUE);
+        }
+
         return IoCallDriver(DeviceExtension->dev_object, Irp);
     }
 
     // This goes for image files with DO_BUFFERED_IO or DO_NEITHER_IO.
-    // We allocate NP pool as buffer for a request to send down. A completion
-    // routine takes care of copying read operation data back to original IRP.
+    // We send down the system address of the original buffer, together with
+    // its MDL. Reads that fill cache use an NP pool buffer instead, and a
+    // completion routine takes care of copying data back to original IRP.
 
     item = (PLOWER_DEVICE_WORK_ITEM)
         ExAllocatePoolWithTag(NonPagedPool,
@@ -290,9 +319,13 @@ ImDiskReadWriteLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension)
     lower_io_stack->MajorFunction = io_stack->MajorFunction;
     lower_io_stack->Parameters = io_stack->Parameters;
 
-    if ((io_stack->MajorFunction == IRP_MJ_READ) ||
-        (io_stack->MajorFunction == IRP_MJ_WRITE))
+    if ((io_stack->MajorFunction == IRP_MJ_READ) &&
+        IMDISK_CACHE_FILL(DeviceExtension,
+            io_stack->Parameters.Read.ByteOffset.QuadPart,
+            io_stack->Parameters.Read.Length))
     {
+        KLOCK_QUEUE_HANDLE lock_handle;
+
         lower_irp->AssociatedIrp.SystemBuffer =
             lower_irp->UserBuffer =
             item->AllocatedBuffer = (PUCHAR)
@@ -310,15 +343,24 @@ ImDiskReadWriteLowerDevice(PIRP Irp, PDEVICE_EXTENSION DeviceExtension)
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (io_stack->MajorFunction == IRP_MJ_WRITE)
-        {
-            RtlCopyMemory(item->AllocatedBuffer, item->SystemBuffer,
-                io_stack->Parameters.Write.Length);
-        }
-        else if (io_stack->MajorFunction == IRP_MJ_READ)
-        {
-            item->CopyBack = TRUE;
-        }
+        item->CopyBack = TRUE;
+
+        // Data read is only cached if no write completes while reading
+        ImDiskAcquireLock(&DeviceExtension->cache_lock, &lock_handle);
+
+        item->CacheGeneration =
+            ImDiskCacheGeneration(&DeviceExtension->cache);
+
+        ImDiskReleaseLock(&lock_handle);
+    }
+    else if ((io_stack->MajorFunction == IRP_MJ_READ) ||
+        (io_stack->MajorFunction == IRP_MJ_WRITE))
+    {
+        lower_irp->AssociatedIrp.SystemBuffer =
+            lower_irp->UserBuffer =
+            item->SystemBuffer;
+
+        lower_irp->MdlAddress = Irp->MdlAddress;
     }
 
     lower_irp->Tail.Overlay.Thread = Irp->Tail.Overlay.Thread;
@@ -959,3 +959,588 @@ ImDiskUnmapOrZeroProxy(IN PPROXY_CONNECTION Proxy,
     return IoStatusBlock->Status;
 }
 
+
+// Tagged proxy requests. The device thread sends read and write requests
+// without waiting for responses, and a receiver thread reads responses in
+// the order the service sends them. The device thread and the receiver
+// thread each mark an entry when done with it, and whichever is last
+// completes the request and frees the entry. The same states are used by
+// the user mode client in devio/devioq.c.
+
+// Completes the request of an entry that has been freed.
+VOID
+ImDiskCompleteProxyQueueEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PPROXY_QUEUE_ENTRY Entry)
+{
+    PIRP irp = Entry->irp;
+    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(irp);
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    KeSetEvent(&DeviceExtension->proxy_entry_freed, 0, FALSE);
+
+    irp->IoStatus = Entry->io_status;
+
+    if (Entry->request_code == IMDPROXY_REQ_READ)
+    {
+        if (NT_SUCCESS(irp->IoStatus.Status))
+        {
+            if (Entry->allocated_buffer != NULL)
+            {
+                ImDiskAcquireLock(&DeviceExtension->cache_lock,
+                    &lock_handle);
+
+                ImDiskCacheInsert(&DeviceExtension->cache,
+                    Entry->cache_generation,
+                    io_stack->Parameters.Read.ByteOffset.QuadPart,
+                    Entry->allocated_buffer, irp->IoStatus.Information);
+
+                ImDiskReleaseLock(&lock_handle);
+
+                RtlCopyMemory(Entry->system_buffer, Entry->allocated_buffer,
+                    irp->IoStatus.Information);
+            }
+
+            if (DeviceExtension->byte_swap)
+                ImDiskByteSwapBuffer(Entry->system_buffer,
+                    irp->IoStatus.Information);
+        }
+    }
+    else
+    {
+        ImDiskInvalidateCache(DeviceExtension,
+            io_stack->Parameters.Write.ByteOffset.QuadPart,
+            Entry->length);
+    }
+
+    if (Entry->allocated_buffer != NULL)
+        ExFreePoolWithTag(Entry->allocated_buffer, POOL_TAG);
+
+    if (NT_SUCCESS(irp->IoStatus.Status))
+    {
+        if (io_stack->FileObject != NULL)
+        {
+            io_stack->FileObject->CurrentByteOffset.QuadPart +=
+                irp->IoStatus.Information;
+        }
+    }
+    else
+    {
+        KdPrint(("ImDisk: Tagged request failed on device %i: %#x.\n",
+            DeviceExtension->device_number,
+            irp->IoStatus.Status));
+
+        // As with untagged requests, a failed proxy request means that the
+        // connection cannot be trusted anymore.
+        ImDiskRemoveVirtualDisk(io_stack->DeviceObject);
+
+        irp->IoStatus.Status = STATUS_DEVICE_DOES_NOT_EXIST;
+        irp->IoStatus.Information = 0;
+    }
+
+    IoCompleteRequest(irp,
+        NT_SUCCESS(irp->IoStatus.Status) ?
+        IO_DISK_INCREMENT : IO_NO_INCREMENT);
+}
+
+// Frees an entry that both threads are done with. Called with queue lock
+// held. The entry is copied to Done, to complete after lock is released.
+VOID
+ImDiskReleaseProxyQueueEntry(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PPROXY_QUEUE_ENTRY Entry,
+    OUT PPROXY_QUEUE_ENTRY Done)
+{
+    *Done = *Entry;
+
+    Entry->in_use = FALSE;
+    --DeviceExtension->proxy_in_flight;
+}
+
+// Completes requests that have been sent and are waiting for responses,
+// after connection has failed. Requests that are still being sent, or
+// whose response is being read, are completed by the thread doing that.
+VOID
+ImDiskAbortProxyQueue(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    for (;;)
+    {
+        PROXY_QUEUE_ENTRY done;
+        KLOCK_QUEUE_HANDLE lock_handle;
+        ULONG i;
+
+        ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+        for (i = 0; i < DeviceExtension->proxy_queue_depth; i++)
+        {
+            PPROXY_QUEUE_ENTRY entry = DeviceExtension->proxy_queue + i;
+
+            if (entry->in_use && entry->sent && !entry->responded &&
+                entry != DeviceExtension->proxy_receiving)
+                break;
+        }
+
+        if (i == DeviceExtension->proxy_queue_depth)
+        {
+            ImDiskReleaseLock(&lock_handle);
+            return;
+        }
+
+        DeviceExtension->proxy_queue[i].responded = TRUE;
+        --DeviceExtension->proxy_unanswered;
+        DeviceExtension->proxy_queue[i].io_status.Status =
+            STATUS_CONNECTION_RESET;
+        DeviceExtension->proxy_queue[i].io_status.Information = 0;
+
+        ImDiskReleaseProxyQueueEntry(DeviceExtension,
+            DeviceExtension->proxy_queue + i, &done);
+
+        ImDiskReleaseLock(&lock_handle);
+
+        ImDiskCompleteProxyQueueEntry(DeviceExtension, &done);
+    }
+}
+
+// Reads one response and completes its request if it has been sent.
+// Returns FALSE if the connection failed.
+BOOLEAN
+ImDiskReceiveProxyQueue(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    struct
+    {
+        IMDPROXY_TAGGED_RESP tagged_resp;
+        IMDPROXY_READ_RESP read_resp;
+    } resp = { 0 };
+    IO_STATUS_BLOCK io_status;
+    PPROXY_QUEUE_ENTRY entry;
+    PROXY_QUEUE_ENTRY done;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    NTSTATUS status;
+    BOOLEAN connection_ok = TRUE;
+    BOOLEAN sent;
+
+    status = ImDiskSafeIOStream(DeviceExtension->proxy.device,
+        IRP_MJ_READ,
+        &io_status,
+        &DeviceExtension->terminate_thread,
+        &resp,
+        sizeof(resp));
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk Proxy Client: Error reading tagged response: %#x.\n",
+            status));
+
+        return FALSE;
+    }
+
+    ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+    entry = resp.tagged_resp.io_tag < DeviceExtension->proxy_queue_depth ?
+        DeviceExtension->proxy_queue + resp.tagged_resp.io_tag : NULL;
+
+    if (entry == NULL || !entry->in_use || entry->responded)
+    {
+        ImDiskReleaseLock(&lock_handle);
+
+        KdPrint(("ImDisk Proxy Client: Response with unknown tag %u.\n",
+            (ULONG)resp.tagged_resp.io_tag));
+
+        return FALSE;
+    }
+
+    DeviceExtension->proxy_receiving = entry;
+
+    ImDiskReleaseLock(&lock_handle);
+
+    // Request fields are not changed while entry is in use. Tagged reads
+    // are never completed partially, so shorter data than requested is
+    // only returned at end of image.
+    if (resp.read_resp.errorno != 0)
+    {
+#pragma warning(suppress: 6064)
+#pragma warning(suppress: 6328)
+        KdPrint(("ImDisk Proxy Client: Server returned error 0x%.8x%.8x.\n",
+            resp.read_resp.errorno));
+
+        status = STATUS_IO_DEVICE_ERROR;
+    }
+    else if (entry->request_code == IMDPROXY_REQ_READ)
+    {
+        if (resp.read_resp.length > entry->length)
+        {
+            KdPrint(("ImDisk Proxy Client: Server sent %u bytes, "
+                "expected %u.\n",
+                (ULONG)resp.read_resp.length, entry->length));
+
+            status = STATUS_IO_DEVICE_ERROR;
+            connection_ok = FALSE;
+        }
+        else if (resp.read_resp.length > 0)
+        {
+            status = ImDiskSafeIOStream(DeviceExtension->proxy.device,
+                IRP_MJ_READ,
+                &io_status,
+                &DeviceExtension->terminate_thread,
+                entry->buffer,
+                (ULONG)resp.read_resp.length);
+
+            connection_ok = NT_SUCCESS(status);
+        }
+    }
+    else if (resp.read_resp.length != entry->length)
+    {
+        KdPrint(("ImDisk Proxy Client: IMDPROXY_REQ_WRITE %u bytes, "
+            "IMDPROXY_RESP_WRITE %u bytes.\n",
+            entry->length,
+            (ULONG)resp.read_resp.length));
+
+        status = STATUS_IO_DEVICE_ERROR;
+    }
+
+    ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+    DeviceExtension->proxy_receiving = NULL;
+
+    entry->responded = TRUE;
+    --DeviceExtension->proxy_unanswered;
+    entry->io_status.Status = NT_SUCCESS(status) ?
+        STATUS_SUCCESS : STATUS_IO_DEVICE_ERROR;
+    entry->io_status.Information = NT_SUCCESS(status) ?
+        (ULONG_PTR)resp.read_resp.length : 0;
+
+    sent = entry->sent;
+    if (sent)
+        ImDiskReleaseProxyQueueEntry(DeviceExtension, entry, &done);
+
+    ImDiskReleaseLock(&lock_handle);
+
+    if (sent)
+        ImDiskCompleteProxyQueueEntry(DeviceExtension, &done);
+
+    return connection_ok;
+}
+
+VOID
+ImDiskProxyReceiverThread(IN PVOID Context)
+{
+    PDEVICE_EXTENSION device_extension = (PDEVICE_EXTENSION)Context;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    for (;;)
+    {
+        KLOCK_QUEUE_HANDLE lock_handle;
+        BOOLEAN failed;
+        ULONG unanswered;
+
+        ImDiskAcquireLock(&device_extension->proxy_queue_lock, &lock_handle);
+
+        failed = device_extension->proxy_queue_failed;
+        unanswered = device_extension->proxy_unanswered;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        if (failed)
+            break;
+
+        // Entries still in use may already have their responses, and
+        // reading then would take the response to an untagged request
+        // sent after the queue has drained
+        if (unanswered == 0)
+        {
+            KeWaitForSingleObject(&device_extension->proxy_request_sent,
+                Executive,
+                KernelMode,
+                FALSE,
+                NULL);
+
+            continue;
+        }
+
+        if (!ImDiskReceiveProxyQueue(device_extension))
+        {
+            KdPrint(("ImDisk: Proxy connection lost on device %i.\n",
+                device_extension->device_number));
+
+            ImDiskAcquireLock(&device_extension->proxy_queue_lock,
+                &lock_handle);
+
+            device_extension->proxy_queue_failed = TRUE;
+
+            ImDiskReleaseLock(&lock_handle);
+
+            ImDiskAbortProxyQueue(device_extension);
+
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+ImDiskStartProxyQueue(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG QueueDepth)
+{
+    HANDLE thread_handle;
+    NTSTATUS status;
+
+    DeviceExtension->proxy_queue = (PPROXY_QUEUE_ENTRY)
+        ExAllocatePoolWithTag(NonPagedPool,
+            QueueDepth * sizeof(PROXY_QUEUE_ENTRY), POOL_TAG);
+
+    if (DeviceExtension->proxy_queue == NULL)
+    {
+        DeviceExtension->proxy_queue_depth = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(DeviceExtension->proxy_queue,
+        QueueDepth * sizeof(PROXY_QUEUE_ENTRY));
+
+    DeviceExtension->proxy_queue_depth = QueueDepth;
+    DeviceExtension->proxy_in_flight = 0;
+    DeviceExtension->proxy_unanswered = 0;
+    DeviceExtension->proxy_queue_failed = FALSE;
+    DeviceExtension->proxy_receiving = NULL;
+
+    status = PsCreateSystemThread(&thread_handle,
+        (ACCESS_MASK)0L,
+        NULL,
+        NULL,
+        NULL,
+        ImDiskProxyReceiverThread,
+        DeviceExtension);
+
+    if (NT_SUCCESS(status))
+    {
+        status = ObReferenceObjectByHandle(thread_handle,
+            SYNCHRONIZE,
+            *PsThreadType,
+            KernelMode,
+            (PVOID*)&DeviceExtension->proxy_receiver,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            // Receiver thread exits when it finds queue marked as failed
+            DeviceExtension->proxy_queue_failed = TRUE;
+            KeSetEvent(&DeviceExtension->proxy_request_sent, 0, FALSE);
+
+            ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+        }
+
+        ZwClose(thread_handle);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk: Cannot create proxy receiver thread. (%#x)\n",
+            status));
+
+        ExFreePoolWithTag(DeviceExtension->proxy_queue, POOL_TAG);
+        DeviceExtension->proxy_queue = NULL;
+        DeviceExtension->proxy_queue_depth = 0;
+        return status;
+    }
+
+    KdPrint(("ImDisk: Device %i sends up to %u tagged proxy requests.\n",
+        DeviceExtension->device_number, QueueDepth));
+
+    return STATUS_SUCCESS;
+}
+
+// Sends a read or write request and returns without waiting for the
+// response, first waiting for a free entry if queue is full. The request
+// is completed by this function or by receiver thread, and must not be
+// accessed by the caller after this call.
+VOID
+ImDiskSendProxyQueue(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PIRP Irp,
+    IN ULONGLONG RequestCode,
+    IN PUCHAR Buffer,
+    IN PUCHAR AllocatedBuffer OPTIONAL,
+    IN PUCHAR SystemBuffer,
+    IN unsigned int CacheGeneration,
+    IN PLARGE_INTEGER ByteOffset)
+{
+    struct
+    {
+        IMDPROXY_TAGGED_REQ tagged_req;
+        IMDPROXY_READ_REQ read_req;
+    } req = { 0 };
+    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+    PROXY_QUEUE_ENTRY request = { 0 };
+    PROXY_QUEUE_ENTRY done;
+    PPROXY_QUEUE_ENTRY entry = NULL;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+    ULONG io_tag;
+    BOOLEAN responded;
+    BOOLEAN failed;
+
+    request.irp = Irp;
+    request.request_code = RequestCode;
+    request.length = io_stack->Parameters.Read.Length;
+    request.buffer = Buffer;
+    request.allocated_buffer = AllocatedBuffer;
+    request.system_buffer = SystemBuffer;
+    request.cache_generation = CacheGeneration;
+    request.in_use = TRUE;
+
+    for (;;)
+    {
+        ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+        if (DeviceExtension->proxy_queue_failed ||
+            DeviceExtension->proxy_in_flight <
+            DeviceExtension->proxy_queue_depth)
+            break;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        KeWaitForSingleObject(&DeviceExtension->proxy_entry_freed,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+    }
+
+    if (DeviceExtension->proxy_queue_failed)
+    {
+        ImDiskReleaseLock(&lock_handle);
+
+        request.io_status.Status = STATUS_CONNECTION_RESET;
+        ImDiskCompleteProxyQueueEntry(DeviceExtension, &request);
+        return;
+    }
+
+    for (io_tag = 0; io_tag < DeviceExtension->proxy_queue_depth; io_tag++)
+        if (!DeviceExtension->proxy_queue[io_tag].in_use)
+        {
+            entry = DeviceExtension->proxy_queue + io_tag;
+            break;
+        }
+
+    *entry = request;
+    ++DeviceExtension->proxy_in_flight;
+    ++DeviceExtension->proxy_unanswered;
+
+    ImDiskReleaseLock(&lock_handle);
+
+    KeSetEvent(&DeviceExtension->proxy_request_sent, 0, FALSE);
+
+    req.tagged_req.request_code = IMDPROXY_REQ_TAGGED;
+    req.tagged_req.io_tag = io_tag;
+    req.read_req.request_code = RequestCode;
+    req.read_req.offset = ByteOffset->QuadPart;
+    req.read_req.length = request.length;
+
+    status = ImDiskSafeIOStream(DeviceExtension->proxy.device,
+        IRP_MJ_WRITE,
+        &io_status,
+        &DeviceExtension->terminate_thread,
+        &req,
+        sizeof(req));
+
+    if (NT_SUCCESS(status) && RequestCode == IMDPROXY_REQ_WRITE &&
+        request.length > 0)
+    {
+        status = ImDiskSafeIOStream(DeviceExtension->proxy.device,
+            IRP_MJ_WRITE,
+            &io_status,
+            &DeviceExtension->terminate_thread,
+            Buffer,
+            request.length);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk Proxy Client: Error sending tagged request: %#x.\n",
+            status));
+    }
+
+    ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+    entry->sent = TRUE;
+
+    if (!NT_SUCCESS(status))
+        DeviceExtension->proxy_queue_failed = TRUE;
+
+    failed = DeviceExtension->proxy_queue_failed;
+
+    responded = entry->responded;
+    if (responded)
+        ImDiskReleaseProxyQueueEntry(DeviceExtension, entry, &done);
+
+    ImDiskReleaseLock(&lock_handle);
+
+    if (responded)
+        ImDiskCompleteProxyQueueEntry(DeviceExtension, &done);
+
+    // Request will not get a response if receiver thread has stopped
+    if (failed)
+        ImDiskAbortProxyQueue(DeviceExtension);
+}
+
+// Waits until all tagged requests have completed, so that requests sent
+// after this call are ordered after them.
+VOID
+ImDiskDrainProxyQueue(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->proxy_queue == NULL)
+        return;
+
+    for (;;)
+    {
+        KLOCK_QUEUE_HANDLE lock_handle;
+        ULONG in_flight;
+
+        ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+        in_flight = DeviceExtension->proxy_in_flight;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        if (in_flight == 0)
+            return;
+
+        KeWaitForSingleObject(&DeviceExtension->proxy_entry_freed,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+    }
+}
+
+VOID
+ImDiskStopProxyQueue(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if (DeviceExtension->proxy_queue == NULL)
+        return;
+
+    ImDiskDrainProxyQueue(DeviceExtension);
+
+    ImDiskAcquireLock(&DeviceExtension->proxy_queue_lock, &lock_handle);
+
+    DeviceExtension->proxy_queue_failed = TRUE;
+
+    ImDiskReleaseLock(&lock_handle);
+
+    KeSetEvent(&DeviceExtension->proxy_request_sent, 0, FALSE);
+
+    KeWaitForSingleObject(DeviceExtension->proxy_receiver,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL);
+
+    ObDereferenceObject(DeviceExtension->proxy_receiver);
+    DeviceExtension->proxy_receiver = NULL;
+
+    ExFreePoolWithTag(DeviceExtension->proxy_queue, POOL_TAG);
+    DeviceExtension->proxy_queue = NULL;
+    DeviceExtension->proxy_queue_depth = 0;
+}
@@ -0,0 +1,408 @@
+/*
+ImDisk Virtual Disk Driver for Windows NT/2000/XP.
+This driver emulates harddisk partitions, floppy drives and CD/DVD-ROM
+drives from disk image files, in virtual memory or by redirecting I/O
+requests somewhere else, possibly to another machine, through a
+co-operating user-mode service, ImDskSvc.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "imdsksys.h"
+
+//
+// Shared thread pool. Devices that use it have no threads of their own.
+// A device with queued requests is put last in a ready list, and a pool
+// thread that takes it from there serves at most IMDISK_POOL_BATCH_REQUESTS
+// of its requests before putting it last again, so that a busy device does
+// not keep other devices waiting. Requests of a device are served by one
+// pool thread at a time, in queue order, as by a device thread. Proxy
+// devices keep their own threads, since their requests wait for the proxy
+// service and would keep pool threads from serving other devices.
+//
+LIST_ENTRY PoolReadyList;
+KSPIN_LOCK PoolLock;
+KSEMAPHORE PoolSemaphore;       // Count of devices in ready list
+HANDLE *PoolThreads = NULL;
+ULONG PoolThreadCount = 0;      // Zero if pool is not used
+BOOLEAN PoolStopping = FALSE;
+ULONG PoolDevices = 0;          // Pool devices not yet deleted
+KEVENT PoolDevicesGone;         // Signalled while PoolDevices is zero
+
+typedef ULONG
+(NTAPI *PKE_QUERY_ACTIVE_PROCESSOR_COUNT_EX)(IN USHORT GroupNumber);
+
+#ifndef ALL_PROCESSOR_GROUPS
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+#endif
+
+// Number of active processors in all processor groups.
+// KeQueryActiveProcessorCountEx only exists from Windows 7, so it is looked
+// up at run time, with processors in the active processor mask counted on
+// older versions, where there is only one group.
+static ULONG
+ImDiskActiveProcessorCount()
+{
+    UNICODE_STRING routine_name;
+    PKE_QUERY_ACTIVE_PROCESSOR_COUNT_EX query_count;
+    KAFFINITY active;
+    ULONG count = 0;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&routine_name, L"KeQueryActiveProcessorCountEx");
+
+    query_count = (PKE_QUERY_ACTIVE_PROCESSOR_COUNT_EX)
+        MmGetSystemRoutineAddress(&routine_name);
+
+    if (query_count != NULL)
+        return query_count(ALL_PROCESSOR_GROUPS);
+
+    for (active = KeQueryActiveProcessors(); active != 0; active &= active - 1)
+        count++;
+
+    return count;
+}
+
+NTSTATUS
+ImDiskStartThreadPool()
+{
+    OBJECT_ATTRIBUTES object_attributes;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG thread_count;
+    ULONG i;
+
+    PAGED_CODE();
+
+    // One thread for each processor in all processor groups
+    thread_count = ImDiskActiveProcessorCount();
+
+    InitializeListHead(&PoolReadyList);
+    KeInitializeSpinLock(&PoolLock);
+    KeInitializeSemaphore(&PoolSemaphore, 0, MAXLONG);
+    KeInitializeEvent(&PoolDevicesGone, NotificationEvent, TRUE);
+
+    PoolThreads = (HANDLE*)ExAllocatePoolWithTag(NonPagedPool,
+        thread_count * sizeof(HANDLE), POOL_TAG);
+
+    if (PoolThreads == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    // Handles are kept to wait for threads when driver unloads
+    InitializeObjectAttributes(&object_attributes, NULL, OBJ_KERNEL_HANDLE,
+        NULL, NULL);
+
+    for (i = 0; i < thread_count; i++)
+    {
+        status = PsCreateSystemThread(&PoolThreads[i],
+            SYNCHRONIZE,
+            &object_attributes,
+            NULL,
+            NULL,
+            ImDiskPoolThread,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("ImDisk: Cannot create pool thread. (%#x)\n", status));
+            break;
+        }
+    }
+
+    PoolThreadCount = i;
+
+    if (PoolThreadCount == 0)
+    {
+        ExFreePoolWithTag(PoolThreads, POOL_TAG);
+        PoolThreads = NULL;
+        return status;
+    }
+
+    KdPrint(("ImDisk: Started %u pool threads.\n", PoolThreadCount));
+
+    return STATUS_SUCCESS;
+}
+
+// Called when driver unloads, after all pool devices have been requested
+// to shut down. Waits for them to be deleted, then stops pool threads.
+VOID
+ImDiskStopThreadPool()
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (PoolThreadCount == 0)
+        return;
+
+    KdPrint(("ImDisk: Waiting for pool devices to be deleted.\n"));
+
+    KeWaitForSingleObject(&PoolDevicesGone,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL);
+
+    ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+    PoolStopping = TRUE;
+
+    ImDiskReleaseLock(&lock_handle);
+
+    KeReleaseSemaphore(&PoolSemaphore, (KPRIORITY)0, (LONG)PoolThreadCount,
+        FALSE);
+
+    for (i = 0; i < PoolThreadCount; i++)
+    {
+        ZwWaitForSingleObject(PoolThreads[i], FALSE, NULL);
+        ZwClose(PoolThreads[i]);
+    }
+
+    ExFreePoolWithTag(PoolThreads, POOL_TAG);
+    PoolThreads = NULL;
+    PoolThreadCount = 0;
+}
+
+// Puts a pool device that was still referenced when it was to be deleted
+// in ready list again
+static VOID
+ImDiskPoolRetryTimer(IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    ImDiskPoolSignalDevice((PDEVICE_EXTENSION)DeferredContext);
+}
+
+// Called by device thread after creating device. Returns TRUE if the
+// device is served by the pool from now on, in which case the device
+// thread exits. Requests queued earlier are served by the pool too.
+BOOLEAN
+ImDiskPoolAddDevice(IN PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION device_extension =
+        (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if ((PoolThreadCount == 0) || device_extension->use_proxy)
+        return FALSE;
+
+    device_extension->device_object = DeviceObject;
+
+    KeInitializeTimer(&device_extension->pool_retry_timer);
+
+    KeInitializeDpc(&device_extension->pool_retry_dpc, ImDiskPoolRetryTimer,
+        device_extension);
+
+    ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+    if (PoolDevices++ == 0)
+        KeClearEvent(&PoolDevicesGone);
+
+    device_extension->pool_device = TRUE;
+
+    ImDiskReleaseLock(&lock_handle);
+
+    ImDiskPoolSignalDevice(device_extension);
+
+    return TRUE;
+}
+
+// Called when requests are queued for a pool device, or when it is
+// requested to shut down.
+VOID
+ImDiskPoolSignalDevice(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+    if (DeviceExtension->pool_running)
+    {
+        // Put in ready list again by the pool thread serving it
+        DeviceExtension->pool_signalled = TRUE;
+    }
+    else if (!DeviceExtension->pool_queued)
+    {
+        InsertTailList(&PoolReadyList, &DeviceExtension->pool_list_entry);
+        DeviceExtension->pool_queued = TRUE;
+
+        KeReleaseSemaphore(&PoolSemaphore, (KPRIORITY)0, 1, FALSE);
+    }
+
+    ImDiskReleaseLock(&lock_handle);
+}
+
+// Serves a batch of queued requests for a device, or shuts the device down
+// if it has no queued requests and is being removed. Returns TRUE if device
+// object was deleted. Otherwise, Requeue is set if the device needs to be
+// served again even if no more requests are queued.
+BOOLEAN
+ImDiskPoolServeDevice(IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PBOOLEAN Requeue)
+{
+    PDEVICE_OBJECT device_object = DeviceExtension->device_object;
+    LARGE_INTEGER time_out;
+    ULONG i = 0;
+
+    *Requeue = FALSE;
+
+    while (i < IMDISK_POOL_BATCH_REQUESTS)
+    {
+        PIMDQUEUE_ENTRY request =
+            ImDiskQueuePop(&DeviceExtension->irp_queue);
+
+        if (request == NULL)
+        {
+            // Requests queued from now on signal device again. Requests
+            // queued after last pop are served in this batch.
+            if (ImDiskQueuePrepareWait(&DeviceExtension->irp_queue))
+                break;
+
+            continue;
+        }
+
+        ImDiskDeviceThreadRequest(
+            CONTAINING_RECORD(request, IRP, Tail.Overlay.ListEntry),
+            DeviceExtension,
+            device_object);
+
+        i++;
+    }
+
+    // Other devices get their turn before remaining requests, or before
+    // more background work on a sparse VM disk
+    if ((i == IMDISK_POOL_BATCH_REQUESTS) ||
+        ImDiskVmBackground(device_object))
+    {
+        *Requeue = TRUE;
+        return FALSE;
+    }
+
+    if (KeReadStateEvent(&DeviceExtension->terminate_thread) == 0)
+        return FALSE;
+
+    // Timer routine from an earlier try must be done before the device
+    // object can be deleted
+    if (DeviceExtension->pool_retry_set)
+    {
+        KeCancelTimer(&DeviceExtension->pool_retry_timer);
+        KeFlushQueuedDpcs();
+    }
+
+    if (ImDiskDeviceThreadShutdown(device_object))
+        return TRUE;
+
+    // Device object is still referenced. It is tried again after a while,
+    // like a device thread does, without keeping this pool thread from
+    // other devices. Requests that arrive before that are served as usual.
+    time_out.QuadPart = -1000000;
+
+    DeviceExtension->pool_retry_set = TRUE;
+
+    KeSetTimer(&DeviceExtension->pool_retry_timer, time_out,
+        &DeviceExtension->pool_retry_dpc);
+
+    return FALSE;
+}
+
+VOID
+ImDiskPoolThread(IN PVOID Context)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    for (;;)
+    {
+        KLOCK_QUEUE_HANDLE lock_handle;
+        PDEVICE_EXTENSION device_extension;
+        BOOLEAN requeue;
+
+        KeWaitForSingleObject(&PoolSemaphore,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL);
+
+        ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+        if (IsListEmpty(&PoolReadyList))
+        {
+            BOOLEAN stopping = PoolStopping;
+
+            ImDiskReleaseLock(&lock_handle);
+
+            if (stopping)
+                break;
+
+            continue;
+        }
+
+        device_extension = CONTAINING_RECORD(RemoveHeadList(&PoolReadyList),
+            DEVICE_EXTENSION, pool_list_entry);
+
+        device_extension->pool_queued = FALSE;
+        device_extension->pool_running = TRUE;
+        device_extension->pool_signalled = FALSE;
+
+        ImDiskReleaseLock(&lock_handle);
+
+        if (ImDiskPoolServeDevice(device_extension, &requeue))
+        {
+            ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+            if (--PoolDevices == 0)
+                KeSetEvent(&PoolDevicesGone, (KPRIORITY)0, FALSE);
+
+            ImDiskReleaseLock(&lock_handle);
+
+            continue;
+        }
+
+        ImDiskAcquireLock(&PoolLock, &lock_handle);
+
+        device_extension->pool_running = FALSE;
+
+        if (requeue || device_extension->pool_signalled)
+        {
+            InsertTailList(&PoolReadyList,
+                &device_extension->pool_list_entry);
+            device_extension->pool_queued = TRUE;
+
+            KeReleaseSemaphore(&PoolSemaphore, (KPRIORITY)0, 1, FALSE);
+        }
+
+        ImDiskReleaseLock(&lock_handle);
+    }
+
+    KdPrint(("ImDisk: Pool thread %p stopping.\n", KeGetCurrentThread()));
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
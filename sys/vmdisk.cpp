@@ -0,0 +1,934 @@
+/*
+ImDisk Virtual Disk Driver for Windows NT/2000/XP.
+This driver emulates harddisk partitions, floppy drives and CD/DVD-ROM
+drives from disk image files, in virtual memory or by redirecting I/O
+requests somewhere else, possibly to another machine, through a
+co-operating user-mode service, ImDskSvc.
+
+Copyright (C) 2005-2023 Olof Lagerkvist.
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "imdsksys.h"
+
+//
+// Sparse vm disks. Memory for the whole disk is only reserved when the
+// device is created, and is committed one chunk of IMDISK_VM_CHUNK_SIZE
+// bytes at a time when first written to. Chunks that have not been written
+// to read as zeros, and writes of all zeros to them are skipped.
+//
+// Chunks of a disk created from an image file are loaded from the file
+// when first accessed, or in background while no requests are queued. The
+// image file is closed when all chunks are loaded. Chunks where image data
+// is all zeros are not kept committed.
+//
+// State of each chunk is kept in one byte, so that reads and writes only
+// check one byte for each chunk they touch. Chunk states are only used by
+// the thread that serves requests of the device.
+//
+// Trim requests give memory of trimmed chunks back, so that memory used by
+// a disk where files are created and deleted does not only grow.
+//
+// If CompressAfterSeconds is set in registry, committed chunks that have not
+// been accessed for that many seconds are compressed into a store while no
+// requests are queued, and decommitted. A compressed chunk is decompressed
+// into committed memory again when accessed, or only into the request
+// buffer if memory cannot be committed for it. Chunks that do not compress
+// well enough are kept as they are until they have been cold for that long
+// again. A timer counts seconds and wakes the thread serving the device
+// once a second to check chunks.
+//
+
+#ifndef MEM_RESET
+#define MEM_RESET 0x80000
+#endif
+
+static ULONG_PTR
+ImDiskVmDiskSize(IN PDEVICE_EXTENSION DeviceExtension)
+{
+#ifdef _WIN64
+    return DeviceExtension->disk_geometry.Cylinders.QuadPart;
+#else
+    return DeviceExtension->disk_geometry.Cylinders.LowPart;
+#endif
+}
+
+// Bytes of a chunk that are within a disk of given size
+static SIZE_T
+ImDiskVmChunkLength(IN ULONG_PTR DiskSize,
+    IN ULONG_PTR Chunk)
+{
+    ULONG_PTR start = Chunk << IMDISK_VM_CHUNK_SHIFT;
+
+    if (DiskSize - start < IMDISK_VM_CHUNK_SIZE)
+        return DiskSize - start;
+
+    return IMDISK_VM_CHUNK_SIZE;
+}
+
+static NTSTATUS
+ImDiskVmCommitChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Chunk)
+{
+    PVOID base = DeviceExtension->image_buffer +
+        (Chunk << IMDISK_VM_CHUNK_SHIFT);
+    SIZE_T size = ImDiskVmChunkLength(ImDiskVmDiskSize(DeviceExtension),
+        Chunk);
+    NTSTATUS status;
+
+    status = ZwAllocateVirtualMemory(NtCurrentProcess(),
+        &base,
+        0,
+        &size,
+        MEM_COMMIT,
+        PAGE_READWRITE);
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk: Cannot commit memory for vm disk %i (%#x).\n",
+            DeviceExtension->device_number, status));
+
+        return STATUS_DISK_FULL;
+    }
+
+    DeviceExtension->vm_chunks[Chunk] = IMDISK_VM_CHUNK_COMMITTED;
+    DeviceExtension->vm_committed_chunks++;
+
+    ImDiskTierTouch(&DeviceExtension->vm_tier, Chunk,
+        DeviceExtension->vm_tier_clock);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+ImDiskVmDecommitChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Chunk)
+{
+    PVOID base = DeviceExtension->image_buffer +
+        (Chunk << IMDISK_VM_CHUNK_SHIFT);
+    SIZE_T size = ImDiskVmChunkLength(ImDiskVmDiskSize(DeviceExtension),
+        Chunk);
+
+    ZwFreeVirtualMemory(NtCurrentProcess(),
+        &base,
+        &size,
+        MEM_DECOMMIT);
+
+    DeviceExtension->vm_chunks[Chunk] = IMDISK_VM_CHUNK_ZERO;
+    DeviceExtension->vm_committed_chunks--;
+}
+
+// Called when a chunk no longer needs image data
+static VOID
+ImDiskVmImageChunkDone(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (--DeviceExtension->vm_image_chunks != 0)
+        return;
+
+    KdPrint(("ImDisk: Image loaded into vm disk %i.\n",
+        DeviceExtension->device_number));
+
+    ZwClose(DeviceExtension->file_handle);
+    DeviceExtension->file_handle = NULL;
+}
+
+static NTSTATUS
+ImDiskVmLoadChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Chunk)
+{
+    ULONG_PTR start = Chunk << IMDISK_VM_CHUNK_SHIFT;
+    SIZE_T length = ImDiskVmChunkLength(ImDiskVmDiskSize(DeviceExtension),
+        Chunk);
+    PUCHAR data = DeviceExtension->image_buffer + start;
+    LARGE_INTEGER offset;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    status = ImDiskVmCommitChunk(DeviceExtension, Chunk);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    offset.QuadPart = DeviceExtension->image_offset.QuadPart + start;
+
+    status = ImDiskSafeReadFile(DeviceExtension->file_handle,
+        &io_status,
+        data,
+        length,
+        &offset);
+
+    // Disk may be larger than image file, remaining data reads as zeros
+    if (status == STATUS_END_OF_FILE)
+        status = STATUS_SUCCESS;
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ImDisk: Failed to read image file (%#x).\n", status));
+
+        ImDiskVmDecommitChunk(DeviceExtension, Chunk);
+
+        DeviceExtension->vm_chunks[Chunk] = IMDISK_VM_CHUNK_IMAGE;
+
+        return status;
+    }
+
+    if (DeviceExtension->byte_swap)
+        ImDiskByteSwapBuffer(data, length);
+
+    if (ImDiskIsBufferZero(data, length))
+        ImDiskVmDecommitChunk(DeviceExtension, Chunk);
+
+    ImDiskVmImageChunkDone(DeviceExtension);
+
+    return STATUS_SUCCESS;
+}
+
+// Frees compressed data of a chunk that is not needed any longer
+static VOID
+ImDiskVmDropChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Chunk)
+{
+    ImDiskTierDrop(&DeviceExtension->vm_tier, Chunk);
+
+    DeviceExtension->vm_chunks[Chunk] = IMDISK_VM_CHUNK_ZERO;
+}
+
+// Decompresses a chunk into committed memory
+static NTSTATUS
+ImDiskVmExpandChunk(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Chunk)
+{
+    NTSTATUS status;
+
+    status = ImDiskVmCommitChunk(DeviceExtension, Chunk);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    if (!ImDiskTierDecompress(&DeviceExtension->vm_tier, Chunk,
+        DeviceExtension->image_buffer + (Chunk << IMDISK_VM_CHUNK_SHIFT),
+        ImDiskVmChunkLength(ImDiskVmDiskSize(DeviceExtension), Chunk)))
+    {
+        KdPrint(("ImDisk: Bad compressed data in vm disk %i.\n",
+            DeviceExtension->device_number));
+
+        ImDiskVmDecommitChunk(DeviceExtension, Chunk);
+
+        DeviceExtension->vm_chunks[Chunk] = IMDISK_VM_CHUNK_COMPRESSED;
+
+        return STATUS_DATA_ERROR;
+    }
+
+    ImDiskTierDrop(&DeviceExtension->vm_tier, Chunk);
+
+    return STATUS_SUCCESS;
+}
+
+// Reads part of a compressed chunk without committing memory for it
+static NTSTATUS
+ImDiskVmReadCompressed(IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Buffer,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length)
+{
+    ULONG_PTR chunk = Offset >> IMDISK_VM_CHUNK_SHIFT;
+    SIZE_T chunk_length =
+        ImDiskVmChunkLength(ImDiskVmDiskSize(DeviceExtension), chunk);
+    PUCHAR data = Buffer;
+
+    if (Length < chunk_length)
+        data = DeviceExtension->vm_tier_buffer;
+
+    if (!ImDiskTierDecompress(&DeviceExtension->vm_tier, chunk, data,
+        chunk_length))
+        return STATUS_DATA_ERROR;
+
+    if (data != Buffer)
+        RtlCopyMemory(Buffer,
+            data + (Offset & (IMDISK_VM_CHUNK_SIZE - 1)),
+            Length);
+
+    return STATUS_SUCCESS;
+}
+
+// Counts seconds for compression of cold chunks, and wakes thread serving
+// the device to check them
+static VOID
+ImDiskVmTierTimer(IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2)
+{
+    PDEVICE_EXTENSION device_extension = (PDEVICE_EXTENSION)DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    device_extension->vm_tier_clock++;
+    device_extension->vm_tier_due = TRUE;
+
+    if (device_extension->pool_device)
+        ImDiskPoolSignalDevice(device_extension);
+    else
+        KeSetEvent(&device_extension->request_event, (KPRIORITY)0, FALSE);
+}
+
+// Starts compression of cold chunks. Disk works without it if there is not
+// enough memory for it.
+static VOID
+ImDiskVmInitializeTier(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LARGE_INTEGER due_time;
+
+    if (!ImDiskTierInitialize(&DeviceExtension->vm_tier,
+        (unsigned int)IMDISK_VM_CHUNK_SIZE,
+        DeviceExtension->vm_chunk_count))
+    {
+        KdPrint(("ImDisk: Not enough memory to compress vm disk %i.\n",
+            DeviceExtension->device_number));
+
+        return;
+    }
+
+    DeviceExtension->vm_tier_buffer = (PUCHAR)
+        ExAllocatePoolWithTag(NonPagedPool, IMDISK_VM_CHUNK_SIZE, POOL_TAG);
+
+    if (DeviceExtension->vm_tier_buffer == NULL)
+    {
+        KdPrint(("ImDisk: Not enough memory to compress vm disk %i.\n",
+            DeviceExtension->device_number));
+
+        ImDiskTierFree(&DeviceExtension->vm_tier);
+
+        return;
+    }
+
+    DeviceExtension->vm_tier_clock = 0;
+    DeviceExtension->vm_tier_due = FALSE;
+    DeviceExtension->vm_compress_next = 0;
+
+    KeInitializeTimer(&DeviceExtension->vm_tier_timer);
+
+    KeInitializeDpc(&DeviceExtension->vm_tier_dpc, ImDiskVmTierTimer,
+        DeviceExtension);
+
+    due_time.QuadPart = -10000000;
+
+    KeSetTimerEx(&DeviceExtension->vm_tier_timer, due_time, 1000,
+        &DeviceExtension->vm_tier_dpc);
+
+    KdPrint(("ImDisk: Compressing chunks of vm disk %i after %u seconds.\n",
+        DeviceExtension->device_number, CompressAfterSeconds));
+}
+
+NTSTATUS
+ImDiskVmInitializeSparse(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    ULONG_PTR chunks = (ImDiskVmDiskSize(DeviceExtension) +
+        IMDISK_VM_CHUNK_SIZE - 1) >> IMDISK_VM_CHUNK_SHIFT;
+
+    DeviceExtension->vm_chunks = (PUCHAR)
+        ExAllocatePoolWithTag(NonPagedPool, chunks, POOL_TAG);
+
+    if (DeviceExtension->vm_chunks == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    DeviceExtension->vm_chunk_count = chunks;
+    DeviceExtension->vm_committed_chunks = 0;
+    DeviceExtension->vm_load_next = 0;
+
+    if (DeviceExtension->file_handle != NULL)
+    {
+        RtlFillMemory(DeviceExtension->vm_chunks, chunks,
+            IMDISK_VM_CHUNK_IMAGE);
+
+        DeviceExtension->vm_image_chunks = chunks;
+    }
+    else
+    {
+        RtlFillMemory(DeviceExtension->vm_chunks, chunks,
+            IMDISK_VM_CHUNK_ZERO);
+
+        DeviceExtension->vm_image_chunks = 0;
+    }
+
+    KdPrint(("ImDisk: Sparse vm disk %i with %I64u chunks.\n",
+        DeviceExtension->device_number, (ULONGLONG)chunks));
+
+    if (CompressAfterSeconds != 0)
+        ImDiskVmInitializeTier(DeviceExtension);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ImDiskVmFreeSparse(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension->vm_tier_buffer != NULL)
+    {
+        KeCancelTimer(&DeviceExtension->vm_tier_timer);
+        KeFlushQueuedDpcs();
+
+        KdPrint(("ImDisk: Vm disk %i had %I64u compressed chunks in %I64u "
+            "bytes, %I64u compressions, %I64u decompressions.\n",
+            DeviceExtension->device_number,
+            (ULONGLONG)DeviceExtension->vm_tier.compressed_blocks,
+            DeviceExtension->vm_tier.store_bytes,
+            DeviceExtension->vm_tier.compressions,
+            DeviceExtension->vm_tier.decompressions));
+
+        ImDiskTierFree(&DeviceExtension->vm_tier);
+
+        ExFreePoolWithTag(DeviceExtension->vm_tier_buffer, POOL_TAG);
+        DeviceExtension->vm_tier_buffer = NULL;
+    }
+
+    if (DeviceExtension->vm_chunks != NULL)
+    {
+        ExFreePoolWithTag(DeviceExtension->vm_chunks, POOL_TAG);
+        DeviceExtension->vm_chunks = NULL;
+    }
+
+    DeviceExtension->vm_chunk_count = 0;
+    DeviceExtension->vm_committed_chunks = 0;
+    DeviceExtension->vm_image_chunks = 0;
+
+    if (DeviceExtension->file_handle != NULL)
+    {
+        ZwClose(DeviceExtension->file_handle);
+        DeviceExtension->file_handle = NULL;
+    }
+}
+
+NTSTATUS
+ImDiskVmRead(IN PDEVICE_EXTENSION DeviceExtension,
+    OUT PUCHAR Buffer,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length)
+{
+    while (Length > 0)
+    {
+        ULONG_PTR chunk = Offset >> IMDISK_VM_CHUNK_SHIFT;
+        SIZE_T part = IMDISK_VM_CHUNK_SIZE -
+            (Offset & (IMDISK_VM_CHUNK_SIZE - 1));
+
+        if (part > Length)
+            part = Length;
+
+        if (DeviceExtension->vm_chunks[chunk] == IMDISK_VM_CHUNK_IMAGE)
+        {
+            NTSTATUS status = ImDiskVmLoadChunk(DeviceExtension, chunk);
+
+            if (!NT_SUCCESS(status))
+                return status;
+        }
+        else if ((DeviceExtension->vm_chunks[chunk] ==
+            IMDISK_VM_CHUNK_COMPRESSED) &&
+            !NT_SUCCESS(ImDiskVmExpandChunk(DeviceExtension, chunk)))
+        {
+            NTSTATUS status = ImDiskVmReadCompressed(DeviceExtension,
+                Buffer, Offset, part);
+
+            if (!NT_SUCCESS(status))
+                return status;
+
+            goto next_chunk;
+        }
+
+        if (DeviceExtension->vm_chunks[chunk] == IMDISK_VM_CHUNK_COMMITTED)
+        {
+            ImDiskTierTouch(&DeviceExtension->vm_tier, chunk,
+                DeviceExtension->vm_tier_clock);
+
+            RtlCopyMemory(Buffer, DeviceExtension->image_buffer + Offset,
+                part);
+        }
+        else
+            RtlZeroMemory(Buffer, part);
+
+    next_chunk:
+        Buffer += part;
+        Offset += part;
+        Length -= part;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Writes data from Buffer, or Fill bytes if Buffer is NULL
+static NTSTATUS
+ImDiskVmWriteRange(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PUCHAR Buffer OPTIONAL,
+    IN UCHAR Fill,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length)
+{
+    ULONG_PTR disk_size = ImDiskVmDiskSize(DeviceExtension);
+
+    while (Length > 0)
+    {
+        ULONG_PTR chunk = Offset >> IMDISK_VM_CHUNK_SHIFT;
+        SIZE_T part = IMDISK_VM_CHUNK_SIZE -
+            (Offset & (IMDISK_VM_CHUNK_SIZE - 1));
+        NTSTATUS status;
+
+        if (part > Length)
+            part = Length;
+
+        if (DeviceExtension->vm_chunks[chunk] == IMDISK_VM_CHUNK_IMAGE)
+        {
+            // Image data is not needed if all of it is overwritten
+            if (part == ImDiskVmChunkLength(disk_size, chunk))
+            {
+                DeviceExtension->vm_chunks[chunk] = IMDISK_VM_CHUNK_ZERO;
+
+                ImDiskVmImageChunkDone(DeviceExtension);
+            }
+            else
+            {
+                status = ImDiskVmLoadChunk(DeviceExtension, chunk);
+
+                if (!NT_SUCCESS(status))
+                    return status;
+            }
+        }
+        else if (DeviceExtension->vm_chunks[chunk] ==
+            IMDISK_VM_CHUNK_COMPRESSED)
+        {
+            if (part == ImDiskVmChunkLength(disk_size, chunk))
+            {
+                ImDiskVmDropChunk(DeviceExtension, chunk);
+            }
+            else
+            {
+                status = ImDiskVmExpandChunk(DeviceExtension, chunk);
+
+                if (!NT_SUCCESS(status))
+                    return status;
+            }
+        }
+
+        if (DeviceExtension->vm_chunks[chunk] == IMDISK_VM_CHUNK_ZERO)
+        {
+            if (Buffer != NULL ? ImDiskIsBufferZero(Buffer, part) : Fill == 0)
+                goto next_chunk;
+
+            // Newly committed memory is zero-filled
+            status = ImDiskVmCommitChunk(DeviceExtension, chunk);
+
+            if (!NT_SUCCESS(status))
+                return status;
+        }
+        else
+        {
+            ImDiskTierTouch(&DeviceExtension->vm_tier, chunk,
+                DeviceExtension->vm_tier_clock);
+        }
+
+        if (Buffer != NULL)
+            RtlCopyMemory(DeviceExtension->image_buffer + Offset, Buffer,
+                part);
+        else
+            RtlFillMemory(DeviceExtension->image_buffer + Offset, part,
+                Fill);
+
+    next_chunk:
+        if (Buffer != NULL)
+            Buffer += part;
+
+        Offset += part;
+        Length -= part;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ImDiskVmWrite(IN PDEVICE_EXTENSION DeviceExtension,
+    IN PUCHAR Buffer,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length)
+{
+    return ImDiskVmWriteRange(DeviceExtension, Buffer, 0, Offset, Length);
+}
+
+NTSTATUS
+ImDiskVmFill(IN PDEVICE_EXTENSION DeviceExtension,
+    IN UCHAR Fill,
+    IN ULONG_PTR Offset,
+    IN SIZE_T Length)
+{
+    return ImDiskVmWriteRange(DeviceExtension, NULL, Fill, Offset, Length);
+}
+
+// Loads a batch of chunks from image file in background. Returns TRUE if
+// there are more chunks to load. A device that cannot load its image is
+// removed, as when an image was loaded before the device was used.
+static BOOLEAN
+ImDiskVmLoadNext(IN PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION device_extension =
+        (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    ULONG loaded = 0;
+
+    if ((device_extension->vm_image_chunks == 0) ||
+        KeReadStateEvent(&device_extension->terminate_thread))
+        return FALSE;
+
+    while ((loaded < IMDISK_VM_LOAD_BATCH_CHUNKS) &&
+        (device_extension->vm_load_next < device_extension->vm_chunk_count))
+    {
+        ULONG_PTR chunk = device_extension->vm_load_next++;
+
+        if (device_extension->vm_chunks[chunk] == IMDISK_VM_CHUNK_IMAGE)
+        {
+            NTSTATUS status = ImDiskVmLoadChunk(device_extension, chunk);
+
+            if (!NT_SUCCESS(status))
+            {
+                ImDiskRemoveVirtualDisk(DeviceObject);
+                return FALSE;
+            }
+
+            loaded++;
+        }
+    }
+
+    return (device_extension->vm_image_chunks != 0) &&
+        (device_extension->vm_load_next < device_extension->vm_chunk_count);
+}
+
+// Checks a batch of chunks and compresses those that are cold, once each
+// second. Returns TRUE if there are more chunks to check this second.
+static BOOLEAN
+ImDiskVmCompressNext(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    ULONG_PTR disk_size = ImDiskVmDiskSize(DeviceExtension);
+    ULONG now = DeviceExtension->vm_tier_clock;
+    ULONG checked = 0;
+    ULONG compressed = 0;
+
+    if ((DeviceExtension->vm_tier_buffer == NULL) ||
+        !DeviceExtension->vm_tier_due ||
+        KeReadStateEvent(&DeviceExtension->terminate_thread))
+        return FALSE;
+
+    while ((checked < IMDISK_VM_SCAN_BATCH_CHUNKS) &&
+        (compressed < IMDISK_VM_COMPRESS_BATCH_CHUNKS))
+    {
+        ULONG_PTR chunk = DeviceExtension->vm_compress_next++;
+
+        if (chunk >= DeviceExtension->vm_chunk_count)
+        {
+            DeviceExtension->vm_compress_next = 0;
+            DeviceExtension->vm_tier_due = FALSE;
+            return FALSE;
+        }
+
+        checked++;
+
+        if ((DeviceExtension->vm_chunks[chunk] !=
+            IMDISK_VM_CHUNK_COMMITTED) ||
+            !ImDiskTierIsCold(&DeviceExtension->vm_tier, chunk, now,
+                CompressAfterSeconds))
+            continue;
+
+        compressed++;
+
+        if (ImDiskTierCompress(&DeviceExtension->vm_tier, chunk,
+            DeviceExtension->image_buffer + (chunk << IMDISK_VM_CHUNK_SHIFT),
+            ImDiskVmChunkLength(disk_size, chunk)))
+        {
+            ImDiskVmDecommitChunk(DeviceExtension, chunk);
+
+            DeviceExtension->vm_chunks[chunk] = IMDISK_VM_CHUNK_COMPRESSED;
+        }
+        else
+        {
+            // Not tried again until it has been cold for the full time
+            ImDiskTierTouch(&DeviceExtension->vm_tier, chunk, now);
+        }
+    }
+
+    return TRUE;
+}
+
+// Background work for sparse vm disks while no requests are queued. Returns
+// TRUE if there is more to do before waiting for requests.
+BOOLEAN
+ImDiskVmBackground(IN PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION device_extension =
+        (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    if (ImDiskVmLoadNext(DeviceObject))
+        return TRUE;
+
+    return ImDiskVmCompressNext(device_extension);
+}
+
+// Resets whole pages in a range, so that their data need not be kept in
+// physical memory or page file. Data in reset pages may read as zeros
+// afterwards.
+static VOID
+ImDiskVmResetPages(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR Start,
+    IN ULONG_PTR End)
+{
+    ULONG_PTR first = (Start + PAGE_SIZE - 1) & ~((ULONG_PTR)PAGE_SIZE - 1);
+    ULONG_PTR last = End & ~((ULONG_PTR)PAGE_SIZE - 1);
+    PVOID base = DeviceExtension->image_buffer + first;
+    SIZE_T size = last - first;
+
+    if (first >= last)
+        return;
+
+    ZwAllocateVirtualMemory(NtCurrentProcess(),
+        &base,
+        0,
+        &size,
+        MEM_RESET,
+        PAGE_READWRITE);
+}
+
+// Releases memory of a trimmed range. Whole chunks of sparse vm disks are
+// decommitted, and trimmed parts of other committed chunks are zeroed and
+// their whole pages reset. Chunks that are all zeros after that are
+// decommitted too. Trimmed parts of chunks not yet loaded from image file,
+// or held compressed, are left as they are. Trimmed ranges of other vm
+// disks are zeroed and their whole pages reset, so that they read as zeros
+// as on sparse vm disks.
+VOID
+ImDiskVmTrim(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG Offset,
+    IN LONGLONG Length)
+{
+    ULONG_PTR disk_size = ImDiskVmDiskSize(DeviceExtension);
+    ULONG_PTR start;
+    ULONG_PTR end;
+
+    if ((Offset < 0) || (Length <= 0) || ((ULONGLONG)Offset >= disk_size))
+        return;
+
+    if ((ULONGLONG)Length > disk_size - (ULONGLONG)Offset)
+        Length = disk_size - (ULONG_PTR)Offset;
+
+    start = (ULONG_PTR)Offset;
+    end = start + (ULONG_PTR)Length;
+
+    if (DeviceExtension->vm_chunks == NULL)
+    {
+        // Reset pages may keep their data, so they are zeroed first
+        RtlZeroMemory(DeviceExtension->image_buffer + start, end - start);
+
+        ImDiskVmResetPages(DeviceExtension, start, end);
+        return;
+    }
+
+    while (start < end)
+    {
+        ULONG_PTR chunk = start >> IMDISK_VM_CHUNK_SHIFT;
+        SIZE_T chunk_length = ImDiskVmChunkLength(disk_size, chunk);
+        SIZE_T part = IMDISK_VM_CHUNK_SIZE -
+            (start & (IMDISK_VM_CHUNK_SIZE - 1));
+
+        if (part > end - start)
+            part = end - start;
+
+        switch (DeviceExtension->vm_chunks[chunk])
+        {
+        case IMDISK_VM_CHUNK_IMAGE:
+            if (part == chunk_length)
+            {
+                DeviceExtension->vm_chunks[chunk] = IMDISK_VM_CHUNK_ZERO;
+
+                ImDiskVmImageChunkDone(DeviceExtension);
+            }
+            break;
+
+        case IMDISK_VM_CHUNK_COMPRESSED:
+            if (part == chunk_length)
+                ImDiskVmDropChunk(DeviceExtension, chunk);
+            break;
+
+        case IMDISK_VM_CHUNK_COMMITTED:
+            if (part < chunk_length)
+            {
+                RtlZeroMemory(DeviceExtension->image_buffer + start, part);
+
+                if (!ImDiskIsBufferZero(DeviceExtension->image_buffer +
+                    (chunk << IMDISK_VM_CHUNK_SHIFT), chunk_length))
+                {
+                    // Reset pages hold zeros whether they are discarded
+                    // or not
+                    ImDiskVmResetPages(DeviceExtension, start,
+                        start + part);
+                    break;
+                }
+            }
+
+            ImDiskVmDecommitChunk(DeviceExtension, chunk);
+            break;
+        }
+
+        start += part;
+    }
+}
+
+// Moves committed chunks to a newly reserved range of NewSize bytes.
+// Caller sets new disk size when this function succeeds.
+NTSTATUS
+ImDiskVmGrowSparse(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG_PTR NewSize)
+{
+    ULONG_PTR old_size = ImDiskVmDiskSize(DeviceExtension);
+    ULONG_PTR old_count = DeviceExtension->vm_chunk_count;
+    ULONG_PTR new_count = (NewSize + IMDISK_VM_CHUNK_SIZE - 1) >>
+        IMDISK_VM_CHUNK_SHIFT;
+    ULONG_PTR committed = 0;
+    ULONG_PTR image = 0;
+    PUCHAR new_chunks;
+    PUCHAR new_buffer = NULL;
+    SIZE_T max_size = NewSize;
+    SIZE_T free_size = 0;
+    NTSTATUS status;
+    ULONG_PTR i;
+
+    // Image data after end of a partial last chunk is not disk data, so
+    // that chunk is loaded while its length is still known
+    if (((old_size & (IMDISK_VM_CHUNK_SIZE - 1)) != 0) &&
+        (DeviceExtension->vm_chunks[old_count - 1] ==
+            IMDISK_VM_CHUNK_IMAGE))
+    {
+        status = ImDiskVmLoadChunk(DeviceExtension, old_count - 1);
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    // Same for a partial last chunk held compressed, which is compressed
+    // with its old length
+    if (((old_size & (IMDISK_VM_CHUNK_SIZE - 1)) != 0) &&
+        (DeviceExtension->vm_chunks[old_count - 1] ==
+            IMDISK_VM_CHUNK_COMPRESSED))
+    {
+        status = ImDiskVmExpandChunk(DeviceExtension, old_count - 1);
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    // Added blocks of compression tier are not used if growing fails
+    if ((DeviceExtension->vm_tier_buffer != NULL) &&
+        !ImDiskTierResize(&DeviceExtension->vm_tier, new_count))
+        return STATUS_NO_MEMORY;
+
+    new_chunks = (PUCHAR)
+        ExAllocatePoolWithTag(NonPagedPool, new_count, POOL_TAG);
+
+    if (new_chunks == NULL)
+        return STATUS_NO_MEMORY;
+
+    status = ZwAllocateVirtualMemory(NtCurrentProcess(),
+        (PVOID*)&new_buffer,
+        0,
+        &max_size,
+        MEM_RESERVE,
+        PAGE_READWRITE);
+
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePoolWithTag(new_chunks, POOL_TAG);
+        return STATUS_NO_MEMORY;
+    }
+
+    for (i = 0; i < new_count; i++)
+    {
+        UCHAR state = i < old_count ?
+            DeviceExtension->vm_chunks[i] : (UCHAR)IMDISK_VM_CHUNK_ZERO;
+
+        new_chunks[i] = state;
+
+        if (state == IMDISK_VM_CHUNK_IMAGE)
+        {
+            image++;
+        }
+        else if (state == IMDISK_VM_CHUNK_COMMITTED)
+        {
+            ULONG_PTR start = i << IMDISK_VM_CHUNK_SHIFT;
+            PVOID base = new_buffer + start;
+            SIZE_T size = ImDiskVmChunkLength(NewSize, i);
+            SIZE_T copy_size = ImDiskVmChunkLength(old_size, i);
+
+            status = ZwAllocateVirtualMemory(NtCurrentProcess(),
+                &base,
+                0,
+                &size,
+                MEM_COMMIT,
+                PAGE_READWRITE);
+
+            if (!NT_SUCCESS(status))
+            {
+                ZwFreeVirtualMemory(NtCurrentProcess(),
+                    (PVOID*)&new_buffer,
+                    &free_size,
+                    MEM_RELEASE);
+
+                ExFreePoolWithTag(new_chunks, POOL_TAG);
+
+                return STATUS_NO_MEMORY;
+            }
+
+            RtlCopyMemory(new_buffer + start,
+                DeviceExtension->image_buffer + start,
+                min(copy_size, size));
+
+            committed++;
+        }
+    }
+
+    ZwFreeVirtualMemory(NtCurrentProcess(),
+        (PVOID*)&DeviceExtension->image_buffer,
+        &free_size,
+        MEM_RELEASE);
+
+    ExFreePoolWithTag(DeviceExtension->vm_chunks, POOL_TAG);
+
+    DeviceExtension->image_buffer = new_buffer;
+    DeviceExtension->vm_chunks = new_chunks;
+    DeviceExtension->vm_chunk_count = new_count;
+    DeviceExtension->vm_committed_chunks = committed;
+    DeviceExtension->vm_image_chunks = image;
+
+    if (DeviceExtension->vm_load_next > new_count)
+        DeviceExtension->vm_load_next = new_count;
+
+    if ((image == 0) && (DeviceExtension->file_handle != NULL))
+    {
+        ZwClose(DeviceExtension->file_handle);
+        DeviceExtension->file_handle = NULL;
+    }
+
+    return STATUS_SUCCESS;
+}